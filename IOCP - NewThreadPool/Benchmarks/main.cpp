@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "common/CachedAlloc.h"
+#include "common/HandleTable.h"
+#include "common/Log.h"
+#include "Server/Client.h"
+#include "Server/IOEvent.h"
+#include "Server/Packet.h"
+
+// Microbenchmarks of the primitives on the server's hot paths. Every case runs at 1, 2, 4, ...
+// threads up to the number of processors, or the number given on the command line, so that
+// contention shows up, and is repeated a few times. The results are appended as CSV rows to the
+// file given on the command line, or to benchmarks.csv.
+//
+//   Benchmarks [max threads] [csv path]
+
+namespace
+{
+const int DEFAULT_REPETITIONS = 5;
+const char* const DEFAULT_CSV_PATH = "benchmarks.csv";
+
+// What a case measures is run() called on every thread at once. setup() and teardown() run on
+// the main thread around every repetition and aren't timed.
+struct Case
+{
+    const char* name;
+    DWORD param;
+    // Operations that every thread does per repetition.
+    DWORD iterations;
+    void (*setup)(DWORD param, int numThreads);
+    void (*run)(DWORD param, int threadIndex, DWORD iterations);
+    void (*teardown)();
+};
+
+struct Worker
+{
+    const Case* benchmark;
+    int index;
+    HANDLE startEvent;
+    HANDLE thread;
+};
+
+// Keeps the optimizer from throwing away work whose result isn't used.
+volatile ULONG_PTR g_Sink = 0;
+
+DWORD WINAPI WorkerThread(LPVOID lpParam)
+{
+    Worker* worker = static_cast<Worker*>(lpParam);
+
+    WaitForSingleObject(worker->startEvent, INFINITE);
+    worker->benchmark->run(worker->benchmark->param, worker->index,
+                           worker->benchmark->iterations);
+
+    return 0;
+}
+
+// Returns how long the threads took to do all of their iterations in nanoseconds, or 0 if the
+// threads couldn't be started.
+double RunOnce(const Case& benchmark, int numThreads)
+{
+    if (benchmark.setup != NULL)
+    {
+        benchmark.setup(benchmark.param, numThreads);
+    }
+
+    // The threads are all created up front and released together, so that thread creation
+    // isn't timed.
+    HANDLE startEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    std::vector<Worker> workers(numThreads);
+    std::vector<HANDLE> threads;
+    for (int i = 0; i < numThreads; ++i)
+    {
+        workers[i].benchmark = &benchmark;
+        workers[i].index = i;
+        workers[i].startEvent = startEvent;
+        workers[i].thread = CreateThread(NULL, 0, WorkerThread, &workers[i], 0, NULL);
+        if (workers[i].thread == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not create a benchmark thread.");
+            break;
+        }
+        threads.push_back(workers[i].thread);
+    }
+
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    SetEvent(startEvent);
+    if (threads.empty())
+    {
+        ERROR_MSG("None of the %d threads of %s could be started.", numThreads, benchmark.name);
+    }
+    else
+    {
+        // There are never more threads than MAXIMUM_WAIT_OBJECTS.
+        WaitForMultipleObjects(static_cast<DWORD>(threads.size()), &threads[0], TRUE, INFINITE);
+    }
+
+    QueryPerformanceCounter(&end);
+
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        CloseHandle(threads[i]);
+    }
+    CloseHandle(startEvent);
+
+    if (benchmark.teardown != NULL)
+    {
+        benchmark.teardown();
+    }
+
+    if (threads.size() != static_cast<size_t>(numThreads))
+    {
+        return 0;
+    }
+
+    return static_cast<double>(end.QuadPart - start.QuadPart) * 1e9 / frequency.QuadPart;
+}
+
+// Writes a row for every thread count the case runs at.
+void RunCase(const Case& benchmark, int maxThreads, FILE* csv)
+{
+    for (int numThreads = 1; numThreads <= maxThreads; numThreads *= 2)
+    {
+        std::vector<double> nsPerOp;
+        for (int repetition = 0; repetition < DEFAULT_REPETITIONS; ++repetition)
+        {
+            const double elapsed = RunOnce(benchmark, numThreads);
+            if (elapsed == 0)
+            {
+                return;
+            }
+
+            // Every thread does its own iterations, so this is the time per operation as the
+            // threads see it.
+            nsPerOp.push_back(elapsed / benchmark.iterations);
+        }
+
+        std::sort(nsPerOp.begin(), nsPerOp.end());
+        const double median = nsPerOp[nsPerOp.size() / 2];
+        // Operations of all the threads together per microsecond.
+        const double mops = numThreads * 1e3 / median;
+
+        fprintf(csv, "%s,%u,%d,%u,%d,%.2f,%.2f,%.3f\n", benchmark.name, benchmark.param,
+                numThreads, benchmark.iterations, DEFAULT_REPETITIONS, median, nsPerOp[0], mops);
+        fflush(csv);
+
+        printf("%-24s %6u %3d threads : %9.2f ns/op %9.3f Mops/s\n", benchmark.name,
+               benchmark.param, numThreads, median, mops);
+    }
+}
+
+//---------------------------------------------------------------------------------------------
+// CachedAlloc
+
+CachedAlloc* g_Allocator = NULL;
+
+// A burst is bigger than a magazine, so that it goes through the shared list.
+const int ALLOC_BURST_SIZE = 256;
+
+void SetupAllocator(DWORD param, int /* numThreads */) { g_Allocator = new CachedAlloc(param); }
+
+void TeardownAllocator()
+{
+    delete g_Allocator;
+    g_Allocator = NULL;
+}
+
+void RunAllocGetPut(DWORD /* param */, int /* threadIndex */, DWORD iterations)
+{
+    for (DWORD i = 0; i < iterations; ++i)
+    {
+        void* object = g_Allocator->get();
+        g_Sink = reinterpret_cast<ULONG_PTR>(object);
+        g_Allocator->put(object);
+    }
+}
+
+void RunAllocBurst(DWORD /* param */, int /* threadIndex */, DWORD iterations)
+{
+    void* objects[ALLOC_BURST_SIZE];
+
+    for (DWORD i = 0; i < iterations; i += ALLOC_BURST_SIZE)
+    {
+        for (int j = 0; j < ALLOC_BURST_SIZE; ++j)
+        {
+            objects[j] = g_Allocator->get();
+        }
+        for (int j = 0; j < ALLOC_BURST_SIZE; ++j)
+        {
+            g_Allocator->put(objects[j]);
+        }
+    }
+}
+
+//---------------------------------------------------------------------------------------------
+// IOEvent
+
+// Every thread creates its events for a client of its own, so that the reference count isn't
+// shared. The clients hold a reference of their own so the last Release() never hands them to a
+// server, and they are kept for the rest of the process.
+std::vector<Client*> g_EventClients;
+
+void SetupEventClients(DWORD /* param */, int numThreads)
+{
+    while (g_EventClients.size() < static_cast<size_t>(numThreads))
+    {
+        Client* client = new Client(NULL);
+        client->AddRef();
+        g_EventClients.push_back(client);
+    }
+}
+
+void RunEventCreateDestroy(DWORD /* param */, int threadIndex, DWORD iterations)
+{
+    Client* client = g_EventClients[threadIndex];
+
+    for (DWORD i = 0; i < iterations; ++i)
+    {
+        IOEvent* event = IOEvent::Create(IOEvent::RECV, client);
+        g_Sink = reinterpret_cast<ULONG_PTR>(event);
+        IOEvent::Destroy(event);
+    }
+}
+
+// What IOEvent::Create() spends on clearing the event on its own.
+void RunZeroEvent(DWORD /* param */, int /* threadIndex */, DWORD iterations)
+{
+    BYTE event[sizeof(IOEvent)];
+
+    for (DWORD i = 0; i < iterations; ++i)
+    {
+        ZeroMemory(event, sizeof(event));
+        g_Sink = event[i % sizeof(event)];
+    }
+}
+
+//---------------------------------------------------------------------------------------------
+// Packet
+
+void RunPacketCreateDestroy(DWORD param, int /* threadIndex */, DWORD iterations)
+{
+    std::vector<BYTE> payload(param, 0x5A);
+
+    for (DWORD i = 0; i < iterations; ++i)
+    {
+        Packet* packet = Packet::Create(NULL, &payload[0], param);
+        g_Sink = reinterpret_cast<ULONG_PTR>(packet);
+        Packet::Destroy(packet);
+    }
+}
+
+//---------------------------------------------------------------------------------------------
+// Client registry
+
+// Stands in for a client in the registry. A lookup takes a reference like the server's do.
+struct RegistryEntry
+{
+    volatile long refCount;
+};
+
+HandleTable<RegistryEntry>* g_Registry = NULL;
+std::vector<RegistryEntry> g_Entries;
+std::vector<HandleId> g_EntryIds;
+
+void SetupRegistry(DWORD param, int /* numThreads */)
+{
+    g_Registry = new HandleTable<RegistryEntry>();
+    g_Entries.assign(param, RegistryEntry());
+    g_EntryIds.resize(param);
+    for (DWORD i = 0; i < param; ++i)
+    {
+        g_Entries[i].refCount = 0;
+        g_EntryIds[i] = g_Registry->Add(&g_Entries[i]);
+    }
+}
+
+void TeardownRegistry()
+{
+    delete g_Registry;
+    g_Registry = NULL;
+    g_Entries.clear();
+    g_EntryIds.clear();
+}
+
+void RunRegistryLookup(DWORD param, int threadIndex, DWORD iterations)
+{
+    // xorshift, so that picking the next id costs next to nothing.
+    DWORD state = 2463534242UL + threadIndex;
+
+    for (DWORD i = 0; i < iterations; ++i)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        RegistryEntry* entry = NULL;
+        g_Registry->Visit(g_EntryIds[state % param], [&entry](RegistryEntry* object)
+        {
+            InterlockedIncrement(&object->refCount);
+            entry = object;
+        });
+
+        if (entry != NULL)
+        {
+            InterlockedDecrement(&entry->refCount);
+        }
+    }
+}
+
+//---------------------------------------------------------------------------------------------
+// Log
+
+void SetupTraceOff(DWORD /* param */, int /* numThreads */) { Log::EnableTrace(false); }
+
+void SetupTraceOn(DWORD /* param */, int /* numThreads */) { Log::EnableTrace(true); }
+
+void TeardownTrace() { Log::EnableTrace(false); }
+
+void RunTrace(DWORD /* param */, int threadIndex, DWORD iterations)
+{
+    for (DWORD i = 0; i < iterations; ++i)
+    {
+        TRACE("benchmark thread %d message %u", threadIndex, i);
+    }
+}
+
+// Packets are copied at each of the sizes, and the bigger ones do fewer iterations so that every
+// size takes about as long.
+const Case CASES[] = {
+    {"cachedalloc_get_put", 64, 1000000, SetupAllocator, RunAllocGetPut, TeardownAllocator},
+    {"cachedalloc_burst", 64, 1000000, SetupAllocator, RunAllocBurst, TeardownAllocator},
+    {"ioevent_create_destroy", 0, 1000000, SetupEventClients, RunEventCreateDestroy, NULL},
+    {"zeromemory_ioevent", static_cast<DWORD>(sizeof(IOEvent)), 1000000, NULL, RunZeroEvent,
+     NULL},
+    {"packet_create_destroy", 64, 1000000, NULL, RunPacketCreateDestroy, NULL},
+    {"packet_create_destroy", 1024, 500000, NULL, RunPacketCreateDestroy, NULL},
+    {"packet_create_destroy", 4096, 200000, NULL, RunPacketCreateDestroy, NULL},
+    {"packet_create_destroy", 16384, 50000, NULL, RunPacketCreateDestroy, NULL},
+    {"packet_create_destroy", 65536, 10000, NULL, RunPacketCreateDestroy, NULL},
+    {"handle_lookup", 1000, 1000000, SetupRegistry, RunRegistryLookup, TeardownRegistry},
+    {"handle_lookup", 10000, 1000000, SetupRegistry, RunRegistryLookup, TeardownRegistry},
+    {"handle_lookup", 100000, 1000000, SetupRegistry, RunRegistryLookup, TeardownRegistry},
+    {"log_trace_off", 0, 1000000, SetupTraceOff, RunTrace, TeardownTrace},
+    // The writer can't keep up with this, so most of these traces end up dropped.
+    {"log_trace_on", 0, 100000, SetupTraceOn, RunTrace, TeardownTrace},
+};
+}
+
+int main(int argc, char* argv[])
+{
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+
+    int maxThreads = static_cast<int>(systemInfo.dwNumberOfProcessors);
+    if (argc > 1)
+    {
+        maxThreads = atoi(argv[1]);
+    }
+    maxThreads = std::min<int>(std::max<int>(maxThreads, 1), MAXIMUM_WAIT_OBJECTS);
+
+    const char* csvPath = argc > 2 ? argv[2] : DEFAULT_CSV_PATH;
+
+    FILE* csv = NULL;
+    if (fopen_s(&csv, csvPath, "a") != 0 || csv == NULL)
+    {
+        ERROR_MSG("Could not open %s.", csvPath);
+        return 1;
+    }
+
+    fseek(csv, 0, SEEK_END);
+    if (ftell(csv) == 0)
+    {
+        fprintf(csv, "benchmark,param,threads,iterations,repetitions,median_ns_per_op,"
+                     "min_ns_per_op,median_mops\n");
+    }
+
+    // Traces are queued like they are in the server, and only the ones that fit are written.
+    Log::Setup();
+
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); ++i)
+    {
+        RunCase(CASES[i], maxThreads, csv);
+    }
+
+    printf("Dropped traces : %ld\n", Log::GetNumDropped());
+
+    Log::Cleanup();
+    fclose(csv);
+
+    return 0;
+}
@@ -4,7 +4,11 @@
 #include "common/Log.h"
 #include "common/Network.h"
 
+#include "common/BufferPool.h"
 #include "common/CachedAlloc.h"
+#include "common/CritSecLock.h"
+#include "common/InlineCompletion.h"
+#include "common/Metrics.h"
 
 #include <cassert>
 #include <iostream>
@@ -29,8 +33,11 @@ class IOEvent
 
    public:
     OVERLAPPED overlapped;
-    Client* client;
+    Client* client;  // referenced until the event is destroyed
     Type type;
+    // The pooled buffer a send owns until the event is destroyed, or NULL.
+    BYTE* buffer;
+    DWORD bufferSize;
 
    private:
     IOEvent();
@@ -41,6 +48,8 @@ class IOEvent
 
 // use thread-safe memory pool
 CachedAlloc eventAllocator(sizeof(IOEvent));
+// Every send has a buffer of its own, so that any number of them can be outstanding.
+BufferPool sendBufferPool;
 
 /* static */ IOEvent* IOEvent::Create(Client* client, Type type)
 {
@@ -48,10 +57,26 @@ CachedAlloc eventAllocator(sizeof(IOEvent));
     ZeroMemory(event, sizeof(IOEvent));
     event->client = client;
     event->type = type;
+
+    client->AddRef();
+
     return event;
 }
 
-/* static */ void IOEvent::Destroy(IOEvent* event) { eventAllocator.put(event); }
+/* static */ void IOEvent::Destroy(IOEvent* event)
+{
+    Client* client = event->client;
+
+    if (event->buffer != NULL)
+    {
+        sendBufferPool.put(event->buffer, event->bufferSize);
+    }
+
+    eventAllocator.put(event);
+
+    // This may destroy the client, so do it last.
+    client->Release();
+}
 
 void PrintConnectionInfo(SOCKET socket)
 {
@@ -71,17 +96,25 @@ Client::IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */, PVOID /* Cont
                              PVOID Overlapped, ULONG IoResult, ULONG_PTR NumberOfBytesTransferred,
                              PTP_IO /* Io */)
 {
-    IOEvent* event = CONTAINING_RECORD(Overlapped, IOEvent, overlapped);
+    HandleCompletion(static_cast<LPOVERLAPPED>(Overlapped), IoResult, NumberOfBytesTransferred);
+}
+
+/* static */ void CALLBACK
+Client::WorkerInlineCompletion(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
+{
+    LPOVERLAPPED overlapped = static_cast<LPOVERLAPPED>(Context);
+    assert(overlapped);
+
+    HandleCompletion(overlapped, ERROR_SUCCESS, overlapped->InternalHigh);
+}
+
+/* static */ void Client::HandleCompletion(LPOVERLAPPED overlapped, ULONG IoResult,
+                                           ULONG_PTR NumberOfBytesTransferred)
+{
+    IOEvent* event = CONTAINING_RECORD(overlapped, IOEvent, overlapped);
     assert(event);
     assert(event->client);
 
-    if (!ClientMan::Instance()->IsAlive(event->client))
-    {
-        // No client for this event.
-        IOEvent::Destroy(event);
-        return;
-    }
-
     if (IoResult == ERROR_SUCCESS)
     {
         switch (event->type)
@@ -99,7 +132,7 @@ Client::IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */, PVOID /* Cont
             else
             {
                 event->client->OnClose();
-                ClientMan::Instance()->PostRemoveClient(event->client);
+                ClientMan::Instance()->PostRemoveClient(event->client->GetId());
             }
             break;
 
@@ -116,36 +149,39 @@ Client::IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */, PVOID /* Cont
     {
         ERROR_CODE(IoResult, "I/O operation failed.");
 
+        Client* client = event->client;
         if (event->type == IOEvent::CONNECT 
-            && (event->client->m_info = event->client->m_info->ai_next) != NULL)
+            && (client->m_info = client->FindAddress(client->m_info->ai_next)) != NULL)
         {
+            StartThreadpoolIo(client->m_pTPIO);
+
+            int error = 0;
             if (!Network::ConnectEx(
-                event->client->GetSocket(), 
-                event->client->m_info->ai_addr, 
-                event->client->m_info->ai_addrlen, 
-                &event->overlapped))
+                client->GetSocket(), 
+                client->m_info->ai_addr, 
+                static_cast<int>(client->m_info->ai_addrlen), 
+                &event->overlapped)
+                && (error = WSAGetLastError()) != ERROR_IO_PENDING)
             {
-                int error = WSAGetLastError();
-
-                if (error != ERROR_IO_PENDING)
-                {
-                    ERROR_CODE(IoResult, "I/O operation failed.");
-                    ClientMan::Instance()->PostRemoveClient(event->client);
-                }
-                else
-                {
-                    StartThreadpoolIo(event->client->m_pTPIO);
-                    return; // bypass Destroy()
-                }
+                CancelThreadpoolIo(client->m_pTPIO);
+                ERROR_CODE(error, "ConnectEx() failed.");
+                ClientMan::Instance()->OnConnectResult(false);
+                ClientMan::Instance()->PostRemoveClient(client->GetId());
             }
             else
             {
-                event->client->OnConnect();
+                // The socket doesn't skip the completion port until it has connected, so the
+                // callback is called even if the connect succeeded right away.
+                return; // bypass Destroy()
             }
         }
         else
         {
-            ClientMan::Instance()->PostRemoveClient(event->client);
+            if (event->type == IOEvent::CONNECT)
+            {
+                ClientMan::Instance()->OnConnectResult(false);
+            }
+            ClientMan::Instance()->PostRemoveClient(event->client->GetId());
         }
     }
 
@@ -154,30 +190,54 @@ Client::IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */, PVOID /* Cont
 
 Client::Client() 
     : m_pTPIO(NULL), 
+    m_Id(INVALID_HANDLE_ID),
+    m_RefCount(0),
     m_Socket(INVALID_SOCKET), 
+    m_SkipCompletionPort(false),
     m_State(WAIT),
-    m_infoList(NULL),
-    m_info(NULL)
-{}
+    m_Family(AF_UNSPEC),
+    m_info(NULL),
+    m_NumSending(0),
+    m_SendDepth(DEFAULT_SEND_DEPTH),
+    m_Benchmarking(false),
+    m_BenchmarkMessageSize(0),
+    m_NumUnsent(0),
+    m_NumWaitingForCredit(0),
+    m_WaitingForCredit(false),
+    m_NextSendSequence(0),
+    m_NextRecvSequence(0),
+    m_RecvOffset(0)
+{
+    ZeroMemory(&m_RecvHeader, sizeof(m_RecvHeader));
+    InitializeCriticalSection(&m_SendLock);
+}
 
 Client::~Client() 
 { 
+    assert(m_RefCount == 0);
+
     Destroy();
-    if (m_infoList)
-        freeaddrinfo(m_infoList);
+
+    for (size_t i = 0; i < m_PendingSends.size(); ++i)
+    {
+        sendBufferPool.put(m_PendingSends[i].first, m_PendingSends[i].second);
+    }
+
+    DeleteCriticalSection(&m_SendLock);
 }
 
-bool Client::Create(short port)
+bool Client::Create(int family, const Network::SocketOptions& options)
 {
     assert(m_Socket == INVALID_SOCKET);
     assert(m_State == WAIT);
 
     // Create Socket
-    m_Socket = Network::CreateSocket(true, port);
+    m_Socket = Network::CreateConnectSocket(family);
     if (m_Socket == INVALID_SOCKET)
     {
         return false;
     }
+    m_Family = family;
 
     // Make the address re-usable to re-run the same client instantly.
     bool reuseAddr = true;
@@ -188,6 +248,12 @@ bool Client::Create(short port)
         return false;
     }
 
+    // The loopback fast path and the buffer sizes only count if they are set before ConnectEx().
+    if (!Network::ApplySocketOptions(m_Socket, options))
+    {
+        return false;
+    }
+
     // Create & Start ThreaddPool for socket IO
     m_pTPIO =
         CreateThreadpoolIo(reinterpret_cast<HANDLE>(m_Socket), IoCompletionCallback, NULL, NULL);
@@ -217,56 +283,62 @@ void Client::Destroy()
 {
     Close();
 
+    // Nothing references the client any more, so no callback can be outstanding and we don't
+    // have to wait for them. This also makes it safe to destroy a client in its own callback.
     if (m_pTPIO != NULL)
     {
-        WaitForThreadpoolIoCallbacks(m_pTPIO, false);
         CloseThreadpoolIo(m_pTPIO);
         m_pTPIO = NULL;
     }
 }
 
-bool Client::PostConnect(const char* ip, short port)
+void Client::Release()
 {
-    if (m_State != CREATED)
+    const long refCount = InterlockedDecrement(&m_RefCount);
+    assert(refCount >= 0);
+
+    if (refCount == 0)
     {
-        return false;
+        ClientMan::Instance()->OnClientReleased(this);
     }
+}
 
-    assert(m_Socket != INVALID_SOCKET);
-
-    // Get Address Info
-    addrinfo hints;
-    ZeroMemory(&hints, sizeof(addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-    hints.ai_flags = 0;
+const addrinfo* Client::FindAddress(const addrinfo* addresses)
+{
+    while (addresses != NULL && addresses->ai_family != m_Family)
+    {
+        addresses = addresses->ai_next;
+    }
+    return addresses;
+}
 
-    char portStr[32] = "";
-    if (-1 == sprintf_s(portStr, sizeof(portStr), "%d", port))
+bool Client::PostConnect(const addrinfo* addresses)
+{
+    if (m_State != CREATED)
     {
         return false;
     }
 
-    m_infoList = NULL;
-    if (getaddrinfo(ip, portStr, &hints, &m_infoList) != 0)
+    assert(m_Socket != INVALID_SOCKET);
+
+    if (FindAddress(addresses) == NULL)
     {
-        ERROR_CODE(WSAGetLastError(), "getaddrinfo() failed.");
+        ERROR_MSG("The server has no address of the client's family.");
         return false;
     }
   
     IOEvent* event = IOEvent::Create(this, IOEvent::CONNECT);
+    m_State = CONNECTING;
 
     // loop through all the results and connect to the first we can
-    m_info = m_infoList;
-    for (; m_info != NULL; m_info = m_info->ai_next)
+    for (m_info = FindAddress(addresses); m_info != NULL; m_info = FindAddress(m_info->ai_next))
     {
         StartThreadpoolIo(m_pTPIO);
 
         if (!Network::ConnectEx(
             m_Socket, 
             m_info->ai_addr, 
-            m_info->ai_addrlen, 
+            static_cast<int>(m_info->ai_addrlen), 
             &event->overlapped))
         {
             int error = WSAGetLastError();
@@ -277,19 +349,14 @@ bool Client::PostConnect(const char* ip, short port)
                 ERROR_CODE(error, "ConnectEx() failed.");
                 continue;
             }
-            else
-            {
-                return true;
-            }
-        }
-        else
-        {
-            OnConnect();
-            IOEvent::Destroy(event);
-            return true;
         }
+
+        // The socket doesn't skip the completion port until it has connected, so the callback is
+        // called even if the connect succeeded right away.
+        return true;
     }
 
+    m_State = CREATED;
     IOEvent::Destroy(event);
     return false;
 }
@@ -298,11 +365,11 @@ void Client::PostReceive()
 {
     if (m_State == CLOSED)
     {
-        ClientMan::Instance()->PostRemoveClient(this);
+        ClientMan::Instance()->PostRemoveClient(m_Id);
         return;
     }
 
-    assert(m_State == CREATED || m_State == CONNECTED);
+    assert(m_State == CONNECTING || m_State == CONNECTED);
 
     WSABUF recvBufferDescriptor;
     recvBufferDescriptor.buf = reinterpret_cast<char*>(m_recvBuffer);
@@ -322,11 +389,12 @@ void Client::PostReceive()
     {
         CancelThreadpoolIo(m_pTPIO);
 
-        if (m_State == CREATED)
+        if (m_State == CONNECTING)
         {
             // Even though we get successful connection event, if our first call of WSARecv
             // failed, it means we failed in connecting.
             ERROR_CODE(error, "Server cannot accept this connection.");
+            ClientMan::Instance()->OnConnectResult(false);
         }
         else
         {
@@ -334,18 +402,29 @@ void Client::PostReceive()
         }
 
         // Error Handling
-        ClientMan::Instance()->PostRemoveClient(this);
+        ClientMan::Instance()->PostRemoveClient(m_Id);
+        IOEvent::Destroy(event);
     }
     else
     {
         // If this is the first call of WSARecv, we can now set the state CONNECTED.
-        if (m_State == CREATED)
+        if (m_State == CONNECTING)
         {
             m_State = CONNECTED;
+            ClientMan::Instance()->OnConnectResult(true);
             PrintConnectionInfo(m_Socket);
         }
 
-        // In this case, the completion callback will have already been scheduled to be called.
+        if (error == 0 && m_SkipCompletionPort)
+        {
+            // No completion is queued for I/O that succeeded synchronously, so handle it here.
+            CancelThreadpoolIo(m_pTPIO);
+            OnInlineCompletion(&event->overlapped, numberOfBytes);
+        }
+        else
+        {
+            // In this case, the completion callback will have already been scheduled to be called.
+        }
     }
 }
 
@@ -356,17 +435,94 @@ void Client::PostSend(const char* buffer, unsigned int size)
         return;
     }
 
+    while (size > 0)
+    {
+        const DWORD chunkSize = min(size, static_cast<unsigned int>(MAX_SEND_SIZE));
+        BYTE* chunk = static_cast<BYTE*>(sendBufferPool.get(chunkSize));
+        assert(chunk);
+
+        memcpy(chunk, buffer, chunkSize);
+        QueueSend(chunk, chunkSize);
+
+        buffer += chunkSize;
+        size -= chunkSize;
+    }
+
+    StartSends();
+}
+
+void Client::SetSendDepth(DWORD depth)
+{
+    assert(depth > 0);
+
+    {
+        CritSecLock lock(m_SendLock);
+        m_SendDepth = depth;
+    }
+
+    // A deeper pipeline has room for the sends that have been waiting.
+    StartSends();
+}
+
+DWORD Client::GetSendDepth()
+{
+    CritSecLock lock(m_SendLock);
+    return m_SendDepth;
+}
+
+void Client::QueueSend(BYTE* buffer, DWORD size)
+{
+    CritSecLock lock(m_SendLock);
+
+    m_PendingSends.push_back(std::make_pair(buffer, size));
+}
+
+void Client::StartSends()
+{
+    for (;;)
+    {
+        std::pair<BYTE*, DWORD> send;
+        {
+            CritSecLock lock(m_SendLock);
+
+            if (m_PendingSends.empty() || m_NumSending >= m_SendDepth)
+            {
+                return;
+            }
+
+            send = m_PendingSends.front();
+            m_PendingSends.pop_front();
+            ++m_NumSending;
+        }
+
+        if (!PostSendBuffer(send.first, send.second))
+        {
+            return;
+        }
+    }
+}
+
+bool Client::PostSendBuffer(BYTE* buffer, DWORD size)
+{
+    assert(buffer);
+
+    IOEvent* event = IOEvent::Create(this, IOEvent::SEND);
+    event->buffer = buffer;
+    event->bufferSize = size;
+
+    if (m_State != CONNECTED)
+    {
+        IOEvent::Destroy(event);
+        return false;
+    }
+
     WSABUF recvBufferDescriptor;
-    recvBufferDescriptor.buf = reinterpret_cast<char*>(m_sendBuffer);
+    recvBufferDescriptor.buf = reinterpret_cast<char*>(buffer);
     recvBufferDescriptor.len = size;
 
-    memcpy(m_sendBuffer, buffer, size);
-
     DWORD numberOfBytes = size;
     DWORD sendFlags = 0;
 
-    IOEvent* event = IOEvent::Create(this, IOEvent::SEND);
-
     StartThreadpoolIo(m_pTPIO);
 
     int ret = WSASend(m_Socket, &recvBufferDescriptor, 1, &numberOfBytes, sendFlags,
@@ -382,13 +538,23 @@ void Client::PostSend(const char* buffer, unsigned int size)
             ERROR_CODE(error, "WSASend() failed.");
 
             // Error Handling
-            ClientMan::Instance()->PostRemoveClient(this);
+            ClientMan::Instance()->PostRemoveClient(m_Id);
+            IOEvent::Destroy(event);
+            return false;
         }
     }
+    else if (m_SkipCompletionPort)
+    {
+        // No completion is queued for I/O that succeeded synchronously, so handle it here.
+        CancelThreadpoolIo(m_pTPIO);
+        OnInlineCompletion(&event->overlapped, numberOfBytes);
+    }
     else
     {
         // In this case, the completion callback will have already been scheduled to be called.
     }
+
+    return true;
 }
 
 bool Client::Shutdown()
@@ -409,6 +575,165 @@ bool Client::Shutdown()
     return true;
 }
 
+bool Client::StartBenchmark(DWORD messageSize, DWORD inFlight)
+{
+    assert(messageSize >= MIN_BENCHMARK_MESSAGE_SIZE && messageSize <= MAX_BENCHMARK_MESSAGE_SIZE);
+    assert(inFlight > 0);
+
+    {
+        CritSecLock lock(m_SendLock);
+
+        if (m_State != CONNECTED || m_BenchmarkMessageSize != 0)
+        {
+            return false;
+        }
+
+        m_BenchmarkMessageSize = messageSize;
+        m_Benchmarking = true;
+
+        for (DWORD i = 0; i < inFlight; ++i)
+        {
+            ReleaseBenchmarkSlot();
+        }
+    }
+
+    FlushBenchmarkSends();
+    return true;
+}
+
+void Client::StopBenchmark()
+{
+    CritSecLock lock(m_SendLock);
+
+    m_Benchmarking = false;
+    m_NumUnsent = 0;
+    m_NumWaitingForCredit = 0;
+    m_WaitingForCredit = false;
+}
+
+DWORD Client::GrantSendCredits(DWORD credits, bool& stillWaiting)
+{
+    DWORD numGranted = 0;
+    {
+        CritSecLock lock(m_SendLock);
+
+        numGranted = min(credits, m_NumWaitingForCredit);
+        m_NumWaitingForCredit -= numGranted;
+        m_NumUnsent += numGranted;
+
+        m_WaitingForCredit = m_Benchmarking && m_NumWaitingForCredit > 0;
+        stillWaiting = m_WaitingForCredit;
+    }
+
+    FlushBenchmarkSends();
+    return numGranted;
+}
+
+void Client::OnBenchmarkRecv(DWORD numberOfBytes)
+{
+    // The echoes come back in whatever pieces the stream splits them into. Only the header of
+    // each is kept.
+    const DWORD headerSize = sizeof(BenchmarkHeader);
+    const BYTE* data = m_recvBuffer;
+    while (numberOfBytes > 0)
+    {
+        DWORD consumed = 0;
+        if (m_RecvOffset < headerSize)
+        {
+            consumed = min(numberOfBytes, headerSize - m_RecvOffset);
+            memcpy(reinterpret_cast<BYTE*>(&m_RecvHeader) + m_RecvOffset, data, consumed);
+        }
+        else
+        {
+            consumed = min(numberOfBytes, m_BenchmarkMessageSize - m_RecvOffset);
+        }
+
+        data += consumed;
+        numberOfBytes -= consumed;
+        m_RecvOffset += consumed;
+
+        if (m_RecvOffset == m_BenchmarkMessageSize)
+        {
+            m_RecvOffset = 0;
+            OnBenchmarkEcho();
+        }
+    }
+
+    // All the slots that have been freed go out with a single send.
+    FlushBenchmarkSends();
+}
+
+void Client::OnBenchmarkEcho()
+{
+    if (m_RecvHeader.sequence != m_NextRecvSequence || m_RecvHeader.size != m_BenchmarkMessageSize)
+    {
+        ClientMan::Instance()->OnBenchmarkMismatch();
+    }
+    else if (ClientMan::Instance()->IsBenchmarkRunning())
+    {
+        Metrics::RecordLatency(Metrics::ROUND_TRIP, m_RecvHeader.sendTime);
+    }
+    m_NextRecvSequence = m_RecvHeader.sequence + 1;
+
+    CritSecLock lock(m_SendLock);
+
+    if (m_Benchmarking)
+    {
+        ReleaseBenchmarkSlot();
+    }
+}
+
+void Client::ReleaseBenchmarkSlot()
+{
+    if (ClientMan::Instance()->TakeSendCredit())
+    {
+        ++m_NumUnsent;
+        return;
+    }
+
+    ++m_NumWaitingForCredit;
+    if (!m_WaitingForCredit)
+    {
+        m_WaitingForCredit = true;
+        ClientMan::Instance()->WaitForSendCredit(m_Id);
+    }
+}
+
+void Client::FlushBenchmarkSends()
+{
+    {
+        CritSecLock lock(m_SendLock);
+
+        // Only fill the pipeline, and stamp the messages as late as possible, so that the round
+        // trips don't include the time they waited for a send to complete.
+        while (m_Benchmarking && m_NumUnsent > 0 &&
+               m_NumSending + m_PendingSends.size() < m_SendDepth)
+        {
+            const DWORD numMessages = min(m_NumUnsent, MAX_SEND_SIZE / m_BenchmarkMessageSize);
+            const DWORD size = numMessages * m_BenchmarkMessageSize;
+
+            BYTE* buffer = static_cast<BYTE*>(sendBufferPool.get(size));
+            assert(buffer);
+            // Only the headers mean anything. The rest of every message stays zero.
+            ZeroMemory(buffer, size);
+
+            BenchmarkHeader header;
+            header.sendTime = Metrics::Now();
+            header.size = m_BenchmarkMessageSize;
+            for (DWORD i = 0; i < numMessages; ++i)
+            {
+                header.sequence = m_NextSendSequence++;
+                memcpy(buffer + i * m_BenchmarkMessageSize, &header, sizeof(header));
+            }
+
+            m_NumUnsent -= numMessages;
+            m_PendingSends.push_back(std::make_pair(buffer, size));
+        }
+    }
+
+    StartSends();
+}
+
 void Client::OnConnect()
 {
     // The socket s does not enable previously set properties or options until
@@ -419,12 +744,45 @@ void Client::OnConnect()
     }
     else
     {
+        if (ClientMan::Instance()->IsInlineCompletionEnabled() && !m_SkipCompletionPort &&
+            Network::SkipCompletionPortOnSuccess(m_Socket))
+        {
+            m_SkipCompletionPort = true;
+        }
+
         PostReceive();
     }
 }
 
+void Client::OnInlineCompletion(LPOVERLAPPED overlapped, DWORD numberOfBytes)
+{
+    // The handler posts the next I/O, which may complete inline again. Past a few levels, let the
+    // thread pool carry on from a fresh stack.
+    if (!InlineCompletionScope::CanEnter())
+    {
+        overlapped->InternalHigh = numberOfBytes;
+        if (TrySubmitThreadpoolCallback(Client::WorkerInlineCompletion, overlapped, NULL))
+        {
+            return;
+        }
+
+        ERROR_CODE(GetLastError(), "Could not start WorkerInlineCompletion. call it directly.");
+    }
+
+    InlineCompletionScope scope;
+    HandleCompletion(overlapped, ERROR_SUCCESS, numberOfBytes);
+}
+
 void Client::OnRecv(DWORD dwNumberOfBytesTransfered)
 {
+    if (m_BenchmarkMessageSize > 0)
+    {
+        OnBenchmarkRecv(dwNumberOfBytesTransfered);
+
+        PostReceive();
+        return;
+    }
+
     // Do not process packet received here.
     // Instead, publish event with the packet and call PostRecv()
     m_recvBuffer[dwNumberOfBytesTransfered] = '\0';
@@ -436,6 +794,22 @@ void Client::OnRecv(DWORD dwNumberOfBytesTransfered)
 
 void Client::OnSend(DWORD dwNumberOfBytesTransfered)
 {
+    {
+        CritSecLock lock(m_SendLock);
+
+        assert(m_NumSending > 0);
+        --m_NumSending;
+    }
+
+    if (m_BenchmarkMessageSize > 0)
+    {
+        FlushBenchmarkSends();
+        return;
+    }
+
+    // The send's buffer goes back to the pool with its event, so the next one can go out.
+    StartSends();
+
     TRACE("OnSend() : %d", dwNumberOfBytesTransfered);
 }
 
@@ -1,7 +1,18 @@
 #pragma once
 
 #include <winsock2.h>
+#include <deque>
 #include <string>
+#include <utility>
+
+#include "common/HandleTable.h"
+
+struct addrinfo;
+
+namespace Network
+{
+struct SocketOptions;
+}
 
 class Client
 {
@@ -9,14 +20,34 @@ private:
 	enum
 	{
 		MAX_RECV_BUFFER = 1024,
-		MAX_SEND_BUFFER = 1024,
+	};
+
+	// Every benchmark message starts with this. The server echoes it back as it is.
+	struct BenchmarkHeader
+	{
+		LONGLONG sendTime; // Metrics::Now()
+		DWORD sequence;
+		DWORD size;
 	};
 
 public:
+	enum
+	{
+		// Every send has a buffer of its own from a pool of this size at most. Larger messages
+		// are split over several sends.
+		MAX_SEND_SIZE = 64 * 1024,
+		// Sends that are posted at once. The rest wait in the client until one of them completes.
+		DEFAULT_SEND_DEPTH = 8,
+		MIN_BENCHMARK_MESSAGE_SIZE = sizeof(BenchmarkHeader),
+		// Messages are batched into sends, which have to fit at least one.
+		MAX_BENCHMARK_MESSAGE_SIZE = MAX_SEND_SIZE,
+	};
+
 	enum State
 	{
 		WAIT,
 		CREATED,
+		CONNECTING,
 		CONNECTED,
 		CLOSED,
 	};
@@ -29,6 +60,9 @@ private:
         ULONG IoResult,
         ULONG_PTR NumberOfBytesTransferred,
         PTP_IO Io);
+	static void CALLBACK WorkerInlineCompletion(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
+
+	static void HandleCompletion(LPOVERLAPPED overlapped, ULONG IoResult, ULONG_PTR NumberOfBytesTransferred);
 
 public:
 	Client();
@@ -37,32 +71,99 @@ public:
     Client(const Client&) = delete;
     Client& operator=(const Client&) = delete;
 
-	bool Create(short port);
+	// Creates a socket of family with options, which can only connect to addresses of that family.
+	bool Create(int family, const Network::SocketOptions& options);
     void Close();
 	void Destroy();
 
-	bool PostConnect(const char* ip, short port);
+	// Every outstanding IOEvent holds a reference, as does ClientMan while the client is
+	// registered. The last Release() deletes the client.
+	void AddRef() { InterlockedIncrement(&m_RefCount); }
+	void Release();
+
+	// Connects to the first of addresses that works. They are shared by all the clients, and
+	// have to stay until the connect has completed.
+	bool PostConnect(const addrinfo* addresses);
 	void PostReceive();
+	// Copies buffer into pooled send buffers, so the caller can reuse it right away.
 	void PostSend(const char* buffer, unsigned int size);
 
+	// How many sends can be outstanding at once.
+	void SetSendDepth(DWORD depth);
+	DWORD GetSendDepth();
+
 	bool Shutdown();
 
+	// Keeps inFlight messages of messageSize bytes outstanding until StopBenchmark(). A client
+	// runs one benchmark at most, since the echoes of an earlier one could still be on their way.
+	bool StartBenchmark(DWORD messageSize, DWORD inFlight);
+	void StopBenchmark();
+	// Sends up to credits of the messages that are waiting for a credit, and returns how many.
+	// stillWaiting tells whether more are waiting.
+	DWORD GrantSendCredits(DWORD credits, bool& stillWaiting);
+
 	void OnConnect();
 	void OnRecv(DWORD dwNumberOfBytesTransfered);
 	void OnSend(DWORD dwNumberOfBytesTransfered);
 	void OnClose();
+	void OnInlineCompletion(LPOVERLAPPED overlapped, DWORD numberOfBytes);
+
+private:
+	// The first of addresses, or the ones after it, of the socket's family.
+	const addrinfo* FindAddress(const addrinfo* addresses);
+
+	// Queues size bytes of a pooled buffer, which the send takes over.
+	void QueueSend(BYTE* buffer, DWORD size);
+	// Posts the queued sends while there is room in the pipeline.
+	void StartSends();
+	// Takes over buffer. Returns false if the send failed, which removes the client.
+	bool PostSendBuffer(BYTE* buffer, DWORD size);
+
+	void OnBenchmarkRecv(DWORD numberOfBytes);
+	void OnBenchmarkEcho();
+	// An echo has freed a message's slot. m_SendLock must be held.
+	void ReleaseBenchmarkSlot();
+	// Sends the messages that have credits while there is room in the pipeline.
+	void FlushBenchmarkSends();
+
+public:
+	void SetId(HandleId id) { m_Id = id; }
+	HandleId GetId() { return m_Id; }
 
 	State GetState() { return m_State; }
 	SOCKET GetSocket() { return m_Socket; }
 
 private:
 	TP_IO* m_pTPIO;
+	HandleId m_Id;
+	volatile long m_RefCount;
 
 	State m_State;
 	SOCKET m_Socket;
+	bool m_SkipCompletionPort;
 	BYTE m_recvBuffer[MAX_RECV_BUFFER];
-	BYTE m_sendBuffer[MAX_SEND_BUFFER];
 
-    struct addrinfo* m_infoList;
-    struct addrinfo* m_info;
+	int m_Family;
+	// The address being connected to.
+	const struct addrinfo* m_info;
+
+	// Guards the sends and the sending side of the benchmark. The receiving side is only touched
+	// by the one outstanding receive.
+	CRITICAL_SECTION m_SendLock;
+	// Pooled buffers and their sizes, in the order they are sent.
+	std::deque<std::pair<BYTE*, DWORD> > m_PendingSends;
+	DWORD m_NumSending;
+	DWORD m_SendDepth;
+
+	bool m_Benchmarking;
+	DWORD m_BenchmarkMessageSize; // 0 until a benchmark starts.
+	// Messages that can be sent, and those that are waiting for a credit first.
+	DWORD m_NumUnsent;
+	DWORD m_NumWaitingForCredit;
+	bool m_WaitingForCredit;
+	DWORD m_NextSendSequence;
+	DWORD m_NextRecvSequence;
+	// How much of the message being echoed has arrived, and its header.
+	DWORD m_RecvOffset;
+	BenchmarkHeader m_RecvHeader;
 };
@@ -2,143 +2,719 @@
 #include "Client.h"
 
 #include "common/Log.h"
+#include "common/Network.h"
 #include "common/CritSecLock.h"
+#include "common/ThreadPoolTimer.h"
 
+#include <Ws2tcpip.h>
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
 
 /* static */ void CALLBACK
 ClientMan::WorkerRemoveClient(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
 {
-    Client* client = static_cast<Client*>(Context);
-    assert(client);
+    HandleId clientId = reinterpret_cast<HandleId>(Context);
+    assert(clientId != INVALID_HANDLE_ID);
 
-    ClientMan::Instance()->RemoveClient(client);
+    ClientMan::Instance()->RemoveClient(clientId);
+}
+
+/* static */ void CALLBACK ClientMan::WorkerAddClients(PTP_CALLBACK_INSTANCE /* Instance */,
+                                                    PVOID Context, PTP_WORK /* Work */)
+{
+    ClientMan* clientMan = static_cast<ClientMan*>(Context);
+    assert(clientMan);
+
+    clientMan->AddQueuedClients();
+}
+
+/* static */ void CALLBACK ClientMan::WorkerConnectClients(PTP_CALLBACK_INSTANCE /* Instance */,
+                                                        PVOID Context, PTP_WORK /* Work */)
+{
+    ClientMan* clientMan = static_cast<ClientMan*>(Context);
+    assert(clientMan);
+
+    clientMan->ConnectQueuedClients();
+}
+
+/* static */ void CALLBACK ClientMan::WorkerRampConnects(PTP_CALLBACK_INSTANCE /* Instance */,
+                                                      PVOID Context, PTP_TIMER /* Timer */)
+{
+    ClientMan* clientMan = static_cast<ClientMan*>(Context);
+    assert(clientMan);
+
+    clientMan->RampConnects();
+}
+
+/* static */ void CALLBACK ClientMan::WorkerGrantSendCredits(PTP_CALLBACK_INSTANCE /* Instance */,
+                                                          PVOID Context, PTP_TIMER /* Timer */)
+{
+    ClientMan* clientMan = static_cast<ClientMan*>(Context);
+    assert(clientMan);
+
+    clientMan->GrantSendCredits();
 }
 
 ClientMan::ClientMan()
-    : m_hNoClients(CreateEvent(NULL, TRUE, FALSE, NULL))
+    : m_NumLiveClients(0),
+      m_hNoClients(CreateEvent(NULL, TRUE, FALSE, NULL)),
+      m_InlineCompletion(false),
+      m_CanSkipCompletionPort(Network::CanSkipCompletionPortOnSuccess()),
+      m_SendDepth(Client::DEFAULT_SEND_DEPTH),
+      m_NumProcessors(1),
+      m_ClientFamily(AF_INET),
+      m_AddWork(NULL),
+      m_NumToAdd(0),
+      m_NumAddFailures(0),
+      m_ConnectAddresses(NULL),
+      m_NextConnect(0),
+      m_ConnectLimit(0),
+      m_ConnectRate(0),
+      m_ConnectRemainder(0),
+      m_NumConnectTicks(0),
+      m_ConnectWork(NULL),
+      m_ConnectTimer(NULL),
+      m_NumConnectsStarted(0),
+      m_NumConnected(0),
+      m_NumConnectFailures(0),
+      m_BenchmarkRunning(false),
+      m_NumBenchmarkClients(0),
+      m_NumMismatched(0),
+      m_CreditTimer(NULL),
+      m_SendCredits(0),
+      m_CreditRemainder(0)
 { 
-    InitializeCriticalSection(&m_CSForClients); 
+    ZeroMemory(&m_Benchmark, sizeof(m_Benchmark));
+    m_BenchmarkStart.QuadPart = 0;
+
+    InitializeCriticalSection(&m_CSForCreditTick);
+    InitializeCriticalSection(&m_CSForCreditWaiters);
+    InitializeCriticalSection(&m_CSForServerAddresses);
+    InitializeCriticalSection(&m_CSForConnectTick);
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    m_NumProcessors = max(systemInfo.dwNumberOfProcessors, 1UL);
+
+    // Without the work items, clients are created and connected on the calling thread.
+    m_AddWork = CreateThreadpoolWork(ClientMan::WorkerAddClients, this, NULL);
+    if (m_AddWork == NULL)
+    {
+        ERROR_CODE(GetLastError(), "Could not create the work to add clients.");
+    }
+
+    m_ConnectWork = CreateThreadpoolWork(ClientMan::WorkerConnectClients, this, NULL);
+    if (m_ConnectWork == NULL)
+    {
+        ERROR_CODE(GetLastError(), "Could not create the work to connect clients.");
+    }
 }
 
 ClientMan::~ClientMan()
 {
+    if (m_BenchmarkRunning)
+    {
+        BenchmarkResult result;
+        StopBenchmark(result);
+    }
+
+    if (m_CreditTimer != NULL)
+    {
+        CloseThreadpoolTimer(m_CreditTimer);
+    }
+
+    StopConnectRamp();
+    if (m_ConnectTimer != NULL)
+    {
+        CloseThreadpoolTimer(m_ConnectTimer);
+    }
+    if (m_ConnectWork != NULL)
+    {
+        CloseThreadpoolWork(m_ConnectWork);
+    }
+    if (m_AddWork != NULL)
+    {
+        CloseThreadpoolWork(m_AddWork);
+    }
+
+    // The connects that were still outstanding have completed by now, so nothing uses the
+    // addresses any more.
     RemoveClients();
 
-    DeleteCriticalSection(&m_CSForClients);
+    for (std::map<std::string, addrinfo*>::iterator it = m_ServerAddresses.begin();
+         it != m_ServerAddresses.end(); ++it)
+    {
+        freeaddrinfo(it->second);
+    }
+
+    CloseHandle(m_hNoClients);
+
+    DeleteCriticalSection(&m_CSForConnectTick);
+    DeleteCriticalSection(&m_CSForServerAddresses);
+    DeleteCriticalSection(&m_CSForCreditWaiters);
+    DeleteCriticalSection(&m_CSForCreditTick);
 }
 
 void ClientMan::AddClients(int numClients)
 {
-    CritSecLock lock(m_CSForClients);
+    if (numClients <= 0)
+    {
+        return;
+    }
 
-    for (int i = 0; i < numClients; ++i)
+    m_NumToAdd = numClients;
+    m_NumAddFailures = 0;
+
+    if (m_AddWork == NULL)
+    {
+        AddQueuedClients();
+    }
+    else
     {
-        Client* client = new Client();
+        const long numBatches = (numClients + CLIENT_BATCH_SIZE - 1) / CLIENT_BATCH_SIZE;
+        const long numWorkers = min(numBatches, static_cast<long>(m_NumProcessors));
+        for (long i = 0; i < numWorkers; ++i)
+        {
+            SubmitThreadpoolWork(m_AddWork);
+        }
+        WaitForThreadpoolWorkCallbacks(m_AddWork, FALSE);
+    }
+
+    TRACE(" Added : %d, failed : %d", numClients - m_NumAddFailures, m_NumAddFailures);
+}
 
-        if (client->Create(0))
+void ClientMan::AddQueuedClients()
+{
+    while (InterlockedDecrement(&m_NumToAdd) >= 0)
+    {
+        if (!AddClient())
         {
-            m_listClient.push_back(client);
+            InterlockedIncrement(&m_NumAddFailures);
         }
-        else
+    }
+}
+
+bool ClientMan::AddClient()
+{
+    Client* client = new Client();
+    client->SetSendDepth(m_SendDepth);
+
+    if (client->Create(m_ClientFamily, m_SocketOptions))
+    {
+        HandleId clientId = m_Clients.Add(client);
+        if (clientId != INVALID_HANDLE_ID)
         {
-            delete client;
+            // This reference belongs to m_Clients.
+            InterlockedIncrement(&m_NumLiveClients);
+            client->AddRef();
+            client->SetId(clientId);
+            return true;
         }
+
+        ERROR_MSG("Too many clients.");
+    }
+
+    delete client;
+    return false;
+}
+
+const addrinfo* ClientMan::ResolveServer(const char* ip, u_short port)
+{
+    char portStr[32] = "";
+    if (-1 == sprintf_s(portStr, sizeof(portStr), "%d", port))
+    {
+        return NULL;
+    }
+
+    const std::string key = std::string(ip) + " " + portStr;
+
+    CritSecLock lock(m_CSForServerAddresses);
+
+    std::map<std::string, addrinfo*>::iterator it = m_ServerAddresses.find(key);
+    if (it != m_ServerAddresses.end())
+    {
+        return it->second;
+    }
+
+    addrinfo hints;
+    ZeroMemory(&hints, sizeof(addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = 0;
+
+    addrinfo* addresses = NULL;
+    if (getaddrinfo(ip, portStr, &hints, &addresses) != 0)
+    {
+        ERROR_CODE(WSAGetLastError(), "getaddrinfo() failed. address : %s, port : %d", ip, port);
+        return NULL;
     }
+
+    m_ServerAddresses[key] = addresses;
+    m_ClientFamily = addresses->ai_family;
+    return addresses;
 }
 
 void ClientMan::ConnectClients(const char* ip, u_short port)
 {
-    CritSecLock lock(m_CSForClients);
+    const addrinfo* addresses = ResolveServer(ip, port);
+    if (addresses == NULL)
+    {
+        return;
+    }
 
-    for (auto client : m_listClient)
+    // The queue can't change while clients are taken from it.
+    StopConnectRamp();
+
+    m_ConnectQueue.clear();
+    m_Clients.ForEach([this](Client* client)
+    {
+        if (client->GetState() == Client::CREATED)
+        {
+            m_ConnectQueue.push_back(client->GetId());
+        }
+    });
+
+    m_ConnectAddresses = addresses;
+    m_NextConnect = 0;
+    m_ConnectLimit = 0;
+    m_ConnectRemainder = 0;
+    m_NumConnectTicks = 0;
+    m_NumConnectsStarted = 0;
+    m_NumConnected = 0;
+    m_NumConnectFailures = 0;
+
+    if (m_ConnectRate == 0 || m_ConnectTimer == NULL)
     {
-        client->PostConnect(ip, port);
+        ReleaseConnects(static_cast<long>(m_ConnectQueue.size()));
+        return;
     }
+
+    SetRelativeTimer(m_ConnectTimer, CONNECT_TICK_MS, CONNECT_TICK_MS);
 }
 
-void ClientMan::ShutdownClients()
+void ClientMan::SetConnectRate(DWORD connectsPerSecond)
+{
+    if (connectsPerSecond > 0 && m_ConnectTimer == NULL)
+    {
+        m_ConnectTimer = CreateThreadpoolTimer(ClientMan::WorkerRampConnects, this, NULL);
+        if (m_ConnectTimer == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not create the timer for the connect ramp.");
+            return;
+        }
+    }
+
+    m_ConnectRate = connectsPerSecond;
+}
+
+DWORD ClientMan::GetConnectRate() { return m_ConnectRate; }
+
+ClientMan::ConnectStats ClientMan::GetConnectStats()
+{
+    ConnectStats stats = {m_ConnectQueue.size(), m_NumConnectsStarted, m_NumConnected,
+                          m_NumConnectFailures};
+    return stats;
+}
+
+void ClientMan::RampConnects()
 {
-    CritSecLock lock(m_CSForClients);
+    // A tick that runs late mustn't overlap with the next one.
+    CritSecLock lock(m_CSForConnectTick);
+
+    m_ConnectRemainder += static_cast<ULONGLONG>(m_ConnectRate) * CONNECT_TICK_MS;
+    const ULONGLONG numConnects = m_ConnectRemainder / 1000;
+    m_ConnectRemainder %= 1000;
+
+    const long numQueued = static_cast<long>(m_ConnectQueue.size());
+    const long numReleased = static_cast<long>(
+        min(numConnects, static_cast<ULONGLONG>(numQueued - m_ConnectLimit)));
+    ReleaseConnects(numReleased);
+
+    const bool done = m_ConnectLimit == numQueued;
+    if (done || ++m_NumConnectTicks % CONNECT_PROGRESS_TICKS == 0)
+    {
+        TRACE(" Connects : %d of %d started, %d connected, %d failed", m_NumConnectsStarted,
+              numQueued, m_NumConnected, m_NumConnectFailures);
+    }
 
-    for (auto client : m_listClient)
+    if (done)
     {
-        client->Shutdown();
+        SetThreadpoolTimer(m_ConnectTimer, NULL, 0, 0);
     }
 }
 
-void ClientMan::RemoveClients()
+void ClientMan::ReleaseConnects(long numClients)
 {
-    EnterCriticalSection(&m_CSForClients);
-    for (auto client : m_listClient)
+    if (numClients <= 0)
     {
-        client->Close();
+        return;
     }
-    const bool isEmpty = m_listClient.empty();
-    if (!isEmpty)
+
+    InterlockedExchangeAdd(&m_ConnectLimit, numClients);
+
+    if (m_ConnectWork == NULL)
     {
-        ResetEvent(m_hNoClients);
+        ConnectQueuedClients();
+        return;
     }
-    LeaveCriticalSection(&m_CSForClients);
 
-    if (!isEmpty)
+    const long numBatches = (numClients + CLIENT_BATCH_SIZE - 1) / CLIENT_BATCH_SIZE;
+    const long numWorkers = min(numBatches, static_cast<long>(m_NumProcessors));
+    for (long i = 0; i < numWorkers; ++i)
     {
-        WaitForSingleObject(m_hNoClients, INFINITE);
+        SubmitThreadpoolWork(m_ConnectWork);
     }
 }
 
-void ClientMan::Send(const std::string& msg)
+void ClientMan::ConnectQueuedClients()
 {
-    CritSecLock lock(m_CSForClients);
+    for (;;)
+    {
+        const long index = m_NextConnect;
+        if (index >= m_ConnectLimit)
+        {
+            return;
+        }
+
+        if (InterlockedCompareExchange(&m_NextConnect, index + 1, index) != index)
+        {
+            continue;
+        }
+
+        // Only hold the client's shard for the lookup.
+        Client* client = NULL;
+        if (!m_Clients.Visit(m_ConnectQueue[index], [&client](Client* queued)
+            {
+                queued->AddRef();
+                client = queued;
+            }))
+        {
+            continue;
+        }
+
+        InterlockedIncrement(&m_NumConnectsStarted);
+        if (!client->PostConnect(m_ConnectAddresses))
+        {
+            OnConnectResult(false);
+        }
+
+        client->Release();
+    }
+}
 
-    for (auto client : m_listClient)
+void ClientMan::StopConnectRamp()
+{
+    if (m_ConnectTimer != NULL)
+    {
+        SetThreadpoolTimer(m_ConnectTimer, NULL, 0, 0);
+        WaitForThreadpoolTimerCallbacks(m_ConnectTimer, TRUE);
+    }
+
+    // The clients let through so far still connect.
+    if (m_ConnectWork != NULL)
     {
-        client->PostSend(msg.c_str(), msg.length());
+        WaitForThreadpoolWorkCallbacks(m_ConnectWork, FALSE);
     }
 }
 
-void ClientMan::PostRemoveClient(Client* client)
+void ClientMan::OnConnectResult(bool connected)
+{
+    InterlockedIncrement(connected ? &m_NumConnected : &m_NumConnectFailures);
+}
+
+void ClientMan::ShutdownClients()
+{
+    m_Clients.ForEach([](Client* client) { client->Shutdown(); });
+}
+
+void ClientMan::RemoveClients()
 {
-    if (!TrySubmitThreadpoolCallback(ClientMan::WorkerRemoveClient, client, NULL))
+    // Reset before closing so that the last release can't be missed.
+    ResetEvent(m_hNoClients);
+
+    // Closing the sockets makes the outstanding I/O complete, which drops the last references.
+    m_Clients.RemoveAll([](Client* client)
+    {
+        client->Close();
+        client->Release();
+    });
+
+    if (m_NumLiveClients != 0)
+    {
+        WaitForSingleObject(m_hNoClients, INFINITE);
+    }
+}
+
+void ClientMan::Send(const std::string& msg)
+{
+    m_Clients.ForEach(
+        [&msg](Client* client) { client->PostSend(msg.c_str(), msg.length()); });
+}
+
+void ClientMan::PostRemoveClient(HandleId clientId)
+{
+    if (!TrySubmitThreadpoolCallback(ClientMan::WorkerRemoveClient,
+                                     reinterpret_cast<PVOID>(clientId), NULL))
     {
         ERROR_CODE(GetLastError(), "Could not start WorkerRemoveClient.");
 
         // This is not good. We should remove the client in a different thread to wait until its IO
         // operations are complete.
         // You need a fallback strategy. DO NOT JUST FOLLOW THIS EXAMPLE. YOU HAVE BEEN WARNED.
-        RemoveClient(client);
+        RemoveClient(clientId);
+    }
+}
+
+void ClientMan::RemoveClient(HandleId clientId)
+{
+    Client* client = m_Clients.Remove(clientId);
+    if (client == NULL)
+    {
+        return;
+    }
+
+    // Outstanding events keep the client alive, so it is deleted once they have completed.
+    client->Close();
+    client->Release();
+}
+
+void ClientMan::OnClientReleased(Client* client)
+{
+    delete client;
+
+    if (InterlockedDecrement(&m_NumLiveClients) == 0)
+    {
+        SetEvent(m_hNoClients);
     }
 }
 
-void ClientMan::RemoveClient(Client* client)
+size_t ClientMan::GetNumClients() { return m_Clients.GetSize(); }
+
+size_t ClientMan::GetNumConnectedClients()
 {
-    CritSecLock lock(m_CSForClients);
+    size_t numConnected = 0;
+    m_Clients.ForEach([&numConnected](Client* client)
+    {
+        if (client->GetState() == Client::CONNECTED)
+        {
+            ++numConnected;
+        }
+    });
+    return numConnected;
+}
 
-    ClientList::iterator itor = find(m_listClient.begin(), m_listClient.end(), client);
+bool ClientMan::StartBenchmark(const BenchmarkOptions& options)
+{
+    if (m_BenchmarkRunning)
+    {
+        ERROR_MSG("A benchmark is running already.");
+        return false;
+    }
 
-    if (itor != m_listClient.end())
+    if (options.messageSize < Client::MIN_BENCHMARK_MESSAGE_SIZE ||
+        options.messageSize > Client::MAX_BENCHMARK_MESSAGE_SIZE || options.inFlight == 0)
     {
-        delete *itor;
-        m_listClient.erase(itor);
+        ERROR_MSG("Messages have to be %d to %d bytes, and at least one has to be in flight.",
+                  Client::MIN_BENCHMARK_MESSAGE_SIZE, Client::MAX_BENCHMARK_MESSAGE_SIZE);
+        return false;
+    }
 
-        if (m_listClient.empty())
+    if (options.rate > 0 && m_CreditTimer == NULL)
+    {
+        m_CreditTimer = CreateThreadpoolTimer(ClientMan::WorkerGrantSendCredits, this, NULL);
+        if (m_CreditTimer == NULL)
         {
-            SetEvent(m_hNoClients);
+            ERROR_CODE(GetLastError(), "Could not create the timer for send credits.");
+            return false;
         }
     }
+
+    m_Benchmark = options;
+    m_NumMismatched = 0;
+    m_CreditRemainder = 0;
+    m_SendCredits = 0;
+
+    m_BenchmarkRunning = true;
+    QueryPerformanceCounter(&m_BenchmarkStart);
+
+    // The first messages wait for the first tick like any others, so that the rate holds from the
+    // start.
+    if (options.rate > 0)
+    {
+        SetRelativeTimer(m_CreditTimer, BENCHMARK_TICK_MS, BENCHMARK_TICK_MS);
+    }
+
+    size_t numStarted = 0;
+    m_Clients.ForEach([&options, &numStarted](Client* client)
+    {
+        if (client->StartBenchmark(options.messageSize, options.inFlight))
+        {
+            ++numStarted;
+        }
+    });
+    m_NumBenchmarkClients = numStarted;
+
+    if (numStarted == 0)
+    {
+        ERROR_MSG("No connected client could start the benchmark.");
+        BenchmarkResult result;
+        StopBenchmark(result);
+        return false;
+    }
+
+    return true;
 }
 
-size_t ClientMan::GetNumClients()
+void ClientMan::StopBenchmark(BenchmarkResult& result)
 {
-    CritSecLock lock(m_CSForClients);
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+
+    m_BenchmarkRunning = false;
 
-    return m_listClient.size();
+    if (m_CreditTimer != NULL)
+    {
+        SetThreadpoolTimer(m_CreditTimer, NULL, 0, 0);
+        WaitForThreadpoolTimerCallbacks(m_CreditTimer, TRUE);
+    }
+
+    m_Clients.ForEach([](Client* client) { client->StopBenchmark(); });
+
+    {
+        CritSecLock lock(m_CSForCreditWaiters);
+        m_CreditWaiters.clear();
+    }
+
+    Metrics::Snapshot snapshot;
+    Metrics::GetSnapshot(snapshot);
+
+    result.numClients = m_NumBenchmarkClients;
+    result.seconds = static_cast<double>(now.QuadPart - m_BenchmarkStart.QuadPart) /
+                     static_cast<double>(frequency.QuadPart);
+    result.latency = snapshot.latencies[Metrics::ROUND_TRIP];
+    result.numMismatched = m_NumMismatched;
 }
 
-bool ClientMan::IsAlive(const Client* client)
+bool ClientMan::TakeSendCredit()
 {
-    CritSecLock lock(m_CSForClients);
+    if (m_Benchmark.rate == 0)
+    {
+        return true;
+    }
+
+    for (;;)
+    {
+        const long credits = m_SendCredits;
+        if (credits <= 0)
+        {
+            return false;
+        }
 
-    ClientList::const_iterator itor = find(m_listClient.begin(), m_listClient.end(), client);
-    return itor != m_listClient.end();
+        if (InterlockedCompareExchange(&m_SendCredits, credits - 1, credits) == credits)
+        {
+            return true;
+        }
+    }
+}
+
+void ClientMan::WaitForSendCredit(HandleId clientId)
+{
+    CritSecLock lock(m_CSForCreditWaiters);
+
+    m_CreditWaiters.push_back(clientId);
 }
+
+void ClientMan::GrantSendCredits()
+{
+    // A tick that runs late mustn't overlap with the next one.
+    CritSecLock tickLock(m_CSForCreditTick);
+
+    // Credits the last tick left over expire, so that a stall doesn't turn into a burst.
+    InterlockedExchange(&m_SendCredits, 0);
+
+    m_CreditRemainder += static_cast<ULONGLONG>(m_Benchmark.rate) * BENCHMARK_TICK_MS;
+    ULONGLONG credits = m_CreditRemainder / 1000;
+    m_CreditRemainder %= 1000;
+
+    std::vector<HandleId> waiters;
+    {
+        CritSecLock lock(m_CSForCreditWaiters);
+        waiters.swap(m_CreditWaiters);
+    }
+
+    // The clients that have waited get the credits first, in the order they asked for them.
+    std::vector<HandleId> stillWaiting;
+    size_t numServed = 0;
+    for (; numServed < waiters.size() && credits > 0; ++numServed)
+    {
+        // Only hold the client's shard for the lookup. Sending may remove the client.
+        Client* client = NULL;
+        if (!m_Clients.Visit(waiters[numServed], [&client](Client* waiter)
+            {
+                waiter->AddRef();
+                client = waiter;
+            }))
+        {
+            continue;
+        }
+
+        bool waiting = false;
+        const DWORD available = static_cast<DWORD>(std::min<ULONGLONG>(credits, MAXDWORD));
+        credits -= client->GrantSendCredits(available, waiting);
+        if (waiting)
+        {
+            stillWaiting.push_back(waiters[numServed]);
+        }
+
+        client->Release();
+    }
+
+    {
+        CritSecLock lock(m_CSForCreditWaiters);
+
+        // Those that have run out of credits go to the back, behind the ones that got none.
+        m_CreditWaiters.insert(m_CreditWaiters.begin(), waiters.begin() + numServed,
+                               waiters.end());
+        m_CreditWaiters.insert(m_CreditWaiters.end(), stillWaiting.begin(), stillWaiting.end());
+    }
+
+    InterlockedExchange(&m_SendCredits,
+                        static_cast<long>(std::min<ULONGLONG>(credits, LONG_MAX)));
+}
+
+void ClientMan::EnableInlineCompletion(bool enable)
+{
+    if (enable && !m_CanSkipCompletionPort)
+    {
+        ERROR_MSG("A layered provider doesn't support inline completion. It won't be used.");
+        return;
+    }
+
+    m_InlineCompletion = enable;
+}
+
+bool ClientMan::IsInlineCompletionEnabled() { return m_InlineCompletion; }
+
+void ClientMan::SetSendDepth(DWORD depth)
+{
+    if (depth == 0)
+    {
+        ERROR_MSG("At least one send has to be outstanding.");
+        return;
+    }
+
+    m_SendDepth = depth;
+    m_Clients.ForEach([depth](Client* client) { client->SetSendDepth(depth); });
+}
+
+DWORD ClientMan::GetSendDepth() { return m_SendDepth; }
+
+void ClientMan::SetSocketOptions(const Network::SocketOptions& options)
+{
+    m_SocketOptions = options;
+}
+
+const Network::SocketOptions& ClientMan::GetSocketOptions() { return m_SocketOptions; }
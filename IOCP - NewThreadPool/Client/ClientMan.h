@@ -1,42 +1,200 @@
 #pragma once
 
 #include <winsock2.h>
-#include <vector>
+#include <map>
 #include <string>
+#include <vector>
 
 #include "common/TSingleton.h"
+#include "common/HandleTable.h"
+#include "common/Metrics.h"
+#include "common/Network.h"
 
 class Client;
+struct addrinfo;
 
 
 class ClientMan : public TSingleton<ClientMan>
 {
+	friend class Client;
+
+public:
+	// A closed-loop benchmark: every connection keeps inFlight messages of messageSize bytes
+	// outstanding, and sends another one whenever one has been echoed back.
+	struct BenchmarkOptions
+	{
+		DWORD messageSize;
+		DWORD inFlight;
+		// Messages a second over all the connections, or 0 to send as fast as the echoes allow.
+		DWORD rate;
+		DWORD duration; // in seconds
+	};
+
+	struct BenchmarkResult
+	{
+		size_t numClients;
+		double seconds;
+		// Round trips of the messages echoed back while the benchmark ran.
+		Metrics::LatencyStats latency;
+		// Echoes that didn't match the message that was due.
+		long numMismatched;
+	};
+
+	// The progress of the last ConnectClients().
+	struct ConnectStats
+	{
+		size_t numQueued; // clients that were waiting to connect.
+		long numStarted;
+		long numConnected;
+		long numFailed;
+	};
+
 private:
+	enum
+	{
+		// How often the send credits of a rate limited benchmark are handed out.
+		BENCHMARK_TICK_MS = 10,
+		// How often a connect ramp lets the next clients connect, and how many ticks apart it
+		// reports its progress.
+		CONNECT_TICK_MS = 10,
+		CONNECT_PROGRESS_TICKS = 100,
+		// Clients a pool thread creates or connects before another thread is asked to help.
+		CLIENT_BATCH_SIZE = 64,
+	};
+
 	static void CALLBACK WorkerRemoveClient(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
+	static void CALLBACK WorkerAddClients(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+		PTP_WORK /* Work */);
+	static void CALLBACK WorkerConnectClients(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+		PTP_WORK /* Work */);
+	static void CALLBACK WorkerRampConnects(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+		PTP_TIMER /* Timer */);
+	static void CALLBACK WorkerGrantSendCredits(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+		PTP_TIMER /* Timer */);
 
 public:
 	ClientMan();
 	virtual ~ClientMan();
 
+	// Creates the clients on the pool threads, and returns once they have all been created.
 	void AddClients(int numClients);
+	// Connects the clients that haven't been yet, on the pool threads and at the connect rate.
+	// Returns right away. A connect that is still ramping up is finished first.
 	void ConnectClients(const char* ip, u_short port);
+	// Connects a second over all the clients, or 0 to connect them all at once.
+	void SetConnectRate(DWORD connectsPerSecond);
+	DWORD GetConnectRate();
+	ConnectStats GetConnectStats();
+	// Resolves the server once for all the clients, and keeps what it resolved to until the
+	// ClientMan is deleted. Clients added from then on are of the family of its first address.
+	// Returns NULL if it doesn't resolve.
+	const addrinfo* ResolveServer(const char* ip, u_short port);
+
 	void ShutdownClients();
 	void RemoveClients();
-	void PostRemoveClient(Client* client);
+	void PostRemoveClient(HandleId clientId);
 	void Send(const std::string& msg);
 
-	bool IsAlive(const Client* client);
 	size_t GetNumClients();
+	// Clients whose connection has been established.
+	size_t GetNumConnectedClients();
 
-private:
-	void RemoveClient(Client* client);
+	// Starts the benchmark on every connected client that hasn't run one yet. Round trips are
+	// recorded in Metrics::ROUND_TRIP, so only one benchmark is measured per run of the process.
+	bool StartBenchmark(const BenchmarkOptions& options);
+	// Stops sending. Echoes that are still on their way are no longer recorded.
+	void StopBenchmark(BenchmarkResult& result);
+	bool IsBenchmarkRunning() { return m_BenchmarkRunning; }
+
+	// Handle I/O that completes synchronously on the posting thread instead of through the
+	// completion port. This applies to clients connected from then on, and is ignored if a layered
+	// provider doesn't support it.
+	void EnableInlineCompletion(bool enable);
+	bool IsInlineCompletionEnabled();
 
+	// How many sends each client can have outstanding, including the clients added later.
+	void SetSendDepth(DWORD depth);
+	DWORD GetSendDepth();
+
+	// The socket options of clients added from then on, which are set before they connect.
+	// Must not be changed while clients are being added.
+	void SetSocketOptions(const Network::SocketOptions& options);
+	const Network::SocketOptions& GetSocketOptions();
 
 private:
-	typedef std::vector<Client*> ClientList;
-	ClientList m_listClient;
+	void RemoveClient(HandleId clientId);
+	void OnClientReleased(Client* client);
+
+	bool AddClient();
+	void AddQueuedClients();
+	// Connects the queued clients that the ramp has let through.
+	void ConnectQueuedClients();
+	void RampConnects();
+	// Lets numClients more of the queued clients connect.
+	void ReleaseConnects(long numClients);
+	// Stops the ramp and waits for the clients it has let through to connect.
+	void StopConnectRamp();
+	void OnConnectResult(bool connected);
+
+	// A client may send a message if it can take a credit. One that can't waits for the next
+	// tick, which serves the waiting clients first.
+	bool TakeSendCredit();
+	void WaitForSendCredit(HandleId clientId);
+	void GrantSendCredits();
+	void OnBenchmarkMismatch() { InterlockedIncrement(&m_NumMismatched); }
 
-	CRITICAL_SECTION m_CSForClients;
 
+private:
+	HandleTable<Client> m_Clients;
+
+	// Clients that have not been released yet, including the removed ones with I/O outstanding.
+	volatile long m_NumLiveClients;
     HANDLE m_hNoClients;
+
+	volatile bool m_InlineCompletion;
+	bool m_CanSkipCompletionPort;
+	volatile DWORD m_SendDepth;
+	Network::SocketOptions m_SocketOptions;
+	DWORD m_NumProcessors;
+
+	// What each server "ip port" resolved to.
+	std::map<std::string, addrinfo*> m_ServerAddresses;
+	CRITICAL_SECTION m_CSForServerAddresses;
+	volatile int m_ClientFamily;
+
+	TP_WORK* m_AddWork;
+	volatile long m_NumToAdd;
+	volatile long m_NumAddFailures;
+
+	// The clients of the last ConnectClients(). Only those before m_ConnectLimit may connect,
+	// and m_NextConnect is the next of them that hasn't.
+	std::vector<HandleId> m_ConnectQueue;
+	const addrinfo* m_ConnectAddresses;
+	volatile long m_NextConnect;
+	volatile long m_ConnectLimit;
+	volatile DWORD m_ConnectRate;
+	// Thousandths of a connect carried over from the last tick. Only the ramp touches it.
+	ULONGLONG m_ConnectRemainder;
+	DWORD m_NumConnectTicks;
+	TP_WORK* m_ConnectWork;
+	TP_TIMER* m_ConnectTimer;
+	CRITICAL_SECTION m_CSForConnectTick;
+	volatile long m_NumConnectsStarted;
+	volatile long m_NumConnected;
+	volatile long m_NumConnectFailures;
+
+	BenchmarkOptions m_Benchmark;
+	volatile bool m_BenchmarkRunning;
+	size_t m_NumBenchmarkClients;
+	LARGE_INTEGER m_BenchmarkStart;
+	volatile long m_NumMismatched;
+
+	TP_TIMER* m_CreditTimer;
+	// Credits that can be taken right away. Whatever a tick leaves over expires with the next one.
+	volatile long m_SendCredits;
+	// Thousandths of a credit carried over from the last tick. Only the tick touches it.
+	ULONGLONG m_CreditRemainder;
+	CRITICAL_SECTION m_CSForCreditTick;
+	CRITICAL_SECTION m_CSForCreditWaiters;
+	std::vector<HandleId> m_CreditWaiters;
 };
@@ -1,23 +1,119 @@
 
+#include <cstdio>
 #include <string>
 #include <iostream>
 #include <vector>
 
 #include "common/Log.h"
+#include "common/Metrics.h"
 #include "common/Network.h"
 #include "ClientMan.h"
 
 using std::string;
 using std::cin;
 
+namespace
+{
+	// How long a benchmark waits for its clients to connect.
+	const DWORD BENCHMARK_CONNECT_TIMEOUT_MS = 10000;
+	const DWORD BENCHMARK_CONNECT_POLL_MS = 100;
+
+	// Appends a row to path, along with the header if the file is new.
+	void WriteBenchmarkCsv(const char* path, const ClientMan::BenchmarkOptions& options,
+		const ClientMan::BenchmarkResult& result)
+	{
+		FILE* file = NULL;
+		if(fopen_s(&file, path, "a") != 0 || file == NULL)
+		{
+			ERROR_MSG("Could not open %s.", path);
+			return;
+		}
+
+		fseek(file, 0, SEEK_END);
+		if(ftell(file) == 0)
+		{
+			fprintf(file, "clients,message_size,in_flight,rate,seconds,messages,msgs_per_sec,"
+				"bytes_per_sec,p50_us,p90_us,p99_us,p999_us,max_us,mismatched\n");
+		}
+
+		const double msgsPerSec = result.latency.count / result.seconds;
+		fprintf(file, "%Iu,%u,%u,%u,%.3f,%I64d,%.1f,%.1f,%u,%u,%u,%u,%u,%d\n",
+			result.numClients, options.messageSize, options.inFlight, options.rate,
+			result.seconds, result.latency.count, msgsPerSec, msgsPerSec * options.messageSize,
+			result.latency.p50, result.latency.p90, result.latency.p99, result.latency.p999,
+			result.latency.max, result.numMismatched);
+
+		fclose(file);
+	}
+
+	// Connects numClients clients, runs the benchmark on them for its duration and prints what
+	// it measured. The server has to echo without framing.
+	void RunBenchmark(const char* serverIP, u_short serverPort, int numClients,
+		const ClientMan::BenchmarkOptions& options, const char* csvPath)
+	{
+		ClientMan* clientMan = ClientMan::Instance();
+
+		clientMan->AddClients(numClients);
+		clientMan->ConnectClients(serverIP, serverPort);
+
+		for(DWORD waited = 0; waited < BENCHMARK_CONNECT_TIMEOUT_MS;
+			waited += BENCHMARK_CONNECT_POLL_MS)
+		{
+			if(clientMan->GetNumConnectedClients() == clientMan->GetNumClients())
+			{
+				break;
+			}
+			Sleep(BENCHMARK_CONNECT_POLL_MS);
+		}
+		TRACE(" Connected : %d of %d", clientMan->GetNumConnectedClients(), numClients);
+
+		if(!clientMan->StartBenchmark(options))
+		{
+			clientMan->RemoveClients();
+			return;
+		}
+
+		Sleep(options.duration * 1000);
+
+		ClientMan::BenchmarkResult result;
+		clientMan->StopBenchmark(result);
+
+		const double msgsPerSec = result.latency.count / result.seconds;
+		TRACE(" Benchmark : %Iu clients, %u byte messages, %u in flight, rate %u, %.3f s",
+			result.numClients, options.messageSize, options.inFlight, options.rate, result.seconds);
+		TRACE(" Throughput : %I64d messages, %.1f msgs/s, %.1f bytes/s",
+			result.latency.count, msgsPerSec, msgsPerSec * options.messageSize);
+		TRACE(" Round trip (us) : p50 : %u, p90 : %u, p99 : %u, p99.9 : %u, max : %u",
+			result.latency.p50, result.latency.p90, result.latency.p99, result.latency.p999,
+			result.latency.max);
+		if(result.numMismatched > 0)
+		{
+			ERROR_MSG("%d echoes didn't match the message that was due.", result.numMismatched);
+		}
+
+		if(csvPath != NULL)
+		{
+			WriteBenchmarkCsv(csvPath, options, result);
+		}
+
+		clientMan->RemoveClients();
+	}
+}
+
 void main(int argc, char* argv[])
 {
 	Log::Setup();
 
-	if(argc != 4)
+	if(argc != 4 && (argc < 8 || argc > 11))
 	{
 		TRACE("Please add server IP, port and max number of clients in command line.");
 		TRACE("(ex) 127.0.0.1 1234 1000");
+		TRACE("To run a benchmark instead, add message size, messages in flight per client, "
+			"messages per second (0 for no limit), seconds, and optionally a CSV file (- for "
+			"none), the sends each client can have outstanding and the socket profile (default, "
+			"latency or bulk).");
+		TRACE("(ex) 127.0.0.1 1234 1000 64 4 0 30 results.csv 8 latency");
+		Log::Cleanup();
 		return;
 	}
 
@@ -29,11 +125,65 @@ void main(int argc, char* argv[])
 
 	if (!Network::Initialize())
 	{
+		Log::Cleanup();
+		return;
+	}
+
+	if (!Metrics::Setup())
+	{
+		ERROR_CODE(GetLastError(), "Could not set up the metrics.");
+		Network::Deinitialize();
+		Log::Cleanup();
 		return;
 	}
 
 	ClientMan::New();
 
+	// Every client connects to what this resolves to, and is created for its family.
+	if(ClientMan::Instance()->ResolveServer(serverIP, serverPort) == NULL)
+	{
+		ClientMan::Delete();
+		Metrics::Cleanup();
+		Network::Deinitialize();
+		Log::Cleanup();
+		return;
+	}
+
+	if(argc >= 8)
+	{
+		ClientMan::BenchmarkOptions options;
+		options.messageSize = static_cast<DWORD>(atoi(argv[4]));
+		options.inFlight = static_cast<DWORD>(atoi(argv[5]));
+		options.rate = static_cast<DWORD>(atoi(argv[6]));
+		options.duration = static_cast<DWORD>(atoi(argv[7]));
+		const char* csvPath = argc >= 9 && string(argv[8]) != "-" ? argv[8] : NULL;
+
+		if(argc >= 10)
+		{
+			ClientMan::Instance()->SetSendDepth(static_cast<DWORD>(atoi(argv[9])));
+		}
+
+		Network::SocketOptions socketOptions;
+		if(argc >= 11 && !Network::GetSocketProfile(argv[10], socketOptions))
+		{
+			ERROR_MSG("Unknown socket profile : %s", argv[10]);
+			ClientMan::Delete();
+			Metrics::Cleanup();
+			Network::Deinitialize();
+			Log::Cleanup();
+			return;
+		}
+		ClientMan::Instance()->SetSocketOptions(socketOptions);
+
+		RunBenchmark(serverIP, serverPort, maxClients, options, csvPath);
+
+		ClientMan::Delete();
+		Metrics::Cleanup();
+		Network::Deinitialize();
+		Log::Cleanup();
+		return;
+	}
+
 	string input;
 	bool loop = true;
 	while(loop)
@@ -60,6 +210,44 @@ void main(int argc, char* argv[])
 		{
 			ClientMan::Instance()->RemoveClients();
 		}
+		else if(input == "`enable_inline_completion")
+		{
+			ClientMan::Instance()->EnableInlineCompletion(true);
+		}
+		else if(input == "`disable_inline_completion")
+		{
+			ClientMan::Instance()->EnableInlineCompletion(false);
+		}
+		else if(input.compare(0, 14, "`connect_rate ") == 0)
+		{
+			ClientMan::Instance()->SetConnectRate(static_cast<DWORD>(atoi(input.c_str() + 14)));
+			TRACE(" Connects per second : %u (0 for no limit)", ClientMan::Instance()->GetConnectRate());
+		}
+		else if(input == "`connect_stats")
+		{
+			ClientMan::ConnectStats stats = ClientMan::Instance()->GetConnectStats();
+			TRACE(" Connects : %Iu queued, %d started, %d connected, %d failed",
+				stats.numQueued, stats.numStarted, stats.numConnected, stats.numFailed);
+		}
+		else if(input.compare(0, 16, "`socket_profile ") == 0)
+		{
+			// Only clients created from then on get the profile.
+			Network::SocketOptions socketOptions;
+			if(Network::GetSocketProfile(input.c_str() + 16, socketOptions))
+			{
+				ClientMan::Instance()->SetSocketOptions(socketOptions);
+				TRACE(" Socket profile : %s", input.c_str() + 16);
+			}
+			else
+			{
+				ERROR_MSG("Unknown socket profile : %s", input.c_str() + 16);
+			}
+		}
+		else if(input.compare(0, 12, "`send_depth ") == 0)
+		{
+			ClientMan::Instance()->SetSendDepth(static_cast<DWORD>(atoi(input.c_str() + 12)));
+			TRACE(" Send depth : %u", ClientMan::Instance()->GetSendDepth());
+		}
 		else if(input == "`enable_trace")
 		{
 			Log::EnableTrace(true);
@@ -80,6 +268,8 @@ void main(int argc, char* argv[])
 	
 	ClientMan::Delete();
 
+	Metrics::Cleanup();
+
 	Network::Deinitialize();
 
 	Log::Cleanup();
@@ -0,0 +1,196 @@
+#include "AdmissionControl.h"
+
+#include "common/CritSecLock.h"
+
+#include <ws2tcpip.h>
+#include <cassert>
+#include <cstring>
+
+AdmissionControl::AdmissionControl()
+    : m_RatePerSecond(0), m_MaxTokens(0), m_NumSources(0), m_NumRateLimited(0),
+      m_NumUntracked(0)
+{
+    for (int i = 0; i < NUM_SHARDS; ++i)
+    {
+        InitializeCriticalSection(&m_Shards[i].cs);
+        m_Shards[i].lastSweep = GetTickCount();
+    }
+}
+
+AdmissionControl::~AdmissionControl()
+{
+    for (int i = 0; i < NUM_SHARDS; ++i)
+    {
+        DeleteCriticalSection(&m_Shards[i].cs);
+    }
+}
+
+void AdmissionControl::Configure(DWORD ratePerSecond, DWORD burst)
+{
+    Clear();
+
+    m_RatePerSecond = ratePerSecond;
+    m_MaxTokens = min(max(burst, static_cast<DWORD>(1)), static_cast<DWORD>(MAX_BURST)) *
+                  TOKEN_SCALE;
+}
+
+bool AdmissionControl::Admit(const sockaddr* address, int length)
+{
+    if (!IsEnabled())
+    {
+        return true;
+    }
+
+    Source source;
+    if (!MakeSource(address, length, source))
+    {
+        return true;
+    }
+
+    const size_t hash = SourceHash()(source);
+    Shard& shard = m_Shards[(hash >> 7) & (NUM_SHARDS - 1)];
+    const DWORD now = GetTickCount();
+
+    CritSecLock lock(shard.cs);
+
+    if (now - shard.lastSweep >= SWEEP_INTERVAL_MS)
+    {
+        Sweep(shard, now);
+    }
+
+    BucketMap::iterator it = shard.buckets.find(source);
+    if (it == shard.buckets.end())
+    {
+        if (shard.buckets.size() < MAX_SHARD_SOURCES)
+        {
+            // A new source starts with a full bucket, less this connection's token.
+            Bucket bucket = {m_MaxTokens - TOKEN_SCALE, now};
+            shard.buckets.insert(BucketMap::value_type(source, bucket));
+            InterlockedIncrement(&m_NumSources);
+        }
+        else
+        {
+            InterlockedIncrement(&m_NumUntracked);
+        }
+        return true;
+    }
+
+    Bucket& bucket = it->second;
+    Refill(bucket, now);
+    if (bucket.tokens < TOKEN_SCALE)
+    {
+        InterlockedIncrement(&m_NumRateLimited);
+        return false;
+    }
+
+    bucket.tokens -= TOKEN_SCALE;
+    return true;
+}
+
+void AdmissionControl::Clear()
+{
+    for (int i = 0; i < NUM_SHARDS; ++i)
+    {
+        CritSecLock lock(m_Shards[i].cs);
+
+        InterlockedExchangeAdd(&m_NumSources, -static_cast<long>(m_Shards[i].buckets.size()));
+        m_Shards[i].buckets.clear();
+    }
+}
+
+AdmissionControl::Stats AdmissionControl::GetStats()
+{
+    Stats stats;
+    stats.numSources = m_NumSources;
+    stats.numRateLimited = m_NumRateLimited;
+    stats.numUntracked = m_NumUntracked;
+    return stats;
+}
+
+bool AdmissionControl::Source::operator==(const Source& other) const
+{
+    return address[0] == other.address[0] && address[1] == other.address[1] &&
+           family == other.family;
+}
+
+size_t AdmissionControl::SourceHash::operator()(const Source& source) const
+{
+    // Mixes the words so that neighbouring addresses land in different shards and buckets.
+    ULONGLONG hash = source.address[0] * 0x9E3779B97F4A7C15ULL;
+    hash ^= source.address[1] + 0x632BE59BD9B4E019ULL + (hash << 6) + (hash >> 2);
+    hash ^= static_cast<ULONGLONG>(source.family) * 0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    return static_cast<size_t>(hash);
+}
+
+/* static */ bool AdmissionControl::MakeSource(const sockaddr* address, int length,
+                                               Source& source)
+{
+    ZeroMemory(&source, sizeof(source));
+    if (address == NULL)
+    {
+        return false;
+    }
+
+    if (address->sa_family == AF_INET && length >= static_cast<int>(sizeof(sockaddr_in)))
+    {
+        const sockaddr_in* in = reinterpret_cast<const sockaddr_in*>(address);
+        source.address[0] = in->sin_addr.s_addr;
+        source.family = AF_INET;
+        return true;
+    }
+
+    if (address->sa_family == AF_INET6 && length >= static_cast<int>(sizeof(sockaddr_in6)))
+    {
+        const sockaddr_in6* in6 = reinterpret_cast<const sockaddr_in6*>(address);
+        const BYTE* bytes = reinterpret_cast<const BYTE*>(&in6->sin6_addr);
+
+        // A dual-stack listener sees IPv4 clients as ::ffff:a.b.c.d.
+        static const BYTE v4MappedPrefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+        if (memcmp(bytes, v4MappedPrefix, sizeof(v4MappedPrefix)) == 0)
+        {
+            ULONG v4Address;
+            CopyMemory(&v4Address, bytes + sizeof(v4MappedPrefix), sizeof(v4Address));
+            source.address[0] = v4Address;
+            source.family = AF_INET;
+            return true;
+        }
+
+        CopyMemory(&source.address[0], bytes, sizeof(source.address[0]));
+        source.family = AF_INET6;
+        return true;
+    }
+
+    return false;
+}
+
+void AdmissionControl::Refill(Bucket& bucket, DWORD now) const
+{
+    // A token every 1000 / m_RatePerSecond ms is m_RatePerSecond thousandths of one a ms.
+    const ULONGLONG elapsed = static_cast<DWORD>(now - bucket.lastRefill);
+    const ULONGLONG tokens = bucket.tokens + elapsed * m_RatePerSecond;
+
+    bucket.tokens = static_cast<DWORD>(min(tokens, static_cast<ULONGLONG>(m_MaxTokens)));
+    bucket.lastRefill = now;
+}
+
+void AdmissionControl::Sweep(Shard& shard, DWORD now)
+{
+    long numDropped = 0;
+    for (BucketMap::iterator it = shard.buckets.begin(); it != shard.buckets.end();)
+    {
+        Refill(it->second, now);
+        if (it->second.tokens >= m_MaxTokens)
+        {
+            it = shard.buckets.erase(it);
+            ++numDropped;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    InterlockedExchangeAdd(&m_NumSources, -numDropped);
+    shard.lastSweep = now;
+}
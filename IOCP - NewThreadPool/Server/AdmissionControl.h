@@ -0,0 +1,114 @@
+#pragma once
+
+#include <winsock2.h>
+#include <unordered_map>
+
+// Limits how fast each source address can open connections, with a token bucket per source that
+// refills at a steady rate up to a burst.
+// IPv6 sources are told apart by their /64 prefix, which a single host usually has to itself,
+// and IPv4 addresses mapped into IPv6 count as the IPv4 address.
+// The buckets are kept in shards with a lock each, so accepts from different sources mostly take
+// different locks. A bucket that has refilled is the same as none, so each shard drops those
+// every so often, which keeps it to the sources that have connected lately.
+class AdmissionControl
+{
+public:
+    enum
+    {
+        DEFAULT_BURST = 16,
+        MAX_BURST = 1000000,
+    };
+
+    struct Stats
+    {
+        // Sources with a bucket.
+        long numSources;
+        // Connections that found their source's bucket empty.
+        long numRateLimited;
+        // Connections from new sources that were admitted without a bucket, as their shard
+        // already had MAX_SHARD_SOURCES. They aren't limited until a sweep has made room.
+        long numUntracked;
+    };
+
+public:
+    AdmissionControl();
+    ~AdmissionControl();
+
+    AdmissionControl& operator=(const AdmissionControl&) = delete;
+    AdmissionControl(const AdmissionControl&) = delete;
+
+    // Lets each source open ratePerSecond connections a second, and up to burst at once.
+    // A ratePerSecond of 0 admits every connection, which is the default. Must not be called
+    // while Admit() can be.
+    void Configure(DWORD ratePerSecond, DWORD burst = DEFAULT_BURST);
+    bool IsEnabled() const { return m_RatePerSecond > 0; }
+
+    // Takes a token from the bucket of the address's source. Returns false if it is empty.
+    // Addresses of other families are always admitted.
+    bool Admit(const sockaddr* address, int length);
+
+    // Drops every bucket.
+    void Clear();
+    Stats GetStats();
+
+private:
+    enum
+    {
+        NUM_SHARDS = 16,
+        // Tokens are counted in thousandths, so that slow rates still refill between accepts.
+        TOKEN_SCALE = 1000,
+        // How often a shard drops its full buckets, and how many it keeps at most. New sources
+        // beyond that are admitted without a bucket until a sweep has made room, so that a flood
+        // from many addresses can't grow the table without bounds.
+        SWEEP_INTERVAL_MS = 1000,
+        MAX_SHARD_SOURCES = 16384,
+    };
+
+    // The part of an address that connections are counted by.
+    struct Source
+    {
+        ULONGLONG address[2];
+        USHORT family;
+
+        bool operator==(const Source& other) const;
+    };
+
+    struct SourceHash
+    {
+        size_t operator()(const Source& source) const;
+    };
+
+    struct Bucket
+    {
+        DWORD tokens;
+        // GetTickCount() when the tokens were last added.
+        DWORD lastRefill;
+    };
+
+    typedef std::unordered_map<Source, Bucket, SourceHash> BucketMap;
+
+    struct Shard
+    {
+        CRITICAL_SECTION cs;
+        BucketMap buckets;
+        DWORD lastSweep;
+    };
+
+private:
+    static bool MakeSource(const sockaddr* address, int length, Source& source);
+
+    // Adds the tokens that have accrued since the bucket was last refilled.
+    void Refill(Bucket& bucket, DWORD now) const;
+    // Needs the shard's lock.
+    void Sweep(Shard& shard, DWORD now);
+
+private:
+    DWORD m_RatePerSecond;
+    DWORD m_MaxTokens;
+
+    Shard m_Shards[NUM_SHARDS];
+
+    volatile long m_NumSources;
+    volatile long m_NumRateLimited;
+    volatile long m_NumUntracked;
+};
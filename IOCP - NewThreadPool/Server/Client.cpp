@@ -1,48 +1,481 @@
 #include "Client.h"
+#include "Packet.h"
+#include "Server.h"
+#include "common/CritSecLock.h"
 #include "common/Log.h"
 #include "common/Network.h"
 
-#include "common/CachedAlloc.h"
+#include <cassert>
 
-Client::Client()
-    : m_pTPIO(NULL), m_Socket(INVALID_SOCKET), m_State(WAIT)
+Client::Client(Server* server)
+    : m_Server(server),
+      m_pTPIO(NULL),
+      m_Id(INVALID_HANDLE_ID),
+      m_RefCount(0),
+      m_State(WAIT),
+      m_Reusable(false),
+      m_SkipCompletionPort(false),
+      m_Bound(false),
+      m_NonBlocking(false),
+      m_Socket(INVALID_SOCKET),
+      m_Family(AF_UNSPEC),
+      m_ListenSocket(INVALID_SOCKET),
+      m_SocketOptions(NULL),
+      m_LastRecvTime(0),
+      m_LastSendTime(0),
+      m_RioRQ(RIO_INVALID_RQ),
+      m_RioWorker(-1),
+      m_ThreadPool(0),
+      m_RemoteAddressLength(0),
+      m_SendTransform(NULL),
+      m_CompressionAck(NULL),
+      m_MaxCompressedBatch(0),
+      m_PendingSendBytes(0),
+      m_Sending(false),
+      m_SendAborted(false),
+      m_CompressingSends(false),
+      m_ReadsPaused(false),
+      m_RecvParked(false),
+      m_NextRecvSequence(0),
+      m_NextDeliverSequence(0),
+      m_DeliveringRecvs(false),
+      m_RecvsEnded(false),
+      m_RecvCompression(COMPRESSION_UNNEGOTIATED)
 {
+    ZeroMemory(&m_RemoteAddress, sizeof(m_RemoteAddress));
+    ZeroMemory(m_RecvSlots, sizeof(m_RecvSlots));
+    InitializeCriticalSection(&m_SendLock);
+    InitializeCriticalSection(&m_RecvLock);
+    m_SendingPackets.reserve(MAX_SEND_BUFFERS);
+    Framer::ResetState(m_FrameState);
 }
 
 Client::~Client()
 {
+    assert(m_RefCount == 0);
+
     Destroy();
+
+    // Queued packets reference the client, so there can't be any left.
+    assert(m_SendQueue.empty());
+    assert(m_SendingPackets.empty());
+    assert(m_SendTransform == NULL);
+    assert(m_FrameState.frame == NULL);
+    DeleteCriticalSection(&m_SendLock);
+    DeleteCriticalSection(&m_RecvLock);
 }
 
 
-bool Client::Create()
+bool Client::Create(DWORD socketFlags, int family)
 {
 	m_State = WAIT;
 
-	m_Socket = Network::CreateSocket(false, 0);
+	m_Socket = Network::CreateSocket(false, 0, socketFlags, NULL, family);
 	if(m_Socket == INVALID_SOCKET)
 	{
 		ERROR_MSG("Could not create socket.");		
 		return false;
 	}
+	m_Family = family;
 	return true;
 }
 
 
-void Client::Destroy()
+void Client::Close()
 {
 	if( m_Socket != INVALID_SOCKET )
 	{
 		Network::CloseSocket(m_Socket);
 		CancelIoEx(reinterpret_cast<HANDLE>(m_Socket), NULL);
 		m_Socket = INVALID_SOCKET;
+		// Closing the socket frees its request queue.
+		m_RioRQ = RIO_INVALID_RQ;
 		m_State = DISCONNECTED;
+		m_Reusable = false;
+	}
+}
+
+
+bool Client::Reopen(DWORD socketFlags)
+{
+	assert(!m_Bound);
+
+	if( m_Socket != INVALID_SOCKET )
+	{
+		Network::SetAbortiveClose(m_Socket);
 	}
+	Close();
+
+	return Create(socketFlags, m_Family);
+}
+
+
+void Client::Destroy()
+{
+	Close();
 
+	// Nothing references the client any more, so no callback can be outstanding and we don't
+	// have to wait for them. This also makes it safe to destroy a client in its own callback.
 	if( m_pTPIO != NULL )
 	{
-		WaitForThreadpoolIoCallbacks( m_pTPIO, true );
 		CloseThreadpoolIo( m_pTPIO );
 		m_pTPIO = NULL;
 	}
-}
\ No newline at end of file
+}
+
+
+void Client::Release()
+{
+	const long refCount = InterlockedDecrement(&m_RefCount);
+	assert(refCount >= 0);
+
+	if( refCount == 0 )
+	{
+		assert(m_Server);
+		m_Server->OnClientReleased(this);
+	}
+}
+
+
+bool Client::PushSend(Packet* packet, bool& startSend)
+{
+	CritSecLock lock(m_SendLock);
+
+	if( m_SendAborted )
+	{
+		return false;
+	}
+
+	m_SendQueue.push_back(packet);
+	m_PendingSendBytes += packet->GetPooledSize();
+
+	startSend = !m_Sending;
+	m_Sending = true;
+	return true;
+}
+
+
+DWORD Client::PopSendBatch(WSABUF* buffers, DWORD maxBuffers, Packet** segments, bool* compress)
+{
+	CritSecLock lock(m_SendLock);
+
+	assert(m_Sending);
+	assert(m_SendingPackets.empty());
+	assert(m_SendTransform == NULL);
+
+	const bool compressing = m_CompressingSends;
+	DWORD numBuffers = 0;
+	DWORD numBytes = 0;
+	while( !m_SendQueue.empty() )
+	{
+		Packet* packet = m_SendQueue.front();
+
+		DWORD numSegments = 0;
+		for( Packet* segment = packet; segment != NULL; segment = segment->GetNext() )
+		{
+			++numSegments;
+		}
+
+		// Always take the first packet, which can't have more segments than we have buffers.
+		if( numBuffers + numSegments > maxBuffers && numBuffers > 0 )
+		{
+			break;
+		}
+
+		// A wrapped batch has to fit in a transport frame.
+		const DWORD size = packet->GetTotalSize();
+		if( compressing && numBytes + size > m_MaxCompressedBatch && numBuffers > 0 )
+		{
+			break;
+		}
+		numBytes += size;
+
+		for( Packet* segment = packet; segment != NULL; segment = segment->GetNext() )
+		{
+			buffers[numBuffers].buf = reinterpret_cast<char*>(segment->GetData());
+			buffers[numBuffers].len = segment->GetSize();
+			if( segments != NULL )
+			{
+				segments[numBuffers] = segment;
+			}
+			++numBuffers;
+		}
+
+		m_SendQueue.pop_front();
+		m_SendingPackets.push_back(packet);
+
+		// The peer reads what comes after the ack as transport frames.
+		if( packet == m_CompressionAck )
+		{
+			m_CompressionAck = NULL;
+			m_CompressingSends = true;
+			break;
+		}
+	}
+
+	if( numBuffers == 0 )
+	{
+		m_Sending = false;
+	}
+
+	if( compress != NULL )
+	{
+		*compress = compressing && numBuffers > 0;
+	}
+
+	return numBuffers;
+}
+
+
+bool Client::StartCompressedSends(Packet* ack, DWORD maxBatchSize, bool& startSend)
+{
+	CritSecLock lock(m_SendLock);
+
+	assert(!m_CompressingSends);
+	assert(m_CompressionAck == NULL);
+
+	if( m_SendAborted )
+	{
+		return false;
+	}
+
+	m_SendQueue.push_back(ack);
+	m_PendingSendBytes += ack->GetPooledSize();
+	m_CompressionAck = ack;
+	m_MaxCompressedBatch = maxBatchSize;
+
+	startSend = !m_Sending;
+	m_Sending = true;
+	return true;
+}
+
+
+bool Client::SetSendTransform(Packet* packet)
+{
+	CritSecLock lock(m_SendLock);
+
+	assert(m_SendTransform == NULL);
+
+	if( m_SendAborted )
+	{
+		return false;
+	}
+
+	m_SendTransform = packet;
+	return true;
+}
+
+
+void Client::CompleteSend()
+{
+	CritSecLock lock(m_SendLock);
+
+	// The send's event still references the client, so none of these can be the last reference.
+	for( size_t i = 0; i < m_SendingPackets.size(); ++i )
+	{
+		m_PendingSendBytes -= m_SendingPackets[i]->GetPooledSize();
+		Packet::Destroy(m_SendingPackets[i]);
+	}
+	m_SendingPackets.clear();
+
+	if( m_SendTransform != NULL )
+	{
+		Packet::Destroy(m_SendTransform);
+		m_SendTransform = NULL;
+	}
+}
+
+
+void Client::AbortSends()
+{
+	// Destroy the packets outside the lock, since one of them may hold the last reference.
+	std::vector<Packet*> packets;
+	{
+		CritSecLock lock(m_SendLock);
+
+		m_SendAborted = true;
+		m_Sending = false;
+		m_PendingSendBytes = 0;
+		m_CompressionAck = NULL;
+
+		packets.swap(m_SendingPackets);
+		packets.insert(packets.end(), m_SendQueue.begin(), m_SendQueue.end());
+		m_SendQueue.clear();
+
+		if( m_SendTransform != NULL )
+		{
+			packets.push_back(m_SendTransform);
+			m_SendTransform = NULL;
+		}
+	}
+
+	for( size_t i = 0; i < packets.size(); ++i )
+	{
+		Packet::Destroy(packets[i]);
+	}
+}
+
+
+void Client::ResetSends()
+{
+	CritSecLock lock(m_SendLock);
+
+	assert(m_SendQueue.empty());
+	assert(m_SendingPackets.empty());
+	assert(m_SendTransform == NULL);
+
+	m_PendingSendBytes = 0;
+	m_Sending = false;
+	m_SendAborted = false;
+	m_CompressingSends = false;
+	m_CompressionAck = NULL;
+	m_ReadsPaused = false;
+	m_RecvParked = false;
+}
+
+
+void Client::PauseReads()
+{
+	CritSecLock lock(m_SendLock);
+
+	m_ReadsPaused = true;
+}
+
+
+bool Client::ResumeReads()
+{
+	CritSecLock lock(m_SendLock);
+
+	const bool parked = m_RecvParked;
+	m_ReadsPaused = false;
+	m_RecvParked = false;
+	return parked;
+}
+
+
+bool Client::ParkRecv()
+{
+	CritSecLock lock(m_SendLock);
+
+	if( m_ReadsPaused )
+	{
+		m_RecvParked = true;
+	}
+	return m_RecvParked;
+}
+
+
+bool Client::ClaimParkedRecv()
+{
+	CritSecLock lock(m_SendLock);
+
+	const bool parked = m_RecvParked;
+	m_RecvParked = false;
+	return parked;
+}
+
+
+bool Client::ReserveRecv(DWORD depth, DWORD& sequence)
+{
+	CritSecLock lock(m_RecvLock);
+
+	if( m_RecvsEnded || m_NextRecvSequence - m_NextDeliverSequence >= min(depth, MAX_RECV_DEPTH) )
+	{
+		return false;
+	}
+
+	sequence = m_NextRecvSequence++;
+	return true;
+}
+
+
+bool Client::CompleteRecv(DWORD sequence, Packet* packet, DWORD numberOfBytes)
+{
+	CritSecLock lock(m_RecvLock);
+
+	RecvSlot& slot = m_RecvSlots[sequence % MAX_RECV_DEPTH];
+	assert(!slot.completed);
+	slot.packet = packet;
+	slot.numberOfBytes = numberOfBytes;
+	slot.completed = true;
+
+	// Whoever is handing over takes this one as well.
+	if( m_DeliveringRecvs )
+	{
+		return false;
+	}
+	m_DeliveringRecvs = true;
+	return true;
+}
+
+
+bool Client::PopCompletedRecv(Packet*& packet, DWORD& numberOfBytes, DWORD& numOutstanding)
+{
+	CritSecLock lock(m_RecvLock);
+
+	assert(m_DeliveringRecvs);
+
+	RecvSlot& slot = m_RecvSlots[m_NextDeliverSequence % MAX_RECV_DEPTH];
+	if( !slot.completed )
+	{
+		// Counted under the same lock, so only one thread sees the last receive come back.
+		m_DeliveringRecvs = false;
+		numOutstanding = m_NextRecvSequence - m_NextDeliverSequence;
+		return false;
+	}
+
+	packet = slot.packet;
+	numberOfBytes = slot.numberOfBytes;
+	slot.packet = NULL;
+	slot.completed = false;
+	++m_NextDeliverSequence;
+	return true;
+}
+
+
+bool Client::EndRecvs()
+{
+	CritSecLock lock(m_RecvLock);
+
+	const bool ended = m_RecvsEnded;
+	m_RecvsEnded = true;
+	return !ended;
+}
+
+
+void Client::ResetRecvs()
+{
+	CritSecLock lock(m_RecvLock);
+
+	assert(!m_DeliveringRecvs);
+	assert(m_NextRecvSequence == m_NextDeliverSequence);
+
+	m_NextRecvSequence = 0;
+	m_NextDeliverSequence = 0;
+	m_RecvsEnded = false;
+	m_RecvCompression = COMPRESSION_UNNEGOTIATED;
+}
+
+
+void Client::ResetFrame()
+{
+	// The frame holds a reference, but so does whoever ends receiving, so this isn't the last.
+	Packet::Destroy(m_FrameState.frame);
+	Framer::ResetState(m_FrameState);
+}
+
+
+void Client::SetRemoteAddress(const sockaddr* address, int length)
+{
+	assert(address);
+
+	m_RemoteAddressLength = min(length, static_cast<int>(sizeof(m_RemoteAddress)));
+	CopyMemory(&m_RemoteAddress, address, m_RemoteAddressLength);
+}
+
+
+bool Client::GetRemoteAddress(std::string& ip, u_short& port)
+{
+	return Network::GetAddress(reinterpret_cast<const sockaddr*>(&m_RemoteAddress),
+		m_RemoteAddressLength, ip, port);
+}
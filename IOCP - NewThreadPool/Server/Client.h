@@ -1,13 +1,32 @@
 #pragma once
 
 #include <winsock2.h>
+#include <mswsock.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "common/HandleTable.h"
+#include "common/Strand.h"
+#include "Framer.h"
+
+class Packet;
+class Server;
+
+namespace Network
+{
+struct SocketOptions;
+}
 
 class Client
 {
 public:
 	enum
 	{
-		MAX_RECV_BUFFER = 1024,
+		MAX_SEND_BUFFERS = 64,
+		// Receives that can be outstanding at once. A power of two, so that the sequence numbers
+		// wrap around onto the same slots.
+		MAX_RECV_DEPTH = 16,
 	};
 
 	enum State
@@ -17,29 +36,220 @@ public:
 		DISCONNECTED,
 	};
 
+	// Whether the client has asked for its frames to be compressed, which its first frame tells.
+	enum Compression
+	{
+		COMPRESSION_UNNEGOTIATED,
+		COMPRESSION_OFF,
+		COMPRESSION_ON,
+	};
+
 public:
-    Client();
+    // The server that the client is handed back to once it has been released. Only clients that
+    // are never released can do without one.
+    explicit Client(Server* server);
     ~Client();
 
     Client& operator=(const Client&) = delete;
     Client(const Client&) = delete;
 
-    bool Create();
+    // socketFlags are the engine's WSA_FLAG_* flags. A socket created for Registered I/O can only
+    // be used with it. AcceptEx() only takes a socket of the listen socket's family.
+    bool Create(DWORD socketFlags = 0, int family = AF_UNSPEC);
+	void Close();
+	// Resets the connection and creates a new socket of the same family in place of the old one,
+	// so that a client that hasn't been bound to an engine can take another accept. Returns false
+	// if there is no new socket, in which case the client is left closed.
+	bool Reopen(DWORD socketFlags);
 	void Destroy();
 
+	// Every outstanding IOEvent and Packet holds a reference, as does the server while the client
+	// is connected. The last Release() hands the client back to the server to recycle or delete.
+	void AddRef() { InterlockedIncrement(&m_RefCount); }
+	void Release();
+
+	// At most one send is outstanding. Packets queued meanwhile go out together in the next one.
+	// Returns false if sending has been aborted, in which case the caller still owns the packet.
+	// Otherwise startSend tells whether the caller has to start sending with PopSendBatch().
+	bool PushSend(Packet* packet, bool& startSend);
+	// Moves queued packets into the outstanding send and describes them in buffers.
+	// Returns 0 once the queue is empty, which ends the outstanding send.
+	// If segments is given, it is filled with the segment each buffer belongs to. If compress is
+	// given, it tells whether the batch has to be wrapped in a transport frame.
+	DWORD PopSendBatch(WSABUF* buffers, DWORD maxBuffers, Packet** segments = NULL,
+		bool* compress = NULL);
+	// Queues ack like PushSend() as the last packet that goes out as it is. The batches after it
+	// are wrapped, with at most maxBatchSize bytes of packets each unless a packet is larger.
+	bool StartCompressedSends(Packet* ack, DWORD maxBatchSize, bool& startSend);
+	// Keeps the packet that the outstanding send's packets have been wrapped in until the send
+	// completes. Returns false if sending has been aborted, in which case the caller still owns
+	// the packet and must not post the send.
+	bool SetSendTransform(Packet* packet);
+	// Destroys the packets of the outstanding send once it has completed.
+	void CompleteSend();
+	// Destroys every outstanding and queued packet and rejects new ones.
+	void AbortSends();
+	void ResetSends();
+
+	// Bytes of pool memory that have been queued or are being sent. File regions don't count.
+	DWORD GetPendingSendBytes() { return m_PendingSendBytes; }
+
+	// While reads are paused, a receive that completes is parked instead of being posted again.
+	void PauseReads();
+	// Returns true if a receive had been parked, which the caller has to post now.
+	bool ResumeReads();
+	// Returns true if the caller should park its receive rather than post it.
+	bool ParkRecv();
+	bool IsReadsPaused() { return m_ReadsPaused; }
+	// Returns true if a receive had been parked, which the caller now owns instead of posting it.
+	bool ClaimParkedRecv();
+
+	// Receives posted ahead of each other have a sequence number each, in the order they have been
+	// posted in under GetRecvLock(). What they receive is handed over in that order, by one thread
+	// at a time.
+	// Reserves the next sequence number, unless depth receives are outstanding or receiving has
+	// ended.
+	bool ReserveRecv(DWORD depth, DWORD& sequence);
+	// Stores what a receive has received. A NULL packet ends receiving once it is handed over.
+	// Returns true if the caller has to hand over the completed receives with PopCompletedRecv().
+	bool CompleteRecv(DWORD sequence, Packet* packet, DWORD numberOfBytes);
+	// Takes the next receive in order. Returns false once it hasn't completed, which ends the
+	// handing over, and then tells how many receives are still outstanding.
+	bool PopCompletedRecv(Packet*& packet, DWORD& numberOfBytes, DWORD& numOutstanding);
+	// Returns true the first time. No more receives are reserved after this.
+	bool EndRecvs();
+	bool HaveRecvsEnded() { return m_RecvsEnded; }
+	void ResetRecvs();
+	CRITICAL_SECTION& GetRecvLock() { return m_RecvLock; }
+
+	// The frame in progress references the client, so it has to be dropped once receiving ends.
+	FrameState& GetFrameState() { return m_FrameState; }
+	void ResetFrame();
+
+	// Only the thread that the receives are handed over on touches this.
+	void SetRecvCompression(Compression compression) { m_RecvCompression = compression; }
+	Compression GetRecvCompression() { return m_RecvCompression; }
+
+	// Where the client connected from, as the accept reported it.
+	void SetRemoteAddress(const sockaddr* address, int length);
+	bool GetRemoteAddress(std::string& ip, u_short& port);
+
 public:
+	Server* GetServer() { return m_Server; }
+
 	void SetTPIO(TP_IO* pTPIO) { m_pTPIO = pTPIO; }
 	TP_IO* GetTPIO() { return m_pTPIO; }
 
+	void SetId(HandleId id) { m_Id = id; }
+	HandleId GetId() { return m_Id; }
+
 	void SetState(State state) { m_State = state; }
 	State GetState() { return m_State; }
 
+	// Set once DisconnectEx(TF_REUSE_SOCKET) has succeeded.
+	void SetReusable(bool reusable) { m_Reusable = reusable; }
+	bool IsReusable() { return m_Reusable; }
+
+	// Set once the socket skips the completion port for I/O that succeeds synchronously. This
+	// sticks to the socket, so it survives recycling.
+	void SetSkipCompletionPort(bool skip) { m_SkipCompletionPort = skip; }
+	bool IsSkippingCompletionPort() { return m_SkipCompletionPort; }
+
+	// Set once the engine has bound the socket, which sticks to the socket as well. A recycled
+	// client keeps its binding, and so its thread pool.
+	void SetBound(bool bound) { m_Bound = bound; }
+	bool IsBound() { return m_Bound; }
+
+	// Set once the socket has been made non-blocking, so that it can be drained once a zero-byte
+	// receive completes. Overlapped I/O isn't affected, and this sticks to the socket as well.
+	void SetNonBlocking(bool nonBlocking) { m_NonBlocking = nonBlocking; }
+	bool IsNonBlocking() { return m_NonBlocking; }
+
+	// The request queue of a client served by the RioEngine, and the worker whose completion
+	// queue it posts to.
+	void SetRioQueue(RIO_RQ rq, int worker) { m_RioRQ = rq; m_RioWorker = worker; }
+	RIO_RQ GetRioRQ() { return m_RioRQ; }
+	int GetRioWorker() { return m_RioWorker; }
+
+	// The NodeThreadPools pool that runs the client's callbacks.
+	void SetThreadPool(int pool) { m_ThreadPool = pool; }
+	int GetThreadPool() { return m_ThreadPool; }
+
+	// Runs the client's received packets in order when they are handed to a worker.
+	Strand& GetRecvStrand() { return m_RecvStrand; }
+
 	SOCKET GetSocket() { return m_Socket; }
-	BYTE* GetRecvBuff() { return m_recvBuffer; }
+	int GetFamily() { return m_Family; }
+
+	// The GetTickCount() of the last receive and of the last send that has been queued, which
+	// the idle and heartbeat timers go by.
+	void SetLastRecvTime(DWORD time) { m_LastRecvTime = time; }
+	DWORD GetLastRecvTime() { return m_LastRecvTime; }
+	void SetLastSendTime(DWORD time) { m_LastSendTime = time; }
+	DWORD GetLastSendTime() { return m_LastSendTime; }
+
+	// The listen socket the client's accept has been posted on, and the socket options of its
+	// listener, which outlives the client's accept.
+	void SetListenSocket(SOCKET listenSocket, const Network::SocketOptions* options)
+	{
+		m_ListenSocket = listenSocket;
+		m_SocketOptions = options;
+	}
+	SOCKET GetListenSocket() { return m_ListenSocket; }
+	const Network::SocketOptions* GetSocketOptions() { return m_SocketOptions; }
 
 private:
+	Server* m_Server;
 	TP_IO* m_pTPIO;
+	HandleId m_Id;
+	volatile long m_RefCount;
 	State m_State;
+	bool m_Reusable;
+	bool m_SkipCompletionPort;
+	bool m_Bound;
+	bool m_NonBlocking;
 	SOCKET m_Socket;
-	BYTE m_recvBuffer[MAX_RECV_BUFFER];
+	int m_Family;
+	SOCKET m_ListenSocket;
+	const Network::SocketOptions* m_SocketOptions;
+	volatile DWORD m_LastRecvTime;
+	volatile DWORD m_LastSendTime;
+	RIO_RQ m_RioRQ;
+	int m_RioWorker;
+	int m_ThreadPool;
+	SOCKADDR_STORAGE m_RemoteAddress;
+	int m_RemoteAddressLength;
+
+	CRITICAL_SECTION m_SendLock;
+	std::deque<Packet*> m_SendQueue;
+	std::vector<Packet*> m_SendingPackets;
+	// What the outstanding send's packets have been wrapped in, if anything.
+	Packet* m_SendTransform;
+	// The packet queued last before the sends are wrapped, until it has gone out.
+	Packet* m_CompressionAck;
+	DWORD m_MaxCompressedBatch;
+	volatile DWORD m_PendingSendBytes;
+	bool m_Sending;
+	bool m_SendAborted;
+	bool m_CompressingSends;
+	bool m_ReadsPaused;
+	bool m_RecvParked;
+
+	struct RecvSlot
+	{
+		Packet* packet;
+		DWORD numberOfBytes;
+		bool completed;
+	};
+
+	CRITICAL_SECTION m_RecvLock;
+	RecvSlot m_RecvSlots[MAX_RECV_DEPTH];
+	DWORD m_NextRecvSequence;
+	DWORD m_NextDeliverSequence;
+	bool m_DeliveringRecvs;
+	volatile bool m_RecvsEnded;
+
+	Strand m_RecvStrand;
+	FrameState m_FrameState;
+	Compression m_RecvCompression;
 };
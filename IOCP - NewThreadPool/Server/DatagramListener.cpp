@@ -0,0 +1,704 @@
+#include "DatagramListener.h"
+
+#include "common/CritSecLock.h"
+#include "common/Log.h"
+#include "common/Metrics.h"
+#include "common/Network.h"
+#include "common/ThreadPoolTimer.h"
+
+#include <cassert>
+#include <deque>
+#include <vector>
+
+struct DatagramSession
+{
+    DatagramListener* listener;
+    // The shard whose table and free list the session belongs to.
+    int shard;
+    SOCKADDR_STORAGE address;
+    int addressLength;
+    // The listener's table, every outstanding send and whoever keeps the session.
+    volatile long refCount;
+    // The GetTickCount() of the last datagram, which the sweep goes by.
+    volatile DWORD lastRecvTime;
+
+    CRITICAL_SECTION cs;
+    std::deque<Packet*> sendQueue;
+    DWORD numSending;
+};
+
+void CALLBACK DatagramListener::IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */,
+                                                     PVOID Context, PVOID Overlapped,
+                                                     ULONG IoResult,
+                                                     ULONG_PTR NumberOfBytesTransferred,
+                                                     PTP_IO /* Io */)
+{
+    DatagramListener* listener = static_cast<DatagramListener*>(Context);
+    assert(listener);
+
+    Operation* operation = CONTAINING_RECORD(Overlapped, Operation, overlapped);
+
+    NodeThreadPools::Scope scope(*listener->m_ThreadPools, listener->m_Pool);
+
+    if (operation->type == RECV)
+    {
+        listener->OnRecv(operation, IoResult, static_cast<DWORD>(NumberOfBytesTransferred));
+    }
+    else
+    {
+        listener->OnSend(operation, IoResult, static_cast<DWORD>(NumberOfBytesTransferred));
+    }
+}
+
+void CALLBACK DatagramListener::WorkerSweepSessions(PTP_CALLBACK_INSTANCE /* Instance */,
+                                                    PVOID Context, PTP_TIMER /* Timer */)
+{
+    DatagramListener* listener = static_cast<DatagramListener*>(Context);
+    assert(listener);
+
+    NodeThreadPools::Scope scope(*listener->m_ThreadPools, listener->m_Pool);
+
+    listener->SweepSessions();
+    listener->PostRecvs();
+}
+
+DatagramListener::DatagramListener(const char* address, u_short port, int numRecvs,
+                                   Handler handler, DWORD maxDatagramSize)
+    : m_Address(address != NULL ? address : ""),
+      m_Port(port),
+      m_NumRecvs(numRecvs),
+      m_Handler(handler),
+      m_MaxDatagramSize(min(maxDatagramSize, Packet::GetMaxSegmentCapacity())),
+      m_SessionTimeout(DEFAULT_SESSION_TIMEOUT_SECONDS),
+      m_ThreadPools(NULL),
+      m_Pool(0),
+      m_Socket(INVALID_SOCKET),
+      m_pTPIO(NULL),
+      m_SweepTimer(NULL),
+      m_Operations(sizeof(Operation)),
+      m_NumPostedRecvs(0),
+      m_NumSessions(0),
+      m_NumDroppedRecvs(0),
+      m_NumDroppedSends(0),
+      m_NumUntrackedRecvs(0),
+      m_Closing(true)
+{
+    assert(numRecvs > 0);
+    assert(handler);
+
+    for (int i = 0; i < NUM_SESSION_SHARDS; ++i)
+    {
+        InitializeCriticalSection(&m_Shards[i].cs);
+        // Adding a sender then never rehashes on the receive path.
+        m_Shards[i].sessions.reserve(MAX_SHARD_SESSIONS);
+    }
+}
+
+DatagramListener::~DatagramListener()
+{
+    Close();
+
+    for (int i = 0; i < NUM_SESSION_SHARDS; ++i)
+    {
+        // Every session has been released by now, so they are all back on the free lists.
+        std::vector<DatagramSession*>& freeSessions = m_Shards[i].freeSessions;
+        for (size_t j = 0; j < freeSessions.size(); ++j)
+        {
+            DeleteCriticalSection(&freeSessions[j]->cs);
+            delete freeSessions[j];
+        }
+
+        DeleteCriticalSection(&m_Shards[i].cs);
+    }
+}
+
+void DatagramListener::SetSessionTimeout(DWORD timeoutSeconds)
+{
+    assert(m_Closing);
+    m_SessionTimeout = timeoutSeconds;
+}
+
+bool DatagramListener::Open(NodeThreadPools& pools, int pool)
+{
+    assert(m_Socket == INVALID_SOCKET);
+
+    m_ThreadPools = &pools;
+    m_Pool = pool;
+
+    m_Socket = Network::CreateSocket(true, m_Port, 0, m_Address.empty() ? NULL : m_Address.c_str(),
+                                     AF_UNSPEC, SOCK_DGRAM);
+    if (m_Socket == INVALID_SOCKET)
+    {
+        return false;
+    }
+
+    // One peer that has gone away would otherwise fail the receives of all the others.
+    if (!Network::DisableUdpConnReset(m_Socket))
+    {
+        return false;
+    }
+
+    TP_CALLBACK_ENVIRON* environment = pools.GetEnvironment(pool);
+    m_pTPIO = CreateThreadpoolIo(reinterpret_cast<HANDLE>(m_Socket),
+                                 DatagramListener::IoCompletionCallback, this, environment);
+    if (m_pTPIO == NULL)
+    {
+        ERROR_CODE(GetLastError(), "Could not assign the datagram socket to the IOCP handle.");
+        return false;
+    }
+
+    m_SweepTimer = CreateThreadpoolTimer(DatagramListener::WorkerSweepSessions, this, environment);
+    if (m_SweepTimer == NULL)
+    {
+        ERROR_CODE(GetLastError(), "Could not create the timer for quiet sessions.");
+        return false;
+    }
+
+    m_Closing = false;
+
+    PostRecvs();
+    if (m_NumPostedRecvs == 0)
+    {
+        ERROR_MSG("Could not post any datagram receives. port : %d", m_Port);
+        return false;
+    }
+
+    SetRelativeTimer(m_SweepTimer, SESSION_SWEEP_INTERVAL_MS, SESSION_SWEEP_INTERVAL_MS);
+
+    std::string ip;
+    u_short port = 0;
+    Network::GetLocalAddress(m_Socket, ip, port);
+    TRACE("Receiving datagrams : ip[%s], port[%d], pool[%d], receives[%d]", ip.c_str(), port,
+          m_Pool, m_NumRecvs);
+
+    return true;
+}
+
+void DatagramListener::Close()
+{
+    m_Closing = true;
+
+    if (m_SweepTimer != NULL)
+    {
+        SetThreadpoolTimer(m_SweepTimer, NULL, 0, 0);
+        WaitForThreadpoolTimerCallbacks(m_SweepTimer, true);
+        CloseThreadpoolTimer(m_SweepTimer);
+        m_SweepTimer = NULL;
+    }
+
+    if (m_Socket != INVALID_SOCKET)
+    {
+        Network::CloseSocket(m_Socket);
+        CancelIoEx(reinterpret_cast<HANDLE>(m_Socket), NULL);
+        m_Socket = INVALID_SOCKET;
+    }
+
+    // Let the aborted receives and sends run so that they free their packets and sessions.
+    if (m_pTPIO != NULL)
+    {
+        WaitForThreadpoolIoCallbacks(m_pTPIO, false);
+        CloseThreadpoolIo(m_pTPIO);
+        m_pTPIO = NULL;
+    }
+
+    DropSessions();
+}
+
+DWORD DatagramListener::Send(DatagramSession* session, Packet** packets, DWORD numPackets)
+{
+    assert(session);
+    assert(session->listener == this);
+    assert(packets);
+
+    DWORD numQueued = 0;
+    {
+        CritSecLock lock(session->cs);
+
+        while (numQueued < numPackets && !m_Closing &&
+               session->sendQueue.size() < MAX_SESSION_QUEUE)
+        {
+            session->sendQueue.push_back(packets[numQueued++]);
+        }
+    }
+
+    for (DWORD i = numQueued; i < numPackets; ++i)
+    {
+        Packet::Destroy(packets[i]);
+        InterlockedIncrement(&m_NumDroppedSends);
+    }
+
+    if (numQueued > 0)
+    {
+        PostSends(session);
+    }
+    return numQueued;
+}
+
+/* static */ void DatagramListener::AddRefSession(DatagramSession* session)
+{
+    assert(session);
+    InterlockedIncrement(&session->refCount);
+}
+
+/* static */ void DatagramListener::ReleaseSession(DatagramSession* session)
+{
+    assert(session);
+
+    const long refCount = InterlockedDecrement(&session->refCount);
+    assert(refCount >= 0);
+
+    if (refCount == 0)
+    {
+        // Sends stop being posted once the listener closes, so a session that was swept before
+        // may still have some queued. Nothing else references the session, so nothing is queued
+        // meanwhile.
+        std::deque<Packet*>& sendQueue = session->sendQueue;
+        for (size_t i = 0; i < sendQueue.size(); ++i)
+        {
+            Packet::Destroy(sendQueue[i]);
+        }
+        InterlockedExchangeAdd(&session->listener->m_NumDroppedSends,
+                               static_cast<long>(sendQueue.size()));
+        sendQueue.clear();
+
+        session->listener->RecycleSession(session);
+    }
+}
+
+/* static */ bool DatagramListener::GetRemoteAddress(DatagramSession* session, std::string& ip,
+                                                     u_short& port)
+{
+    assert(session);
+    return Network::GetAddress(reinterpret_cast<const sockaddr*>(&session->address),
+                               session->addressLength, ip, port);
+}
+
+DatagramListener::Stats DatagramListener::GetStats()
+{
+    Stats stats;
+    stats.port = m_Port;
+    if (m_Socket == INVALID_SOCKET || !Network::GetLocalAddress(m_Socket, stats.ip, stats.port))
+    {
+        stats.ip = m_Address;
+    }
+    stats.pool = m_Pool;
+    stats.numRecvs = m_NumRecvs;
+    stats.numPostedRecvs = m_NumPostedRecvs;
+    stats.numSessions = m_NumSessions;
+    stats.numDroppedRecvs = m_NumDroppedRecvs;
+    stats.numDroppedSends = m_NumDroppedSends;
+    stats.numUntrackedRecvs = m_NumUntrackedRecvs;
+    return stats;
+}
+
+/* static */ void DatagramListener::EchoHandler(DatagramListener* listener,
+                                                DatagramSession* session, Packet* packet)
+{
+    listener->Send(session, &packet, 1);
+}
+
+bool DatagramListener::Endpoint::operator==(const Endpoint& other) const
+{
+    return address[0] == other.address[0] && address[1] == other.address[1] &&
+           scopeId == other.scopeId && port == other.port && family == other.family;
+}
+
+size_t DatagramListener::EndpointHash::operator()(const Endpoint& endpoint) const
+{
+    // Mixes the words so that neighbouring addresses and ports land in different buckets.
+    ULONGLONG hash = endpoint.address[0] * 0x9E3779B97F4A7C15ULL;
+    hash ^= endpoint.address[1] + 0x632BE59BD9B4E019ULL + (hash << 6) + (hash >> 2);
+    hash ^= ((static_cast<ULONGLONG>(endpoint.port) << 32) | endpoint.scopeId) *
+            0xC2B2AE3D27D4EB4FULL;
+    hash ^= hash >> 29;
+    return static_cast<size_t>(hash);
+}
+
+/* static */ bool DatagramListener::MakeEndpoint(const sockaddr* address, int length,
+                                                 Endpoint& endpoint)
+{
+    ZeroMemory(&endpoint, sizeof(endpoint));
+    endpoint.family = address->sa_family;
+
+    if (address->sa_family == AF_INET && length >= static_cast<int>(sizeof(sockaddr_in)))
+    {
+        const sockaddr_in* in = reinterpret_cast<const sockaddr_in*>(address);
+        endpoint.address[0] = in->sin_addr.s_addr;
+        endpoint.port = in->sin_port;
+        return true;
+    }
+
+    if (address->sa_family == AF_INET6 && length >= static_cast<int>(sizeof(sockaddr_in6)))
+    {
+        const sockaddr_in6* in6 = reinterpret_cast<const sockaddr_in6*>(address);
+        CopyMemory(endpoint.address, &in6->sin6_addr, sizeof(endpoint.address));
+        endpoint.scopeId = in6->sin6_scope_id;
+        endpoint.port = in6->sin6_port;
+        return true;
+    }
+
+    return false;
+}
+
+DatagramListener::Operation* DatagramListener::AllocOperation(OperationType type)
+{
+    Operation* operation = static_cast<Operation*>(m_Operations.get());
+    if (operation == NULL)
+    {
+        ERROR_MSG("Could not allocate a datagram operation.");
+        return NULL;
+    }
+
+    ZeroMemory(operation, sizeof(Operation));
+    operation->type = type;
+    return operation;
+}
+
+void DatagramListener::FreeOperation(Operation* operation) { m_Operations.put(operation); }
+
+void DatagramListener::PostRecvs()
+{
+    // Count the receive before posting it, so that threads topping up at once don't overshoot.
+    while (!m_Closing)
+    {
+        if (InterlockedIncrement(&m_NumPostedRecvs) > m_NumRecvs || !PostRecv())
+        {
+            InterlockedDecrement(&m_NumPostedRecvs);
+            return;
+        }
+    }
+}
+
+bool DatagramListener::PostRecv()
+{
+    Packet* packet = Packet::Create(NULL, m_MaxDatagramSize);
+    if (packet == NULL)
+    {
+        ERROR_MSG("Could not allocate a datagram buffer.");
+        return false;
+    }
+
+    Operation* operation = AllocOperation(RECV);
+    if (operation == NULL)
+    {
+        Packet::Destroy(packet);
+        return false;
+    }
+
+    operation->packet = packet;
+    operation->buffers[0].buf = reinterpret_cast<CHAR*>(packet->GetData());
+    operation->buffers[0].len = packet->GetCapacity();
+    operation->msg.name = reinterpret_cast<LPSOCKADDR>(&operation->address);
+    operation->msg.namelen = sizeof(operation->address);
+    operation->msg.lpBuffers = operation->buffers;
+    operation->msg.dwBufferCount = 1;
+
+    StartThreadpoolIo(m_pTPIO);
+
+    if (Network::RecvMsg(m_Socket, &operation->msg, &operation->overlapped) == SOCKET_ERROR)
+    {
+        const int error = WSAGetLastError();
+        if (error != WSA_IO_PENDING)
+        {
+            CancelThreadpoolIo(m_pTPIO);
+
+            if (!m_Closing)
+            {
+                ERROR_CODE(error, "WSARecvMsg() failed.");
+            }
+            Packet::Destroy(packet);
+            FreeOperation(operation);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void DatagramListener::OnRecv(Operation* operation, ULONG result, DWORD numberOfBytes)
+{
+    assert(operation);
+
+    Packet* packet = operation->packet;
+
+    // Keep the socket busy while this one is handled.
+    InterlockedDecrement(&m_NumPostedRecvs);
+    PostRecvs();
+
+    if (result == ERROR_MORE_DATA || (operation->msg.dwFlags & MSG_TRUNC) != 0)
+    {
+        InterlockedIncrement(&m_NumDroppedRecvs);
+        Packet::Destroy(packet);
+    }
+    else if (result != ERROR_SUCCESS)
+    {
+        if (!m_Closing)
+        {
+            ERROR_CODE(result, "A datagram receive failed.");
+            Metrics::RecordFailure(result);
+        }
+        Packet::Destroy(packet);
+    }
+    else
+    {
+        Metrics::Add(Metrics::DATAGRAM_RECVS);
+        Metrics::Add(Metrics::DATAGRAM_RECV_BYTES, numberOfBytes);
+
+        packet->SetSize(numberOfBytes);
+
+        DatagramSession* session = AcquireSession(operation->msg.name, operation->msg.namelen);
+        if (session == NULL)
+        {
+            Packet::Destroy(packet);
+        }
+        else
+        {
+            m_Handler(this, session, packet);
+            ReleaseSession(session);
+        }
+    }
+
+    FreeOperation(operation);
+}
+
+void DatagramListener::PostSends(DatagramSession* session)
+{
+    assert(session);
+
+    for (;;)
+    {
+        Packet* packet = NULL;
+        {
+            CritSecLock lock(session->cs);
+
+            if (session->sendQueue.empty() || session->numSending == MAX_SESSION_SENDS)
+            {
+                return;
+            }
+
+            packet = session->sendQueue.front();
+            session->sendQueue.pop_front();
+            ++session->numSending;
+        }
+
+        if (!PostSend(session, packet))
+        {
+            CritSecLock lock(session->cs);
+            --session->numSending;
+        }
+    }
+}
+
+bool DatagramListener::PostSend(DatagramSession* session, Packet* packet)
+{
+    assert(session);
+    assert(packet);
+
+    Operation* operation = AllocOperation(SEND);
+    if (operation == NULL)
+    {
+        Packet::Destroy(packet);
+        return false;
+    }
+
+    // The segments are gathered into one datagram.
+    DWORD numBuffers = 0;
+    for (Packet* segment = packet; segment != NULL; segment = segment->GetNext())
+    {
+        // Only TransmitPackets() can send what isn't in memory.
+        assert(!segment->IsUnmapped());
+
+        operation->buffers[numBuffers].buf = reinterpret_cast<CHAR*>(segment->GetData());
+        operation->buffers[numBuffers].len = segment->GetSize();
+        ++numBuffers;
+    }
+
+    AddRefSession(session);
+    operation->session = session;
+    operation->packet = packet;
+    operation->msg.name = reinterpret_cast<LPSOCKADDR>(&session->address);
+    operation->msg.namelen = session->addressLength;
+    operation->msg.lpBuffers = operation->buffers;
+    operation->msg.dwBufferCount = numBuffers;
+
+    StartThreadpoolIo(m_pTPIO);
+
+    if (Network::SendMsg(m_Socket, &operation->msg, &operation->overlapped) == SOCKET_ERROR)
+    {
+        const int error = WSAGetLastError();
+        if (error != WSA_IO_PENDING)
+        {
+            CancelThreadpoolIo(m_pTPIO);
+
+            if (!m_Closing)
+            {
+                ERROR_CODE(error, "WSASendMsg() failed.");
+            }
+            Packet::Destroy(packet);
+            FreeOperation(operation);
+            ReleaseSession(session);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void DatagramListener::OnSend(Operation* operation, ULONG result, DWORD numberOfBytes)
+{
+    assert(operation);
+
+    DatagramSession* session = operation->session;
+    assert(session);
+
+    if (result == ERROR_SUCCESS)
+    {
+        Metrics::Add(Metrics::DATAGRAM_SENDS);
+        Metrics::Add(Metrics::DATAGRAM_SEND_BYTES, numberOfBytes);
+    }
+    else if (!m_Closing)
+    {
+        ERROR_CODE(result, "A datagram send failed.");
+        Metrics::RecordFailure(result);
+    }
+
+    Packet::Destroy(operation->packet);
+    FreeOperation(operation);
+
+    {
+        CritSecLock lock(session->cs);
+        --session->numSending;
+    }
+
+    if (!m_Closing)
+    {
+        PostSends(session);
+    }
+    ReleaseSession(session);
+}
+
+DatagramSession* DatagramListener::AcquireSession(const sockaddr* address, int length)
+{
+    Endpoint endpoint;
+    if (!MakeEndpoint(address, length, endpoint))
+    {
+        return NULL;
+    }
+
+    const size_t hash = EndpointHash()(endpoint);
+    SessionShard& shard = m_Shards[(hash >> 7) & (NUM_SESSION_SHARDS - 1)];
+
+    CritSecLock lock(shard.cs);
+
+    SessionMap::iterator it = shard.sessions.find(endpoint);
+    if (it != shard.sessions.end())
+    {
+        DatagramSession* session = it->second;
+        session->lastRecvTime = GetTickCount();
+        AddRefSession(session);
+        return session;
+    }
+
+    if (shard.sessions.size() >= MAX_SHARD_SESSIONS)
+    {
+        InterlockedIncrement(&m_NumUntrackedRecvs);
+        return NULL;
+    }
+
+    // Only a shard's first sessions are allocated, and they are reused from then on.
+    DatagramSession* session = NULL;
+    if (!shard.freeSessions.empty())
+    {
+        session = shard.freeSessions.back();
+        shard.freeSessions.pop_back();
+    }
+    else
+    {
+        session = new DatagramSession();
+        InitializeCriticalSection(&session->cs);
+    }
+
+    session->listener = this;
+    session->shard = static_cast<int>(&shard - m_Shards);
+    CopyMemory(&session->address, address, length);
+    session->addressLength = length;
+    // The table's and the caller's.
+    session->refCount = 2;
+    session->lastRecvTime = GetTickCount();
+    session->numSending = 0;
+
+    shard.sessions.insert(SessionMap::value_type(endpoint, session));
+    InterlockedIncrement(&m_NumSessions);
+
+    return session;
+}
+
+void DatagramListener::RecycleSession(DatagramSession* session)
+{
+    assert(session);
+    assert(session->refCount == 0);
+
+    SessionShard& shard = m_Shards[session->shard];
+
+    CritSecLock lock(shard.cs);
+    shard.freeSessions.push_back(session);
+}
+
+void DatagramListener::SweepSessions()
+{
+    if (m_SessionTimeout == 0)
+    {
+        return;
+    }
+
+    const DWORD now = GetTickCount();
+    const DWORD timeoutMs = m_SessionTimeout * 1000;
+
+    std::vector<DatagramSession*> expired;
+    for (int i = 0; i < NUM_SESSION_SHARDS; ++i)
+    {
+        CritSecLock lock(m_Shards[i].cs);
+
+        SessionMap& sessions = m_Shards[i].sessions;
+        for (SessionMap::iterator it = sessions.begin(); it != sessions.end();)
+        {
+            if (now - it->second->lastRecvTime >= timeoutMs)
+            {
+                expired.push_back(it->second);
+                it = sessions.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // What the sessions still have queued goes out before they are recycled, unless the listener
+    // closes first.
+    for (size_t i = 0; i < expired.size(); ++i)
+    {
+        InterlockedDecrement(&m_NumSessions);
+        ReleaseSession(expired[i]);
+    }
+}
+
+void DatagramListener::DropSessions()
+{
+    // Nothing is outstanding any more, so only the queues are left.
+    for (int i = 0; i < NUM_SESSION_SHARDS; ++i)
+    {
+        SessionMap sessions;
+        {
+            CritSecLock lock(m_Shards[i].cs);
+            sessions.swap(m_Shards[i].sessions);
+        }
+
+        for (SessionMap::iterator it = sessions.begin(); it != sessions.end(); ++it)
+        {
+            // The table's is the last reference, which drops what is queued.
+            InterlockedDecrement(&m_NumSessions);
+            ReleaseSession(it->second);
+        }
+    }
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <winsock2.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/CachedAlloc.h"
+#include "common/NodeThreadPools.h"
+#include "Packet.h"
+
+class DatagramListener;
+
+// A remote endpoint that has sent datagrams to a listener.
+struct DatagramSession;
+
+// Receives datagrams on a UDP socket, keeping many receives posted, and sends datagrams back out
+// of it. The senders are told apart by their address, each with a session of its own that is
+// dropped once it has been quiet for the session timeout. Each shard of the session table holds
+// up to MAX_SHARD_SESSIONS, and datagrams from new senders are dropped while theirs is full.
+// Datagrams are received into packets from the same pools as the TCP clients', and every I/O
+// completes on one of the server's NUMA node pools.
+class DatagramListener
+{
+public:
+    enum
+    {
+        // The payload that fits the Ethernet MTU over IPv4 without fragmenting. Datagrams that
+        // don't fit the receive buffer are dropped.
+        DEFAULT_MAX_DATAGRAM_SIZE = 1472,
+        DEFAULT_SESSION_TIMEOUT_SECONDS = 60,
+    };
+
+    // Takes over the packet, which has no sender. The session is only valid during the call,
+    // unless it is kept with AddRefSession().
+    typedef void (*Handler)(DatagramListener* listener, DatagramSession* session, Packet* packet);
+
+    struct Stats
+    {
+        std::string ip;
+        u_short port;
+        int pool;
+        int numRecvs;
+        long numPostedRecvs;
+        long numSessions;
+        // Datagrams that had to be truncated, and sends that went over a session's queue or
+        // were still queued when the listener closed.
+        long numDroppedRecvs;
+        long numDroppedSends;
+        // Datagrams dropped because their sender was new and its shard already had
+        // MAX_SHARD_SESSIONS. They get through once a sweep has made room.
+        long numUntrackedRecvs;
+    };
+
+public:
+    // A NULL address is every local address of the first family that resolves.
+    DatagramListener(const char* address, u_short port, int numRecvs, Handler handler,
+                     DWORD maxDatagramSize = DEFAULT_MAX_DATAGRAM_SIZE);
+    ~DatagramListener();
+
+    DatagramListener& operator=(const DatagramListener&) = delete;
+    DatagramListener(const DatagramListener&) = delete;
+
+    // Must be set before Open().
+    void SetSessionTimeout(DWORD timeoutSeconds);
+
+    // Binds the socket and posts the receives, which complete on pool of pools.
+    bool Open(NodeThreadPools& pools, int pool);
+    // Waits for the outstanding I/O to be aborted, and drops the sessions and what they still
+    // had queued. Sessions that are kept have to be released before.
+    void Close();
+
+    // Takes over the packets and queues them on the session's sends. They aren't batched on the
+    // wire: each is a datagram of its own, sent with a WSASendMsg() of its own. A few of a
+    // session's sends are outstanding at a time, and their completions post the next. Packets
+    // that don't fit the session's queue are dropped. Returns the number queued.
+    DWORD Send(DatagramSession* session, Packet** packets, DWORD numPackets);
+
+    static void AddRefSession(DatagramSession* session);
+    static void ReleaseSession(DatagramSession* session);
+    static bool GetRemoteAddress(DatagramSession* session, std::string& ip, u_short& port);
+
+    int GetPool() { return m_Pool; }
+    Stats GetStats();
+
+    // Sends the datagram back to its sender.
+    static void EchoHandler(DatagramListener* listener, DatagramSession* session, Packet* packet);
+
+private:
+    enum
+    {
+        // Datagrams queued on a session, and how many of them are sent at a time.
+        MAX_SESSION_QUEUE = 256,
+        MAX_SESSION_SENDS = 4,
+        NUM_SESSION_SHARDS = 16,
+        MAX_SHARD_SESSIONS = 1024,
+        // How often quiet sessions are dropped and failed receives are posted again.
+        SESSION_SWEEP_INTERVAL_MS = 1000,
+    };
+
+    enum OperationType
+    {
+        RECV,
+        SEND,
+    };
+
+    // A posted WSARecvMsg() or WSASendMsg(), from a pool of its own.
+    struct Operation
+    {
+        OVERLAPPED overlapped;
+        OperationType type;
+        Packet* packet;
+        // The session that a send holds a reference to.
+        DatagramSession* session;
+        WSAMSG msg;
+        WSABUF buffers[Packet::MAX_SEGMENTS];
+        // Where a receive's datagram came from.
+        SOCKADDR_STORAGE address;
+    };
+
+    // An address and port that sessions are looked up by.
+    struct Endpoint
+    {
+        ULONGLONG address[2];
+        ULONG scopeId;
+        USHORT port;
+        USHORT family;
+
+        bool operator==(const Endpoint& other) const;
+    };
+
+    struct EndpointHash
+    {
+        size_t operator()(const Endpoint& endpoint) const;
+    };
+
+    typedef std::unordered_map<Endpoint, DatagramSession*, EndpointHash> SessionMap;
+
+    // Lookups of different senders mostly take different locks. Sessions that have been released
+    // go back to the free list of their shard, so that new senders don't allocate.
+    struct SessionShard
+    {
+        CRITICAL_SECTION cs;
+        SessionMap sessions;
+        std::vector<DatagramSession*> freeSessions;
+    };
+
+private:
+    static void CALLBACK IoCompletionCallback(PTP_CALLBACK_INSTANCE Instance, PVOID Context,
+                                              PVOID Overlapped, ULONG IoResult,
+                                              ULONG_PTR NumberOfBytesTransferred, PTP_IO Io);
+    static void CALLBACK WorkerSweepSessions(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+                                             PTP_TIMER /* Timer */);
+
+    static bool MakeEndpoint(const sockaddr* address, int length, Endpoint& endpoint);
+
+    Operation* AllocOperation(OperationType type);
+    void FreeOperation(Operation* operation);
+
+    // Tops the receives up to numRecvs.
+    void PostRecvs();
+    bool PostRecv();
+    void OnRecv(Operation* operation, ULONG result, DWORD numberOfBytes);
+
+    void PostSends(DatagramSession* session);
+    // Takes over the packet.
+    bool PostSend(DatagramSession* session, Packet* packet);
+    void OnSend(Operation* operation, ULONG result, DWORD numberOfBytes);
+
+    // Finds or adds the sender's session, with a reference for the caller. Returns NULL if the
+    // sender is new and its shard is full.
+    DatagramSession* AcquireSession(const sockaddr* address, int length);
+    // Puts a session without references back on its shard's free list.
+    void RecycleSession(DatagramSession* session);
+    void SweepSessions();
+    void DropSessions();
+
+private:
+    std::string m_Address;
+    u_short m_Port;
+    int m_NumRecvs;
+    Handler m_Handler;
+    DWORD m_MaxDatagramSize;
+    DWORD m_SessionTimeout;
+
+    NodeThreadPools* m_ThreadPools;
+    int m_Pool;
+    SOCKET m_Socket;
+    TP_IO* m_pTPIO;
+    TP_TIMER* m_SweepTimer;
+    CachedAlloc m_Operations;
+
+    SessionShard m_Shards[NUM_SESSION_SHARDS];
+
+    volatile long m_NumPostedRecvs;
+    volatile long m_NumSessions;
+    volatile long m_NumDroppedRecvs;
+    volatile long m_NumDroppedSends;
+    volatile long m_NumUntrackedRecvs;
+    volatile bool m_Closing;
+};
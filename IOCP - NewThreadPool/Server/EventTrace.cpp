@@ -0,0 +1,160 @@
+#include "EventTrace.h"
+
+#include <evntprov.h>
+
+#include "common/Log.h"
+// Generated from ServerEvents.man by the build, into the intermediate directory.
+#include "ServerEvents.h"
+
+namespace
+{
+static_assert(EventTrace::KEYWORD_IO == IOCP_SERVER_KEYWORD_IO &&
+                  EventTrace::KEYWORD_DATA == IOCP_SERVER_KEYWORD_DATA &&
+                  EventTrace::KEYWORD_CLIENTS == IOCP_SERVER_KEYWORD_CLIENTS,
+              "The keywords have to match ServerEvents.man.");
+
+const LONG ALL_KEYWORDS =
+    EventTrace::KEYWORD_IO | EventTrace::KEYWORD_DATA | EventTrace::KEYWORD_CLIENTS;
+
+REGHANDLE providerHandle = 0;
+
+// Called whenever a session enables or disables the provider, with what all of them enable.
+void NTAPI EnableCallback(LPCGUID /* SourceId */, ULONG IsEnabled, UCHAR Level,
+                          ULONGLONG MatchAnyKeyword, ULONGLONG /* MatchAllKeyword */,
+                          PEVENT_FILTER_DESCRIPTOR /* FilterData */, PVOID /* CallbackContext */)
+{
+    if (IsEnabled == EVENT_CONTROL_CODE_CAPTURE_STATE)
+    {
+        // There is no state to capture, and what is enabled stays as it is.
+        return;
+    }
+
+    LONG keywords = 0;
+    if (IsEnabled == EVENT_CONTROL_CODE_ENABLE_PROVIDER &&
+        (Level == 0 || Level >= WINEVENT_LEVEL_INFO))
+    {
+        // A session that gives no keywords gets every event.
+        keywords = MatchAnyKeyword == 0 ? ALL_KEYWORDS
+                                        : static_cast<LONG>(MatchAnyKeyword & ALL_KEYWORDS);
+    }
+
+    InterlockedExchange(&EventTrace::g_EnabledKeywords, keywords);
+}
+
+void Write(const EVENT_DESCRIPTOR& descriptor, EVENT_DATA_DESCRIPTOR* data, ULONG numData)
+{
+    // There is nothing to do about an event that doesn't fit a session's buffers, which the
+    // session counts as lost.
+    EventWrite(providerHandle, &descriptor, numData, data);
+}
+}
+
+namespace EventTrace
+{
+volatile LONG g_EnabledKeywords = 0;
+
+bool Register()
+{
+    const ULONG result =
+        EventRegister(&IOCP_SERVER_PROVIDER, EnableCallback, NULL, &providerHandle);
+    if (result != ERROR_SUCCESS)
+    {
+        ERROR_CODE(result, "EventRegister() failed.");
+        providerHandle = 0;
+        return false;
+    }
+    return true;
+}
+
+void Unregister()
+{
+    if (providerHandle == 0)
+    {
+        return;
+    }
+
+    // Nothing may be written once the handle is gone, so this has to wait for the server to be
+    // destroyed.
+    InterlockedExchange(&g_EnabledKeywords, 0);
+    EventUnregister(providerHandle);
+    providerHandle = 0;
+}
+
+void WriteIoCreated(const void* event, HandleId clientId, DWORD type)
+{
+    const ULONGLONG id = clientId;
+
+    EVENT_DATA_DESCRIPTOR data[3];
+    EventDataDescCreate(&data[0], &event, sizeof(event));
+    EventDataDescCreate(&data[1], &id, sizeof(id));
+    EventDataDescCreate(&data[2], &type, sizeof(type));
+    Write(EVENT_IO_CREATED, data, 3);
+}
+
+void WriteIoPosted(const void* event, HandleId clientId, DWORD type, DWORD numberOfBytes)
+{
+    const ULONGLONG id = clientId;
+
+    EVENT_DATA_DESCRIPTOR data[4];
+    EventDataDescCreate(&data[0], &event, sizeof(event));
+    EventDataDescCreate(&data[1], &id, sizeof(id));
+    EventDataDescCreate(&data[2], &type, sizeof(type));
+    EventDataDescCreate(&data[3], &numberOfBytes, sizeof(numberOfBytes));
+    Write(EVENT_IO_POSTED, data, 4);
+}
+
+void WriteIoCompleted(const void* event, HandleId clientId, DWORD type, DWORD numberOfBytes,
+                      DWORD status)
+{
+    const ULONGLONG id = clientId;
+
+    EVENT_DATA_DESCRIPTOR data[5];
+    EventDataDescCreate(&data[0], &event, sizeof(event));
+    EventDataDescCreate(&data[1], &id, sizeof(id));
+    EventDataDescCreate(&data[2], &type, sizeof(type));
+    EventDataDescCreate(&data[3], &numberOfBytes, sizeof(numberOfBytes));
+    EventDataDescCreate(&data[4], &status, sizeof(status));
+    Write(EVENT_IO_COMPLETED, data, 5);
+}
+
+void WriteRecvDispatched(HandleId clientId, DWORD numPackets, DWORD numberOfBytes)
+{
+    const ULONGLONG id = clientId;
+
+    EVENT_DATA_DESCRIPTOR data[3];
+    EventDataDescCreate(&data[0], &id, sizeof(id));
+    EventDataDescCreate(&data[1], &numPackets, sizeof(numPackets));
+    EventDataDescCreate(&data[2], &numberOfBytes, sizeof(numberOfBytes));
+    Write(EVENT_RECV_DISPATCHED, data, 3);
+}
+
+void WriteSendCompleted(HandleId clientId, DWORD numberOfBytes, DWORD pendingBytes)
+{
+    const ULONGLONG id = clientId;
+
+    EVENT_DATA_DESCRIPTOR data[3];
+    EventDataDescCreate(&data[0], &id, sizeof(id));
+    EventDataDescCreate(&data[1], &numberOfBytes, sizeof(numberOfBytes));
+    EventDataDescCreate(&data[2], &pendingBytes, sizeof(pendingBytes));
+    Write(EVENT_SEND_COMPLETED, data, 3);
+}
+
+void WriteClientAdded(HandleId clientId, DWORD pool)
+{
+    const ULONGLONG id = clientId;
+
+    EVENT_DATA_DESCRIPTOR data[2];
+    EventDataDescCreate(&data[0], &id, sizeof(id));
+    EventDataDescCreate(&data[1], &pool, sizeof(pool));
+    Write(EVENT_CLIENT_ADDED, data, 2);
+}
+
+void WriteClientRemoved(HandleId clientId)
+{
+    const ULONGLONG id = clientId;
+
+    EVENT_DATA_DESCRIPTOR data[1];
+    EventDataDescCreate(&data[0], &id, sizeof(id));
+    Write(EVENT_CLIENT_REMOVED, data, 1);
+}
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <windows.h>
+
+#include "common/HandleTable.h"
+
+// ETW events at each stage of a client's I/O, so that e.g. WPA can tell how long the stages take
+// on a live server, and how long completions wait for a thread. ETW stamps every event with the
+// time, thread and processor.
+// The provider is described by ServerEvents.man, which is compiled into the executable's
+// resources and has to be installed with wevtutil im for tools to decode the events.
+// An event whose keyword no session has enabled only costs a test of a global, so they stay in
+// release builds.
+namespace EventTrace
+{
+// Match the manifest's keywords.
+enum Keyword
+{
+    // IOEvents being created, posted and completed.
+    KEYWORD_IO = 0x1,
+    // Receives reaching the handler, and sends completing.
+    KEYWORD_DATA = 0x2,
+    // Clients being added and removed.
+    KEYWORD_CLIENTS = 0x4,
+};
+
+// Until Register() and after Unregister(), no keyword is enabled.
+bool Register();
+void Unregister();
+
+// The keywords that sessions have enabled, as the provider's enable callback has last set them.
+extern volatile LONG g_EnabledKeywords;
+inline bool IsEnabled(Keyword keyword) { return (g_EnabledKeywords & keyword) != 0; }
+
+// The IOEvent ties the stages of an I/O together, and type is its IOEvent::Type.
+void WriteIoCreated(const void* event, HandleId clientId, DWORD type);
+// numberOfBytes is how much the I/O has been posted for.
+void WriteIoPosted(const void* event, HandleId clientId, DWORD type, DWORD numberOfBytes);
+void WriteIoCompleted(const void* event, HandleId clientId, DWORD type, DWORD numberOfBytes,
+                      DWORD status);
+void WriteRecvDispatched(HandleId clientId, DWORD numPackets, DWORD numberOfBytes);
+void WriteSendCompleted(HandleId clientId, DWORD numberOfBytes, DWORD pendingBytes);
+void WriteClientAdded(HandleId clientId, DWORD pool);
+void WriteClientRemoved(HandleId clientId);
+}
+
+// The arguments of an event are only evaluated while a session has enabled its keyword.
+#define EVENT_TRACE(keyword, write)                                                             \
+    do                                                                                          \
+    {                                                                                           \
+        if (EventTrace::IsEnabled(EventTrace::keyword))                                         \
+        {                                                                                       \
+            EventTrace::write;                                                                  \
+        }                                                                                       \
+    } while (0)
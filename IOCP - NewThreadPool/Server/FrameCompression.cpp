@@ -0,0 +1,239 @@
+#include "FrameCompression.h"
+
+#include "common/Log.h"
+#include "common/Lz4.h"
+#include "common/Metrics.h"
+
+#include <cstring>
+
+const BYTE FrameCompression::HELLO[HELLO_SIZE] = {'L', 'Z', '4', '?'};
+const BYTE FrameCompression::ACK[HELLO_SIZE] = {'L', 'Z', '4', '!'};
+
+FrameCompression::FrameCompression() : m_Framer(NULL), m_MinBatchSize(0), m_MaxBatchSize(0) {}
+
+bool FrameCompression::Configure(const Framer& framer, DWORD minBatchSize)
+{
+    if (minBatchSize == 0)
+    {
+        m_MinBatchSize = 0;
+        return true;
+    }
+
+    if (!framer.IsEnabled())
+    {
+        ERROR_MSG("Compression needs framing.");
+        return false;
+    }
+
+    // A transport frame has to fit in a single segment, so that it compresses and decompresses
+    // in place, and its length has to fit in the prefix.
+    const DWORD prefixSize = framer.GetPrefixSize();
+    DWORD maxFrameSize = min(framer.GetMaxFrameSize(), Packet::GetMaxSegmentCapacity());
+    if (prefixSize < Framer::MAX_PREFIX_SIZE)
+    {
+        maxFrameSize = min(maxFrameSize, prefixSize + (1UL << (8 * prefixSize)) - 1);
+    }
+
+    // A compressed batch is only kept if it is smaller than the plain one, so that one fits too.
+    const DWORD headerSize = prefixSize + FLAG_SIZE;
+    if (maxFrameSize < headerSize + MIN_MAX_BATCH_SIZE)
+    {
+        ERROR_MSG("Frames of at most %d bytes are too small to compress.", maxFrameSize);
+        return false;
+    }
+
+    m_Framer = &framer;
+    m_MinBatchSize = max(minBatchSize, static_cast<DWORD>(MIN_COMPRESS_SIZE));
+    m_MaxBatchSize = maxFrameSize - headerSize;
+    return true;
+}
+
+bool FrameCompression::IsHello(Packet* frame) const
+{
+    assert(IsEnabled());
+
+    const DWORD prefixSize = m_Framer->GetPrefixSize();
+    return frame->GetNext() == NULL && frame->GetSize() == prefixSize + HELLO_SIZE &&
+           memcmp(frame->GetData() + prefixSize, HELLO, HELLO_SIZE) == 0;
+}
+
+Packet* FrameCompression::CreateAck() const
+{
+    assert(IsEnabled());
+
+    const DWORD prefixSize = m_Framer->GetPrefixSize();
+    Packet* packet = Packet::Create(NULL, prefixSize + HELLO_SIZE);
+    if (packet == NULL)
+    {
+        return NULL;
+    }
+
+    m_Framer->EncodeLength(HELLO_SIZE, packet->GetData());
+    CopyMemory(packet->GetData() + prefixSize, ACK, HELLO_SIZE);
+    packet->SetSize(prefixSize + HELLO_SIZE);
+    return packet;
+}
+
+Packet* FrameCompression::Wrap(WSABUF* buffers, Packet** segments, DWORD& numBuffers) const
+{
+    assert(IsEnabled());
+    assert(numBuffers > 0);
+
+    DWORD size = 0;
+    bool mapped = true;
+    for (DWORD i = 0; i < numBuffers; ++i)
+    {
+        size += buffers[i].len;
+        mapped = mapped && !segments[i]->IsUnmapped();
+    }
+
+    // A frame over the maximum batch goes out on its own, and the peer can't take it compressed
+    // either. Data that is only in a file stays there.
+    if (size >= m_MinBatchSize && size <= m_MaxBatchSize && mapped)
+    {
+        Packet* packet = Compress(buffers, numBuffers, size);
+        if (packet != NULL)
+        {
+            buffers[0].buf = reinterpret_cast<char*>(packet->GetData());
+            buffers[0].len = packet->GetSize();
+            segments[0] = packet;
+            numBuffers = 1;
+            return packet;
+        }
+    }
+
+    const DWORD headerSize = GetHeaderSize();
+    Packet* header = Packet::Create(NULL, headerSize);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+
+    m_Framer->EncodeLength(FLAG_SIZE + size, header->GetData());
+    header->GetData()[headerSize - FLAG_SIZE] = FLAG_PLAIN;
+    header->SetSize(headerSize);
+
+    MoveMemory(buffers + 1, buffers, numBuffers * sizeof(buffers[0]));
+    MoveMemory(segments + 1, segments, numBuffers * sizeof(segments[0]));
+    buffers[0].buf = reinterpret_cast<char*>(header->GetData());
+    buffers[0].len = headerSize;
+    segments[0] = header;
+    ++numBuffers;
+    return header;
+}
+
+Packet* FrameCompression::Compress(const WSABUF* buffers, DWORD numBuffers, DWORD size) const
+{
+    // Matches are only found within contiguous data, so the buffers are gathered first.
+    Packet* gathered = NULL;
+    const BYTE* source = reinterpret_cast<const BYTE*>(buffers[0].buf);
+    if (numBuffers > 1)
+    {
+        gathered = Packet::Create(NULL, size);
+        if (gathered == NULL)
+        {
+            return NULL;
+        }
+        assert(gathered->GetNext() == NULL);
+
+        BYTE* data = gathered->GetData();
+        for (DWORD i = 0; i < numBuffers; ++i)
+        {
+            CopyMemory(data, buffers[i].buf, buffers[i].len);
+            data += buffers[i].len;
+        }
+        gathered->SetSize(size);
+        source = gathered->GetData();
+    }
+
+    // Keep the block only if the frame comes out at least a byte smaller than the plain one.
+    const DWORD headerSize = GetHeaderSize() + ORIGINAL_SIZE_SIZE;
+    const DWORD blockCapacity = size - ORIGINAL_SIZE_SIZE - 1;
+
+    Packet* packet = Packet::Create(NULL, headerSize + blockCapacity);
+    DWORD blockSize = 0;
+    if (packet != NULL)
+    {
+        assert(packet->GetNext() == NULL);
+        blockSize = Lz4::Compress(source, size, packet->GetData() + headerSize, blockCapacity);
+    }
+
+    if (gathered != NULL)
+    {
+        Packet::Destroy(gathered);
+    }
+
+    if (blockSize == 0)
+    {
+        if (packet != NULL)
+        {
+            Packet::Destroy(packet);
+        }
+        return NULL;
+    }
+
+    BYTE* header = packet->GetData();
+    m_Framer->EncodeLength(FLAG_SIZE + ORIGINAL_SIZE_SIZE + blockSize, header);
+    header += m_Framer->GetPrefixSize();
+    *header++ = FLAG_COMPRESSED;
+    for (DWORD i = 0; i < ORIGINAL_SIZE_SIZE; ++i)
+    {
+        *header++ = static_cast<BYTE>(size >> (8 * i));
+    }
+    packet->SetSize(headerSize + blockSize);
+
+    Metrics::Add(Metrics::COMPRESSED_SENDS);
+    Metrics::Add(Metrics::COMPRESSED_SEND_BYTES, size);
+    Metrics::Add(Metrics::COMPRESSED_WIRE_BYTES, packet->GetSize());
+    return packet;
+}
+
+Packet* FrameCompression::Open(Packet* frame, DWORD& offset) const
+{
+    // The sender keeps its transport frames to a single segment as well.
+    const DWORD headerSize = GetHeaderSize();
+    if (frame->GetNext() != NULL || frame->GetSize() < headerSize)
+    {
+        Packet::Destroy(frame);
+        return NULL;
+    }
+
+    const BYTE* data = frame->GetData();
+    if (data[headerSize - FLAG_SIZE] == FLAG_PLAIN)
+    {
+        offset = headerSize;
+        return frame;
+    }
+
+    Packet* packet = NULL;
+    if (data[headerSize - FLAG_SIZE] == FLAG_COMPRESSED &&
+        frame->GetSize() >= headerSize + ORIGINAL_SIZE_SIZE)
+    {
+        DWORD size = 0;
+        for (DWORD i = 0; i < ORIGINAL_SIZE_SIZE; ++i)
+        {
+            size |= static_cast<DWORD>(data[headerSize + i]) << (8 * i);
+        }
+
+        const BYTE* block = data + headerSize + ORIGINAL_SIZE_SIZE;
+        const DWORD blockSize = frame->GetSize() - headerSize - ORIGINAL_SIZE_SIZE;
+        if (size > 0 && size <= Packet::GetMaxSegmentCapacity())
+        {
+            packet = Packet::Create(frame->GetSender(), size);
+        }
+
+        if (packet != NULL && !Lz4::Decompress(block, blockSize, packet->GetData(), size))
+        {
+            Packet::Destroy(packet);
+            packet = NULL;
+        }
+        else if (packet != NULL)
+        {
+            packet->SetSize(size);
+        }
+    }
+
+    Packet::Destroy(frame);
+    offset = 0;
+    return packet;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <winsock2.h>
+#include <cassert>
+
+#include "Framer.h"
+#include "Packet.h"
+
+// Compresses what the server sends to a connection that asks for it, a send's batch of frames at
+// a time, and decompresses what such a connection sends.
+//
+// A connection asks for it with a hello as its first frame, which the server answers with an ack
+// as the last frame that goes out as it is. From then on, both sides send transport frames: a
+// frame of the connection's framing whose data is a flag and then either the inner frames back to
+// back, or their size in 4 little-endian bytes and an LZ4 block of them. A server that doesn't
+// compress hands the hello over like any other frame, so e.g. an echo server sends it back
+// instead of the ack.
+// Batches under the smallest size to compress, and the ones that don't get smaller, go out as they
+// are behind the transport frame's header, which is all that compressing costs them.
+class FrameCompression
+{
+public:
+    enum
+    {
+        DEFAULT_MIN_BATCH_SIZE = 512,
+        HELLO_SIZE = 4,
+    };
+
+    // Both sides' data after the frame's prefix.
+    static const BYTE HELLO[HELLO_SIZE];
+    static const BYTE ACK[HELLO_SIZE];
+
+public:
+    FrameCompression();
+
+    FrameCompression& operator=(const FrameCompression&) = delete;
+    FrameCompression(const FrameCompression&) = delete;
+
+    // Needs framer to be enabled, and to outlive this. A minBatchSize of 0 turns compression
+    // off, which is the default.
+    bool Configure(const Framer& framer, DWORD minBatchSize);
+    bool IsEnabled() const { return m_MinBatchSize > 0; }
+
+    // The most a batch can have before it is wrapped, so that its transport frame stays within
+    // the framing's maximum and a single segment. A frame this large goes out on its own, so
+    // the frames sent to connections that compress have to stay under it.
+    DWORD GetMaxBatchSize() const { return m_MaxBatchSize; }
+
+    bool IsHello(Packet* frame) const;
+    Packet* CreateAck() const;
+
+    // Turns the batch in buffers into one transport frame, either compressed into a packet of
+    // its own or behind a header, which buffers and segments are rewritten to. The batch's
+    // buffers stay in use in the latter, so there has to be room for one more buffer.
+    // Returns the packet that has to be kept until the send has completed, or NULL if it could
+    // not be allocated, in which case the batch is left as it is.
+    Packet* Wrap(WSABUF* buffers, Packet** segments, DWORD& numBuffers) const;
+
+    // Takes over a transport frame and calls onFrame(Packet*) for the frames in it.
+    // Returns false if it isn't well formed, or couldn't be decompressed.
+    template <typename Func> bool Unwrap(Packet* frame, Func onFrame) const;
+
+private:
+    enum
+    {
+        FLAG_PLAIN = 0,
+        FLAG_COMPRESSED = 1,
+        // The flag, and the size before compression.
+        FLAG_SIZE = 1,
+        ORIGINAL_SIZE_SIZE = 4,
+        // Nothing smaller gets any smaller.
+        MIN_COMPRESS_SIZE = 16,
+        // Framing that only fits smaller batches isn't worth a transport frame.
+        MIN_MAX_BATCH_SIZE = 64,
+    };
+
+private:
+    // Returns the packet of the compressed batch, or NULL if it doesn't get smaller.
+    Packet* Compress(const WSABUF* buffers, DWORD numBuffers, DWORD size) const;
+    // Takes over frame, and returns the segment the inner frames are in from offset on, or NULL.
+    Packet* Open(Packet* frame, DWORD& offset) const;
+    DWORD GetHeaderSize() const { return m_Framer->GetPrefixSize() + FLAG_SIZE; }
+
+private:
+    const Framer* m_Framer;
+    DWORD m_MinBatchSize;
+    DWORD m_MaxBatchSize;
+};
+
+template <typename Func> bool FrameCompression::Unwrap(Packet* frame, Func onFrame) const
+{
+    assert(IsEnabled());
+
+    DWORD offset = 0;
+    Packet* segment = Open(frame, offset);
+    if (segment == NULL)
+    {
+        return false;
+    }
+
+    return m_Framer->Split(segment, offset, onFrame);
+}
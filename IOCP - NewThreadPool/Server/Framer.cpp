@@ -0,0 +1,134 @@
+#include "Framer.h"
+
+#include "common/Log.h"
+
+Framer::Framer() : m_PrefixSize(0), m_BigEndian(true), m_MaxFrameSize(DEFAULT_MAX_FRAME_SIZE) {}
+
+bool Framer::Configure(DWORD prefixSize, bool bigEndian, DWORD maxFrameSize)
+{
+    if (prefixSize != 0 && prefixSize != 1 && prefixSize != 2 && prefixSize != MAX_PREFIX_SIZE)
+    {
+        ERROR_MSG("A length prefix of %d bytes is not supported.", prefixSize);
+        return false;
+    }
+
+    // A frame has to fit in a packet, so that reassembling it never reallocates.
+    const DWORD maxPacketSize = Packet::MAX_SEGMENTS * Packet::GetMaxSegmentCapacity();
+    if (maxFrameSize == 0 || maxFrameSize > maxPacketSize)
+    {
+        maxFrameSize = maxPacketSize;
+    }
+
+    m_PrefixSize = prefixSize;
+    m_BigEndian = bigEndian;
+    m_MaxFrameSize = max(maxFrameSize, prefixSize);
+    return true;
+}
+
+/* static */ void Framer::ResetState(FrameState& state)
+{
+    state.frame = NULL;
+    state.frameSize = 0;
+    state.received = 0;
+    state.prefixSize = 0;
+}
+
+/* static */ Packet* Framer::GetRecvTarget(FrameState& state, DWORD& length)
+{
+    if (state.frame == NULL)
+    {
+        return NULL;
+    }
+
+    for (Packet* segment = state.frame; segment != NULL; segment = segment->GetNext())
+    {
+        if (segment->GetSize() < segment->GetCapacity())
+        {
+            // The last segment may have more room than the frame needs.
+            length = min(segment->GetCapacity() - segment->GetSize(),
+                         state.frameSize - state.received);
+            return segment;
+        }
+    }
+
+    assert(false);
+    return NULL;
+}
+
+DWORD Framer::DecodeLength(const BYTE* prefix) const
+{
+    DWORD length = 0;
+    for (DWORD i = 0; i < m_PrefixSize; ++i)
+    {
+        const DWORD byte = m_BigEndian ? prefix[i] : prefix[m_PrefixSize - 1 - i];
+        length = (length << 8) | byte;
+    }
+    return length;
+}
+
+bool Framer::DecodeFrameSize(const BYTE* prefix, DWORD& frameSize) const
+{
+    // Configure() keeps the maximum at least as large as the prefix.
+    const DWORD length = DecodeLength(prefix);
+    if (length > m_MaxFrameSize - m_PrefixSize)
+    {
+        return false;
+    }
+
+    frameSize = m_PrefixSize + length;
+    return true;
+}
+
+void Framer::EncodeLength(DWORD length, BYTE* prefix) const
+{
+    for (DWORD i = 0; i < m_PrefixSize; ++i)
+    {
+        const BYTE byte = static_cast<BYTE>(length >> (8 * (m_PrefixSize - 1 - i)));
+        prefix[m_BigEndian ? i : m_PrefixSize - 1 - i] = byte;
+    }
+}
+
+bool Framer::StartFrame(FrameState& state, Client* sender, DWORD frameSize, const BYTE* data,
+                        DWORD available)
+{
+    assert(state.prefixSize == m_PrefixSize);
+
+    Packet* frame = Packet::Create(sender, frameSize);
+    if (frame == NULL)
+    {
+        return false;
+    }
+
+    // Copy what has been received of the frame so far. The rest is received in place.
+    const BYTE* sources[] = { state.prefix, data };
+    DWORD sizes[] = { m_PrefixSize, available };
+
+    Packet* segment = frame;
+    for (int i = 0; i < 2; ++i)
+    {
+        const BYTE* source = sources[i];
+        DWORD size = sizes[i];
+
+        while (size > 0)
+        {
+            if (segment->GetSize() == segment->GetCapacity())
+            {
+                segment = segment->GetNext();
+                assert(segment);
+            }
+
+            const DWORD count = min(size, segment->GetCapacity() - segment->GetSize());
+            CopyMemory(segment->GetData() + segment->GetSize(), source, count);
+            segment->SetSize(segment->GetSize() + count);
+
+            source += count;
+            size -= count;
+        }
+    }
+
+    state.frame = frame;
+    state.frameSize = frameSize;
+    state.received = m_PrefixSize + available;
+    state.prefixSize = 0;
+    return true;
+}
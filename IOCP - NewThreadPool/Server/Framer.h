@@ -0,0 +1,210 @@
+#pragma once
+
+#include <Windows.h>
+#include <cassert>
+
+#include "Packet.h"
+
+// The reassembly state of one connection.
+struct FrameState
+{
+    // The frame whose rest is being received into it in place, or NULL.
+    Packet* frame;
+    DWORD frameSize;
+    DWORD received;
+    // A length prefix that was split over two receives.
+    BYTE prefix[4];
+    DWORD prefixSize;
+};
+
+// Splits the byte stream of a connection into frames that start with their length.
+// A frame is handed over along with its prefix, so that it can be sent on as it is.
+// Frames that end in one receive are views of the receive buffer, or the buffer itself if they
+// fill it. The start of a frame that doesn't is copied into a packet that fits the frame, and the
+// rest of it is received straight into that packet.
+class Framer
+{
+public:
+    enum
+    {
+        MAX_PREFIX_SIZE = 4,
+        DEFAULT_MAX_FRAME_SIZE = 64 * 1024,
+    };
+
+public:
+    Framer();
+
+    // prefixSize is 1, 2 or 4 bytes, or 0 to hand over every receive as it is.
+    // maxFrameSize includes the prefix. It is capped by the largest packet.
+    bool Configure(DWORD prefixSize, bool bigEndian, DWORD maxFrameSize);
+    bool IsEnabled() const { return m_PrefixSize > 0; }
+    DWORD GetPrefixSize() const { return m_PrefixSize; }
+    DWORD GetMaxFrameSize() const { return m_MaxFrameSize; }
+
+    // Writes the prefix of a frame of length bytes after the prefix.
+    void EncodeLength(DWORD length, BYTE* prefix) const;
+
+    static void ResetState(FrameState& state);
+
+    // Where the next receive has to go while a frame is being reassembled: the segment with room
+    // and how much of that room the frame still needs. Returns NULL if no frame is in progress.
+    static Packet* GetRecvTarget(FrameState& state, DWORD& length);
+
+    // Takes over packet, which holds bytes received into a fresh buffer, and calls onFrame(Packet*)
+    // for every frame that it completes. Returns false if a frame is over the maximum size.
+    template <typename Func> bool Feed(FrameState& state, Packet* packet, Func onFrame);
+
+    // Completes a receive into GetRecvTarget(). Calls onFrame(Packet*) if the frame is complete.
+    template <typename Func> void FeedTarget(FrameState& state, DWORD numberOfBytes, Func onFrame);
+
+    // Takes over segment, whose data from offset on is whole frames back to back, and calls
+    // onFrame(Packet*) with a view of each. Returns false if a frame is over the maximum size or
+    // cut short, in which case the frames before it have been handed over.
+    template <typename Func>
+    bool Split(Packet* segment, DWORD offset, Func onFrame) const;
+
+private:
+    DWORD DecodeLength(const BYTE* prefix) const;
+    // Sets frameSize to the size of the frame the prefix starts, prefix included. Returns false if
+    // it is over the maximum size. The length is checked before the prefix is added to it, so that
+    // a length close to 4 GB can't wrap around to a small frame.
+    bool DecodeFrameSize(const BYTE* prefix, DWORD& frameSize) const;
+    // Starts reassembling a frame out of the prefix collected in state and the available bytes.
+    bool StartFrame(FrameState& state, Client* sender, DWORD frameSize, const BYTE* data,
+                    DWORD available);
+
+private:
+    DWORD m_PrefixSize;
+    bool m_BigEndian;
+    DWORD m_MaxFrameSize;
+};
+
+template <typename Func> bool Framer::Feed(FrameState& state, Packet* packet, Func onFrame)
+{
+    assert(IsEnabled());
+    assert(state.frame == NULL);
+    assert(packet->GetNext() == NULL);
+
+    const DWORD size = packet->GetSize();
+    const BYTE* data = packet->GetData();
+    bool handedOver = false;
+    bool succeeded = true;
+
+    DWORD offset = 0;
+    while (offset < size)
+    {
+        // The prefix of a frame may have been split by the previous receive.
+        const bool prefixSplit = state.prefixSize > 0;
+        const DWORD frameStart = offset;
+
+        const DWORD prefixBytes = min(m_PrefixSize - state.prefixSize, size - offset);
+        CopyMemory(state.prefix + state.prefixSize, data + offset, prefixBytes);
+        state.prefixSize += prefixBytes;
+        offset += prefixBytes;
+
+        if (state.prefixSize < m_PrefixSize)
+        {
+            break;
+        }
+
+        DWORD frameSize = 0;
+        if (!DecodeFrameSize(state.prefix, frameSize))
+        {
+            succeeded = false;
+            break;
+        }
+
+        if (!prefixSplit && frameStart + frameSize <= size)
+        {
+            // The whole frame is in this buffer, so hand it over without copying.
+            if (frameStart == 0 && frameSize == size)
+            {
+                onFrame(packet);
+                handedOver = true;
+            }
+            else
+            {
+                onFrame(Packet::CreateView(packet, frameStart, frameSize));
+            }
+
+            state.prefixSize = 0;
+            offset = frameStart + frameSize;
+            continue;
+        }
+
+        const DWORD available = min(frameSize - m_PrefixSize, size - offset);
+        if (!StartFrame(state, packet->GetSender(), frameSize, data + offset, available))
+        {
+            succeeded = false;
+            break;
+        }
+        offset += available;
+
+        // Only a frame whose prefix was split can be complete already.
+        if (state.received == state.frameSize)
+        {
+            Packet* frame = state.frame;
+            ResetState(state);
+            onFrame(frame);
+        }
+    }
+
+    if (!handedOver)
+    {
+        Packet::Destroy(packet);
+    }
+    return succeeded;
+}
+
+template <typename Func>
+void Framer::FeedTarget(FrameState& state, DWORD numberOfBytes, Func onFrame)
+{
+    assert(state.frame != NULL);
+
+    DWORD length = 0;
+    Packet* segment = GetRecvTarget(state, length);
+    assert(segment);
+    assert(numberOfBytes <= length);
+
+    segment->SetSize(segment->GetSize() + numberOfBytes);
+    state.received += numberOfBytes;
+
+    if (state.received == state.frameSize)
+    {
+        Packet* frame = state.frame;
+        ResetState(state);
+        onFrame(frame);
+    }
+}
+
+template <typename Func> bool Framer::Split(Packet* segment, DWORD offset, Func onFrame) const
+{
+    assert(IsEnabled());
+    assert(segment->GetNext() == NULL);
+
+    const DWORD size = segment->GetSize();
+    const BYTE* data = segment->GetData();
+    bool succeeded = true;
+
+    while (offset < size)
+    {
+        if (size - offset < m_PrefixSize)
+        {
+            succeeded = false;
+            break;
+        }
+
+        DWORD frameSize = 0;
+        if (!DecodeFrameSize(data + offset, frameSize) || frameSize > size - offset)
+        {
+            succeeded = false;
+            break;
+        }
+
+        onFrame(Packet::CreateView(segment, offset, frameSize));
+        offset += frameSize;
+    }
+
+    Packet::Destroy(segment);
+    return succeeded;
+}
@@ -1,9 +1,8 @@
 #include "IOEvent.h"
 #include "Client.h"
+#include "EventTrace.h"
 #include "Packet.h"
 
-#include "common/CachedAlloc.h"
-
 namespace {
 
 CachedAlloc eventAllocator(sizeof(IOEvent));
@@ -19,11 +18,28 @@ CachedAlloc eventAllocator(sizeof(IOEvent));
 	event->m_Type = type;
 	event->m_Packet = packet;
 
+	client->AddRef();
+
+	EVENT_TRACE(KEYWORD_IO, WriteIoCreated(event, client->GetId(), type));
 	return event;	
 }
 
 /* static */ void IOEvent::Destroy(IOEvent* event)
 {
+    Client* client = event->m_Client;
+
     eventAllocator.put(event);
+
+    // This may be the last reference, so release it after we are done with the event.
+    client->Release();
 }
 
+/* static */ void IOEvent::ConfigurePool(size_t reserve, size_t highWater)
+{
+    eventAllocator.setHighWater(highWater);
+    eventAllocator.reserve(reserve);
+}
+
+/* static */ CachedAlloc::Stats IOEvent::GetPoolStats() { return eventAllocator.getStats(); }
+
+/* static */ void IOEvent::TrimPool() { eventAllocator.trim(); }
@@ -1,6 +1,8 @@
 #pragma once
 #include <winsock2.h>
 
+#include "common/CachedAlloc.h"
+
 class Client;
 class Packet;
 
@@ -11,19 +13,39 @@ public:
 	{
 		ACCEPT,
 		RECV,
+		// A receive without a buffer, which completes once the socket has data to read.
+		RECV_READY,
 		SEND,
+		DISCONNECT,
 	};
 
 public:
 	static IOEvent* Create(Type type, Client* client, Packet* packet = NULL);
 	static void Destroy(IOEvent* event);
 
+	static void ConfigurePool(size_t reserve, size_t highWater);
+	static CachedAlloc::Stats GetPoolStats();
+	static void TrimPool();
+
 public:
 	Type GetType() { return m_Type; }
 	Client* GetClient() { return m_Client; }
 	Packet* GetPacket() { return m_Packet; }
 	OVERLAPPED& GetOverlapped() { return m_Overlapped; }
 
+	// The place of a receive among the ones a client has posted ahead of each other.
+	void SetSequence(DWORD sequence) { m_Sequence = sequence; m_Sequenced = true; }
+	DWORD GetSequence() { return m_Sequence; }
+	bool IsSequenced() { return m_Sequenced; }
+
+	// What the I/O was posted for, if the client doesn't tell, e.g. an accept's listener.
+	void SetContext(PVOID context) { m_Context = context; }
+	PVOID GetContext() { return m_Context; }
+
+	// When the I/O was posted, as Metrics::Now() tells it. 0 if it isn't measured.
+	void SetPostTime(LONGLONG postTime) { m_PostTime = postTime; }
+	LONGLONG GetPostTime() { return m_PostTime; }
+
 private:
 	IOEvent();
 	~IOEvent();
@@ -32,7 +54,11 @@ private:
 
 private:
 	OVERLAPPED m_Overlapped;
-	Client* m_Client;
-	Packet* m_Packet; // only for sending.
+	Client* m_Client; // referenced until the event is destroyed.
+	Packet* m_Packet; // only for receiving and accepting. Sends are tracked by the client.
 	Type m_Type;
+	PVOID m_Context;
+	LONGLONG m_PostTime;
+	DWORD m_Sequence;
+	bool m_Sequenced;
 };
\ No newline at end of file
@@ -0,0 +1,121 @@
+#include "IoEngine.h"
+#include "Client.h"
+#include "IOEvent.h"
+#include "Packet.h"
+#include "Server.h"
+
+#include "common/Network.h"
+
+#include <cassert>
+
+void IoEngine::CloseClient(Client* client)
+{
+    assert(client);
+
+    client->Close();
+}
+
+IoEngine::PostResult IoEngine::PostRecv(Client* client, Packet* segment, DWORD offset,
+                                        DWORD length, IOEvent* event, DWORD& numberOfBytes)
+{
+    assert(client);
+    assert(segment || length == 0);
+    assert(event);
+
+    WSABUF buffer;
+    buffer.buf = segment != NULL ? reinterpret_cast<char*>(segment->GetData() + offset) : NULL;
+    buffer.len = length;
+
+    DWORD flags = 0;
+
+    StartIo(client);
+    if (WSARecv(client->GetSocket(), &buffer, 1, &numberOfBytes, &flags, &event->GetOverlapped(),
+                NULL) == SOCKET_ERROR)
+    {
+        return FinishPost(client, WSAGetLastError());
+    }
+    return FinishPost(client, ERROR_SUCCESS);
+}
+
+IoEngine::PostResult IoEngine::PostSend(Client* client, WSABUF* buffers, Packet** /* segments */,
+                                        DWORD numBuffers, IOEvent* event, DWORD& numberOfBytes)
+{
+    assert(client);
+    assert(buffers);
+    assert(event);
+
+    StartIo(client);
+    if (WSASend(client->GetSocket(), buffers, numBuffers, &numberOfBytes, 0,
+                &event->GetOverlapped(), NULL) == SOCKET_ERROR)
+    {
+        return FinishPost(client, WSAGetLastError());
+    }
+    return FinishPost(client, ERROR_SUCCESS);
+}
+
+IoEngine::PostResult IoEngine::PostTransmit(Client* client, TRANSMIT_PACKETS_ELEMENT* elements,
+                                            DWORD numElements, IOEvent* event,
+                                            DWORD& numberOfBytes)
+{
+    assert(client);
+    assert(elements);
+    assert(event);
+
+    StartIo(client);
+    if (!Network::TransmitPackets(client->GetSocket(), elements, numElements,
+                                  &event->GetOverlapped(), 0))
+    {
+        return FinishPost(client, WSAGetLastError());
+    }
+
+    // TransmitPackets() doesn't say how much it sent, but it only succeeds once it has sent it
+    // all.
+    numberOfBytes = 0;
+    for (DWORD i = 0; i < numElements; ++i)
+    {
+        numberOfBytes += elements[i].cLength;
+    }
+    return FinishPost(client, ERROR_SUCCESS);
+}
+
+IoEngine::PostResult IoEngine::PostDisconnect(Client* client, IOEvent* event)
+{
+    assert(client);
+    assert(event);
+
+    StartIo(client);
+    if (!Network::DisconnectEx(client->GetSocket(), &event->GetOverlapped(), TF_REUSE_SOCKET))
+    {
+        return FinishPost(client, WSAGetLastError());
+    }
+    return FinishPost(client, ERROR_SUCCESS);
+}
+
+/* static */ void IoEngine::Complete(IOEvent* event, ULONG result, ULONG_PTR numberOfBytes)
+{
+    Server::HandleCompletion(event, result, numberOfBytes);
+}
+
+IoEngine::PostResult IoEngine::FinishPost(Client* client, int error)
+{
+    if (error == ERROR_SUCCESS)
+    {
+        // No completion is queued for I/O that succeeded synchronously on a socket that skips
+        // the completion port.
+        if (client->IsSkippingCompletionPort())
+        {
+            AbandonIo(client);
+            return POST_COMPLETED;
+        }
+        return POST_PENDING;
+    }
+
+    if (error == ERROR_IO_PENDING)
+    {
+        return POST_PENDING;
+    }
+
+    AbandonIo(client);
+    WSASetLastError(error);
+    return POST_FAILED;
+}
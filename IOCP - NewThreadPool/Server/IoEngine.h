@@ -0,0 +1,89 @@
+#pragma once
+
+#include <winsock2.h>
+#include <mswsock.h>
+
+#include "common/NodeThreadPools.h"
+
+class Client;
+class Packet;
+class IOEvent;
+
+// How client sockets post their I/O and have it completed. Every engine hands its completions
+// to Server::HandleCompletion(), so the rest of the server is the same whichever one runs.
+// The defaults post overlapped Winsock calls, which suits every engine with a completion port
+// behind it. Those engines only have to bind the sockets.
+class IoEngine
+{
+public:
+    enum PostResult
+    {
+        // The I/O was not posted and the event still belongs to the caller. WSAGetLastError()
+        // tells why.
+        POST_FAILED,
+        // The event completes through the engine.
+        POST_PENDING,
+        // The I/O succeeded synchronously and no completion is queued for it, so the caller
+        // has to complete the event.
+        POST_COMPLETED,
+    };
+
+public:
+    IoEngine() {}
+    virtual ~IoEngine() {}
+
+    IoEngine(const IoEngine&) = delete;
+    IoEngine& operator=(const IoEngine&) = delete;
+
+    // Completions are handled on the given pools.
+    virtual bool Create(NodeThreadPools& pools) = 0;
+    virtual void Destroy() = 0;
+
+    // The WSA_FLAG_* flags the engine's sockets are created with.
+    virtual DWORD GetSocketFlags() { return 0; }
+    // Whether a socket can be disconnected with TF_REUSE_SOCKET and accepted again.
+    virtual bool CanReuseSockets() { return true; }
+    // Whether I/O that succeeds synchronously can skip the completion port.
+    virtual bool CanSkipCompletionPort() { return true; }
+    // Whether PostRecv() takes a NULL segment with a length of 0, which completes once the
+    // socket has data to read.
+    virtual bool CanRecvZeroBytes() { return true; }
+    // Whether file regions can be sent, which takes TransmitPackets() on an overlapped socket.
+    virtual bool CanTransmitFiles() { return true; }
+    // Whether the listen sockets go to the process-wide thread pool as well, bound with
+    // BindIoCompletionCallback() and refilled by QueueUserWorkItem(), instead of having a TP_IO on
+    // their node's pool.
+    virtual bool UsesSystemThreadPool() { return false; }
+
+    // Binds an accepted socket, on the client's thread pool.
+    virtual bool AttachClient(Client* client) = 0;
+    // Called once none of the client's I/O is outstanding.
+    virtual void DetachClient(Client* /* client */) {}
+    // Closes the socket, which aborts its outstanding I/O.
+    virtual void CloseClient(Client* client);
+
+    // The receive goes into length bytes of segment's data, starting at offset.
+    virtual PostResult PostRecv(Client* client, Packet* segment, DWORD offset, DWORD length,
+                                IOEvent* event, DWORD& numberOfBytes);
+    // buffers are the ones Client::PopSendBatch() has described, along with their segments.
+    virtual PostResult PostSend(Client* client, WSABUF* buffers, Packet** segments,
+                                DWORD numBuffers, IOEvent* event, DWORD& numberOfBytes);
+    // Sends the elements with TransmitPackets(). Only engines that can queue file regions take
+    // them.
+    virtual PostResult PostTransmit(Client* client, TRANSMIT_PACKETS_ELEMENT* elements,
+                                    DWORD numElements, IOEvent* event, DWORD& numberOfBytes);
+    // Disconnects the socket so that it can be accepted again.
+    virtual PostResult PostDisconnect(Client* client, IOEvent* event);
+
+protected:
+    // Tell the engine about I/O that is about to be posted on the client's socket, and about I/O
+    // that won't complete through it after all.
+    virtual void StartIo(Client* /* client */) {}
+    virtual void AbandonIo(Client* /* client */) {}
+
+    static void Complete(IOEvent* event, ULONG result, ULONG_PTR numberOfBytes);
+
+private:
+    // error is what the posting call left in WSAGetLastError(), or ERROR_SUCCESS.
+    PostResult FinishPost(Client* client, int error);
+};
@@ -0,0 +1,213 @@
+#include "IocpEngine.h"
+#include "Client.h"
+#include "IOEvent.h"
+
+#include "common/Log.h"
+
+#include <cassert>
+
+/* static */ DWORD WINAPI IocpEngine::WorkerThread(LPVOID param)
+{
+    Worker* worker = static_cast<Worker*>(param);
+    assert(worker);
+
+    worker->port->engine->DequeueCompletions(*worker);
+    return 0;
+}
+
+IocpEngine::IocpEngine(DWORD threadsPerPool, DWORD batchSize)
+    : m_ThreadPools(NULL),
+      m_ThreadsPerPool(threadsPerPool),
+      m_BatchSize(min(max(batchSize, 1UL), static_cast<DWORD>(MAX_BATCH_SIZE)))
+{
+}
+
+IocpEngine::~IocpEngine() { Destroy(); }
+
+bool IocpEngine::Create(NodeThreadPools& pools)
+{
+    m_ThreadPools = &pools;
+
+    for (int i = 0; i < pools.GetNumPools(); ++i)
+    {
+        // A thread per processor of the node. The count comes from the node's group affinity,
+        // since GetSystemInfo() only counts the processors of the calling thread's group, which
+        // is at most 64 of them.
+        DWORD threadsPerPool = m_ThreadsPerPool;
+        if (threadsPerPool == 0)
+        {
+            threadsPerPool = max(1UL, pools.GetNumProcessors(i));
+        }
+
+        Port* port = new Port();
+        port->engine = this;
+        port->pool = i;
+        m_Ports.push_back(port);
+
+        // Let all of the port's threads run at once. They are sized to the node, and each takes
+        // on the node's affinity when it opens a Scope of the pool for its first completions.
+        port->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, threadsPerPool);
+        if (port->port == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not create the completion port for pool %d.", i);
+            Destroy();
+            return false;
+        }
+
+        for (DWORD t = 0; t < threadsPerPool; ++t)
+        {
+            Worker* worker = new Worker();
+            worker->port = port;
+            worker->numDequeues = 0;
+            worker->numCompletions = 0;
+
+            worker->thread = CreateThread(NULL, 0, IocpEngine::WorkerThread, worker, 0, NULL);
+            if (worker->thread == NULL)
+            {
+                ERROR_CODE(GetLastError(), "Could not start a completion port thread.");
+                delete worker;
+                Destroy();
+                return false;
+            }
+
+            port->workers.push_back(worker);
+        }
+
+        TRACE("Completion port threads for pool %d : %u, batch : %u", i, threadsPerPool,
+              m_BatchSize);
+    }
+
+    return true;
+}
+
+void IocpEngine::Destroy()
+{
+    for (size_t i = 0; i < m_Ports.size(); ++i)
+    {
+        StopWorkers(*m_Ports[i]);
+
+        if (m_Ports[i]->port != NULL)
+        {
+            CloseHandle(m_Ports[i]->port);
+        }
+        delete m_Ports[i];
+    }
+    m_Ports.clear();
+}
+
+bool IocpEngine::AttachClient(Client* client)
+{
+    assert(client);
+    assert(!m_Ports.empty());
+
+    if (client->IsBound())
+    {
+        return true;
+    }
+
+    // The key is the socket, which GetOverlappedResult() is given for the socket's completions.
+    Port& port = *m_Ports[client->GetThreadPool()];
+    if (CreateIoCompletionPort(reinterpret_cast<HANDLE>(client->GetSocket()), port.port,
+                               static_cast<ULONG_PTR>(client->GetSocket()), 0) == NULL)
+    {
+        ERROR_CODE(GetLastError(), "Could not associate a client with its completion port.");
+        return false;
+    }
+
+    client->SetBound(true);
+    return true;
+}
+
+void IocpEngine::GetStats(DWORD& numThreads, LONGLONG& numDequeues, LONGLONG& numCompletions)
+{
+    numThreads = 0;
+    numDequeues = 0;
+    numCompletions = 0;
+
+    for (size_t i = 0; i < m_Ports.size(); ++i)
+    {
+        const std::vector<Worker*>& workers = m_Ports[i]->workers;
+        numThreads += static_cast<DWORD>(workers.size());
+
+        for (size_t w = 0; w < workers.size(); ++w)
+        {
+            numDequeues += workers[w]->numDequeues;
+            numCompletions += workers[w]->numCompletions;
+        }
+    }
+}
+
+void IocpEngine::DequeueCompletions(Worker& worker)
+{
+    Port& port = *worker.port;
+    std::vector<OVERLAPPED_ENTRY> entries(m_BatchSize);
+
+    for (;;)
+    {
+        ULONG numEntries = 0;
+        if (!GetQueuedCompletionStatusEx(port.port, &entries[0], m_BatchSize, &numEntries,
+                                         INFINITE, FALSE))
+        {
+            ERROR_CODE(GetLastError(), "GetQueuedCompletionStatusEx() failed.");
+            return;
+        }
+
+        // A packet without an OVERLAPPED tells a thread to stop.
+        ULONG numStops = 0;
+        {
+            NodeThreadPools::Scope scope(*m_ThreadPools, port.pool);
+
+            for (ULONG i = 0; i < numEntries; ++i)
+            {
+                OVERLAPPED* overlapped = entries[i].lpOverlapped;
+                if (overlapped == NULL)
+                {
+                    ++numStops;
+                    continue;
+                }
+
+                // The status is an NTSTATUS. GetOverlappedResult() translates it without
+                // waiting, since the I/O has completed.
+                DWORD result = ERROR_SUCCESS;
+                DWORD numberOfBytes = 0;
+                if (!GetOverlappedResult(reinterpret_cast<HANDLE>(entries[i].lpCompletionKey),
+                                         overlapped, &numberOfBytes, FALSE))
+                {
+                    result = GetLastError();
+                }
+
+                IOEvent* event = CONTAINING_RECORD(overlapped, IOEvent, GetOverlapped());
+                Complete(event, result, entries[i].dwNumberOfBytesTransferred);
+            }
+        }
+
+        worker.numDequeues += 1;
+        worker.numCompletions += numEntries - numStops;
+
+        if (numStops > 0)
+        {
+            // Leave the other threads theirs.
+            for (ULONG i = 1; i < numStops; ++i)
+            {
+                PostQueuedCompletionStatus(port.port, 0, 0, NULL);
+            }
+            return;
+        }
+    }
+}
+
+void IocpEngine::StopWorkers(Port& port)
+{
+    for (size_t i = 0; i < port.workers.size(); ++i)
+    {
+        PostQueuedCompletionStatus(port.port, 0, 0, NULL);
+    }
+
+    for (size_t i = 0; i < port.workers.size(); ++i)
+    {
+        WaitForSingleObject(port.workers[i]->thread, INFINITE);
+        CloseHandle(port.workers[i]->thread);
+        delete port.workers[i];
+    }
+    port.workers.clear();
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <winsock2.h>
+#include <vector>
+
+#include "IoEngine.h"
+
+// Serves clients through completion ports of our own instead of a TP_IO per socket.
+// Each NUMA node's pool has a port, which its own threads drain with
+// GetQueuedCompletionStatusEx() a batch at a time, handing the completions to
+// Server::HandleCompletion(). The I/O is posted the same way as with TP_IOs.
+class IocpEngine : public IoEngine
+{
+public:
+    enum
+    {
+        MAX_BATCH_SIZE = 1024,
+    };
+
+private:
+    struct Port;
+
+    struct Worker
+    {
+        Port* port;
+        HANDLE thread;
+        // Only the worker writes these.
+        volatile LONGLONG numDequeues;
+        volatile LONGLONG numCompletions;
+    };
+
+    struct Port
+    {
+        IocpEngine* engine;
+        int pool;
+        HANDLE port;
+        std::vector<Worker*> workers;
+    };
+
+    static DWORD WINAPI WorkerThread(LPVOID param);
+
+public:
+    // threadsPerPool of 0 starts a thread per processor of each pool's node. A thread takes up
+    // to batchSize completions off its port at a time.
+    IocpEngine(DWORD threadsPerPool, DWORD batchSize);
+    virtual ~IocpEngine();
+
+    virtual bool Create(NodeThreadPools& pools);
+    // Stops the threads. Nothing may be outstanding on the ports any more.
+    virtual void Destroy();
+
+    // Associates the client's socket with the port of its thread pool. A socket stays
+    // associated with it, so a recycled client doesn't have to be attached again.
+    virtual bool AttachClient(Client* client);
+
+    void GetStats(DWORD& numThreads, LONGLONG& numDequeues, LONGLONG& numCompletions);
+
+private:
+    void DequeueCompletions(Worker& worker);
+    void StopWorkers(Port& port);
+
+private:
+    NodeThreadPools* m_ThreadPools;
+    std::vector<Port*> m_Ports;
+    DWORD m_ThreadsPerPool;
+    DWORD m_BatchSize;
+};
@@ -0,0 +1,44 @@
+#include "LegacyPoolEngine.h"
+#include "Client.h"
+#include "IOEvent.h"
+
+#include "common/Log.h"
+
+#include <cassert>
+
+/* static */ VOID CALLBACK LegacyPoolEngine::IoCompletionCallback(DWORD dwErrorCode,
+                                                                DWORD dwNumberOfBytesTransfered,
+                                                                LPOVERLAPPED lpOverlapped)
+{
+    IOEvent* event = CONTAINING_RECORD(lpOverlapped, IOEvent, GetOverlapped());
+    assert(event);
+
+    Complete(event, dwErrorCode, dwNumberOfBytesTransfered);
+}
+
+bool LegacyPoolEngine::Create(NodeThreadPools& /* pools */) { return true; }
+
+void LegacyPoolEngine::Destroy()
+{
+    // The process-wide pool can't be waited for. The server waits for its clients instead.
+}
+
+bool LegacyPoolEngine::AttachClient(Client* client)
+{
+    assert(client);
+
+    if (client->IsBound())
+    {
+        return true;
+    }
+
+    if (!BindIoCompletionCallback(reinterpret_cast<HANDLE>(client->GetSocket()),
+                                  LegacyPoolEngine::IoCompletionCallback, 0))
+    {
+        ERROR_CODE(GetLastError(), "BindIoCompletionCallback() failed for a client.");
+        return false;
+    }
+
+    client->SetBound(true);
+    return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <winsock2.h>
+
+#include "IoEngine.h"
+
+// Binds each socket to the process-wide thread pool with BindIoCompletionCallback(), like the
+// old thread pool sample does. Its threads belong to no NUMA node's pool, so the completions
+// run outside of any NodeThreadPools scope. The listen sockets are bound the same way, and their
+// accepts are refilled with QueueUserWorkItem(). The rest of the server's work is still submitted
+// to the node pools.
+class LegacyPoolEngine : public IoEngine
+{
+private:
+    static VOID CALLBACK IoCompletionCallback(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered,
+                                              LPOVERLAPPED lpOverlapped);
+
+public:
+    virtual bool Create(NodeThreadPools& pools);
+    virtual void Destroy();
+
+    virtual bool UsesSystemThreadPool() { return true; }
+
+    // A socket can only be bound once, which lasts until it is closed.
+    virtual bool AttachClient(Client* client);
+};
@@ -1,25 +1,254 @@
 #include "Packet.h"
+#include "Client.h"
+#include "StaticFile.h"
 
-#include "common/CachedAlloc.h"
+#include "common/BufferPool.h"
+
+#include <cassert>
+#include <cstddef>
 
 namespace {
 
-CachedAlloc packetAllocator(sizeof(Packet));
+BufferPool packetPool;
 
 }
 
+/* static */ Packet* Packet::Create(Client* sender, DWORD capacity)
+{
+    if (capacity > MAX_SEGMENTS * GetMaxSegmentCapacity())
+    {
+        return NULL;
+    }
+
+    Packet* head = NULL;
+    Packet** tail = &head;
+    DWORD remaining = capacity;
+
+    do
+    {
+        Packet* segment = CreateSegment(sender, min(remaining, GetMaxSegmentCapacity()));
+        *tail = segment;
+        tail = &segment->m_Next;
+
+        remaining -= min(remaining, segment->m_Capacity);
+    } while (remaining > 0);
+
+    return head;
+}
+
 /* static */ Packet* Packet::Create(Client* sender, const BYTE* buff, DWORD size)
 {
-    Packet* packet = static_cast<Packet*>(packetAllocator.get());
-	packet->m_Sender = sender; 
-	packet->m_Size = size;
-	CopyMemory(packet->m_Data, buff, size);
+    Packet* packet = Create(sender, size);
+    if (packet == NULL)
+    {
+        return NULL;
+    }
+
+    for (Packet* segment = packet; segment != NULL && size > 0; segment = segment->m_Next)
+    {
+        segment->m_Size = min(size, segment->m_Capacity);
+        CopyMemory(segment->m_Data, buff, segment->m_Size);
+
+        buff += segment->m_Size;
+        size -= segment->m_Size;
+    }
+
+    return packet;
+}
+
+/* static */ Packet* Packet::CreateView(Packet* segment, DWORD offset, DWORD size)
+{
+    assert(segment);
+    assert(offset + size <= segment->m_Size);
+
+    // A file region only has to reference the file.
+    if (segment->m_File != NULL)
+    {
+        return CreateFileRegion(segment->m_File, segment->m_FileOffset + offset, size);
+    }
+
+    // A view of a view looks straight into the segment that has the data.
+    Packet* owner = segment->m_Owner != NULL ? segment->m_Owner : segment;
+    InterlockedIncrement(&owner->m_RefCount);
+
+    Packet* view = static_cast<Packet*>(packetPool.get(GetHeaderSize()));
+    view->m_Sender = segment->m_Sender;
+    view->m_Next = NULL;
+    view->m_Owner = owner;
+    view->m_RefCount = 1;
+    view->m_Size = size;
+    view->m_Capacity = size;
+    view->m_Begin = segment->m_Begin + offset;
+    view->m_File = NULL;
+    view->m_FileOffset = 0;
+
+    if (view->m_Sender != NULL)
+    {
+        view->m_Sender->AddRef();
+    }
 
-	return packet;
+    return view;
+}
+
+/* static */ Packet* Packet::CreateShared(Packet* packet)
+{
+    assert(packet);
+
+    Packet* head = NULL;
+    Packet** tail = &head;
+
+    for (Packet* segment = packet; segment != NULL; segment = segment->m_Next)
+    {
+        *tail = CreateView(segment, 0, segment->m_Size);
+        tail = &(*tail)->m_Next;
+    }
+
+    return head;
+}
+
+/* static */ Packet* Packet::CreateFileRegion(StaticFile* file, ULONGLONG offset, DWORD size)
+{
+    assert(file);
+    assert(offset + size <= file->GetSize());
+
+    file->AddRef();
+
+    Packet* region = static_cast<Packet*>(packetPool.get(GetHeaderSize()));
+    region->m_Sender = NULL;
+    region->m_Next = NULL;
+    region->m_Owner = NULL;
+    region->m_RefCount = 1;
+    region->m_Size = size;
+    region->m_Capacity = size;
+    region->m_Begin = file->GetView() != NULL ? const_cast<BYTE*>(file->GetView()) + offset : NULL;
+    region->m_File = file;
+    region->m_FileOffset = offset;
+
+    return region;
 }
 
 /* static */ void Packet::Destroy(Packet* packet)
 {
-    packetAllocator.put(packet);
+    while (packet != NULL)
+    {
+        Packet* next = packet->m_Next;
+        ReleaseSegment(packet);
+        packet = next;
+    }
+}
+
+/* static */ DWORD Packet::GetMaxSegmentCapacity()
+{
+    return static_cast<DWORD>(BufferPool::MAX_BLOCK_SIZE - GetHeaderSize());
+}
+
+/* static */ DWORD Packet::GetSegmentCapacityForBlock(DWORD blockSize)
+{
+    return static_cast<DWORD>(BufferPool::getFittingBlockSize(blockSize) - GetHeaderSize());
+}
+
+/* static */ void Packet::ConfigurePool(DWORD capacity, size_t reserve, size_t highWater)
+{
+    packetPool.setHighWater(GetHeaderSize() + capacity, highWater);
+    packetPool.reserve(GetHeaderSize() + capacity, reserve);
+}
+
+/* static */ CachedAlloc::Stats Packet::GetPoolStats(DWORD capacity)
+{
+    return packetPool.getStats(GetHeaderSize() + capacity);
+}
+
+/* static */ void Packet::TrimPools() { packetPool.trim(); }
+
+/* static */ void Packet::ReleaseSegment(Packet* segment)
+{
+    if (InterlockedDecrement(&segment->m_RefCount) != 0)
+    {
+        return;
+    }
+
+    Client* sender = segment->m_Sender;
+    Packet* owner = segment->m_Owner;
+    StaticFile* file = segment->m_File;
+
+    // Views and file regions are only a header.
+    packetPool.put(segment, owner != NULL || file != NULL
+                                ? GetHeaderSize()
+                                : GetHeaderSize() + segment->m_Capacity);
+
+    if (owner != NULL)
+    {
+        ReleaseSegment(owner);
+    }
+
+    if (file != NULL)
+    {
+        file->Release();
+    }
+
+    if (sender != NULL)
+    {
+        sender->Release();
+    }
+}
+
+/* static */ void Packet::SetSlabObserver(SlabObserver* observer)
+{
+    packetPool.setSlabObserver(observer);
+}
+
+/* static */ BYTE* Packet::GetSlab(Packet* segment, ULONG_PTR& tag)
+{
+    // A view's data is in its owner's block, which may not be in the view's slab.
+    return CachedAlloc::getSlab(segment->m_Owner != NULL ? segment->m_Owner : segment, tag);
+}
+
+DWORD Packet::GetTotalSize() const
+{
+    DWORD size = 0;
+    for (const Packet* segment = this; segment != NULL; segment = segment->m_Next)
+    {
+        size += segment->m_Size;
+    }
+    return size;
+}
+
+DWORD Packet::GetPooledSize() const
+{
+    DWORD size = 0;
+    for (const Packet* segment = this; segment != NULL; segment = segment->m_Next)
+    {
+        if (segment->m_File == NULL)
+        {
+            size += segment->m_Size;
+        }
+    }
+    return size;
+}
+
+/* static */ Packet* Packet::CreateSegment(Client* sender, DWORD capacity)
+{
+    // Use the whole block, since the rest of its size class would be wasted anyway.
+    const size_t blockSize = BufferPool::getBlockSize(GetHeaderSize() + capacity);
+    assert(blockSize != 0);
+
+    Packet* packet = static_cast<Packet*>(packetPool.get(blockSize));
+    packet->m_Sender = sender;
+    packet->m_Next = NULL;
+    packet->m_Owner = NULL;
+    packet->m_RefCount = 1;
+    packet->m_Size = 0;
+    packet->m_Capacity = static_cast<DWORD>(blockSize - GetHeaderSize());
+    packet->m_Begin = packet->m_Data;
+    packet->m_File = NULL;
+    packet->m_FileOffset = 0;
+
+    if (sender != NULL)
+    {
+        sender->AddRef();
+    }
+
+    return packet;
 }
 
+/* static */ size_t Packet::GetHeaderSize() { return offsetof(Packet, m_Data); }
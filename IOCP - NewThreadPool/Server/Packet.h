@@ -1,23 +1,75 @@
 #pragma once
 #include <Windows.h>
 
+#include "common/CachedAlloc.h"
+
 class Client;
+class StaticFile;
+
+// A packet is one or more segments, each drawn from the size class that fits it.
+// Every segment references the sender until it is destroyed. Packets the server sends on its own
+// have no sender.
+// A view is a segment that shares part of another segment's data instead of having its own. The
+// segment it looks into lives until all of its views are destroyed.
+// A file region is a segment of a StaticFile's data. It has no data in memory unless the file has
+// been mapped, in which case its data is in the view of the file.
 class Packet
 {
-private:
+public:
 	enum
 	{
-		MAX_BUFF_SIZE = 1024,
+		MAX_SEGMENTS = 16,
 	};
 	
 public:
+	// Creates an empty packet with room for at least capacity bytes that a receive fills in place.
+	// Capacities that don't fit in one segment are chained. Returns NULL if they don't fit in
+	// MAX_SEGMENTS either.
+	static Packet* Create(Client* sender, DWORD capacity);
+	// Creates a packet holding a copy of buff.
 	static Packet* Create(Client* sender, const BYTE* buff, DWORD size);
+	// Creates a single segment packet of size bytes of segment's data, starting at offset.
+	static Packet* CreateView(Packet* segment, DWORD offset, DWORD size);
+	// Creates a packet of views of all of packet's segments, so that the same payload can be
+	// queued on many sends without being copied.
+	static Packet* CreateShared(Packet* packet);
+	// Creates a single segment packet without a sender of size bytes of file, starting at offset.
+	static Packet* CreateFileRegion(StaticFile* file, ULONGLONG offset, DWORD size);
 	static void Destroy(Packet* packet);
 
+	// The largest capacity of a single segment.
+	static DWORD GetMaxSegmentCapacity();
+	// The capacity of a segment that takes up at most blockSize bytes of pool memory.
+	static DWORD GetSegmentCapacityForBlock(DWORD blockSize);
+
+	// These apply to the pool that serves segments of the given capacity.
+	static void ConfigurePool(DWORD capacity, size_t reserve, size_t highWater);
+	static CachedAlloc::Stats GetPoolStats(DWORD capacity);
+	static void TrimPools();
+
+	// Registers the pool's slabs with observer, e.g. for Registered I/O.
+	static void SetSlabObserver(SlabObserver* observer);
+	// The slab a segment lives in, along with the observer's tag for it.
+	static BYTE* GetSlab(Packet* segment, ULONG_PTR& tag);
+
 public:
 	Client* GetSender() const { return m_Sender; }
+	Packet* GetNext() const { return m_Next; }
     DWORD GetSize() const { return m_Size; }
-	BYTE* GetData() { return m_Data; }
+	void SetSize(DWORD size) { m_Size = size; }
+	DWORD GetCapacity() const { return m_Capacity; }
+	BYTE* GetData() { return m_Begin; }
+
+	// The size over all the segments.
+	DWORD GetTotalSize() const;
+	// The size of the segments whose data is in pool memory, which leaves out file regions.
+	DWORD GetPooledSize() const;
+
+	// The file of a file region, or NULL.
+	StaticFile* GetFile() const { return m_File; }
+	ULONGLONG GetFileOffset() const { return m_FileOffset; }
+	// Whether the data is only in the file, which only TransmitPackets() can send.
+	bool IsUnmapped() const { return m_File != NULL && m_Begin == NULL; }
 
 private:
 	Packet();
@@ -25,8 +77,19 @@ private:
     Packet(const Packet&) = delete;
     Packet& operator=(const Packet&) = delete;
 
+	static Packet* CreateSegment(Client* sender, DWORD capacity);
+	static void ReleaseSegment(Packet* segment);
+	static size_t GetHeaderSize();
+
 private:
-	Client* m_Sender;
+	Client* m_Sender; // referenced until the packet is destroyed.
+	Packet* m_Next; // the next segment of the same payload.
+	Packet* m_Owner; // the segment a view looks into, or NULL.
+	volatile long m_RefCount; // the segment itself and each view of it.
 	DWORD m_Size;
-	BYTE m_Data[MAX_BUFF_SIZE];
+	DWORD m_Capacity;
+	BYTE* m_Begin; // m_Data, or the owner's data a view starts at. NULL for unmapped file regions.
+	StaticFile* m_File; // referenced until the packet is destroyed.
+	ULONGLONG m_FileOffset;
+	BYTE m_Data[1]; // m_Capacity bytes, allocated along with the header. Views have none.
 };
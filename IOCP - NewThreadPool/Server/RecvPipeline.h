@@ -0,0 +1,109 @@
+#pragma once
+
+#include <Windows.h>
+#include <cassert>
+
+#include "Client.h"
+#include "Framer.h"
+#include "Packet.h"
+#include "Server.h"
+
+// A receive handler put together from policies at compile time. Decoding and handling the frames
+// are compiled into the server's dispatch for the Dispatch policy, so a receive reaches them
+// through the one dispatcher the server calls per receive, with neither a switch on the policy nor
+// a function pointer per packet. Receives queued for DISPATCH_BATCHED or DISPATCH_STRAND take one
+// more call when they run on the pool, to the pipeline they were dispatched for.
+//
+// Framing sets up the server's framer, and has
+//   static bool Configure(Server& server);
+// Codec turns a frame into what the handler gets in place, and has
+//   static bool Decode(Packet* packet);
+// which returns false to drop the packet. Dropped packets are destroyed.
+// Handler takes over the packets that are left, all from the same client and in order, and has
+//   static void Handle(Server& server, Packet** packets, DWORD numPackets);
+// Dispatch is where the server hands the receives to the pipeline.
+//
+// The policies have no state, so one pipeline can serve any number of servers. A handler that
+// keeps state per server looks it up by the server it is given.
+template <typename Framing, typename Codec, typename Handler, Server::DispatchPolicy Dispatch>
+class RecvPipeline
+{
+public:
+    // Sets up the server's framing and makes the pipeline its receive handler. Framing that
+    // changes the server's has to be installed before Create().
+    static bool Install(Server& server)
+    {
+        if (!Framing::Configure(server))
+        {
+            return false;
+        }
+
+        server.SetRecvPipeline<RecvPipeline, Dispatch>();
+        return true;
+    }
+
+    static void Run(Packet** packets, DWORD numPackets)
+    {
+        assert(packets);
+        assert(numPackets > 0);
+
+        // The packets hold references to their sender, which is served by the server that gets
+        // them.
+        Server* server = packets[0]->GetSender()->GetServer();
+        assert(server);
+
+        DWORD numDecoded = 0;
+        for (DWORD i = 0; i < numPackets; ++i)
+        {
+            if (Codec::Decode(packets[i]))
+            {
+                packets[numDecoded++] = packets[i];
+            }
+            else
+            {
+                Packet::Destroy(packets[i]);
+            }
+        }
+
+        if (numDecoded > 0)
+        {
+            Handler::Handle(*server, packets, numDecoded);
+        }
+    }
+
+private:
+    RecvPipeline() = delete;
+};
+
+// Leaves the framing the server has been given, so the pipeline can be installed at any time.
+struct ConfiguredFraming
+{
+    static bool Configure(Server& /* server */) { return true; }
+};
+
+// Frames that start with a length of PrefixSize bytes. A PrefixSize of 0 hands over every receive
+// as it is.
+template <DWORD PrefixSize, bool BigEndian = true,
+          DWORD MaxFrameSize = Framer::DEFAULT_MAX_FRAME_SIZE>
+struct LengthPrefixFraming
+{
+    static bool Configure(Server& server)
+    {
+        return server.SetFraming(PrefixSize, BigEndian, MaxFrameSize);
+    }
+};
+
+// Hands the frames over as they have been received.
+struct PlainCodec
+{
+    static bool Decode(Packet* /* packet */) { return true; }
+};
+
+// Sends the packets back to their sender with a single send.
+struct EchoRecv
+{
+    static void Handle(Server& server, Packet** packets, DWORD numPackets)
+    {
+        server.Echo(packets, numPackets);
+    }
+};
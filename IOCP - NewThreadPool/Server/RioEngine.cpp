@@ -0,0 +1,408 @@
+#include "RioEngine.h"
+#include "Client.h"
+#include "Packet.h"
+#include "IOEvent.h"
+
+#include "common/Log.h"
+#include "common/Network.h"
+#include "common/CritSecLock.h"
+
+#include <cassert>
+
+/* static */ void CALLBACK RioEngine::WorkerDequeueCompletions(PTP_CALLBACK_INSTANCE /* Instance */,
+                                                              PVOID Context, PTP_WAIT /* Wait */,
+                                                              TP_WAIT_RESULT /* WaitResult */)
+{
+    CompletionQueue* queue = static_cast<CompletionQueue*>(Context);
+    assert(queue);
+
+    NodeThreadPools::Scope scope(*queue->engine->m_ThreadPools, queue->pool);
+
+    queue->engine->DequeueCompletions(*queue);
+}
+
+RioEngine::RioEngine(DWORD recvDepth)
+    : m_ThreadPools(NULL),
+      m_RecvDepth(recvDepth),
+      m_NextQueue(0),
+      m_Created(false),
+      m_Stopping(false)
+{
+    assert(recvDepth > 0 && recvDepth <= Client::MAX_RECV_DEPTH);
+
+    ZeroMemory(&m_Functions, sizeof(m_Functions));
+
+    for (int i = 0; i < NUM_RQ_LOCKS; ++i)
+    {
+        InitializeCriticalSection(&m_RQLocks[i]);
+    }
+}
+
+RioEngine::~RioEngine()
+{
+    Destroy();
+
+    for (int i = 0; i < NUM_RQ_LOCKS; ++i)
+    {
+        DeleteCriticalSection(&m_RQLocks[i]);
+    }
+}
+
+bool RioEngine::Create(NodeThreadPools& pools)
+{
+    m_ThreadPools = &pools;
+
+    if (!Network::LoadRio(m_Functions))
+    {
+        ERROR_MSG("Registered I/O is not available.");
+        return false;
+    }
+
+    m_Created = true;
+    m_Stopping = false;
+
+    // Every packet is sent from and received into a registered slab.
+    Packet::SetSlabObserver(this);
+
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+
+    // Processors are numbered node by node, so spread the queues over the pools the same way.
+    for (DWORD i = 0; i < systemInfo.dwNumberOfProcessors; ++i)
+    {
+        const int pool = static_cast<int>(i * pools.GetNumPools() / systemInfo.dwNumberOfProcessors);
+
+        CompletionQueue* queue = new CompletionQueue();
+        if (!CreateCompletionQueue(*queue, pool))
+        {
+            delete queue;
+            Destroy();
+            return false;
+        }
+
+        m_Queues.push_back(queue);
+    }
+
+    TRACE("RIO completion queues : %d", static_cast<int>(m_Queues.size()));
+
+    return true;
+}
+
+void RioEngine::Destroy()
+{
+    // Keep the waits from being set again while they are being closed.
+    m_Stopping = true;
+
+    for (size_t i = 0; i < m_Queues.size(); ++i)
+    {
+        DestroyCompletionQueue(*m_Queues[i]);
+        delete m_Queues[i];
+    }
+    m_Queues.clear();
+
+    // This deregisters every slab that is still registered.
+    if (m_Created)
+    {
+        Packet::SetSlabObserver(NULL);
+        m_Created = false;
+    }
+}
+
+bool RioEngine::AttachClient(Client* client)
+{
+    assert(client);
+    assert(!m_Queues.empty());
+
+    const int index = static_cast<int>(static_cast<DWORD>(InterlockedIncrement(&m_NextQueue)) %
+                                       m_Queues.size());
+    CompletionQueue& queue = *m_Queues[index];
+
+    CritSecLock lock(queue.cs);
+
+    // A completion queue that overflows is corrupted, so make room before the client can post.
+    const DWORD required = (queue.numClients + 1) * GetCQEntriesPerClient();
+    if (required > queue.capacity)
+    {
+        const DWORD capacity = min(max(required, queue.capacity * 2), RIO_MAX_CQ_SIZE);
+        if (capacity < required || !m_Functions.RIOResizeCompletionQueue(queue.cq, capacity))
+        {
+            ERROR_CODE(WSAGetLastError(), "RIOResizeCompletionQueue() failed.");
+            return false;
+        }
+        queue.capacity = capacity;
+    }
+
+    RIO_RQ rq = m_Functions.RIOCreateRequestQueue(client->GetSocket(), m_RecvDepth, 1,
+                                                  Client::MAX_SEND_BUFFERS, 1, queue.cq, queue.cq,
+                                                  client);
+    if (rq == RIO_INVALID_RQ)
+    {
+        ERROR_CODE(WSAGetLastError(), "RIOCreateRequestQueue() failed.");
+        return false;
+    }
+
+    ++queue.numClients;
+    client->SetRioQueue(rq, index);
+
+    return true;
+}
+
+void RioEngine::DetachClient(Client* client)
+{
+    assert(client);
+
+    const int index = client->GetRioWorker();
+    if (index < 0)
+    {
+        return;
+    }
+
+    CompletionQueue& queue = *m_Queues[index];
+    {
+        CritSecLock lock(queue.cs);
+
+        assert(queue.numClients > 0);
+        --queue.numClients;
+    }
+
+    client->SetRioQueue(RIO_INVALID_RQ, -1);
+}
+
+void RioEngine::CloseClient(Client* client)
+{
+    assert(client);
+
+    CritSecLock lock(GetRQLock(client));
+
+    client->Close();
+}
+
+IoEngine::PostResult RioEngine::PostRecv(Client* client, Packet* segment, DWORD offset,
+                                         DWORD length, IOEvent* event, DWORD& /* numberOfBytes */)
+{
+    assert(client);
+    assert(segment);
+    assert(event);
+
+    RIO_BUF buf;
+    GetRioBuf(segment, length, buf);
+    buf.Offset += offset;
+
+    CritSecLock lock(GetRQLock(client));
+
+    // The socket may have been closed since the receive was requested.
+    if (client->GetRioRQ() == RIO_INVALID_RQ)
+    {
+        WSASetLastError(WSAENOTSOCK);
+        return POST_FAILED;
+    }
+
+    if (!m_Functions.RIOReceive(client->GetRioRQ(), &buf, 1, 0, event))
+    {
+        return POST_FAILED;
+    }
+    return POST_PENDING;
+}
+
+IoEngine::PostResult RioEngine::PostSend(Client* client, WSABUF* /* buffers */, Packet** segments,
+                                         DWORD numSegments, IOEvent* event,
+                                         DWORD& /* numberOfBytes */)
+{
+    assert(client);
+    assert(segments);
+    assert(numSegments > 0);
+    assert(event);
+
+    CritSecLock lock(GetRQLock(client));
+
+    if (client->GetRioRQ() == RIO_INVALID_RQ)
+    {
+        WSASetLastError(WSAENOTSOCK);
+        return POST_FAILED;
+    }
+
+    // A send takes a single buffer, so queue one per segment and start them together. Only the
+    // last one carries the event, since the others complete before it.
+    for (DWORD i = 0; i < numSegments; ++i)
+    {
+        RIO_BUF buf;
+        GetRioBuf(segments[i], segments[i]->GetSize(), buf);
+
+        const bool last = i == numSegments - 1;
+        if (!m_Functions.RIOSend(client->GetRioRQ(), &buf, 1, last ? 0 : RIO_MSG_DEFER,
+                                 last ? event : NULL))
+        {
+            // Start whatever has been queued already, which references packets that stay in the
+            // outstanding send until the client aborts it.
+            if (i > 0)
+            {
+                const int error = WSAGetLastError();
+                m_Functions.RIOSend(client->GetRioRQ(), NULL, 0, RIO_MSG_COMMIT_ONLY, NULL);
+                WSASetLastError(error);
+            }
+            return POST_FAILED;
+        }
+    }
+
+    return POST_PENDING;
+}
+
+/* virtual */ ULONG_PTR RioEngine::OnSlabAllocated(BYTE* base, size_t size)
+{
+    RIO_BUFFERID id = m_Functions.RIORegisterBuffer(reinterpret_cast<PCHAR>(base),
+                                                    static_cast<DWORD>(size));
+    if (id == RIO_INVALID_BUFFERID)
+    {
+        ERROR_CODE(WSAGetLastError(), "RIORegisterBuffer() failed.");
+    }
+
+    return reinterpret_cast<ULONG_PTR>(id);
+}
+
+/* virtual */ void RioEngine::OnSlabFreed(ULONG_PTR tag)
+{
+    RIO_BUFFERID id = reinterpret_cast<RIO_BUFFERID>(tag);
+    if (id != RIO_INVALID_BUFFERID)
+    {
+        m_Functions.RIODeregisterBuffer(id);
+    }
+}
+
+void RioEngine::DequeueCompletions(CompletionQueue& queue)
+{
+    RIORESULT results[MAX_RESULTS];
+
+    for (;;)
+    {
+        ULONG numResults = 0;
+        {
+            CritSecLock lock(queue.cs);
+
+            numResults = m_Functions.RIODequeueCompletion(queue.cq, results, MAX_RESULTS);
+            if (numResults == 0)
+            {
+                // Ask for the event to be signaled by the next completion, then wait for it.
+                if (!m_Stopping)
+                {
+                    m_Functions.RIONotify(queue.cq);
+                    SetThreadpoolWait(queue.wait, queue.hEvent, NULL);
+                }
+                return;
+            }
+        }
+
+        if (numResults == RIO_CORRUPT_CQ)
+        {
+            ERROR_MSG("RIO completion queue is corrupted.");
+            return;
+        }
+
+        for (ULONG i = 0; i < numResults; ++i)
+        {
+            IOEvent* event =
+                reinterpret_cast<IOEvent*>(static_cast<ULONG_PTR>(results[i].RequestContext));
+            if (event == NULL)
+            {
+                // One of the leading segments of a send. The last one reports for all of them.
+                if (results[i].Status != 0)
+                {
+                    ERROR_CODE(results[i].Status, "RIOSend() of a segment failed.");
+                }
+                continue;
+            }
+
+            Complete(event, results[i].Status != 0 ? results[i].Status : ERROR_SUCCESS,
+                     results[i].BytesTransferred);
+        }
+    }
+}
+
+bool RioEngine::CreateCompletionQueue(CompletionQueue& queue, int pool)
+{
+    queue.engine = this;
+    queue.pool = pool;
+    queue.cq = RIO_INVALID_CQ;
+    queue.wait = NULL;
+    queue.capacity = GetCQEntriesPerClient();
+    queue.numClients = 0;
+    InitializeCriticalSection(&queue.cs);
+
+    queue.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (queue.hEvent == NULL)
+    {
+        ERROR_CODE(GetLastError(), "Could not create the event for a RIO completion queue.");
+        DestroyCompletionQueue(queue);
+        return false;
+    }
+
+    RIO_NOTIFICATION_COMPLETION notification;
+    notification.Type = RIO_EVENT_COMPLETION;
+    notification.Event.EventHandle = queue.hEvent;
+    notification.Event.NotifyReset = TRUE;
+
+    queue.cq = m_Functions.RIOCreateCompletionQueue(queue.capacity, &notification);
+    if (queue.cq == RIO_INVALID_CQ)
+    {
+        ERROR_CODE(WSAGetLastError(), "RIOCreateCompletionQueue() failed.");
+        DestroyCompletionQueue(queue);
+        return false;
+    }
+
+    queue.wait = CreateThreadpoolWait(RioEngine::WorkerDequeueCompletions, &queue,
+                                      m_ThreadPools->GetEnvironment(pool));
+    if (queue.wait == NULL)
+    {
+        ERROR_CODE(GetLastError(), "Could not create the wait for a RIO completion queue.");
+        DestroyCompletionQueue(queue);
+        return false;
+    }
+
+    m_Functions.RIONotify(queue.cq);
+    SetThreadpoolWait(queue.wait, queue.hEvent, NULL);
+
+    return true;
+}
+
+void RioEngine::DestroyCompletionQueue(CompletionQueue& queue)
+{
+    if (queue.wait != NULL)
+    {
+        SetThreadpoolWait(queue.wait, NULL, NULL);
+        WaitForThreadpoolWaitCallbacks(queue.wait, TRUE);
+        CloseThreadpoolWait(queue.wait);
+        queue.wait = NULL;
+    }
+
+    if (queue.cq != RIO_INVALID_CQ)
+    {
+        m_Functions.RIOCloseCompletionQueue(queue.cq);
+        queue.cq = RIO_INVALID_CQ;
+    }
+
+    if (queue.hEvent != NULL)
+    {
+        CloseHandle(queue.hEvent);
+        queue.hEvent = NULL;
+    }
+
+    DeleteCriticalSection(&queue.cs);
+}
+
+CRITICAL_SECTION& RioEngine::GetRQLock(Client* client)
+{
+    // Clients are allocated separately, so the low bits of the address carry little.
+    const ULONG_PTR hash = reinterpret_cast<ULONG_PTR>(client) >> 6;
+    return m_RQLocks[hash % NUM_RQ_LOCKS];
+}
+
+DWORD RioEngine::GetCQEntriesPerClient() { return m_RecvDepth + Client::MAX_SEND_BUFFERS; }
+
+/* static */ void RioEngine::GetRioBuf(Packet* segment, DWORD length, RIO_BUF& buf)
+{
+    ULONG_PTR tag = 0;
+    BYTE* base = Packet::GetSlab(segment, tag);
+
+    buf.BufferId = reinterpret_cast<RIO_BUFFERID>(tag);
+    buf.Offset = static_cast<ULONG>(segment->GetData() - base);
+    buf.Length = length;
+}
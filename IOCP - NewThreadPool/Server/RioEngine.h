@@ -0,0 +1,99 @@
+#pragma once
+
+#include <winsock2.h>
+#include <mswsock.h>
+#include <vector>
+
+#include "IoEngine.h"
+#include "common/CachedAlloc.h"
+
+// Serves clients with Registered I/O instead of a TP_IO per socket.
+// Packets are received into and sent from the packet pool's slabs, which are registered as RIO
+// buffers as they are allocated. Each processor has a completion queue that a thread pool wait
+// drains once its event is signaled, handing the completions to Server::HandleCompletion().
+class RioEngine : public IoEngine, public SlabObserver
+{
+private:
+    enum
+    {
+        // Completions taken off a queue at a time.
+        MAX_RESULTS = 256,
+        NUM_RQ_LOCKS = 64,
+    };
+
+    struct CompletionQueue
+    {
+        RioEngine* engine;
+        int pool;
+        RIO_CQ cq;
+        HANDLE hEvent;
+        TP_WAIT* wait;
+        // Serializes dequeueing with resizing the queue for a new client.
+        CRITICAL_SECTION cs;
+        DWORD capacity;
+        DWORD numClients;
+    };
+
+    static void CALLBACK WorkerDequeueCompletions(PTP_CALLBACK_INSTANCE /* Instance */,
+                                                  PVOID Context, PTP_WAIT /* Wait */,
+                                                  TP_WAIT_RESULT /* WaitResult */);
+
+public:
+    // A request queue takes up to recvDepth receives at a time.
+    explicit RioEngine(DWORD recvDepth = 1);
+    virtual ~RioEngine();
+
+    // The completion queues are drained on the given pools.
+    virtual bool Create(NodeThreadPools& pools);
+    virtual void Destroy();
+
+    virtual DWORD GetSocketFlags() { return WSA_FLAG_REGISTERED_IO; }
+    // A request queue can't be created for a socket twice.
+    virtual bool CanReuseSockets() { return false; }
+    virtual bool CanSkipCompletionPort() { return false; }
+    // Receives always go into a registered buffer.
+    virtual bool CanRecvZeroBytes() { return false; }
+    // Sends always come from a registered buffer.
+    virtual bool CanTransmitFiles() { return false; }
+
+    // Creates the client's request queue on one of the completion queues.
+    virtual bool AttachClient(Client* client);
+    // Gives back the client's room in its completion queue once none of its I/O is outstanding.
+    virtual void DetachClient(Client* client);
+    // Closes the socket, which frees its request queue and aborts its outstanding I/O.
+    virtual void CloseClient(Client* client);
+
+    // Requests always complete through a completion queue, so these never return
+    // POST_COMPLETED.
+    virtual PostResult PostRecv(Client* client, Packet* segment, DWORD offset, DWORD length,
+                                IOEvent* event, DWORD& numberOfBytes);
+    // Each segment is sent from its slab, so the buffers aren't needed.
+    virtual PostResult PostSend(Client* client, WSABUF* buffers, Packet** segments,
+                                DWORD numBuffers, IOEvent* event, DWORD& numberOfBytes);
+
+public:
+    // SlabObserver
+    virtual ULONG_PTR OnSlabAllocated(BYTE* base, size_t size);
+    virtual void OnSlabFreed(ULONG_PTR tag);
+
+private:
+    void DequeueCompletions(CompletionQueue& queue);
+    bool CreateCompletionQueue(CompletionQueue& queue, int pool);
+    void DestroyCompletionQueue(CompletionQueue& queue);
+
+    // RIO doesn't serialize the requests on a request queue, so they are posted under one of these.
+    CRITICAL_SECTION& GetRQLock(Client* client);
+    // Room in a completion queue for everything one client can have outstanding.
+    DWORD GetCQEntriesPerClient();
+    static void GetRioBuf(Packet* segment, DWORD length, RIO_BUF& buf);
+
+private:
+    RIO_EXTENSION_FUNCTION_TABLE m_Functions;
+    NodeThreadPools* m_ThreadPools;
+    DWORD m_RecvDepth;
+    std::vector<CompletionQueue*> m_Queues;
+    volatile long m_NextQueue;
+    CRITICAL_SECTION m_RQLocks[NUM_RQ_LOCKS];
+    bool m_Created;
+    volatile bool m_Stopping;
+};
@@ -1,58 +1,90 @@
 #include "Server.h"
 #include "Client.h"
-#include "Packet.h"
+#include "EventTrace.h"
 #include "IOEvent.h"
+#include "IoEngine.h"
+#include "Packet.h"
+#include "StaticFile.h"
 
 #include "common/Log.h"
 #include "common/Network.h"
 #include "common/CritSecLock.h"
+#include "common/InlineCompletion.h"
+#include "common/Metrics.h"
 
-#include <iostream>
-#include <cassert>
 #include <algorithm>
+#include <cassert>
 
-/* static */ void CALLBACK
-Server::IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */, PVOID /* Context */,
-                             PVOID Overlapped, ULONG IoResult, ULONG_PTR NumberOfBytesTransferred,
-                             PTP_IO /* Io */)
+/* static */ void Server::HandleCompletion(IOEvent* event, ULONG IoResult,
+                                           ULONG_PTR NumberOfBytesTransferred)
 {
-    IOEvent* event = CONTAINING_RECORD(Overlapped, IOEvent, GetOverlapped());
     assert(event);
 
+    // Every client is served by the server that accepted it.
+    Server* server = event->GetClient()->GetServer();
+    assert(server);
+
+    EVENT_TRACE(KEYWORD_IO, WriteIoCompleted(event, event->GetClient()->GetId(), event->GetType(),
+                                             static_cast<DWORD>(NumberOfBytesTransferred),
+                                             IoResult));
+
     if (IoResult != ERROR_SUCCESS)
     {
         ERROR_CODE(IoResult, "I/O operation failed. type[%d]", event->GetType());
+        Metrics::RecordFailure(IoResult);
 
         switch (event->GetType())
         {
+        case IOEvent::RECV:
+        case IOEvent::RECV_READY:
+            server->EndRecv(event);
+            break;
+
         case IOEvent::SEND:
-            Server::Instance()->OnSend(event, NumberOfBytesTransferred);
+            event->GetClient()->AbortSends();
+            server->OnClose(event);
+            break;
+
+        case IOEvent::DISCONNECT:
+            server->OnDisconnect(event, false);
             break;
-        }
 
-        Server::Instance()->OnClose(event);
+        default:
+            server->OnClose(event);
+            break;
+        }
     }
     else
     {
         switch (event->GetType())
         {
-        case IOEvent::ACCEPT:
-            Server::Instance()->OnAccept(event);
-            break;
-
         case IOEvent::RECV:
             if (NumberOfBytesTransferred > 0)
             {
-                Server::Instance()->OnRecv(event, NumberOfBytesTransferred);
+                Metrics::Add(Metrics::RECVS);
+                Metrics::Add(Metrics::RECV_BYTES, NumberOfBytesTransferred);
+                server->OnRecv(event, NumberOfBytesTransferred);
             }
             else
             {
-                Server::Instance()->OnClose(event);
+                server->EndRecv(event);
             }
             break;
 
+        case IOEvent::RECV_READY:
+            Metrics::Add(Metrics::RECV_WAKEUPS);
+            server->OnRecvReady(event);
+            break;
+
         case IOEvent::SEND:
-            Server::Instance()->OnSend(event, NumberOfBytesTransferred);
+            Metrics::Add(Metrics::SENDS);
+            Metrics::Add(Metrics::SEND_BYTES, NumberOfBytesTransferred);
+            Metrics::RecordLatency(Metrics::SEND_TIME, event->GetPostTime());
+            server->OnSend(event, NumberOfBytesTransferred);
+            break;
+
+        case IOEvent::DISCONNECT:
+            server->OnDisconnect(event, true);
             break;
 
         default:
@@ -64,24 +96,32 @@ Server::IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */, PVOID /* Cont
     IOEvent::Destroy(event);
 }
 
-void CALLBACK
-Server::WorkerPostAccept(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_WORK /* Work */)
+void CALLBACK Server::WorkerCloseClients(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
 {
-    Server* server = static_cast<Server*>(Context);
-    assert(server);
+    std::vector<Client*>* clients = static_cast<std::vector<Client*>*>(Context);
+    assert(clients);
+    assert(!clients->empty());
 
-    while (!server->m_ShuttingDown)
-    {
-        server->PostAccept();
-    }
+    (*clients)[0]->GetServer()->CloseClients(&(*clients)[0], clients->size());
+    delete clients;
+}
+
+void CALLBACK Server::WorkerDeleteClients(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
+{
+    std::vector<Client*>* clients = static_cast<std::vector<Client*>*>(Context);
+    assert(clients);
+    assert(!clients->empty());
+
+    Server::DeleteClients(&(*clients)[0], clients->size());
+    delete clients;
 }
 
 void CALLBACK Server::WorkerAddClient(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
 {
-    Client* client = static_cast<Client*>(Context);
-    assert(client);
+    Packet* accepted = static_cast<Packet*>(Context);
+    assert(accepted);
 
-    Server::Instance()->AddClient(client);
+    accepted->GetSender()->GetServer()->AddClient(accepted);
 }
 
 void CALLBACK Server::WorkerRemoveClient(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
@@ -89,437 +129,1599 @@ void CALLBACK Server::WorkerRemoveClient(PTP_CALLBACK_INSTANCE /* Instance */, P
     Client* client = static_cast<Client*>(Context);
     assert(client);
 
-    Server::Instance()->RemoveClient(client);
+    // The id is only cleared once the client has been removed, which then does nothing.
+    client->GetServer()->RemoveClient(client->GetId());
+    // The reference taken when the removal was submitted.
+    client->Release();
 }
 
-void CALLBACK Server::WorkerProcessRecvPacket(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
+void CALLBACK Server::WorkerInlineCompletion(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
 {
-    Packet* packet = static_cast<Packet*>(Context);
-    assert(packet);
+    IOEvent* event = static_cast<IOEvent*>(Context);
+    assert(event);
 
-    Server::Instance()->Echo(packet);
+    HandleCompletion(event, ERROR_SUCCESS, event->GetOverlapped().InternalHigh);
 }
 
 Server::Server()
-    : m_pTPIO(NULL),
-      m_AcceptTPWORK(NULL),
-      m_listenSocket(INVALID_SOCKET),
-      m_MaxPostAccept(0),
-      m_NumPostAccept(0),
-      m_ClientTPCLEAN(NULL),
-      m_ShuttingDown(true)
+    : m_AcceptSweepTPTIMER(NULL),
+      m_RecvCapacity(0),
+      m_MaxClients(0),
+      m_AcceptsPaused(0),
+      m_NumOverCapacity(0),
+      m_AcceptDataTimeout(0),
+      m_AcceptDataSize(0),
+      m_NumReuseHits(0),
+      m_NumReuseMisses(0),
+      m_NumActiveClients(0),
+      m_hNoActiveClients(NULL),
+      m_InlineCompletion(false),
+      m_CanSkipCompletionPort(false),
+      m_ZeroByteRecv(false),
+      m_RecvDepth(1),
+      m_CompressionMinBatch(0),
+      m_RecvHandler(Server::EchoHandler),
+      m_RecvBatchHandler(Server::EchoBatchHandler),
+      m_RecvDispatch(DISPATCH_INLINE),
+      m_RecvDispatcher(GetHandlerDispatcher(DISPATCH_INLINE)),
+      m_RecvSpans(sizeof(RecvSpan)),
+      m_SendLowWater(DEFAULT_SEND_LOW_WATER),
+      m_SendHighWater(DEFAULT_SEND_HIGH_WATER),
+      m_SlowConsumerPolicy(PAUSE_READS),
+      m_NumDroppedPackets(0),
+      m_NumSlowDisconnects(0),
+      m_TimerTPTIMER(NULL),
+      m_NextTimerPool(0),
+      m_IdleTimeout(0),
+      m_HeartbeatInterval(0),
+      m_Heartbeat(NULL),
+      m_NumIdleDisconnects(0),
+      m_NumHeartbeats(0),
+      m_MinThreads(0),
+      m_MaxThreads(0),
+      m_Engine(THREAD_POOL),
+      m_IoEngine(NULL),
+      m_IocpThreads(0),
+      m_IocpBatchSize(DEFAULT_COMPLETION_BATCH_SIZE),
+      m_ShuttingDown(true),
+      m_Draining(false)
 {
+    // Listeners can be added and their stats read before Create() and after Destroy().
+    InitializeCriticalSection(&m_CSForListeners);
 }
 
-Server::~Server() { Destroy(); }
+Server::~Server()
+{
+    Destroy();
+    DeleteCriticalSection(&m_CSForListeners);
+}
 
-bool Server::Create(short port, int maxPostAccept)
+bool Server::Create(short port, int maxPostAccept, DWORD recvBufferSize, size_t expectedClients)
 {
     assert(maxPostAccept > 0);
 
-    m_MaxPostAccept = maxPostAccept;
-
-    // Create Client Work Thread Env for using cleaning group. We need this for shutting down
-    // properly.
-    InitializeThreadpoolEnvironment(&m_ClientTPENV);
-    m_ClientTPCLEAN = CreateThreadpoolCleanupGroup();
-    if (m_ClientTPCLEAN == NULL)
+    // How large a transport frame can be depends on the framing, which is settled by now.
+    if (!m_Compression.Configure(m_Framer, m_CompressionMinBatch))
     {
-        ERROR_CODE(GetLastError(), "Could not create client cleaning group.");
         return false;
     }
-    SetThreadpoolCallbackCleanupGroup(&m_ClientTPENV, m_ClientTPCLEAN, NULL);
 
-    // Create Listen Socket
-    m_listenSocket = Network::CreateSocket(true, port);
-    if (m_listenSocket == INVALID_SOCKET)
     {
-        return false;
+        CritSecLock lock(m_CSForListeners);
+        m_Listeners.insert(m_Listeners.begin(),
+                           CreateListener(NULL, port, maxPostAccept, ACCEPT_THREAD_POOL, NULL));
     }
 
-    // Make the address re-usable to re-run the same server instantly.
-    bool reuseAddr = true;
-    if (setsockopt(m_listenSocket, SOL_SOCKET, SO_REUSEADDR,
-                   reinterpret_cast<const char*>(&reuseAddr), sizeof(reuseAddr)) == SOCKET_ERROR)
+    // Every callback runs on the private pool of a NUMA node, so that a client's I/O and work
+    // stay on one node.
+    if (!m_ThreadPools.Create(m_MinThreads, m_MaxThreads))
     {
-        ERROR_CODE(WSAGetLastError(), "setsockopt() failed with SO_REUSEADDR.");
-        Destroy();
+        ERROR_MSG("Could not create the thread pools.");
         return false;
     }
 
-    // Create & Start ThreaddPool for socket IO
-    m_pTPIO = CreateThreadpoolIo(reinterpret_cast<HANDLE>(m_listenSocket),
-                                 Server::IoCompletionCallback, NULL, NULL);
-    if (m_pTPIO == NULL)
+    for (int i = 0; i < m_ThreadPools.GetNumPools(); ++i)
     {
-        ERROR_CODE(WSAGetLastError(), "Could not assign the listen socket to the IOCP handle.");
-        Destroy();
-        return false;
+        RecvQueue* queue = new RecvQueue();
+        InitializeCriticalSection(&queue->cs);
+        queue->server = this;
+        queue->scheduled = false;
+        queue->pool = i;
+        m_RecvQueues.push_back(queue);
     }
 
-    // Start listening
-    StartThreadpoolIo(m_pTPIO);
-    if (listen(m_listenSocket, SOMAXCONN) == SOCKET_ERROR)
+    if (!CreateEngine())
     {
-        ERROR_CODE(WSAGetLastError(), "listen() failed.");
         return false;
     }
 
-    // Create critical sections for m_Clients
-    InitializeCriticalSection(&m_CSForClients);
+    // Receive into a single segment that fills its size class exactly.
+    m_RecvCapacity = Packet::GetSegmentCapacityForBlock(recvBufferSize);
+    TRACE("Receive capacity : %d", m_RecvCapacity);
 
-    // Create Accept worker
-    m_AcceptTPWORK = CreateThreadpoolWork(Server::WorkerPostAccept, this, NULL);
-    if (m_AcceptTPWORK == NULL)
+    // First data is received into a packet of the receive size, ahead of the addresses.
+    m_AcceptDataSize = 0;
+    if (m_AcceptDataTimeout > 0)
     {
-        ERROR_CODE(GetLastError(), "Could not create AcceptEx worker TPIO.");
-        Destroy();
-        return false;
+        if (m_RecvCapacity > 2 * Network::ACCEPT_ADDRESS_SIZE)
+        {
+            m_AcceptDataSize = m_RecvCapacity - 2 * Network::ACCEPT_ADDRESS_SIZE;
+        }
+        else
+        {
+            ERROR_MSG("The receive buffers are too small to receive first data with accepts.");
+        }
     }
 
-    m_ShuttingDown = false;
-
-    SubmitThreadpoolWork(m_AcceptTPWORK);
-
-    return true;
-}
+    // Pre-warm the pools so that a reconnect storm doesn't start with an allocation per event.
+    if (expectedClients > 0)
+    {
+        // A send and the receives that are outstanding at once.
+        size_t numEvents = expectedClients * (1 + m_RecvDepth);
+        for (size_t i = 0; i < m_Listeners.size(); ++i)
+        {
+            numEvents += m_Listeners[i]->maxPostAccept;
+        }
+        IOEvent::ConfigurePool(numEvents, numEvents * POOL_HIGH_WATER_FACTOR);
+        Packet::ConfigurePool(m_RecvCapacity, expectedClients * m_RecvDepth,
+                              expectedClients * m_RecvDepth * POOL_HIGH_WATER_FACTOR);
+    }
 
-void Server::Destroy()
-{
-    m_ShuttingDown = true;
+    // Create critical sections for m_FreeClients
+    InitializeCriticalSection(&m_CSForFreeClients);
 
-    if (m_AcceptTPWORK != NULL)
+    m_hNoActiveClients = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (m_hNoActiveClients == NULL)
     {
-        WaitForThreadpoolWorkCallbacks(m_AcceptTPWORK, true);
-        CloseThreadpoolWork(m_AcceptTPWORK);
-        m_AcceptTPWORK = NULL;
+        ERROR_CODE(GetLastError(), "Could not create the event for shutting down.");
+        Destroy();
+        return false;
     }
 
-    if (m_listenSocket != INVALID_SOCKET)
+    if (!OpenListeners() || !OpenDatagramListeners() || !StartTimers())
     {
-        Network::CloseSocket(m_listenSocket);
-        CancelIoEx(reinterpret_cast<HANDLE>(m_listenSocket), NULL);
-        m_listenSocket = INVALID_SOCKET;
+        Destroy();
+        return false;
     }
 
-    if (m_pTPIO != NULL)
+    m_CanSkipCompletionPort = Network::CanSkipCompletionPortOnSuccess();
+    if (m_InlineCompletion && !m_CanSkipCompletionPort)
     {
-        WaitForThreadpoolIoCallbacks(m_pTPIO, true);
-        CloseThreadpoolIo(m_pTPIO);
-        m_pTPIO = NULL;
+        ERROR_MSG("A layered provider doesn't support inline completion. It won't be used.");
     }
 
-    if (m_ClientTPCLEAN != NULL)
+    if (m_ZeroByteRecv && !m_IoEngine->CanRecvZeroBytes())
+    {
+        ERROR_MSG("The engine doesn't support zero-byte receives. They won't be used.");
+    }
+    else if (m_ZeroByteRecv && m_RecvDepth > 1)
     {
-        CloseThreadpoolCleanupGroupMembers(m_ClientTPCLEAN, false, NULL);
-        CloseThreadpoolCleanupGroup(m_ClientTPCLEAN);
-        DestroyThreadpoolEnvironment(&m_ClientTPENV);
-        m_ClientTPCLEAN = NULL;
+        ERROR_MSG("Zero-byte receives won't be used with a receive depth of %u.", m_RecvDepth);
     }
 
-    EnterCriticalSection(&m_CSForClients);
-    for (auto client : m_Clients)
+    m_ShuttingDown = false;
+
+    for (size_t i = 0; i < m_Listeners.size(); ++i)
     {
-        delete client;
+        RequestAcceptRefill(m_Listeners[i]);
     }
-    m_Clients.clear();
-    LeaveCriticalSection(&m_CSForClients);
 
-    DeleteCriticalSection(&m_CSForClients);
+    return true;
 }
 
-void Server::PostAccept()
+bool Server::Drain(DWORD timeoutMs)
 {
-    // If the number of clients is too big, we can just stop posting accept.
-    // That's one of the benefits from AcceptEx.
-    int count = m_MaxPostAccept - m_NumPostAccept;
-    if (count > 0)
+    if (m_ShuttingDown)
     {
-        int i = 0;
-        for (; i < count; ++i)
-        {
-            Client* client = new Client();
-            if (!client->Create())
-            {
-                delete client;
-                break;
-            }
+        return true;
+    }
 
-            IOEvent* event = IOEvent::Create(IOEvent::ACCEPT, client);
-            assert(event);
+    const ULONGLONG deadline = GetTickCount64() + timeoutMs;
 
-            StartThreadpoolIo(m_pTPIO);
-            if (!Network::AcceptEx(m_listenSocket, client->GetSocket(), &event->GetOverlapped()))
-            {
-                int error = WSAGetLastError();
+    m_Draining = true;
+    StopAccepting();
 
-                if (error != ERROR_IO_PENDING)
-                {
-                    CancelThreadpoolIo(m_pTPIO);
+    // Stop reading, so that the handler has nothing to queue more sends for. OnSend() no longer
+    // resumes reads, and clients that are still being added are paused by AddClient().
+    m_Clients.ForEach([](Client* client) { client->PauseReads(); });
 
-                    ERROR_CODE(error, "AcceptEx() failed.");
-                    delete client;
-                    IOEvent::Destroy(event);
-                    break;
-                }
-            }
-            else
-            {
-                OnAccept(event);
-                IOEvent::Destroy(event);
-            }
+    ULONGLONG nextProgress = 0;
+    for (;;)
+    {
+        const SendStats stats = GetSendStats();
+        const ULONGLONG now = GetTickCount64();
+
+        if (stats.totalPendingBytes == 0)
+        {
+            TRACE("The sends of %Iu clients have drained.", GetNumClients());
+            return true;
+        }
+
+        if (now >= deadline)
+        {
+            ERROR_MSG("%u bytes were still pending after %u ms.", stats.totalPendingBytes,
+                      timeoutMs);
+            return false;
         }
 
-        InterlockedExchangeAdd(&m_NumPostAccept, i);
+        if (now >= nextProgress)
+        {
+            TRACE("Draining : %u bytes pending, %Iu clients, %I64u ms left",
+                  stats.totalPendingBytes, GetNumClients(), deadline - now);
+            nextProgress = now + SHUTDOWN_PROGRESS_INTERVAL_MS;
+        }
 
-        TRACE("[%d] Post AcceptEx : %d", GetCurrentThreadId(), m_NumPostAccept);
+        Sleep(SHUTDOWN_POLL_MS);
     }
 }
 
-void Server::PostRecv(Client* client)
+void Server::CloseClients(Client** clients, size_t numClients)
 {
-    assert(client);
+    assert(clients);
 
-    WSABUF recvBufferDescriptor;
-    recvBufferDescriptor.buf = reinterpret_cast<char*>(client->GetRecvBuff());
-    recvBufferDescriptor.len = Client::MAX_RECV_BUFFER;
+    for (size_t i = 0; i < numClients; ++i)
+    {
+        Client* client = clients[i];
+        EVENT_TRACE(KEYWORD_CLIENTS, WriteClientRemoved(client->GetId()));
 
-    DWORD numberOfBytes = 0;
-    DWORD recvFlags = 0;
+        // Closing the socket aborts its outstanding I/O, which drops the last references.
+        m_IoEngine->CloseClient(client);
 
-    IOEvent* event = IOEvent::Create(IOEvent::RECV, client);
-    assert(event);
+        // A parked receive has nothing outstanding that would drop the frame in progress.
+        if (client->ClaimParkedRecv())
+        {
+            client->ResetFrame();
+        }
+        client->Release();
+    }
+}
 
-    StartThreadpoolIo(client->GetTPIO());
+/* static */ void Server::DeleteClients(Client** clients, size_t numClients)
+{
+    assert(clients);
 
-    if (WSARecv(client->GetSocket(), &recvBufferDescriptor, 1, &numberOfBytes, &recvFlags,
-                &event->GetOverlapped(), NULL) == SOCKET_ERROR)
+    for (size_t i = 0; i < numClients; ++i)
     {
-        int error = WSAGetLastError();
+        delete clients[i];
+    }
+}
 
-        if (error != ERROR_IO_PENDING)
-        {
-            CancelThreadpoolIo(client->GetTPIO());
+void Server::TearDownClients(std::vector<Client*>& clients, PTP_SIMPLE_CALLBACK callback)
+{
+    // Closing a socket takes a system call or two, which adds up with many clients, so the pools
+    // share the work in batches. The calling thread takes the last one.
+    size_t begin = 0;
+    while (m_ThreadPools.GetNumPools() > 0 && clients.size() - begin > MAX_TEARDOWN_BATCH)
+    {
+        std::vector<Client*>* batch = new std::vector<Client*>(
+            clients.begin() + begin, clients.begin() + begin + MAX_TEARDOWN_BATCH);
+        const int pool = static_cast<int>((begin / MAX_TEARDOWN_BATCH) %
+                                          m_ThreadPools.GetNumPools());
+        begin += MAX_TEARDOWN_BATCH;
 
-            ERROR_CODE(error, "WSARecv() failed.");
+        if (!m_ThreadPools.Submit(pool, callback, batch, true))
+        {
+            ERROR_CODE(GetLastError(), "Could not hand clients to a pool to tear down.");
 
-            OnClose(event);
-            IOEvent::Destroy(event);
+            callback(NULL, batch);
         }
     }
-    else
+
+    if (begin < clients.size())
     {
-        // In this case, the completion callback will have already been scheduled to be called.
+        std::vector<Client*>* batch =
+            new std::vector<Client*>(clients.begin() + begin, clients.end());
+        callback(NULL, batch);
     }
+
+    clients.clear();
 }
 
-void Server::PostSend(Client* client, Packet* packet)
+void Server::Destroy()
 {
-    assert(client);
-    assert(packet);
+    m_ShuttingDown = true;
 
-    WSABUF recvBufferDescriptor;
-    recvBufferDescriptor.buf = reinterpret_cast<char*>(packet->GetData());
-    recvBufferDescriptor.len = packet->GetSize();
+    StopAccepting();
 
-    DWORD sendFlags = 0;
+    // Datagrams have no clients to wait for, so their sessions are dropped right away.
+    CloseDatagramListeners();
 
-    IOEvent* event = IOEvent::Create(IOEvent::SEND, client, packet);
-    assert(event);
+    // The batches of expired timers that are still running are waited for with the other
+    // cleanup work.
+    StopTimers();
 
-    StartThreadpoolIo(client->GetTPIO());
+    // Let the clients that are being added or removed settle before removing the rest.
+    m_ThreadPools.WaitForCleanupWork();
 
-    if (WSASend(client->GetSocket(), &recvBufferDescriptor, 1, NULL, sendFlags,
-                &event->GetOverlapped(), NULL) == SOCKET_ERROR)
+    // The shard locks are only held to take the clients out, not while they are closed.
+    std::vector<Client*> clients;
+    clients.reserve(m_Clients.GetSize());
+    m_Clients.RemoveAll([&clients](Client* client) { clients.push_back(client); });
+    if (!clients.empty())
     {
-        int error = WSAGetLastError();
+        TRACE("Closing %Iu clients.", clients.size());
+        TearDownClients(clients, Server::WorkerCloseClients);
+    }
 
-        if (error != ERROR_IO_PENDING)
+    if (m_hNoActiveClients != NULL)
+    {
+        const ULONGLONG deadline = GetTickCount64() + SHUTDOWN_TIMEOUT_MS;
+        while (m_NumActiveClients != 0 &&
+               WaitForSingleObject(m_hNoActiveClients, SHUTDOWN_PROGRESS_INTERVAL_MS) ==
+                   WAIT_TIMEOUT)
         {
-            CancelThreadpoolIo(client->GetTPIO());
+            if (GetTickCount64() >= deadline)
+            {
+                ERROR_MSG("%d clients were not released in time.", m_NumActiveClients);
+                break;
+            }
+            TRACE("Waiting for %d clients to be released.", m_NumActiveClients);
+        }
 
-            ERROR_CODE(error, "WSASend() failed.");
+        CloseHandle(m_hNoActiveClients);
+        m_hNoActiveClients = NULL;
+    }
 
-            RemoveClient(client);
-        }
+    // The queued packets reference their senders, so the queues are empty by now. Wait for the
+    // work items that ran them to return.
+    m_ThreadPools.WaitForCleanupWork();
+    for (size_t i = 0; i < m_RecvQueues.size(); ++i)
+    {
+        assert(m_RecvQueues[i]->spans.empty());
+        DeleteCriticalSection(&m_RecvQueues[i]->cs);
+        delete m_RecvQueues[i];
     }
-    else
+    m_RecvQueues.clear();
+
+    // Nothing can be outstanding on the engine once every client has been released.
+    if (m_IoEngine != NULL)
     {
-        // In this case, the completion callback will have already been scheduled to be called.
+        delete m_IoEngine;
+        m_IoEngine = NULL;
     }
-}
 
-void Server::OnAccept(IOEvent* event)
-{
-    assert(event);
+    // Nothing recycles clients any more, so the free ones can be deleted without the lock.
+    std::vector<Client*> freeClients;
+    for (int i = 0; i < NUM_CLIENT_FAMILIES; ++i)
+    {
+        freeClients.insert(freeClients.end(), m_FreeClients[i].begin(), m_FreeClients[i].end());
+        m_FreeClients[i].clear();
+    }
+    TearDownClients(freeClients, Server::WorkerDeleteClients);
+    m_ThreadPools.WaitForCleanupWork();
 
-    TRACE("[%d] Enter OnAccept()", GetCurrentThreadId());
-    assert(event->GetType() == IOEvent::ACCEPT);
+    DeleteCriticalSection(&m_CSForFreeClients);
 
-    // Check if we need to post more accept requests.
-    InterlockedDecrement(&m_NumPostAccept);
+    // Groups only hold client ids, so they can go in any order.
+    m_Groups.RemoveAll(Server::DeleteGroup);
 
-    // Add client in a different thread.
-    // It is because we need to return this function ASAP so that this IO worker thread can process
-    // the other IO notifications.
-    // If adding client is fast enough, we can call it here but I assume it's slow.
-    if (!m_ShuttingDown &&
-        !TrySubmitThreadpoolCallback(Server::WorkerAddClient, event->GetClient(), &m_ClientTPENV))
+    // The timers only hold client ids as well.
+    m_Timers.Reset(0);
+    if (m_Heartbeat != NULL)
     {
-        ERROR_CODE(GetLastError(), "Could not start WorkerAddClient.");
-
-        AddClient(event->GetClient());
+        Packet::Destroy(m_Heartbeat);
+        m_Heartbeat = NULL;
     }
 
-    TRACE("[%d] Leave OnAccept()", GetCurrentThreadId());
+    // The next server starts with every source's bucket full.
+    m_Admission.Clear();
+    m_AcceptsPaused = 0;
+
+    // The TP_IOs of the free clients were the last objects bound to the pools.
+    m_ThreadPools.Destroy();
+
+    m_Draining = false;
 }
 
-void Server::OnRecv(IOEvent* event, DWORD dwNumberOfBytesTransfered)
+void Server::PostRecv(Client* client)
 {
-    assert(event);
+    assert(client);
 
-    TRACE("[%d] Enter OnRecv()", GetCurrentThreadId());
+    if (m_RecvDepth > 1)
+    {
+        PostRecvs(client);
+        return;
+    }
 
-    BYTE* buff = event->GetClient()->GetRecvBuff();
-    buff[dwNumberOfBytesTransfered] = '\0';
-    TRACE("[%d] OnRecv : %s", GetCurrentThreadId(), buff);
+    // Receive straight into a packet so that it can be handed over without copying. The rest of
+    // a frame that is being reassembled goes straight into the frame, which the event doesn't own.
+    // An idle client only takes up a buffer once it has sent something, if it waits with a
+    // zero-byte receive.
+    DWORD length = 0;
+    Packet* target = Framer::GetRecvTarget(client->GetFrameState(), length);
+    Packet* packet = NULL;
+    IOEvent::Type type = IOEvent::RECV;
+    if (target == NULL && UseZeroByteRecv(client))
+    {
+        type = IOEvent::RECV_READY;
+    }
+    else if (target == NULL)
+    {
+        packet = Packet::Create(client, m_RecvCapacity);
+        assert(packet);
+        assert(packet->GetNext() == NULL);
+
+        target = packet;
+        length = packet->GetCapacity();
+    }
 
-    // Create packet by copying recv buff.
-    Packet* packet = Packet::Create(event->GetClient(), event->GetClient()->GetRecvBuff(),
-                                    dwNumberOfBytesTransfered);
+    DWORD numberOfBytes = 0;
 
-    // If whatever logics relying on the packet are fast enough, we can manage them here but
-    // assume they are slow.
-    // it's better to request receiving ASAP and handle packets received in another thread.
-    if (!TrySubmitThreadpoolCallback(Server::WorkerProcessRecvPacket, packet, NULL))
-    {
-        ERROR_CODE(GetLastError(), "Could not start WorkerProcessRecvPacket. call it directly.");
+    IOEvent* event = IOEvent::Create(type, client, packet);
+    assert(event);
 
-        Echo(packet);
+    EVENT_TRACE(KEYWORD_IO, WriteIoPosted(event, client->GetId(), type, length));
+    switch (m_IoEngine->PostRecv(client, target, target != NULL ? target->GetSize() : 0, length,
+                                 event, numberOfBytes))
+    {
+    case IoEngine::POST_FAILED:
+    {
+        const int error = WSAGetLastError();
+        ERROR_CODE(error, "Posting a receive failed.");
+        Metrics::RecordFailure(error);
+
+        OnClose(event);
+        DropRecv(event);
+        IOEvent::Destroy(event);
+        break;
     }
 
-    PostRecv(event->GetClient());
+    case IoEngine::POST_COMPLETED:
+        // No completion is queued for I/O that succeeded synchronously, so handle it here.
+        OnInlineCompletion(event, numberOfBytes);
+        break;
 
-    TRACE("[%d] Leave OnRecv()", GetCurrentThreadId());
+    default:
+        // In this case, the completion callback will have already been scheduled to be called.
+        break;
+    }
 }
 
-void Server::OnSend(IOEvent* event, DWORD dwNumberOfBytesTransfered)
+void Server::PostRecvs(Client* client)
 {
-    assert(event);
+    assert(client);
 
-    TRACE("[%d] OnSend : %d", GetCurrentThreadId(), dwNumberOfBytesTransfered);
+    IOEvent* completed[Client::MAX_RECV_DEPTH];
+    DWORD completedBytes[Client::MAX_RECV_DEPTH];
+    DWORD numCompleted = 0;
+    IOEvent* failed = NULL;
 
-    // This should be fast enough to do in this I/O thread.
-    // if not, we need to queue it like what we do in OnRecv().
-    Packet::Destroy(event->GetPacket());
-}
+    // The bytes fill the receives in the order they have been posted in, which the sequence
+    // numbers have to follow. Every receive gets a packet of its own, since the frame in progress
+    // can't be shared between them.
+    {
+        CritSecLock lock(client->GetRecvLock());
 
-void Server::OnClose(IOEvent* event)
-{
-    assert(event);
+        DWORD sequence = 0;
+        while (failed == NULL && client->ReserveRecv(m_RecvDepth, sequence))
+        {
+            Packet* packet = Packet::Create(client, m_RecvCapacity);
+            assert(packet);
+            assert(packet->GetNext() == NULL);
 
-    TRACE("Client's socket has been closed.");
+            IOEvent* event = IOEvent::Create(IOEvent::RECV, client, packet);
+            assert(event);
+            event->SetSequence(sequence);
 
-    // If whatever game logics about this event are fast enough, we can manage them here but I
-    // assume they are slow.
-    if (!m_ShuttingDown &&
-        !TrySubmitThreadpoolCallback(Server::WorkerRemoveClient, event->GetClient(), &m_ClientTPENV))
+            DWORD numberOfBytes = 0;
+            EVENT_TRACE(KEYWORD_IO, WriteIoPosted(event, client->GetId(), IOEvent::RECV,
+                                                  packet->GetCapacity()));
+            switch (m_IoEngine->PostRecv(client, packet, 0, packet->GetCapacity(), event,
+                                         numberOfBytes))
+            {
+            case IoEngine::POST_FAILED:
+            {
+                const int error = WSAGetLastError();
+                ERROR_CODE(error, "Posting a receive failed.");
+                Metrics::RecordFailure(error);
+
+                failed = event;
+                break;
+            }
+
+            case IoEngine::POST_COMPLETED:
+                completed[numCompleted] = event;
+                completedBytes[numCompleted] = numberOfBytes;
+                ++numCompleted;
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+
+    // Handing over may post more, so the receives that have completed synchronously are handled
+    // once the lock has been released.
+    for (DWORD i = 0; i < numCompleted; ++i)
     {
-        ERROR_CODE(GetLastError(), "can't start WorkerRemoveClient. call it directly.");
+        OnInlineCompletion(completed[i], completedBytes[i]);
+    }
 
-        RemoveClient(event->GetClient());
+    // The receives before it still hand over what they have received.
+    if (failed != NULL)
+    {
+        OnSequencedRecv(failed, 0);
+        IOEvent::Destroy(failed);
     }
 }
 
-void Server::AddClient(Client* client)
+void Server::PostSend(Client* client, Packet* packet)
+{
+    assert(packet);
+
+    PostSends(client, &packet, 1);
+}
+
+void Server::PostSends(Client* client, Packet** packets, DWORD numPackets)
 {
     assert(client);
+    assert(packets);
 
-    // The socket sAcceptSocket does not inherit the properties of the socket associated with
-    // sListenSocket parameter until SO_UPDATE_ACCEPT_CONTEXT is set on the socket.
-    if (setsockopt(client->GetSocket(), SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
-                   reinterpret_cast<const char*>(&m_listenSocket),
-                   sizeof(m_listenSocket)) == SOCKET_ERROR)
+    if (m_HeartbeatInterval > 0)
     {
-        ERROR_CODE(WSAGetLastError(), "setsockopt() for AcceptEx() failed.");
-
-        RemoveClient(client);
+        client->SetLastSendTime(GetTickCount());
     }
-    else
+
+    // The packets may hold the last references to the client, so don't touch it after sending.
+    const HandleId clientId = client->GetId();
+    bool startSend = false;
+    bool disconnect = false;
+
+    for (DWORD i = 0; i < numPackets; ++i)
     {
-        client->SetState(Client::ACCEPTED);
+        Packet* packet = packets[i];
+        assert(packet);
 
-        // Connect the socket to IOCP
-        TP_IO* pTPIO = CreateThreadpoolIo(reinterpret_cast<HANDLE>(client->GetSocket()),
-                                          Server::IoCompletionCallback, NULL, NULL);
-        if (pTPIO == NULL)
+        if (disconnect)
         {
-            ERROR_CODE(GetLastError(), "CreateThreadpoolIo failed for a client.");
-
-            RemoveClient(client);
+            Packet::Destroy(packet);
+            continue;
         }
-        else
+
+        // Don't let a client that doesn't read pile up packets without bound.
+        if (client->GetPendingSendBytes() + packet->GetPooledSize() > m_SendHighWater)
         {
-            std::string ip;
-            u_short port = 0;
-            Network::GetRemoteAddress(client->GetSocket(), ip, port);
-            TRACE("[%d] Accept succeeded. client address : ip[%s], port[%d]", GetCurrentThreadId(),
-                  ip.c_str(), port);
+            bool admit = true;
 
-            client->SetTPIO(pTPIO);
+            switch (m_SlowConsumerPolicy)
+            {
+            case PAUSE_READS:
+                if (!client->IsReadsPaused())
+                {
+                    TRACE("[%d] Pausing reads from a slow client.", GetCurrentThreadId());
+                    client->PauseReads();
+                }
+                break;
 
-            EnterCriticalSection(&m_CSForClients);
-            m_Clients.push_back(client);
-            LeaveCriticalSection(&m_CSForClients);
+            case DROP:
+                InterlockedIncrement(&m_NumDroppedPackets);
+                admit = false;
+                break;
 
-            PostRecv(client);
-        }
-    }
-}
+            case DISCONNECT:
+                InterlockedIncrement(&m_NumSlowDisconnects);
+                disconnect = true;
+                admit = false;
+                break;
 
-void Server::RemoveClient(Client* client)
-{
-    assert(client);
+            default:
+                assert(false);
+                break;
+            }
 
-    CritSecLock lock(m_CSForClients);
+            if (!admit)
+            {
+                Packet::Destroy(packet);
+                continue;
+            }
+        }
 
-    ClientList::iterator itor = std::find(m_Clients.begin(), m_Clients.end(), client);
+        // Queue the packet behind the outstanding send, if there is one, so that it goes out with
+        // the others once that send completes.
+        bool start = false;
+        if (!client->PushSend(packet, start))
+        {
+            // Sending to this client has failed already.
+            Packet::Destroy(packet);
+            continue;
+        }
+        startSend = startSend || start;
+    }
 
-    if (itor != m_Clients.end())
+    // Whatever has been queued has to go out even if the client is being disconnected, since the
+    // queued packets keep it from being released.
+    if (startSend)
     {
-        TRACE("[%d] RemoveClient succeeded.", GetCurrentThreadId());
-
-        delete client;
+        PostQueuedSend(client);
+    }
 
-        m_Clients.erase(itor);
+    if (disconnect)
+    {
+        RemoveClient(clientId);
     }
 }
 
-void Server::Echo(Packet* packet)
+void Server::PostQueuedSend(Client* client)
 {
-    assert(packet);
-    assert(packet->GetSender());
-
-    CritSecLock lock(m_CSForClients);
+    assert(client);
 
-    ClientList::iterator itor = std::find(m_Clients.begin(), m_Clients.end(), packet->GetSender());
+    // Gather everything that has been queued into a single WSASend(). A batch that is wrapped
+    // may need a buffer for the transport frame's header.
+    WSABUF sendBufferDescriptors[Client::MAX_SEND_BUFFERS];
+    Packet* segments[Client::MAX_SEND_BUFFERS];
+    const DWORD maxBuffers = Client::MAX_SEND_BUFFERS - (m_Compression.IsEnabled() ? 1 : 0);
+    bool compress = false;
+    DWORD numBuffers =
+        client->PopSendBatch(sendBufferDescriptors, maxBuffers, segments, &compress);
+    if (numBuffers == 0)
+    {
+        return;
+    }
 
-    if (itor == m_Clients.end())
+    // Compressing is done outside the client's send lock, so queueing more doesn't wait for it.
+    if (compress)
     {
-        // No client to send it back.
-        Packet::Destroy(packet);
+        Packet* transform = m_Compression.Wrap(sendBufferDescriptors, segments, numBuffers);
+        if (transform == NULL || !client->SetSendTransform(transform))
+        {
+            // The peer can't read the batch unwrapped, so the client can't be sent to any more.
+            ERROR_MSG("Could not wrap a send.");
+            if (transform != NULL)
+            {
+                Packet::Destroy(transform);
+            }
+
+            const HandleId clientId = client->GetId();
+            client->AbortSends();
+            RemoveClient(clientId);
+            return;
+        }
     }
-    else
+
+    // Data that is only in a file takes TransmitPackets() instead, with the rest of the batch
+    // going out from memory around it.
+    bool transmit = false;
+    for (DWORD i = 0; i < numBuffers && !transmit; ++i)
     {
-        PostSend(packet->GetSender(), packet);
+        transmit = segments[i]->IsUnmapped();
     }
-}
 
-size_t Server::GetNumClients()
-{
-    CritSecLock lock(m_CSForClients);
+    DWORD numberOfBytes = 0;
 
-    return m_Clients.size();
-}
+    IOEvent* event = IOEvent::Create(IOEvent::SEND, client);
+    assert(event);
+    event->SetPostTime(Metrics::Now());
+
+    if (EventTrace::IsEnabled(EventTrace::KEYWORD_IO))
+    {
+        DWORD length = 0;
+        for (DWORD i = 0; i < numBuffers; ++i)
+        {
+            length += sendBufferDescriptors[i].len;
+        }
+        EventTrace::WriteIoPosted(event, client->GetId(), IOEvent::SEND, length);
+    }
 
-long Server::GetNumPostAccepts() { return m_NumPostAccept; }
+    IoEngine::PostResult result;
+    if (transmit)
+    {
+        TRANSMIT_PACKETS_ELEMENT elements[Client::MAX_SEND_BUFFERS];
+        for (DWORD i = 0; i < numBuffers; ++i)
+        {
+            ZeroMemory(&elements[i], sizeof(elements[i]));
+            elements[i].cLength = sendBufferDescriptors[i].len;
+            if (segments[i]->IsUnmapped())
+            {
+                elements[i].dwElFlags = TP_ELEMENT_FILE;
+                elements[i].hFile = segments[i]->GetFile()->GetHandle();
+                elements[i].nFileOffset.QuadPart =
+                    static_cast<LONGLONG>(segments[i]->GetFileOffset());
+            }
+            else
+            {
+                elements[i].dwElFlags = TP_ELEMENT_MEMORY;
+                elements[i].pBuffer = sendBufferDescriptors[i].buf;
+            }
+        }
+
+        result = m_IoEngine->PostTransmit(client, elements, numBuffers, event, numberOfBytes);
+    }
+    else
+    {
+        result = m_IoEngine->PostSend(client, sendBufferDescriptors, segments, numBuffers, event,
+                                      numberOfBytes);
+    }
+
+    switch (result)
+    {
+    case IoEngine::POST_FAILED:
+    {
+        const int error = WSAGetLastError();
+        ERROR_CODE(error, "Posting a send failed.");
+        Metrics::RecordFailure(error);
+
+        // The event may hold the last reference, so don't touch the client after it's gone.
+        const HandleId clientId = client->GetId();
+        client->AbortSends();
+        IOEvent::Destroy(event);
+
+        RemoveClient(clientId);
+        break;
+    }
+
+    case IoEngine::POST_COMPLETED:
+        // No completion is queued for I/O that succeeded synchronously, so handle it here.
+        OnInlineCompletion(event, numberOfBytes);
+        break;
+
+    default:
+        // In this case, the completion callback will have already been scheduled to be called.
+        break;
+    }
+}
+
+void Server::PostDisconnect(Client* client)
+{
+    assert(client);
+
+    client->SetState(Client::DISCONNECTED);
+
+    // A socket the engine can't reuse is closed instead of being kept for AcceptEx().
+    if (!m_IoEngine->CanReuseSockets())
+    {
+        m_IoEngine->CloseClient(client);
+        return;
+    }
+
+    assert(client->IsBound());
+
+    IOEvent* event = IOEvent::Create(IOEvent::DISCONNECT, client);
+    assert(event);
+
+    EVENT_TRACE(KEYWORD_IO, WriteIoPosted(event, client->GetId(), IOEvent::DISCONNECT, 0));
+    switch (m_IoEngine->PostDisconnect(client, event))
+    {
+    case IoEngine::POST_FAILED:
+    {
+        const int error = WSAGetLastError();
+        ERROR_CODE(error, "DisconnectEx() failed.");
+        Metrics::RecordFailure(error);
+
+        // The client was not marked as reusable, so it will be destroyed once released.
+        IOEvent::Destroy(event);
+        break;
+    }
+
+    case IoEngine::POST_COMPLETED:
+        // No completion is queued for I/O that succeeded synchronously, so handle it here.
+        OnInlineCompletion(event, 0);
+        break;
+
+    default:
+        // In this case, the completion callback will have already been scheduled to be called.
+        break;
+    }
+}
+
+void Server::OnRecv(IOEvent* event, DWORD dwNumberOfBytesTransfered)
+{
+    assert(event);
+
+    TRACE("[%d] Enter OnRecv()", GetCurrentThreadId());
+
+    TRACE("[%d] OnRecv : %d bytes", GetCurrentThreadId(), dwNumberOfBytesTransfered);
+
+    if (event->IsSequenced())
+    {
+        OnSequencedRecv(event, dwNumberOfBytesTransfered);
+        return;
+    }
+
+    // Hand the packets over before posting the next receive, so that the handler sees a client's
+    // packets in the order they arrived.
+    if (!DeliverRecv(event->GetClient(), event->GetPacket(), dwNumberOfBytesTransfered))
+    {
+        OnClose(event);
+        return;
+    }
+
+    // If the client doesn't keep up with what we send, wait for it to drain before receiving more.
+    if (!event->GetClient()->ParkRecv())
+    {
+        PostRecv(event->GetClient());
+    }
+
+    TRACE("[%d] Leave OnRecv()", GetCurrentThreadId());
+}
+
+void Server::OnSequencedRecv(IOEvent* event, DWORD numberOfBytes)
+{
+    assert(event);
+    assert(event->IsSequenced());
+
+    Client* client = event->GetClient();
+
+    // A receive that has received nothing ends receiving once the ones before it are handed over.
+    Packet* packet = event->GetPacket();
+    if (numberOfBytes == 0)
+    {
+        Packet::Destroy(packet);
+        packet = NULL;
+    }
+
+    if (!client->CompleteRecv(event->GetSequence(), packet, numberOfBytes))
+    {
+        return;
+    }
+
+    DWORD numOutstanding = 0;
+    while (client->PopCompletedRecv(packet, numberOfBytes, numOutstanding))
+    {
+        if (client->HaveRecvsEnded())
+        {
+            Packet::Destroy(packet);
+        }
+        else if ((packet == NULL || !DeliverRecv(client, packet, numberOfBytes)) &&
+                 client->EndRecvs())
+        {
+            OnClose(event);
+        }
+    }
+
+    if (client->HaveRecvsEnded())
+    {
+        // Whoever sees the last receive come back drops the frame in progress.
+        if (numOutstanding == 0)
+        {
+            client->ResetFrame();
+        }
+        return;
+    }
+
+    // Reads that have been paused are parked by the last outstanding receive, so that a parked
+    // client never has a receive outstanding.
+    if (numOutstanding > 0 && client->IsReadsPaused())
+    {
+        return;
+    }
+
+    if (!client->ParkRecv())
+    {
+        PostRecvs(client);
+    }
+}
+
+void Server::EndRecv(IOEvent* event)
+{
+    assert(event);
+
+    if (event->IsSequenced())
+    {
+        OnSequencedRecv(event, 0);
+    }
+    else
+    {
+        DropRecv(event);
+        OnClose(event);
+    }
+}
+
+bool Server::UseZeroByteRecv(Client* client)
+{
+    assert(client);
+
+    if (!m_ZeroByteRecv || !m_IoEngine->CanRecvZeroBytes() || m_RecvDepth > 1)
+    {
+        return false;
+    }
+
+    // recv() must not block once a wake-up turns out to be spurious.
+    if (!client->IsNonBlocking())
+    {
+        u_long nonBlocking = 1;
+        if (ioctlsocket(client->GetSocket(), FIONBIO, &nonBlocking) == SOCKET_ERROR)
+        {
+            ERROR_CODE(WSAGetLastError(), "ioctlsocket() failed with FIONBIO.");
+            return false;
+        }
+        client->SetNonBlocking(true);
+    }
+
+    return true;
+}
+
+void Server::OnRecvReady(IOEvent* event)
+{
+    assert(event);
+    assert(event->GetType() == IOEvent::RECV_READY);
+
+    Client* client = event->GetClient();
+
+    // Read what has arrived into buffers from the pool, the same way a receive would have
+    // received it. A read that doesn't fill its buffer has most likely taken everything.
+    for (int i = 0; i < MAX_DRAIN_READS; ++i)
+    {
+        DWORD length = 0;
+        Packet* target = Framer::GetRecvTarget(client->GetFrameState(), length);
+        Packet* packet = NULL;
+        if (target == NULL)
+        {
+            packet = Packet::Create(client, m_RecvCapacity);
+            assert(packet);
+            assert(packet->GetNext() == NULL);
+
+            target = packet;
+            length = packet->GetCapacity();
+        }
+
+        char* buffer = reinterpret_cast<char*>(target->GetData() + target->GetSize());
+        const int received = recv(client->GetSocket(), buffer, static_cast<int>(length), 0);
+        if (received == SOCKET_ERROR || received == 0)
+        {
+            const int error = received == 0 ? ERROR_SUCCESS : WSAGetLastError();
+            Packet::Destroy(packet);
+
+            if (error == WSAEWOULDBLOCK)
+            {
+                break;
+            }
+
+            // 0 is a graceful close.
+            if (error != ERROR_SUCCESS)
+            {
+                ERROR_CODE(error, "recv() after a zero-byte receive failed.");
+                Metrics::RecordFailure(error);
+            }
+
+            DropRecv(event);
+            OnClose(event);
+            return;
+        }
+
+        Metrics::Add(Metrics::RECVS);
+        Metrics::Add(Metrics::RECV_BYTES, received);
+
+        if (!DeliverRecv(client, packet, static_cast<DWORD>(received)))
+        {
+            OnClose(event);
+            return;
+        }
+
+        if (static_cast<DWORD>(received) < length || client->IsReadsPaused())
+        {
+            break;
+        }
+    }
+
+    // After MAX_DRAIN_READS, the next zero-byte receive completes right away if there is more.
+    if (!client->ParkRecv())
+    {
+        PostRecv(client);
+    }
+}
+
+bool Server::DeliverRecv(Client* client, Packet* packet, DWORD numberOfBytes)
+{
+    assert(client);
+
+    if (m_IdleTimeout > 0)
+    {
+        client->SetLastRecvTime(GetTickCount());
+    }
+
+    // The frames of the receive are handed over together.
+    RecvSpan span;
+    span.numPackets = 0;
+    span.completedAt = Metrics::Now();
+    auto add = [this, client, &span](Packet* frame) {
+        span.packets[span.numPackets++] = frame;
+        if (span.numPackets == MAX_SPAN_PACKETS)
+        {
+            DispatchRecv(client, span);
+        }
+    };
+
+    // A client that compresses sends transport frames after its hello, whose frames are handed
+    // over instead. The frames after a bad one are dropped.
+    bool unwrapped = true;
+    auto collect = [this, client, &add, &unwrapped](Packet* frame) {
+        if (!m_Compression.IsEnabled())
+        {
+            add(frame);
+            return;
+        }
+
+        if (!unwrapped)
+        {
+            Packet::Destroy(frame);
+            return;
+        }
+
+        switch (client->GetRecvCompression())
+        {
+        case Client::COMPRESSION_UNNEGOTIATED:
+            if (m_Compression.IsHello(frame))
+            {
+                Packet::Destroy(frame);
+                client->SetRecvCompression(StartCompressedSends(client) ? Client::COMPRESSION_ON
+                                                                        : Client::COMPRESSION_OFF);
+            }
+            else
+            {
+                client->SetRecvCompression(Client::COMPRESSION_OFF);
+                add(frame);
+            }
+            break;
+
+        case Client::COMPRESSION_ON:
+            unwrapped = m_Compression.Unwrap(frame, add);
+            break;
+
+        default:
+            add(frame);
+            break;
+        }
+    };
+
+    // The packet was received into, so it only needs its size filled in. Without one, the bytes
+    // went into the frame being reassembled.
+    bool framed = true;
+    if (packet == NULL)
+    {
+        m_Framer.FeedTarget(client->GetFrameState(), numberOfBytes, collect);
+    }
+    else
+    {
+        packet->SetSize(numberOfBytes);
+
+        if (!m_Framer.IsEnabled())
+        {
+            collect(packet);
+        }
+        else if (!m_Framer.Feed(client->GetFrameState(), packet, collect))
+        {
+            ERROR_MSG("A frame is over the maximum size or could not be allocated.");
+            framed = false;
+        }
+    }
+
+    if (!unwrapped)
+    {
+        ERROR_MSG("A transport frame is not well formed or could not be decompressed.");
+    }
+
+    if (!framed || !unwrapped)
+    {
+        // The frames before the bad one are still good.
+        if (span.numPackets > 0)
+        {
+            DispatchRecv(client, span);
+        }
+
+        client->ResetFrame();
+        return false;
+    }
+
+    if (span.numPackets > 0)
+    {
+        DispatchRecv(client, span);
+    }
+
+    return true;
+}
+
+void Server::DropRecv(IOEvent* event)
+{
+    assert(event);
+    assert(event->GetType() == IOEvent::RECV || event->GetType() == IOEvent::RECV_READY);
+
+    // No more receives are posted, so nothing else touches the frame in progress.
+    Packet::Destroy(event->GetPacket());
+    event->GetClient()->ResetFrame();
+}
+
+void Server::OnSend(IOEvent* event, DWORD dwNumberOfBytesTransfered)
+{
+    assert(event);
+
+    TRACE("[%d] OnSend : %d", GetCurrentThreadId(), dwNumberOfBytesTransfered);
+
+    // This should be fast enough to do in this I/O thread.
+    // if not, we need to queue it like what we do in OnRecv().
+    Client* client = event->GetClient();
+    client->CompleteSend();
+
+    EVENT_TRACE(KEYWORD_DATA, WriteSendCompleted(client->GetId(), dwNumberOfBytesTransfered,
+                                                 client->GetPendingSendBytes()));
+
+    if (client->IsReadsPaused() && client->GetPendingSendBytes() <= m_SendLowWater &&
+        !m_Draining)
+    {
+        TRACE("[%d] Resuming reads from a slow client.", GetCurrentThreadId());
+
+        if (client->ResumeReads())
+        {
+            PostRecv(client);
+        }
+    }
+
+    // Send whatever has been queued while this send was outstanding.
+    PostQueuedSend(client);
+}
+
+void Server::OnClose(IOEvent* event)
+{
+    assert(event);
+
+    TRACE("Client's socket has been closed.");
+
+    if (m_ShuttingDown)
+    {
+        return;
+    }
+
+    // If whatever game logics about this event are fast enough, we can manage them here but I
+    // assume they are slow.
+    // If the client has already been removed, its handle is invalid and removing it does nothing.
+    // The worker needs the client, which the event's reference doesn't keep for it.
+    Client* client = event->GetClient();
+    client->AddRef();
+    if (!m_ThreadPools.Submit(client->GetThreadPool(), Server::WorkerRemoveClient, client, true))
+    {
+        ERROR_CODE(GetLastError(), "can't start WorkerRemoveClient. call it directly.");
+
+        RemoveClient(client->GetId());
+        client->Release();
+    }
+}
+
+void Server::OnDisconnect(IOEvent* event, bool succeeded)
+{
+    assert(event);
+    assert(event->GetType() == IOEvent::DISCONNECT);
+
+    TRACE("[%d] OnDisconnect : %d", GetCurrentThreadId(), succeeded);
+
+    // The client goes back to the pool once its last reference is released.
+    event->GetClient()->SetReusable(succeeded);
+}
+
+void Server::OnInlineCompletion(IOEvent* event, DWORD numberOfBytes)
+{
+    assert(event);
+
+    // The handler posts the next I/O, which may complete inline again. Past a few levels, let the
+    // thread pool carry on from a fresh stack.
+    if (!InlineCompletionScope::CanEnter())
+    {
+        event->GetOverlapped().InternalHigh = numberOfBytes;
+        if (m_ThreadPools.Submit(event->GetClient()->GetThreadPool(),
+                                 Server::WorkerInlineCompletion, event, false))
+        {
+            return;
+        }
+
+        ERROR_CODE(GetLastError(), "Could not start WorkerInlineCompletion. call it directly.");
+    }
+
+    InlineCompletionScope scope;
+    HandleCompletion(event, ERROR_SUCCESS, numberOfBytes);
+}
+
+/* static */ int Server::GetClientFamilyIndex(int family) { return family == AF_INET6 ? 1 : 0; }
+
+Client* Server::AcquireClient(int family)
+{
+    InterlockedIncrement(&m_NumActiveClients);
+
+    {
+        CritSecLock lock(m_CSForFreeClients);
+
+        ClientList& freeClients = m_FreeClients[GetClientFamilyIndex(family)];
+        if (!freeClients.empty())
+        {
+            Client* client = freeClients.back();
+            freeClients.pop_back();
+
+            InterlockedIncrement(&m_NumReuseHits);
+
+            return client;
+        }
+    }
+
+    InterlockedIncrement(&m_NumReuseMisses);
+
+    Client* client = new Client(this);
+    if (!client->Create(m_IoEngine->GetSocketFlags(), family))
+    {
+        delete client;
+        InterlockedDecrement(&m_NumActiveClients);
+        return NULL;
+    }
+
+    return client;
+}
+
+bool Server::RecycleClient(Client* client)
+{
+    assert(client);
+
+    if (m_ShuttingDown || !client->IsReusable())
+    {
+        return false;
+    }
+
+    CritSecLock lock(m_CSForFreeClients);
+
+    ClientList& freeClients = m_FreeClients[GetClientFamilyIndex(client->GetFamily())];
+    if (freeClients.size() >= MAX_FREE_CLIENTS)
+    {
+        return false;
+    }
+
+    client->SetState(Client::WAIT);
+    client->SetReusable(false);
+    client->ResetSends();
+    client->ResetRecvs();
+    client->SetId(INVALID_HANDLE_ID);
+
+    freeClients.push_back(client);
+    return true;
+}
+
+void Server::OnClientReleased(Client* client)
+{
+    assert(client);
+
+    // Nothing references the client any more, so none of its I/O is outstanding and it can be
+    // destroyed right here, even inside one of its own callbacks.
+    m_IoEngine->DetachClient(client);
+
+    if (!RecycleClient(client))
+    {
+        delete client;
+    }
+
+    if (InterlockedDecrement(&m_NumActiveClients) == 0 && m_ShuttingDown)
+    {
+        SetEvent(m_hNoActiveClients);
+    }
+}
+
+void Server::AddClient(Packet* accepted)
+{
+    assert(accepted);
+
+    Client* client = accepted->GetSender();
+    assert(client);
+
+    // The socket sAcceptSocket does not inherit the properties of the socket associated with
+    // sListenSocket parameter until SO_UPDATE_ACCEPT_CONTEXT is set on the socket.
+    SOCKET listenSocket = client->GetListenSocket();
+    if (setsockopt(client->GetSocket(), SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
+                   reinterpret_cast<const char*>(&listenSocket),
+                   sizeof(listenSocket)) == SOCKET_ERROR)
+    {
+        ERROR_CODE(WSAGetLastError(), "setsockopt() for AcceptEx() failed.");
+
+        Packet::Destroy(accepted);
+        client->Release();
+    }
+    else
+    {
+        client->SetState(Client::ACCEPTED);
+
+        // Some of the listen socket's options aren't inherited by every version of Windows, so
+        // they are set once more. The connection works without them, and failures are logged.
+        if (client->GetSocketOptions() != NULL)
+        {
+            Network::ApplySocketOptions(client->GetSocket(), *client->GetSocketOptions(), true);
+        }
+
+        if (!BindClient(client))
+        {
+            Packet::Destroy(accepted);
+            client->Release();
+        }
+        else
+        {
+            if (Log::IsTraceEnabled())
+            {
+                std::string ip;
+                u_short port = 0;
+                client->GetRemoteAddress(ip, port);
+                TRACE("[%d] Accept succeeded. client address : ip[%s], port[%d]",
+                      GetCurrentThreadId(), ip.c_str(), port);
+            }
+
+            HandleId clientId = m_Clients.Add(client);
+            if (clientId == INVALID_HANDLE_ID)
+            {
+                ERROR_MSG("Too many clients.");
+
+                Packet::Destroy(accepted);
+                PostDisconnect(client);
+                client->Release();
+                return;
+            }
+
+            // The reference we have been given now belongs to m_Clients.
+            client->SetId(clientId);
+            ScheduleClientTimers(client);
+
+            EVENT_TRACE(KEYWORD_CLIENTS, WriteClientAdded(clientId, client->GetThreadPool()));
+
+            // A drain that has started since the accept completed has missed this client.
+            if (m_Draining)
+            {
+                client->PauseReads();
+            }
+
+            // What the client sent with the accept is handed over like any receive.
+            if (accepted->GetSize() > 0)
+            {
+                if (!DeliverRecv(client, accepted, accepted->GetSize()))
+                {
+                    RemoveClient(clientId);
+                    return;
+                }
+            }
+            else
+            {
+                Packet::Destroy(accepted);
+            }
+
+            if (!client->ParkRecv())
+            {
+                PostRecv(client);
+            }
+        }
+    }
+}
+
+bool Server::BindClient(Client* client)
+{
+    assert(client);
+
+    // Connect the socket to the engine. A recycled socket keeps what it has been bound to, and so
+    // the thread pool it has been given.
+    if (!client->IsBound())
+    {
+        // Socket handles are multiples of four.
+        client->SetThreadPool(m_ThreadPools.SelectPool(
+            client->GetSocket(), static_cast<ULONG_PTR>(client->GetSocket()) >> 2));
+    }
+
+    if (!m_IoEngine->AttachClient(client))
+    {
+        return false;
+    }
+
+    if (m_InlineCompletion && m_CanSkipCompletionPort && m_IoEngine->CanSkipCompletionPort() &&
+        !client->IsSkippingCompletionPort() &&
+        Network::SkipCompletionPortOnSuccess(client->GetSocket()))
+    {
+        client->SetSkipCompletionPort(true);
+    }
+
+    return true;
+}
+
+void Server::RemoveClient(HandleId clientId)
+{
+    Client* client = m_Clients.Remove(clientId);
+    if (client == NULL)
+    {
+        return;
+    }
+
+    TRACE("[%d] RemoveClient succeeded.", GetCurrentThreadId());
+    EVENT_TRACE(KEYWORD_CLIENTS, WriteClientRemoved(clientId));
+
+    // The client has made room for an accept if they were paused at the cap.
+    if (m_AcceptsPaused != 0 && !IsAtMaxClients())
+    {
+        ResumeAccepts();
+    }
+
+    client->SetId(INVALID_HANDLE_ID);
+
+    // A parked receive has nothing outstanding that would drop the frame in progress.
+    if (client->ClaimParkedRecv())
+    {
+        client->ResetFrame();
+    }
+
+    // Instead of closing the socket, disconnect it so that it can be reused for AcceptEx().
+    PostDisconnect(client);
+
+    // Drop the reference m_Clients had. The client is recycled once its I/O has finished.
+    client->Release();
+}
+
+bool Server::CanConfigure(const char* setting)
+{
+    if (!m_ShuttingDown)
+    {
+        ERROR_MSG("%s can't be changed while the server is running.", setting);
+        return false;
+    }
+    return true;
+}
+
+size_t Server::GetNumClients() { return m_Clients.GetSize(); }
+
+size_t Server::GetNumFreeClients()
+{
+    CritSecLock lock(m_CSForFreeClients);
+
+    size_t numFreeClients = 0;
+    for (int i = 0; i < NUM_CLIENT_FAMILIES; ++i)
+    {
+        numFreeClients += m_FreeClients[i].size();
+    }
+    return numFreeClients;
+}
+
+long Server::GetNumReuseHits() { return m_NumReuseHits; }
+
+long Server::GetNumReuseMisses() { return m_NumReuseMisses; }
+
+CachedAlloc::Stats Server::GetEventPoolStats() { return IOEvent::GetPoolStats(); }
+
+CachedAlloc::Stats Server::GetRecvPoolStats() { return Packet::GetPoolStats(m_RecvCapacity); }
+
+void Server::TrimPools()
+{
+    IOEvent::TrimPool();
+    Packet::TrimPools();
+}
+
+void Server::EnableInlineCompletion(bool enable) { m_InlineCompletion = enable; }
+
+bool Server::IsInlineCompletionEnabled() { return m_InlineCompletion; }
+
+void Server::EnableZeroByteRecv(bool enable) { m_ZeroByteRecv = enable; }
+
+bool Server::IsZeroByteRecvEnabled() { return m_ZeroByteRecv; }
+
+bool Server::SetSocketOptions(const Network::SocketOptions& options)
+{
+    if (!CanConfigure("The socket options"))
+    {
+        return false;
+    }
+
+    m_SocketOptions = options;
+    return true;
+}
+
+const Network::SocketOptions& Server::GetSocketOptions() { return m_SocketOptions; }
+
+bool Server::SetRecvDepth(DWORD depth)
+{
+    if (!CanConfigure("The receive depth"))
+    {
+        return false;
+    }
+
+    if (depth == 0 || depth > Client::MAX_RECV_DEPTH)
+    {
+        ERROR_MSG("The receive depth has to be between 1 and %d.", Client::MAX_RECV_DEPTH);
+        return false;
+    }
+
+    m_RecvDepth = depth;
+    return true;
+}
+
+DWORD Server::GetRecvDepth() { return m_RecvDepth; }
+
+bool Server::SetFraming(DWORD prefixSize, bool bigEndian, DWORD maxFrameSize)
+{
+    if (!CanConfigure("Framing"))
+    {
+        return false;
+    }
+
+    return m_Framer.Configure(prefixSize, bigEndian, maxFrameSize);
+}
+
+bool Server::SendFile(HandleId clientId, StaticFile* file, ULONGLONG offset, ULONGLONG size)
+{
+    assert(file);
+
+    if (!m_IoEngine->CanTransmitFiles())
+    {
+        ERROR_MSG("The I/O engine can't send files.");
+        return false;
+    }
+
+    if (offset > file->GetSize() || size > file->GetSize() - offset)
+    {
+        ERROR_MSG("The region is outside the file.");
+        return false;
+    }
+
+    Client* client = NULL;
+    m_Clients.Visit(clientId, [&client](Client* found)
+    {
+        found->AddRef();
+        client = found;
+    });
+    if (client == NULL)
+    {
+        return false;
+    }
+
+    const bool accepted = client->GetState() == Client::ACCEPTED;
+    while (accepted && size > 0)
+    {
+        const DWORD regionSize =
+            static_cast<DWORD>(std::min<ULONGLONG>(size, MAX_FILE_REGION_SIZE));
+        PostSend(client, Packet::CreateFileRegion(file, offset, regionSize));
+        offset += regionSize;
+        size -= regionSize;
+    }
+
+    client->Release();
+    return accepted;
+}
+
+void Server::SetSendWatermarks(DWORD lowWater, DWORD highWater)
+{
+    assert(lowWater <= highWater);
+
+    m_SendLowWater = lowWater;
+    m_SendHighWater = highWater;
+}
+
+void Server::SetSlowConsumerPolicy(SlowConsumerPolicy policy) { m_SlowConsumerPolicy = policy; }
+
+Server::SlowConsumerPolicy Server::GetSlowConsumerPolicy() { return m_SlowConsumerPolicy; }
+
+Server::SendStats Server::GetSendStats()
+{
+    SendStats stats = {0, 0, 0, 0, m_NumDroppedPackets, m_NumSlowDisconnects};
+
+    const DWORD highWater = m_SendHighWater;
+    m_Clients.ForEach([&stats, highWater](Client* client)
+    {
+        const DWORD pendingBytes = client->GetPendingSendBytes();
+
+        stats.totalPendingBytes += pendingBytes;
+        stats.maxPendingBytes = max(stats.maxPendingBytes, pendingBytes);
+        if (pendingBytes > highWater)
+        {
+            ++stats.numOverHighWater;
+        }
+        if (client->IsReadsPaused())
+        {
+            ++stats.numReadsPaused;
+        }
+    });
+
+    return stats;
+}
+
+void Server::GetTopPendingSends(std::vector<std::pair<HandleId, DWORD> >& pendingSends,
+                                size_t maxClients)
+{
+    pendingSends.clear();
+
+    m_Clients.ForEach([&pendingSends](Client* client)
+    {
+        const DWORD pendingBytes = client->GetPendingSendBytes();
+        if (pendingBytes > 0)
+        {
+            pendingSends.push_back(std::make_pair(client->GetId(), pendingBytes));
+        }
+    });
+
+    const size_t numClients = min(maxClients, pendingSends.size());
+    std::partial_sort(pendingSends.begin(), pendingSends.begin() + numClients, pendingSends.end(),
+                      [](const std::pair<HandleId, DWORD>& a, const std::pair<HandleId, DWORD>& b)
+                      { return a.second > b.second; });
+    pendingSends.resize(numClients);
+}
@@ -1,18 +1,42 @@
 #pragma once
 
 #include <winsock2.h>
+#include <cassert>
+#include <string>
+#include <utility>
 #include <vector>
 
-#include "common/TSingleton.h"
+#include "common/CachedAlloc.h"
+#include "common/HandleTable.h"
+#include "common/Network.h"
+#include "common/NodeThreadPools.h"
+#include "common/TimerWheel.h"
+#include "AdmissionControl.h"
+#include "DatagramListener.h"
+#include "FrameCompression.h"
+#include "Framer.h"
+
+class StaticFile;
 
 class Client;
 class Packet;
 class IOEvent;
+class IoEngine;
+
+// Groups of clients that a payload can be broadcast to.
+typedef HandleId GroupId;
 
-class Server :  public TSingleton<Server>
+// The members that make up the connection lifecycle are in Server.cpp, and the rest in a
+// Server*.cpp per component: listeners, admission, timers, datagrams, compression, engines,
+// receive dispatch and groups.
+class Server
 {
+	friend class Client;
+	friend class IoEngine;
+
 private:
-	// Callback Routine
+	// Callback Routine of the listen sockets, whose context is the Listener. The engine runs the
+	// clients' completions.
 	static void CALLBACK IoCompletionCallback(
         PTP_CALLBACK_INSTANCE Instance,
         PVOID Context,
@@ -23,56 +47,699 @@ private:
 
 	// Worker Thread Functions
 	static void CALLBACK WorkerPostAccept(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_WORK /* Work */);
+	static void CALLBACK WorkerRetryPostAccept(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_TIMER /* Timer */);
+	// With an engine on the process-wide pool, the listen sockets' accepts complete and their
+	// refills run there as well, outside of any node pool's scope.
+	static VOID CALLBACK SystemAcceptCallback(DWORD dwErrorCode, DWORD dwNumberOfBytesTransfered,
+		LPOVERLAPPED lpOverlapped);
+	static DWORD WINAPI SystemPostAccept(LPVOID Context);
+	static void CALLBACK WorkerSweepPendingAccepts(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_TIMER /* Timer */);
+	static void CALLBACK WorkerTickTimers(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_TIMER /* Timer */);
+	static void CALLBACK WorkerRunTimers(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
 
+	static void CALLBACK WorkerCloseClients(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
+	static void CALLBACK WorkerDeleteClients(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
 	static void CALLBACK WorkerAddClient(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
 	static void CALLBACK WorkerRemoveClient(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
-	static void CALLBACK WorkerProcessRecvPacket(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
+	static void CALLBACK WorkerRunRecvStrand(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
+	static void CALLBACK WorkerProcessRecvQueue(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
+	static void CALLBACK WorkerInlineCompletion(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context);
+
+	static void HandleCompletion(IOEvent* event, ULONG IoResult, ULONG_PTR NumberOfBytesTransferred);
+
+public:
+	enum
+	{
+		DEFAULT_RECV_BUFFER_SIZE = 1024,
+		DEFAULT_SEND_HIGH_WATER = 1024 * 1024,
+		DEFAULT_SEND_LOW_WATER = 256 * 1024,
+		DEFAULT_COMPLETION_BATCH_SIZE = 64,
+	};
+
+	// How client sockets do their I/O.
+	enum Engine
+	{
+		// A TP_IO per socket, with overlapped WSARecv() and WSASend().
+		THREAD_POOL,
+		// Registered I/O from registered packet pool memory. Its sockets can't be recycled.
+		REGISTERED_IO,
+		// A completion port per NUMA node with threads of our own, which dequeue completions in
+		// batches. The I/O is posted as with THREAD_POOL.
+		COMPLETION_PORT,
+		// The process-wide thread pool through BindIoCompletionCallback(), as the old thread pool
+		// sample uses it. Its threads serve no NUMA node in particular.
+		LEGACY_THREAD_POOL,
+	};
+
+	// Where the packets of a receive are handed to the receive handler.
+	enum DispatchPolicy
+	{
+		// Right in the I/O callback, before the next receive is posted. For handlers that are
+		// cheaper than a thread hop. This keeps a client's packets in order.
+		DISPATCH_INLINE,
+		// Queued on the client's thread pool, where one work item runs everything that has been
+		// queued meanwhile. This keeps a client's packets in order.
+		// Each receive is queued once, however many frames it completes.
+		DISPATCH_BATCHED,
+		// On the client's strand, which runs its packets in order on the client's thread pool
+		// while other clients' run in parallel. For slow handlers.
+		DISPATCH_STRAND,
+	};
+
+	// Takes over the packet, so it has to send or destroy it.
+	typedef void (*RecvHandler)(Packet* packet);
+	// Takes over the frames one receive has completed, all from the same client and in order.
+	// The array is only valid during the call.
+	typedef void (*RecvBatchHandler)(Packet** packets, DWORD numPackets);
+
+	// What happens to a client whose pending send bytes would go over the high water mark.
+	enum SlowConsumerPolicy
+	{
+		// Keep sending but stop receiving from it until it drains below the low water mark.
+		PAUSE_READS,
+		// Drop the packet.
+		DROP,
+		// Disconnect it.
+		DISCONNECT,
+	};
+
+	struct SendStats
+	{
+		DWORD totalPendingBytes;
+		DWORD maxPendingBytes;
+		size_t numOverHighWater;
+		size_t numReadsPaused;
+		long numDroppedPackets;
+		long numSlowDisconnects;
+	};
+
+	struct TimerStats
+	{
+		// Idle and heartbeat timers on the wheel.
+		size_t numTimers;
+		long numIdleDisconnects;
+		long numHeartbeats;
+	};
+
+	struct CompletionPortStats
+	{
+		DWORD numThreads;
+		LONGLONG numDequeues;
+		LONGLONG numCompletions;
+	};
+
+	struct ListenerStats
+	{
+		std::string ip;
+		u_short port;
+		int pool;
+		int maxPostAccept;
+		long numPostAccepts;
+	};
+
+	struct AdmissionStats
+	{
+		// Sources with a token bucket.
+		long numSources;
+		// Accepts whose connection was reset because their source was over its rate, or because
+		// the server was at its most clients.
+		long numRateLimited;
+		long numOverCapacity;
+		// Accepts from new sources that were admitted without being rate limited, as too many
+		// sources already had a bucket.
+		long numUntracked;
+		// Whether the accepts aren't being posted again, as the server is at its most clients.
+		bool acceptsPaused;
+	};
 
 public:
 	Server();
 	virtual ~Server();
 
-	bool Create(short port, int maxPostAccept);
+	// The settings that must be set before Create() aren't changed once the server is running;
+	// their setters log an error and return false instead.
+	// Must be set before Create().
+	bool SetEngine(Engine engine);
+	Engine GetEngine();
+	// The thread limits of each NUMA node's pool. Must be set before Create().
+	// maxThreads of 0 allows a thread per processor of the node.
+	bool SetThreadPoolLimits(DWORD minThreads, DWORD maxThreads);
+	void GetThreadPoolStats(std::vector<NodeThreadPools::Stats>& stats);
+	// The threads of each NUMA node's port for COMPLETION_PORT, and how many completions they
+	// take off it at a time. threadsPerPool of 0 starts a thread per processor of the node.
+	// Must be set before Create().
+	bool SetCompletionPortThreads(DWORD threadsPerPool,
+		DWORD batchSize = DEFAULT_COMPLETION_BATCH_SIZE);
+	// All zeros unless the engine is COMPLETION_PORT.
+	CompletionPortStats GetCompletionPortStats();
+
+	// recvBufferSize is the pool memory each posted receive takes up. It is rounded down to a
+	// buffer size class.
+	// If expectedClients is given, the event and receive pools are pre-warmed for that many
+	// clients and give memory back once they hold POOL_HIGH_WATER_FACTOR times that much.
+	// The first listener listens on port of every local address, with its accepts on the first
+	// NUMA node's pool.
+	bool Create(short port, int maxPostAccept, DWORD recvBufferSize = DEFAULT_RECV_BUFFER_SIZE,
+		size_t expectedClients = 0);
+	// Closes the clients on all the pools at once and waits up to SHUTDOWN_TIMEOUT_MS for them to
+	// be released. What they still had queued to send is dropped, unless Drain() came first.
 	void Destroy();
+	// Stops accepting and reading, and waits up to timeoutMs for what has been queued on the
+	// clients' sends to go out, tracing the progress. The server then only sends until it is
+	// destroyed. Returns true if everything was sent in time.
+	bool Drain(DWORD timeoutMs);
+	bool IsDraining() { return m_Draining; }
+
+	// Listens on another port or address as well, e.g. "::" next to "0.0.0.0" to take IPv6 and
+	// IPv4 connections on sockets of their own. A NULL address is every local address of the
+	// first family that resolves. The listener keeps maxPostAccept accepts posted, which run on
+	// pool and add their clients there. A pool of -1 spreads the listeners over the pools in
+	// turn. The listener and its clients get options, or the server's socket options if it is
+	// NULL, so that latency-sensitive and bulk ports can be tuned apart. Must be called before
+	// Create(). The listeners are dropped by Destroy().
+	bool AddListener(const char* address, u_short port, int maxPostAccept, int pool = -1,
+		const Network::SocketOptions* options = NULL);
+	void GetListenerStats(std::vector<ListenerStats>& stats);
+	// Receives datagrams on port of address as well, keeping numRecvs receives posted, and hands
+	// them to handler on pool along with the session of their sender. A pool of -1 spreads them
+	// over the pools like the listeners. Must be called before Create(). The datagram listeners
+	// are closed by Destroy(), which drops their sessions.
+	bool AddDatagramListener(const char* address, u_short port, int numRecvs,
+		DatagramListener::Handler handler, int pool = -1,
+		DWORD maxDatagramSize = DatagramListener::DEFAULT_MAX_DATAGRAM_SIZE);
+	void GetDatagramStats(std::vector<DatagramListener::Stats>& stats);
+	// The socket options of the listeners that haven't been given their own, including the first
+	// one, and of their clients. They are set on the listen socket before it listens, and on
+	// every accepted socket once it has taken over the listen socket's properties. Must be set
+	// before Create().
+	bool SetSocketOptions(const Network::SocketOptions& options);
+	const Network::SocketOptions& GetSocketOptions();
+
+	// Lets each source address open ratePerSecond connections a second and burst at once. The
+	// accepts over that are reset with an abortive close as soon as they complete, before they
+	// take up a client or a thread of the pools, and so can't hold up the other sources' for
+	// long. 0 admits every source, which is the default. Must be set before Create().
+	bool SetAcceptRate(DWORD ratePerSecond, DWORD burst = AdmissionControl::DEFAULT_BURST);
+	// Stops posting accepts while maxClients are connected, which leaves further connections in
+	// the listen backlog until clients have been removed. The accepts that were already posted
+	// are reset as they complete meanwhile, although the ones admitted just before the cap was
+	// reached can still take the clients a little over it. 0 doesn't limit the clients, which is
+	// the default. Must be set before Create().
+	bool SetMaxClients(size_t maxClients);
+	size_t GetMaxClients();
+	AdmissionStats GetAdmissionStats();
 
 	size_t GetNumClients();
+	// The accepts posted on all the listeners.
 	long GetNumPostAccepts();
 
+	size_t GetNumFreeClients();
+	long GetNumReuseHits();
+	long GetNumReuseMisses();
+
+	CachedAlloc::Stats GetEventPoolStats();
+	CachedAlloc::Stats GetRecvPoolStats();
+	void TrimPools();
+
+	// Handle I/O that completes synchronously on the posting thread instead of through the
+	// completion port. This applies to clients accepted from then on, and is ignored if a
+	// layered provider doesn't support it.
+	void EnableInlineCompletion(bool enable);
+	bool IsInlineCompletionEnabled();
+
+	// Waits for idle clients with a receive of zero bytes, which completes once data has arrived.
+	// It is then read into buffers from the pool without blocking, so the receive buffers only
+	// add up for clients that are sending. This applies to receives posted from then on, and is
+	// ignored by REGISTERED_IO.
+	void EnableZeroByteRecv(bool enable);
+	bool IsZeroByteRecvEnabled();
+
+	// Completes an accept only once the client has sent something, which is handed to the
+	// receive handler straight from the accept and saves a receive per connection. Connections
+	// that stay silent are never accepted, so they are dropped after timeoutSeconds.
+	// 0 accepts connections as soon as they are made, which is the default. Must be set before
+	// Create().
+	bool SetAcceptFirstData(DWORD timeoutSeconds);
+	DWORD GetAcceptFirstDataTimeout();
+
+	// Keeps depth receives outstanding on every client, which are handed over in the order they
+	// have been posted in. This keeps a fast connection's socket busy while the last receive is
+	// handled, at the cost of a receive buffer per receive. 1 posts the next receive once the last
+	// has been handled, which is the default. Zero-byte receives aren't used with more than one.
+	// Must be set before Create().
+	bool SetRecvDepth(DWORD depth);
+	DWORD GetRecvDepth();
+
+	// Splits what clients send into frames that start with their length, which are handed to the
+	// receive handler along with the other frames of their receive. prefixSize of 0 hands over
+	// every receive as it is, which is the default. Must be set before Create().
+	bool SetFraming(DWORD prefixSize, bool bigEndian = true,
+		DWORD maxFrameSize = Framer::DEFAULT_MAX_FRAME_SIZE);
+	// Compresses what is sent to the clients that ask for it with FrameCompression's hello, in
+	// batches of at least minBatchSize bytes, and decompresses what they send. Needs framing, and
+	// the frames sent to these clients have to stay under what a transport frame can take.
+	// 0 turns it off, which is the default. Must be set before Create().
+	bool SetCompression(DWORD minBatchSize = FrameCompression::DEFAULT_MIN_BATCH_SIZE);
+
+	// Either handler replaces the other. The default is EchoBatchHandler, dispatched inline.
+	// The handlers are told which server a packet came to by its sender's GetServer(), so that
+	// servers in the same process can run handlers of their own; RecvPipeline puts one together
+	// at compile time.
+	void SetRecvHandler(RecvHandler handler, DispatchPolicy policy);
+	void SetRecvBatchHandler(RecvBatchHandler handler, DispatchPolicy policy);
+	// Replaces the handlers with Handler::Run(Packet** packets, DWORD numPackets), which is
+	// compiled into the dispatch for Dispatch instead of being called through a pointer.
+	template <typename Handler, DispatchPolicy Dispatch>
+	void SetRecvPipeline();
+	DispatchPolicy GetRecvDispatchPolicy();
+	// Receives queued for DISPATCH_BATCHED that haven't reached the handler yet.
+	size_t GetNumQueuedRecvs();
+	// Sends the packet back to its sender.
+	static void EchoHandler(Packet* packet);
+	// Sends the packets back to their sender with a single send.
+	static void EchoBatchHandler(Packet** packets, DWORD numPackets);
+	// What both echo handlers do, for handlers that know the server their packets came to.
+	void Echo(Packet** packets, DWORD numPackets);
+
+	// Members are kept apart from the clients, so broadcasting to a large group doesn't hold up
+	// clients that are being added or removed. A member that has been removed from the server
+	// drops out of its groups by the next broadcast.
+	GroupId CreateGroup();
+	void DestroyGroup(GroupId groupId);
+	// Returns false if the group or the client doesn't exist.
+	bool JoinGroup(GroupId groupId, HandleId clientId);
+	void LeaveGroup(GroupId groupId, HandleId clientId);
+	size_t GetGroupSize(GroupId groupId);
+	size_t GetNumGroups();
+	// Takes over payload and queues it on every member's sends except excludedId's, sharing its
+	// data among them. Returns the number of members it has been queued for.
+	size_t Broadcast(GroupId groupId, Packet* payload, HandleId excludedId = INVALID_HANDLE_ID);
+
+	// Queues size bytes of file from offset on the client's sends, without copying them into
+	// packets. File regions don't count towards the send watermarks. Returns false if the client
+	// doesn't exist, the range is outside the file or the engine can't send files.
+	bool SendFile(HandleId clientId, StaticFile* file, ULONGLONG offset, ULONGLONG size);
+
+	void SetSendWatermarks(DWORD lowWater, DWORD highWater);
+	void SetSlowConsumerPolicy(SlowConsumerPolicy policy);
+	SlowConsumerPolicy GetSlowConsumerPolicy();
+	SendStats GetSendStats();
+	// Fills pendingSends with up to maxClients clients that have the most bytes pending.
+	void GetTopPendingSends(std::vector<std::pair<HandleId, DWORD> >& pendingSends, size_t maxClients);
+
+	// Removes clients that haven't sent anything for timeoutSeconds, so that a dead peer doesn't
+	// keep its client and receive buffer until TCP gives up. 0 leaves idle clients alone, which
+	// is the default. Must be set before Create().
+	bool SetIdleTimeout(DWORD timeoutSeconds);
+	DWORD GetIdleTimeout();
+	// Sends a copy of payload to every client that hasn't been sent anything for intervalSeconds,
+	// so that the peer can tell the connection is alive. With framing, payload has to be a whole
+	// frame. An intervalSeconds of 0 sends no heartbeats, which is the default. Must be set before
+	// Create().
+	bool SetHeartbeat(DWORD intervalSeconds, const BYTE* payload, DWORD size);
+	DWORD GetHeartbeatInterval();
+	TimerStats GetTimerStats();
+
+private:
+	enum
+	{
+		ACCEPT_RETRY_DELAY_MS = 100,
+		// How often accepts that wait for first data are checked for silent connections.
+		ACCEPT_SWEEP_INTERVAL_MS = 1000,
+		MAX_FREE_CLIENTS = 4096,
+		// Free clients are kept apart for IPv4 and IPv6.
+		NUM_CLIENT_FAMILIES = 2,
+		SHUTDOWN_TIMEOUT_MS = 10000,
+		// How often a drain checks on the sends, and how often it and Destroy() trace progress.
+		SHUTDOWN_POLL_MS = 100,
+		SHUTDOWN_PROGRESS_INTERVAL_MS = 1000,
+		// Clients that a pool closes or deletes at a time when the server is destroyed.
+		MAX_TEARDOWN_BATCH = 1024,
+		POOL_HIGH_WATER_FACTOR = 2,
+		// The first listener's accepts, adding its clients and the sweep run on the first node's
+		// pool.
+		ACCEPT_THREAD_POOL = 0,
+		// Reads one zero-byte receive's completion takes at most before waiting again.
+		MAX_DRAIN_READS = 16,
+		// Receives a strand runs before it lets other work have the thread.
+		MAX_STRAND_BATCH = 64,
+		// Frames of one receive that are handed over together. A receive that completes more
+		// is handed over in several spans.
+		MAX_SPAN_PACKETS = 64,
+		// The largest file region queued as one packet. A larger file is sent in several.
+		MAX_FILE_REGION_SIZE = 16 * 1024 * 1024,
+		// The idle and heartbeat timers are rounded up to whole ticks of the wheel.
+		TIMER_TICK_MS = 100,
+		// Expired timers a tick handles itself. The rest are handed to the pools in batches.
+		MAX_TIMER_BATCH = 256,
+	};
+
+	// A listen socket with the accepts posted on it.
+	struct Listener
+	{
+		Server* server;
+		std::string address;
+		u_short port;
+		// The pool that runs the accepts and adds their clients, which then move to their own.
+		int pool;
+		// Known once the socket has been bound.
+		int family;
+		// Taken from the server's when the listener is opened, unless it has its own.
+		bool ownOptions;
+		Network::SocketOptions options;
+		SOCKET socket;
+		TP_IO* pTPIO;
+		// Submitted whenever the accept backlog runs low.
+		TP_WORK* acceptWork;
+		// With an engine on the process-wide pool, the socket is bound with
+		// BindIoCompletionCallback() and the refills are queued with QueueUserWorkItem(), in place
+		// of pTPIO and acceptWork. Neither can be waited for, so the accepts and refills on their
+		// way are counted, along with one for the listener until it is closed.
+		bool systemPool;
+		volatile long numSystemCallbacks;
+		HANDLE systemCallbacksDone;
+		// Retries refilling when posting AcceptEx failed.
+		TP_TIMER* retryTimer;
+
+		int maxPostAccept;
+		int minPostAccept;
+		volatile long numPostAccept;
+		volatile long refillPending;
+
+		// Accepts that wait for first data, which the sweep checks for silent connections.
+		std::vector<IOEvent*> pendingAccepts;
+		CRITICAL_SECTION csForPendingAccepts;
+	};
+
+	struct Group
+	{
+		CRITICAL_SECTION cs;
+		std::vector<HandleId> members;
+	};
+
+	// The packets one receive has completed.
+	struct RecvSpan
+	{
+		// When the receive completed, as Metrics::Now() tells it.
+		LONGLONG completedAt;
+		// Hands a queued span to the handler it was dispatched for, which a later SetRecvHandler()
+		// doesn't change.
+		void (*run)(RecvSpan& span);
+		DWORD numPackets;
+		Packet* packets[MAX_SPAN_PACKETS];
+	};
+
+	// Hands a span over the way a handler and dispatch policy have been compiled into it.
+	typedef void (*RecvDispatcher)(Server& server, Client* client, RecvSpan& span);
+
+	// Receives waiting for DISPATCH_BATCHED on one thread pool.
+	struct RecvQueue
+	{
+		CRITICAL_SECTION cs;
+		std::vector<RecvSpan*> spans;
+		// Only touched by the work item that runs the queue.
+		std::vector<RecvSpan*> running;
+		Server* server;
+		bool scheduled;
+		int pool;
+	};
+
+	// A client's timers are dropped once it has been removed, as its id no longer resolves.
+	enum TimerKind
+	{
+		IDLE_TIMER,
+		HEARTBEAT_TIMER,
+	};
+
+	struct ClientTimer
+	{
+		HandleId clientId;
+		TimerKind kind;
+	};
+
+	// Expired timers handed to a pool.
+	struct TimerBatch
+	{
+		Server* server;
+		std::vector<ClientTimer> timers;
+	};
+
 private:
-	void PostAccept();
+	bool IsAccepting() { return !m_ShuttingDown && !m_Draining; }
+	// Logs an error and returns false once the server has been created, as what setting sets is
+	// read by the pools' threads without a lock.
+	bool CanConfigure(const char* setting);
+	// Also stops the sweep of silent connections, which goes over the listeners.
+	void StopAccepting();
+	void CloseClients(Client** clients, size_t numClients);
+	static void DeleteClients(Client** clients, size_t numClients);
+	// Hands clients to callback in batches spread over the pools, which get a vector of their
+	// own. The batches are waited for with the cleanup work.
+	void TearDownClients(std::vector<Client*>& clients, PTP_SIMPLE_CALLBACK callback);
+
+	// Creates the engine the server has been given, on the pools.
+	bool CreateEngine();
+
+	Listener* CreateListener(const char* address, u_short port, int maxPostAccept, int pool,
+		const Network::SocketOptions* options);
+	// Opens the listeners on their pools, and starts the sweep of silent connections if accepts
+	// wait for first data.
+	bool OpenListeners();
+	bool OpenListener(Listener* listener);
+	// Waits for the listener's accepts to be aborted and deletes it.
+	void CloseListener(Listener* listener);
+
+	bool OpenDatagramListeners();
+	void CloseDatagramListeners();
+
+	void RequestAcceptRefill(Listener* listener);
+	// Bracket an AcceptEx() on the listener's TP_IO or the process-wide pool.
+	static void StartAcceptIo(Listener* listener);
+	static void AbandonAcceptIo(Listener* listener);
+	// Drops a count of numSystemCallbacks, and wakes CloseListener() with the last one.
+	static void ReleaseSystemCallback(Listener* listener);
+	// What both listen socket callbacks do with a completed accept.
+	static void HandleAcceptCompletion(Listener* listener, IOEvent* event, ULONG IoResult,
+		DWORD numberOfBytes);
+	void PostAccept(Listener* listener);
+	bool IsAtMaxClients() { return m_MaxClients > 0 && GetNumClients() >= m_MaxClients; }
+	// Refills the listeners once a client has been removed while the accepts were paused.
+	void ResumeAccepts();
 	void PostRecv(Client* client);
+	// Tops up the client's receives to the receive depth.
+	void PostRecvs(Client* client);
+	// Whether the client waits with a zero-byte receive, which makes its socket non-blocking.
+	bool UseZeroByteRecv(Client* client);
 	void PostSend(Client* client, Packet* packet);
+	// Queues all the packets before starting a send, so that they go out together.
+	void PostSends(Client* client, Packet** packets, DWORD numPackets);
+	void PostQueuedSend(Client* client);
+	// Answers the client's hello, after which its sends are wrapped. Returns false if the ack
+	// couldn't be queued, in which case the client goes on as if the server doesn't compress.
+	bool StartCompressedSends(Client* client);
+	void PostDisconnect(Client* client);
 
-	void OnAccept(IOEvent* event);
+	void OnAccept(Listener* listener, IOEvent* event, DWORD numberOfBytes);
+	void OnAcceptFailed(Listener* listener, IOEvent* event);
+	// Whether the connection from remote may become a client. Counts the ones that may not.
+	bool AdmitClient(const sockaddr* remote, int remoteLength);
+	// Resets the connection of an accepted socket that hasn't been admitted. A client that hasn't
+	// been bound to the engine is reused with a new socket, and a bound one is closed.
+	void RejectClient(Client* client);
+	void ForgetPendingAccept(Listener* listener, IOEvent* event);
+	void SweepPendingAccepts();
+
+	// The wheel's pool timer only runs while there are idle timeouts or heartbeats.
+	bool StartTimers();
+	void StopTimers();
+	static ULONGLONG GetTimerTick();
+	static ULONGLONG GetTimerTicks(DWORD ms);
+	void ScheduleClientTimers(Client* client);
+	void TickTimers();
+	// Removes the clients whose idle timers have run out together, once their timers are done.
+	void RunTimers(const ClientTimer* timers, size_t numTimers);
 	void OnRecv(IOEvent* event, DWORD dwNumberOfBytesTransfered);
+	// Hands over the receives that have completed in order. 0 bytes ends receiving.
+	void OnSequencedRecv(IOEvent* event, DWORD numberOfBytes);
+	// Ends receiving once a receive has failed or the client has closed the connection.
+	void EndRecv(IOEvent* event);
+	// Reads what has arrived once a zero-byte receive has completed.
+	void OnRecvReady(IOEvent* event);
 	void OnSend(IOEvent* event, DWORD dwNumberOfBytesTransfered);
 	void OnClose(IOEvent* event);
+	// Destroys the receive's packet and the frame in progress once receiving has ended.
+	void DropRecv(IOEvent* event);
+	void OnDisconnect(IOEvent* event, bool succeeded);
+	void OnInlineCompletion(IOEvent* event, DWORD numberOfBytes);
+
+	// The client's socket is of the family the listener accepts.
+	Client* AcquireClient(int family);
+	static int GetClientFamilyIndex(int family);
+	bool RecycleClient(Client* client);
+	void OnClientReleased(Client* client);
+
+	// Takes over the accept's packet, which holds what the client sent first if anything.
+	void AddClient(Packet* accepted);
+	// Binds an accepted socket to the engine.
+	bool BindClient(Client* client);
+	void RemoveClient(HandleId clientId);
+
+	// Frames what a receive has completed into packet, or into the frame in progress if packet
+	// is NULL, and hands it over. Returns false if the client sent a bad frame, once the frames
+	// before it have been handed over.
+	bool DeliverRecv(Client* client, Packet* packet, DWORD numberOfBytes);
 
-	void AddClient(Client* client);
-	void RemoveClient(Client* client);
+	// Hands the span over and empties it. The span only has to outlive the call.
+	void DispatchRecv(Client* client, RecvSpan& span) { m_RecvDispatcher(*this, client, span); }
+	template <typename Handler, DispatchPolicy Dispatch>
+	static void DispatchRecvTo(Server& server, Client* client, RecvSpan& span);
+	template <typename Handler>
+	static void RunRecvSpan(RecvSpan& span);
+	// The dispatcher that hands spans to the handler set by SetRecvHandler() or
+	// SetRecvBatchHandler().
+	static RecvDispatcher GetHandlerDispatcher(DispatchPolicy policy);
+	static void RunRecvHandler(Packet** packets, DWORD numPackets);
+	static void TraceRecvDispatch(const RecvSpan& span);
+	RecvSpan* CopyRecvSpan(const RecvSpan& span);
+	void FreeRecvSpan(RecvSpan* span);
+	// Take over the copy of a span for DISPATCH_BATCHED and DISPATCH_STRAND.
+	void QueueRecvSpan(Client* client, RecvSpan* span);
+	void PostRecvStrand(Client* client, RecvSpan* span);
+	void ProcessRecvQueue(RecvQueue* queue);
+	static void RunStrandRecvSpan(PVOID context);
+	void ScheduleRecvStrand(Client* client);
 
-	void Echo(Packet* packet);
+	static void DeleteGroup(Group* group);
 
 private:
     Server& operator=(const Server&) = delete;
     Server(const Server&) = delete;
 
 private:
-	TP_IO* m_pTPIO;
-	SOCKET m_listenSocket;
+	// Fixed once Create() has opened them, until StopAccepting() takes them out to close them.
+	// Pool threads resume accepts and the console reads the stats meanwhile, so changes and
+	// reads off the thread that runs the server hold m_CSForListeners.
+	std::vector<Listener*> m_Listeners;
+	CRITICAL_SECTION m_CSForListeners;
+	TP_TIMER* m_AcceptSweepTPTIMER;
+	// Each with the pool it asked for, -1 until Create() has picked one.
+	std::vector<std::pair<DatagramListener*, int> > m_DatagramListeners;
 
-	TP_WORK* m_AcceptTPWORK; 
+	HandleTable<Client> m_Clients;
+	HandleTable<Group> m_Groups;
 
+	DWORD m_RecvCapacity;
+	Network::SocketOptions m_SocketOptions;
+
+	AdmissionControl m_Admission;
+	size_t m_MaxClients;
+	volatile long m_AcceptsPaused;
+	volatile long m_NumOverCapacity;
+
+	// Receiving first data with accepts is on while the timeout isn't 0.
+	DWORD m_AcceptDataTimeout;
+	DWORD m_AcceptDataSize;
+
+	// Disconnected clients whose socket and TP_IO can be handed to AcceptEx again, by family.
 	typedef std::vector<Client*> ClientList;
-	ClientList m_Clients;
+	ClientList m_FreeClients[NUM_CLIENT_FAMILIES];
+	CRITICAL_SECTION m_CSForFreeClients;
+	volatile long m_NumReuseHits;
+	volatile long m_NumReuseMisses;
+
+	// Clients that are not in m_FreeClients. Destroy() waits for them to be released.
+	volatile long m_NumActiveClients;
+	HANDLE m_hNoActiveClients;
 
-	int	m_MaxPostAccept;
-	volatile long m_NumPostAccept;
+	NodeThreadPools m_ThreadPools;
+	DWORD m_MinThreads;
+	DWORD m_MaxThreads;
 
-	CRITICAL_SECTION m_CSForClients;
+	volatile bool m_InlineCompletion;
+	bool m_CanSkipCompletionPort;
+	volatile bool m_ZeroByteRecv;
+	DWORD m_RecvDepth;
 
-	TP_CALLBACK_ENVIRON m_ClientTPENV;
-	TP_CLEANUP_GROUP* m_ClientTPCLEAN;
+	Framer m_Framer;
+	FrameCompression m_Compression;
+	DWORD m_CompressionMinBatch;
+	// The batch handler is used while it is set.
+	volatile RecvHandler m_RecvHandler;
+	volatile RecvBatchHandler m_RecvBatchHandler;
+	volatile DispatchPolicy m_RecvDispatch;
+	volatile RecvDispatcher m_RecvDispatcher;
+	std::vector<RecvQueue*> m_RecvQueues;
+	CachedAlloc m_RecvSpans;
+
+	volatile DWORD m_SendLowWater;
+	volatile DWORD m_SendHighWater;
+	volatile SlowConsumerPolicy m_SlowConsumerPolicy;
+	volatile long m_NumDroppedPackets;
+	volatile long m_NumSlowDisconnects;
+
+	// Every client's idle and heartbeat timers are on the wheel, which a single pool timer ticks.
+	// Receives and sends only note the time, and a timer that expires before the client has been
+	// idle for its whole timeout is scheduled again for the rest.
+	TimerWheel<ClientTimer> m_Timers;
+	TP_TIMER* m_TimerTPTIMER;
+	// The pool that the next batch of expired timers is handed to. Only the tick touches it.
+	int m_NextTimerPool;
+	DWORD m_IdleTimeout;
+	DWORD m_HeartbeatInterval;
+	std::vector<BYTE> m_HeartbeatPayload;
+	// Each heartbeat is a view of this.
+	Packet* m_Heartbeat;
+	volatile long m_NumIdleDisconnects;
+	volatile long m_NumHeartbeats;
+
+	Engine m_Engine;
+	IoEngine* m_IoEngine;
+	DWORD m_IocpThreads;
+	DWORD m_IocpBatchSize;
 
 	volatile bool m_ShuttingDown;
+	volatile bool m_Draining;
 };
+
+template <typename Handler, Server::DispatchPolicy Dispatch>
+void Server::SetRecvPipeline()
+{
+	// Spans that are already queued still go to the handler they were dispatched for.
+	m_RecvDispatch = Dispatch;
+	m_RecvDispatcher = &Server::DispatchRecvTo<Handler, Dispatch>;
+}
+
+template <typename Handler, Server::DispatchPolicy Dispatch>
+/* static */ void Server::DispatchRecvTo(Server& server, Client* client, RecvSpan& span)
+{
+	assert(client);
+	assert(span.numPackets > 0);
+
+	if (Dispatch == DISPATCH_INLINE)
+	{
+		RunRecvSpan<Handler>(span);
+	}
+	else
+	{
+		RecvSpan* copy = server.CopyRecvSpan(span);
+		copy->run = &Server::RunRecvSpan<Handler>;
+
+		if (Dispatch == DISPATCH_BATCHED)
+		{
+			server.QueueRecvSpan(client, copy);
+		}
+		else
+		{
+			server.PostRecvStrand(client, copy);
+		}
+	}
+
+	span.numPackets = 0;
+}
+
+template <typename Handler>
+/* static */ void Server::RunRecvSpan(RecvSpan& span)
+{
+	TraceRecvDispatch(span);
+	Handler::Run(span.packets, span.numPackets);
+}
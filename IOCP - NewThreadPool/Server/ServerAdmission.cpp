@@ -0,0 +1,83 @@
+#include "Server.h"
+#include "Client.h"
+#include "IoEngine.h"
+
+#include "common/Network.h"
+#include "common/Metrics.h"
+
+#include <cassert>
+
+bool Server::AdmitClient(const sockaddr* remote, int remoteLength)
+{
+    // Checked first, so that a source doesn't spend a token on a connection that is turned away
+    // anyway.
+    if (IsAtMaxClients())
+    {
+        InterlockedIncrement(&m_NumOverCapacity);
+        return false;
+    }
+
+    return m_Admission.Admit(remote, remoteLength);
+}
+
+void Server::RejectClient(Client* client)
+{
+    assert(client);
+
+    Metrics::Add(Metrics::REJECTED_ACCEPTS);
+
+    // The connection is reset rather than disconnected, which takes neither a round trip with the
+    // peer nor binding the socket to the engine, so turning a flood away costs the listener's
+    // callback two system calls per connection.
+    if (client->IsBound())
+    {
+        // A socket that is bound to the engine stays bound, so a recycled client goes with it.
+        Network::SetAbortiveClose(client->GetSocket());
+        m_IoEngine->CloseClient(client);
+        return;
+    }
+
+    // A client that was never bound gets a fresh socket and goes back to the pool once the
+    // event and the packet have released it.
+    if (client->Reopen(m_IoEngine->GetSocketFlags()))
+    {
+        client->SetReusable(true);
+    }
+}
+
+bool Server::SetAcceptRate(DWORD ratePerSecond, DWORD burst)
+{
+    if (!CanConfigure("The accept rate"))
+    {
+        return false;
+    }
+
+    m_Admission.Configure(ratePerSecond, burst);
+    return true;
+}
+
+bool Server::SetMaxClients(size_t maxClients)
+{
+    if (!CanConfigure("The client cap"))
+    {
+        return false;
+    }
+
+    m_MaxClients = maxClients;
+    return true;
+}
+
+size_t Server::GetMaxClients() { return m_MaxClients; }
+
+Server::AdmissionStats Server::GetAdmissionStats()
+{
+    const AdmissionControl::Stats admission = m_Admission.GetStats();
+
+    AdmissionStats stats;
+    stats.numSources = admission.numSources;
+    stats.numRateLimited = admission.numRateLimited;
+    stats.numOverCapacity = m_NumOverCapacity;
+    stats.numUntracked = admission.numUntracked;
+    stats.acceptsPaused = m_AcceptsPaused != 0;
+    return stats;
+}
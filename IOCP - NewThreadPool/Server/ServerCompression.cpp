@@ -0,0 +1,43 @@
+#include "Server.h"
+#include "Client.h"
+#include "Packet.h"
+
+#include "common/Log.h"
+
+#include <cassert>
+
+bool Server::StartCompressedSends(Client* client)
+{
+    assert(client);
+
+    Packet* ack = m_Compression.CreateAck();
+    if (ack == NULL)
+    {
+        ERROR_MSG("Could not allocate the compression ack.");
+        return false;
+    }
+
+    bool startSend = false;
+    if (!client->StartCompressedSends(ack, m_Compression.GetMaxBatchSize(), startSend))
+    {
+        Packet::Destroy(ack);
+        return false;
+    }
+
+    if (startSend)
+    {
+        PostQueuedSend(client);
+    }
+    return true;
+}
+
+bool Server::SetCompression(DWORD minBatchSize)
+{
+    if (!CanConfigure("Compression"))
+    {
+        return false;
+    }
+
+    m_CompressionMinBatch = minBatchSize;
+    return true;
+}
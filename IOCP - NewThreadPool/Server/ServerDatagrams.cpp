@@ -0,0 +1,59 @@
+#include "Server.h"
+
+#include "common/Log.h"
+
+bool Server::AddDatagramListener(const char* address, u_short port, int numRecvs,
+                                 DatagramListener::Handler handler, int pool,
+                                 DWORD maxDatagramSize)
+{
+    if (numRecvs <= 0)
+    {
+        ERROR_MSG("A datagram listener needs to post at least one receive. port : %d", port);
+        return false;
+    }
+
+    if (!m_ShuttingDown)
+    {
+        ERROR_MSG("Listeners can't be added while the server is running. port : %d", port);
+        return false;
+    }
+
+    m_DatagramListeners.push_back(std::make_pair(
+        new DatagramListener(address, port, numRecvs, handler, maxDatagramSize), pool));
+    return true;
+}
+
+void Server::GetDatagramStats(std::vector<DatagramListener::Stats>& stats)
+{
+    stats.clear();
+    for (size_t i = 0; i < m_DatagramListeners.size(); ++i)
+    {
+        stats.push_back(m_DatagramListeners[i].first->GetStats());
+    }
+}
+
+bool Server::OpenDatagramListeners()
+{
+    // They carry on spreading over the pools where the listeners left off.
+    for (size_t i = 0; i < m_DatagramListeners.size(); ++i)
+    {
+        int pool = m_DatagramListeners[i].second;
+        pool = pool < 0 ? static_cast<int>((m_Listeners.size() + i) % m_ThreadPools.GetNumPools())
+                        : pool % m_ThreadPools.GetNumPools();
+
+        if (!m_DatagramListeners[i].first->Open(m_ThreadPools, pool))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Server::CloseDatagramListeners()
+{
+    for (size_t i = 0; i < m_DatagramListeners.size(); ++i)
+    {
+        delete m_DatagramListeners[i].first;
+    }
+    m_DatagramListeners.clear();
+}
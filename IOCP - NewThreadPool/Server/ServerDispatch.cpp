@@ -0,0 +1,261 @@
+#include "Server.h"
+#include "Client.h"
+#include "EventTrace.h"
+#include "Packet.h"
+
+#include "common/Log.h"
+#include "common/CritSecLock.h"
+#include "common/Metrics.h"
+
+#include <cassert>
+
+void CALLBACK Server::WorkerRunRecvStrand(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
+{
+    Client* client = static_cast<Client*>(Context);
+    assert(client);
+
+    // Let the next batch queue behind the work that has piled up meanwhile.
+    if (client->GetRecvStrand().Run(MAX_STRAND_BATCH))
+    {
+        client->GetServer()->ScheduleRecvStrand(client);
+    }
+    else
+    {
+        // The reference taken when the strand was scheduled.
+        client->Release();
+    }
+}
+
+void CALLBACK Server::WorkerProcessRecvQueue(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
+{
+    RecvQueue* queue = static_cast<RecvQueue*>(Context);
+    assert(queue);
+
+    queue->server->ProcessRecvQueue(queue);
+}
+
+/* static */ Server::RecvDispatcher Server::GetHandlerDispatcher(DispatchPolicy policy)
+{
+    // The handlers are read when each span runs, so they can be changed without another
+    // dispatcher.
+    struct InstalledHandler
+    {
+        static void Run(Packet** packets, DWORD numPackets)
+        {
+            RunRecvHandler(packets, numPackets);
+        }
+    };
+
+    switch (policy)
+    {
+    case DISPATCH_INLINE:
+        return &Server::DispatchRecvTo<InstalledHandler, DISPATCH_INLINE>;
+    case DISPATCH_BATCHED:
+        return &Server::DispatchRecvTo<InstalledHandler, DISPATCH_BATCHED>;
+    case DISPATCH_STRAND:
+        return &Server::DispatchRecvTo<InstalledHandler, DISPATCH_STRAND>;
+    default:
+        assert(false);
+        return &Server::DispatchRecvTo<InstalledHandler, DISPATCH_INLINE>;
+    }
+}
+
+/* static */ void Server::RunRecvHandler(Packet** packets, DWORD numPackets)
+{
+    // The packets hold references to their sender, which is served by the server that gets them.
+    Server* server = packets[0]->GetSender()->GetServer();
+
+    RecvBatchHandler batchHandler = server->m_RecvBatchHandler;
+    if (batchHandler != NULL)
+    {
+        batchHandler(packets, numPackets);
+        return;
+    }
+
+    RecvHandler handler = server->m_RecvHandler;
+    for (DWORD i = 0; i < numPackets; ++i)
+    {
+        handler(packets[i]);
+    }
+}
+
+/* static */ void Server::TraceRecvDispatch(const RecvSpan& span)
+{
+    Metrics::RecordLatency(Metrics::DISPATCH_DELAY, span.completedAt);
+
+    if (EventTrace::IsEnabled(EventTrace::KEYWORD_DATA))
+    {
+        DWORD numberOfBytes = 0;
+        for (DWORD i = 0; i < span.numPackets; ++i)
+        {
+            numberOfBytes += span.packets[i]->GetTotalSize();
+        }
+        EventTrace::WriteRecvDispatched(span.packets[0]->GetSender()->GetId(), span.numPackets,
+                                        numberOfBytes);
+    }
+}
+
+Server::RecvSpan* Server::CopyRecvSpan(const RecvSpan& span)
+{
+    RecvSpan* copy = static_cast<RecvSpan*>(m_RecvSpans.get());
+    copy->numPackets = span.numPackets;
+    copy->completedAt = span.completedAt;
+    CopyMemory(copy->packets, span.packets, span.numPackets * sizeof(Packet*));
+    return copy;
+}
+
+void Server::FreeRecvSpan(RecvSpan* span) { m_RecvSpans.put(span); }
+
+void Server::QueueRecvSpan(Client* client, RecvSpan* span)
+{
+    RecvQueue* queue = m_RecvQueues[client->GetThreadPool()];
+
+    bool schedule = false;
+    {
+        CritSecLock lock(queue->cs);
+
+        queue->spans.push_back(span);
+        schedule = !queue->scheduled;
+        queue->scheduled = true;
+    }
+
+    // Receives queued while the queue is scheduled go with it, so only the first one submits.
+    // The queue is waited for on shutdown, since it is deleted afterwards.
+    if (schedule &&
+        !m_ThreadPools.Submit(queue->pool, Server::WorkerProcessRecvQueue, queue, true))
+    {
+        ERROR_CODE(GetLastError(), "Could not start WorkerProcessRecvQueue. call it directly.");
+
+        ProcessRecvQueue(queue);
+    }
+}
+
+void Server::PostRecvStrand(Client* client, RecvSpan* span)
+{
+    if (client->GetRecvStrand().Post(Server::RunStrandRecvSpan, span))
+    {
+        // The last packet the strand runs may hold the last reference, so the strand needs its
+        // own until it is idle again.
+        client->AddRef();
+        ScheduleRecvStrand(client);
+    }
+}
+
+void Server::ProcessRecvQueue(RecvQueue* queue)
+{
+    assert(queue);
+
+    for (;;)
+    {
+        {
+            CritSecLock lock(queue->cs);
+
+            if (queue->spans.empty())
+            {
+                queue->scheduled = false;
+                return;
+            }
+
+            queue->running.swap(queue->spans);
+        }
+
+        for (size_t i = 0; i < queue->running.size(); ++i)
+        {
+            RecvSpan* span = queue->running[i];
+            span->run(*span);
+            FreeRecvSpan(span);
+        }
+        queue->running.clear();
+    }
+}
+
+/* static */ void Server::RunStrandRecvSpan(PVOID context)
+{
+    RecvSpan* span = static_cast<RecvSpan*>(context);
+    assert(span);
+
+    // The packets hold references to their sender, which outlives them.
+    Server* server = span->packets[0]->GetSender()->GetServer();
+    span->run(*span);
+    server->FreeRecvSpan(span);
+}
+
+void Server::ScheduleRecvStrand(Client* client)
+{
+    assert(client);
+
+    if (!m_ThreadPools.Submit(client->GetThreadPool(), Server::WorkerRunRecvStrand, client, false))
+    {
+        ERROR_CODE(GetLastError(), "Could not start WorkerRunRecvStrand. call it directly.");
+
+        while (client->GetRecvStrand().Run(MAX_STRAND_BATCH))
+        {
+        }
+        client->Release();
+    }
+}
+
+/* static */ void Server::EchoHandler(Packet* packet)
+{
+    packet->GetSender()->GetServer()->Echo(&packet, 1);
+}
+
+/* static */ void Server::EchoBatchHandler(Packet** packets, DWORD numPackets)
+{
+    packets[0]->GetSender()->GetServer()->Echo(packets, numPackets);
+}
+
+void Server::Echo(Packet** packets, DWORD numPackets)
+{
+    assert(packets);
+    assert(numPackets > 0);
+    assert(packets[0]->GetSender());
+
+    // The packets hold references to their sender, so no lookup is needed to keep it alive.
+    Client* client = packets[0]->GetSender();
+
+    if (client->GetState() != Client::ACCEPTED)
+    {
+        // No client to send them back.
+        for (DWORD i = 0; i < numPackets; ++i)
+        {
+            Packet::Destroy(packets[i]);
+        }
+    }
+    else
+    {
+        PostSends(client, packets, numPackets);
+    }
+}
+
+void Server::SetRecvHandler(RecvHandler handler, DispatchPolicy policy)
+{
+    assert(handler);
+    // Set this before clearing the batch handler, so that there is always one to run.
+    m_RecvHandler = handler;
+    m_RecvBatchHandler = NULL;
+    m_RecvDispatch = policy;
+    m_RecvDispatcher = GetHandlerDispatcher(policy);
+}
+
+void Server::SetRecvBatchHandler(RecvBatchHandler handler, DispatchPolicy policy)
+{
+    assert(handler);
+    m_RecvBatchHandler = handler;
+    m_RecvDispatch = policy;
+    m_RecvDispatcher = GetHandlerDispatcher(policy);
+}
+
+Server::DispatchPolicy Server::GetRecvDispatchPolicy() { return m_RecvDispatch; }
+
+size_t Server::GetNumQueuedRecvs()
+{
+    size_t numQueued = 0;
+    for (size_t i = 0; i < m_RecvQueues.size(); ++i)
+    {
+        CritSecLock lock(m_RecvQueues[i]->cs);
+
+        numQueued += m_RecvQueues[i]->spans.size();
+    }
+    return numQueued;
+}
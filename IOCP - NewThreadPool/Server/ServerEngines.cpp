@@ -0,0 +1,91 @@
+#include "Server.h"
+#include "IoEngine.h"
+#include "IocpEngine.h"
+#include "LegacyPoolEngine.h"
+#include "RioEngine.h"
+#include "ThreadPoolEngine.h"
+
+bool Server::CreateEngine()
+{
+    switch (m_Engine)
+    {
+    case REGISTERED_IO:
+        m_IoEngine = new RioEngine(m_RecvDepth);
+        break;
+
+    case COMPLETION_PORT:
+        m_IoEngine = new IocpEngine(m_IocpThreads, m_IocpBatchSize);
+        break;
+
+    case LEGACY_THREAD_POOL:
+        m_IoEngine = new LegacyPoolEngine();
+        break;
+
+    default:
+        m_IoEngine = new ThreadPoolEngine();
+        break;
+    }
+
+    if (!m_IoEngine->Create(m_ThreadPools))
+    {
+        delete m_IoEngine;
+        m_IoEngine = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool Server::SetEngine(Engine engine)
+{
+    if (!CanConfigure("The engine"))
+    {
+        return false;
+    }
+
+    m_Engine = engine;
+    return true;
+}
+
+Server::Engine Server::GetEngine() { return m_Engine; }
+
+bool Server::SetThreadPoolLimits(DWORD minThreads, DWORD maxThreads)
+{
+    if (!CanConfigure("The thread pool limits"))
+    {
+        return false;
+    }
+
+    m_MinThreads = minThreads;
+    m_MaxThreads = maxThreads;
+    return true;
+}
+
+void Server::GetThreadPoolStats(std::vector<NodeThreadPools::Stats>& stats)
+{
+    m_ThreadPools.GetStats(stats);
+}
+
+bool Server::SetCompletionPortThreads(DWORD threadsPerPool, DWORD batchSize)
+{
+    if (!CanConfigure("The completion port threads"))
+    {
+        return false;
+    }
+
+    m_IocpThreads = threadsPerPool;
+    m_IocpBatchSize = batchSize;
+    return true;
+}
+
+Server::CompletionPortStats Server::GetCompletionPortStats()
+{
+    CompletionPortStats stats;
+    ZeroMemory(&stats, sizeof(stats));
+
+    if (m_Engine == COMPLETION_PORT && m_IoEngine != NULL)
+    {
+        static_cast<IocpEngine*>(m_IoEngine)->GetStats(stats.numThreads, stats.numDequeues,
+                                                       stats.numCompletions);
+    }
+    return stats;
+}
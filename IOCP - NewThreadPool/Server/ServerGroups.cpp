@@ -0,0 +1,144 @@
+#include "Server.h"
+#include "Client.h"
+#include "Packet.h"
+
+#include "common/Log.h"
+#include "common/CritSecLock.h"
+
+#include <algorithm>
+#include <cassert>
+
+GroupId Server::CreateGroup()
+{
+    Group* group = new Group();
+    InitializeCriticalSection(&group->cs);
+
+    const GroupId groupId = m_Groups.Add(group);
+    if (groupId == INVALID_HANDLE_ID)
+    {
+        ERROR_MSG("Too many groups.");
+        DeleteGroup(group);
+    }
+    return groupId;
+}
+
+void Server::DestroyGroup(GroupId groupId)
+{
+    // Broadcasts only use a group while they hold its slot, so nothing uses it once it's removed.
+    Group* group = m_Groups.Remove(groupId);
+    if (group != NULL)
+    {
+        DeleteGroup(group);
+    }
+}
+
+bool Server::JoinGroup(GroupId groupId, HandleId clientId)
+{
+    if (!m_Clients.Contains(clientId))
+    {
+        return false;
+    }
+
+    return m_Groups.Visit(groupId, [clientId](Group* group)
+    {
+        CritSecLock lock(group->cs);
+
+        if (std::find(group->members.begin(), group->members.end(), clientId) ==
+            group->members.end())
+        {
+            group->members.push_back(clientId);
+        }
+    });
+}
+
+void Server::LeaveGroup(GroupId groupId, HandleId clientId)
+{
+    m_Groups.Visit(groupId, [clientId](Group* group)
+    {
+        CritSecLock lock(group->cs);
+
+        std::vector<HandleId>::iterator it =
+            std::find(group->members.begin(), group->members.end(), clientId);
+        if (it != group->members.end())
+        {
+            // Order doesn't matter, so fill the hole with the last member.
+            *it = group->members.back();
+            group->members.pop_back();
+        }
+    });
+}
+
+size_t Server::GetGroupSize(GroupId groupId)
+{
+    size_t size = 0;
+    m_Groups.Visit(groupId, [&size](Group* group)
+    {
+        CritSecLock lock(group->cs);
+
+        size = group->members.size();
+    });
+    return size;
+}
+
+size_t Server::GetNumGroups() { return m_Groups.GetSize(); }
+
+size_t Server::Broadcast(GroupId groupId, Packet* payload, HandleId excludedId)
+{
+    assert(payload);
+
+    // Work on a copy, so that members can join and leave while the payload is being queued.
+    std::vector<HandleId> members;
+    m_Groups.Visit(groupId, [&members](Group* group)
+    {
+        CritSecLock lock(group->cs);
+
+        members = group->members;
+    });
+
+    std::vector<HandleId> removed;
+    size_t numQueued = 0;
+
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+        if (members[i] == excludedId)
+        {
+            continue;
+        }
+
+        // Only hold the client's shard for the lookup. Sending may remove the client.
+        Client* client = NULL;
+        if (!m_Clients.Visit(members[i], [&client](Client* member)
+            {
+                member->AddRef();
+                client = member;
+            }))
+        {
+            removed.push_back(members[i]);
+            continue;
+        }
+
+        if (client->GetState() == Client::ACCEPTED)
+        {
+            PostSend(client, Packet::CreateShared(payload));
+            ++numQueued;
+        }
+
+        client->Release();
+    }
+
+    // Every member has its own views, which keep the data alive until they have been sent.
+    Packet::Destroy(payload);
+
+    for (size_t i = 0; i < removed.size(); ++i)
+    {
+        LeaveGroup(groupId, removed[i]);
+    }
+
+    return numQueued;
+}
+
+/* static */ void Server::DeleteGroup(Group* group)
+{
+    DeleteCriticalSection(&group->cs);
+    delete group;
+}
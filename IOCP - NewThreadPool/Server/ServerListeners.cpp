@@ -0,0 +1,777 @@
+#include "Server.h"
+#include "Client.h"
+#include "EventTrace.h"
+#include "IOEvent.h"
+#include "Packet.h"
+
+#include "common/Log.h"
+#include "common/Network.h"
+#include "common/CritSecLock.h"
+#include "common/Metrics.h"
+#include "common/ThreadPoolTimer.h"
+
+#include <algorithm>
+#include <cassert>
+
+/* static */ void CALLBACK
+Server::IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+                             PVOID Overlapped, ULONG IoResult, ULONG_PTR NumberOfBytesTransferred,
+                             PTP_IO /* Io */)
+{
+    Listener* listener = static_cast<Listener*>(Context);
+    assert(listener);
+
+    NodeThreadPools::Scope scope(listener->server->m_ThreadPools, listener->pool);
+
+    IOEvent* event = CONTAINING_RECORD(Overlapped, IOEvent, GetOverlapped());
+    assert(event);
+
+    HandleAcceptCompletion(listener, event, IoResult,
+                           static_cast<DWORD>(NumberOfBytesTransferred));
+}
+
+/* static */ VOID CALLBACK Server::SystemAcceptCallback(DWORD dwErrorCode,
+                                                       DWORD dwNumberOfBytesTransfered,
+                                                       LPOVERLAPPED lpOverlapped)
+{
+    IOEvent* event = CONTAINING_RECORD(lpOverlapped, IOEvent, GetOverlapped());
+    assert(event);
+
+    // The callback has no context of its own, so the event carries the listener.
+    Listener* listener = static_cast<Listener*>(event->GetContext());
+    assert(listener);
+
+    // The process-wide pool's threads belong to no node, so no scope is opened here.
+    HandleAcceptCompletion(listener, event, dwErrorCode, dwNumberOfBytesTransfered);
+
+    ReleaseSystemCallback(listener);
+}
+
+/* static */ void Server::HandleAcceptCompletion(Listener* listener, IOEvent* event,
+                                                 ULONG IoResult, DWORD numberOfBytes)
+{
+    assert(event->GetType() == IOEvent::ACCEPT);
+
+    EVENT_TRACE(KEYWORD_IO, WriteIoCompleted(event, INVALID_HANDLE_ID, IOEvent::ACCEPT,
+                                             numberOfBytes, IoResult));
+
+    if (IoResult != ERROR_SUCCESS)
+    {
+        ERROR_CODE(IoResult, "AcceptEx() failed. port[%d]", listener->port);
+        Metrics::RecordFailure(IoResult);
+
+        listener->server->OnAcceptFailed(listener, event);
+    }
+    else
+    {
+        Metrics::Add(Metrics::ACCEPTS);
+        if (numberOfBytes > 0)
+        {
+            Metrics::Add(Metrics::RECVS);
+            Metrics::Add(Metrics::RECV_BYTES, numberOfBytes);
+        }
+        listener->server->OnAccept(listener, event, numberOfBytes);
+    }
+
+    IOEvent::Destroy(event);
+}
+
+void CALLBACK
+Server::WorkerPostAccept(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_WORK /* Work */)
+{
+    Listener* listener = static_cast<Listener*>(Context);
+    assert(listener);
+
+    NodeThreadPools::Scope scope(listener->server->m_ThreadPools, listener->pool);
+
+    // Clear the flag before refilling so that an accept completing while we are posting can queue
+    // the next refill.
+    InterlockedExchange(&listener->refillPending, 0);
+
+    if (listener->server->IsAccepting())
+    {
+        listener->server->PostAccept(listener);
+    }
+}
+
+/* static */ DWORD WINAPI Server::SystemPostAccept(LPVOID Context)
+{
+    Listener* listener = static_cast<Listener*>(Context);
+    assert(listener);
+
+    InterlockedExchange(&listener->refillPending, 0);
+
+    if (listener->server->IsAccepting())
+    {
+        listener->server->PostAccept(listener);
+    }
+
+    ReleaseSystemCallback(listener);
+    return 0;
+}
+
+void CALLBACK Server::WorkerRetryPostAccept(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+                                            PTP_TIMER /* Timer */)
+{
+    Listener* listener = static_cast<Listener*>(Context);
+    assert(listener);
+
+    NodeThreadPools::Scope scope(listener->server->m_ThreadPools, listener->pool);
+
+    listener->server->RequestAcceptRefill(listener);
+}
+
+void CALLBACK Server::WorkerSweepPendingAccepts(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+                                                PTP_TIMER /* Timer */)
+{
+    Server* server = static_cast<Server*>(Context);
+    assert(server);
+
+    NodeThreadPools::Scope scope(server->m_ThreadPools, ACCEPT_THREAD_POOL);
+
+    server->SweepPendingAccepts();
+}
+
+Server::Listener* Server::CreateListener(const char* address, u_short port, int maxPostAccept,
+                                         int pool, const Network::SocketOptions* options)
+{
+    assert(maxPostAccept > 0);
+
+    Listener* listener = new Listener();
+    listener->server = this;
+    listener->address = address != NULL ? address : "";
+    listener->port = port;
+    listener->pool = pool;
+    listener->family = AF_UNSPEC;
+    listener->ownOptions = options != NULL;
+    if (options != NULL)
+    {
+        listener->options = *options;
+    }
+    listener->socket = INVALID_SOCKET;
+    listener->pTPIO = NULL;
+    listener->acceptWork = NULL;
+    listener->systemPool = false;
+    listener->numSystemCallbacks = 0;
+    listener->systemCallbacksDone = NULL;
+    listener->retryTimer = NULL;
+    listener->maxPostAccept = maxPostAccept;
+    // Refill the accept backlog once it has drained by a quarter. This keeps the number of
+    // pending AcceptEx calls steady during a connection storm without queueing a refill per
+    // accept.
+    listener->minPostAccept = max(1, maxPostAccept - maxPostAccept / 4);
+    listener->numPostAccept = 0;
+    listener->refillPending = 0;
+    InitializeCriticalSection(&listener->csForPendingAccepts);
+
+    return listener;
+}
+
+bool Server::OpenListeners()
+{
+    // Spread the listeners that have no pool of their own over the pools in turn.
+    for (size_t i = 0; i < m_Listeners.size(); ++i)
+    {
+        Listener* listener = m_Listeners[i];
+        if (listener->pool < 0)
+        {
+            listener->pool = static_cast<int>(i % m_ThreadPools.GetNumPools());
+        }
+        else
+        {
+            listener->pool %= m_ThreadPools.GetNumPools();
+        }
+
+        if (!OpenListener(listener))
+        {
+            return false;
+        }
+    }
+
+    // Accepts that wait for first data don't complete for a connection that sends nothing, so
+    // check on them now and then.
+    if (m_AcceptDataSize > 0)
+    {
+        m_AcceptSweepTPTIMER =
+            CreateThreadpoolTimer(Server::WorkerSweepPendingAccepts, this,
+                                  m_ThreadPools.GetEnvironment(ACCEPT_THREAD_POOL));
+        if (m_AcceptSweepTPTIMER == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not create the timer for silent connections.");
+            return false;
+        }
+
+        SetRelativeTimer(m_AcceptSweepTPTIMER, ACCEPT_SWEEP_INTERVAL_MS, ACCEPT_SWEEP_INTERVAL_MS);
+    }
+    return true;
+}
+
+bool Server::OpenListener(Listener* listener)
+{
+    assert(listener);
+
+    // Create Listen Socket
+    listener->socket = Network::CreateSocket(
+        true, listener->port, 0, listener->address.empty() ? NULL : listener->address.c_str());
+    if (listener->socket == INVALID_SOCKET)
+    {
+        return false;
+    }
+
+    // The accepted sockets have to be of the family the address has resolved to.
+    listener->family = Network::GetSocketFamily(listener->socket);
+
+    // Make the address re-usable to re-run the same server instantly.
+    bool reuseAddr = true;
+    if (setsockopt(listener->socket, SOL_SOCKET, SO_REUSEADDR,
+                   reinterpret_cast<const char*>(&reuseAddr), sizeof(reuseAddr)) == SOCKET_ERROR)
+    {
+        ERROR_CODE(WSAGetLastError(), "setsockopt() failed with SO_REUSEADDR.");
+        return false;
+    }
+
+    // Accepted sockets inherit these, and some of them, like the buffer sizes that the window is
+    // scaled for, only count if they are set before the connection is made.
+    if (!listener->ownOptions)
+    {
+        listener->options = m_SocketOptions;
+    }
+    if (!Network::ApplySocketOptions(listener->socket, listener->options))
+    {
+        return false;
+    }
+
+    TP_CALLBACK_ENVIRON* environment = m_ThreadPools.GetEnvironment(listener->pool);
+    listener->systemPool = m_IoEngine->UsesSystemThreadPool();
+    if (listener->systemPool)
+    {
+        // The listener holds a count of its own until CloseListener() lets go of it.
+        listener->systemCallbacksDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (listener->systemCallbacksDone == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not create the listener's callbacks event.");
+            return false;
+        }
+        listener->numSystemCallbacks = 1;
+
+        if (!BindIoCompletionCallback(reinterpret_cast<HANDLE>(listener->socket),
+                                      Server::SystemAcceptCallback, 0))
+        {
+            ERROR_CODE(GetLastError(), "BindIoCompletionCallback() failed for the listen socket.");
+            return false;
+        }
+    }
+    else
+    {
+        // Create ThreaddPool for socket IO. Each accept starts it when it is posted.
+        listener->pTPIO = CreateThreadpoolIo(reinterpret_cast<HANDLE>(listener->socket),
+                                             Server::IoCompletionCallback, listener, environment);
+        if (listener->pTPIO == NULL)
+        {
+            ERROR_CODE(WSAGetLastError(), "Could not assign the listen socket to the IOCP handle.");
+            return false;
+        }
+    }
+
+    // Start listening
+    if (listen(listener->socket, SOMAXCONN) == SOCKET_ERROR)
+    {
+        ERROR_CODE(WSAGetLastError(), "listen() failed.");
+        return false;
+    }
+
+    // Create Accept worker. It is submitted whenever the accept backlog runs low. On the
+    // process-wide pool, the refills are queued one by one instead.
+    if (!listener->systemPool)
+    {
+        listener->acceptWork =
+            CreateThreadpoolWork(Server::WorkerPostAccept, listener, environment);
+        if (listener->acceptWork == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not create AcceptEx worker TPIO.");
+            return false;
+        }
+    }
+
+    // The retry timer stays on the node's pool, whichever pool the accepts complete on.
+    // Create a timer to retry refilling when posting AcceptEx failed.
+    listener->retryTimer =
+        CreateThreadpoolTimer(Server::WorkerRetryPostAccept, listener, environment);
+    if (listener->retryTimer == NULL)
+    {
+        ERROR_CODE(GetLastError(), "Could not create AcceptEx retry timer.");
+        return false;
+    }
+
+    std::string ip;
+    u_short port = 0;
+    Network::GetLocalAddress(listener->socket, ip, port);
+    TRACE("Listening : ip[%s], port[%d], pool[%d], max accept[%d]", ip.c_str(), port,
+          listener->pool, listener->maxPostAccept);
+
+    return true;
+}
+
+void Server::CloseListener(Listener* listener)
+{
+    assert(listener);
+
+    if (listener->retryTimer != NULL)
+    {
+        SetThreadpoolTimer(listener->retryTimer, NULL, 0, 0);
+        WaitForThreadpoolTimerCallbacks(listener->retryTimer, true);
+        CloseThreadpoolTimer(listener->retryTimer);
+        listener->retryTimer = NULL;
+    }
+
+    if (listener->acceptWork != NULL)
+    {
+        WaitForThreadpoolWorkCallbacks(listener->acceptWork, true);
+        CloseThreadpoolWork(listener->acceptWork);
+        listener->acceptWork = NULL;
+    }
+
+    if (listener->socket != INVALID_SOCKET)
+    {
+        Network::CloseSocket(listener->socket);
+        CancelIoEx(reinterpret_cast<HANDLE>(listener->socket), NULL);
+        listener->socket = INVALID_SOCKET;
+    }
+
+    // Let the aborted accepts run so that they release their clients.
+    if (listener->pTPIO != NULL)
+    {
+        WaitForThreadpoolIoCallbacks(listener->pTPIO, false);
+        CloseThreadpoolIo(listener->pTPIO);
+        listener->pTPIO = NULL;
+    }
+
+    // The process-wide pool can't be waited for, so wait for the count of its callbacks to drop
+    // to zero once the listener has let go of its own.
+    if (listener->systemCallbacksDone != NULL)
+    {
+        if (InterlockedDecrement(&listener->numSystemCallbacks) != 0)
+        {
+            WaitForSingleObject(listener->systemCallbacksDone, INFINITE);
+        }
+        CloseHandle(listener->systemCallbacksDone);
+        listener->systemCallbacksDone = NULL;
+    }
+
+    assert(listener->pendingAccepts.empty());
+    DeleteCriticalSection(&listener->csForPendingAccepts);
+    delete listener;
+}
+
+bool Server::AddListener(const char* address, u_short port, int maxPostAccept, int pool,
+                         const Network::SocketOptions* options)
+{
+    if (maxPostAccept <= 0)
+    {
+        ERROR_MSG("A listener needs to post at least one accept. port : %d", port);
+        return false;
+    }
+
+    if (!m_ShuttingDown)
+    {
+        ERROR_MSG("Listeners can't be added while the server is running. port : %d", port);
+        return false;
+    }
+
+    CritSecLock lock(m_CSForListeners);
+    m_Listeners.push_back(CreateListener(address, port, maxPostAccept, pool, options));
+    return true;
+}
+
+void Server::GetListenerStats(std::vector<ListenerStats>& stats)
+{
+    stats.clear();
+
+    CritSecLock lock(m_CSForListeners);
+    for (size_t i = 0; i < m_Listeners.size(); ++i)
+    {
+        const Listener* listener = m_Listeners[i];
+
+        ListenerStats stat;
+        stat.port = listener->port;
+        if (!Network::GetLocalAddress(listener->socket, stat.ip, stat.port))
+        {
+            stat.ip = listener->address;
+        }
+        stat.pool = listener->pool;
+        stat.maxPostAccept = listener->maxPostAccept;
+        stat.numPostAccepts = listener->numPostAccept;
+        stats.push_back(stat);
+    }
+}
+
+void Server::StopAccepting()
+{
+    if (m_AcceptSweepTPTIMER != NULL)
+    {
+        SetThreadpoolTimer(m_AcceptSweepTPTIMER, NULL, 0, 0);
+        WaitForThreadpoolTimerCallbacks(m_AcceptSweepTPTIMER, true);
+        CloseThreadpoolTimer(m_AcceptSweepTPTIMER);
+        m_AcceptSweepTPTIMER = NULL;
+    }
+
+    // Take the listeners out first, so that ResumeAccepts() and the stats no longer reach them
+    // once they are being closed. A refill that has been requested already is waited for by
+    // CloseListener().
+    std::vector<Listener*> listeners;
+    {
+        CritSecLock lock(m_CSForListeners);
+        listeners.swap(m_Listeners);
+    }
+
+    // The accepts that are aborted by closing the listen sockets don't refill, as the server no
+    // longer accepts.
+    for (size_t i = 0; i < listeners.size(); ++i)
+    {
+        CloseListener(listeners[i]);
+    }
+}
+
+void Server::RequestAcceptRefill(Listener* listener)
+{
+    assert(listener);
+
+    if (!IsAccepting())
+    {
+        return;
+    }
+
+    // Only one refill needs to be queued at a time. It posts up to maxPostAccept in one batch.
+    if (InterlockedCompareExchange(&listener->refillPending, 1, 0) != 0)
+    {
+        return;
+    }
+
+    if (!listener->systemPool)
+    {
+        SubmitThreadpoolWork(listener->acceptWork);
+        return;
+    }
+
+    InterlockedIncrement(&listener->numSystemCallbacks);
+    if (!QueueUserWorkItem(Server::SystemPostAccept, listener, WT_EXECUTEDEFAULT))
+    {
+        ERROR_CODE(GetLastError(), "Could not queue the AcceptEx refill.");
+
+        ReleaseSystemCallback(listener);
+        InterlockedExchange(&listener->refillPending, 0);
+        SetRelativeTimer(listener->retryTimer, ACCEPT_RETRY_DELAY_MS, 0);
+    }
+}
+
+/* static */ void Server::StartAcceptIo(Listener* listener)
+{
+    if (listener->systemPool)
+    {
+        InterlockedIncrement(&listener->numSystemCallbacks);
+    }
+    else
+    {
+        StartThreadpoolIo(listener->pTPIO);
+    }
+}
+
+/* static */ void Server::AbandonAcceptIo(Listener* listener)
+{
+    if (listener->systemPool)
+    {
+        ReleaseSystemCallback(listener);
+    }
+    else
+    {
+        CancelThreadpoolIo(listener->pTPIO);
+    }
+}
+
+/* static */ void Server::ReleaseSystemCallback(Listener* listener)
+{
+    // CloseListener() may delete the listener as soon as the event is set.
+    if (InterlockedDecrement(&listener->numSystemCallbacks) == 0)
+    {
+        SetEvent(listener->systemCallbacksDone);
+    }
+}
+
+void Server::PostAccept(Listener* listener)
+{
+    assert(listener);
+
+    // Connections over the cap wait in the listen backlog, which the kernel bounds, until a
+    // client has been removed. The flag is raised before checking again, so that a removal in
+    // between either sees it or leaves room that is seen here.
+    if (IsAtMaxClients())
+    {
+        InterlockedExchange(&m_AcceptsPaused, 1);
+        if (IsAtMaxClients())
+        {
+            TRACE("[%d] Accepts paused at %Iu clients : port[%d]", GetCurrentThreadId(),
+                  m_MaxClients, listener->port);
+            return;
+        }
+    }
+
+    // Reserve the slots we are going to fill so that two refills running at the same time never
+    // post more than maxPostAccept.
+    // If the number of clients is too big, we can just stop posting accept.
+    // That's one of the benefits from AcceptEx.
+    int count = 0;
+    for (;;)
+    {
+        long numPostAccept = listener->numPostAccept;
+        count = listener->maxPostAccept - numPostAccept;
+        if (count <= 0)
+        {
+            return;
+        }
+
+        if (InterlockedCompareExchange(&listener->numPostAccept, listener->maxPostAccept,
+                                       numPostAccept) == numPostAccept)
+        {
+            break;
+        }
+    }
+
+    int i = 0;
+    for (; i < count; ++i)
+    {
+        Client* client = AcquireClient(listener->family);
+        if (client == NULL)
+        {
+            break;
+        }
+        client->SetListenSocket(listener->socket, &listener->options);
+
+        // Every accept has a buffer of its own, which takes the first data and the addresses
+        // behind it.
+        Packet* packet = Packet::Create(
+            client, m_AcceptDataSize > 0 ? m_RecvCapacity : 2 * Network::ACCEPT_ADDRESS_SIZE);
+        assert(packet);
+        assert(packet->GetNext() == NULL);
+
+        IOEvent* event = IOEvent::Create(IOEvent::ACCEPT, client, packet);
+        assert(event);
+        event->SetContext(listener);
+
+        if (m_AcceptDataSize > 0)
+        {
+            CritSecLock lock(listener->csForPendingAccepts);
+            listener->pendingAccepts.push_back(event);
+        }
+
+        // The listen socket doesn't skip the completion port, so an accept that succeeds
+        // synchronously still completes through it.
+        EVENT_TRACE(KEYWORD_IO, WriteIoPosted(event, INVALID_HANDLE_ID, IOEvent::ACCEPT,
+                                              m_AcceptDataSize));
+        StartAcceptIo(listener);
+        if (!Network::AcceptEx(listener->socket, client->GetSocket(), packet->GetData(),
+                               m_AcceptDataSize, &event->GetOverlapped()))
+        {
+            int error = WSAGetLastError();
+
+            if (error != ERROR_IO_PENDING)
+            {
+                AbandonAcceptIo(listener);
+
+                ERROR_CODE(error, "AcceptEx() failed.");
+                Metrics::RecordFailure(error);
+
+                // These drop the only references, which destroys the client.
+                ForgetPendingAccept(listener, event);
+                Packet::Destroy(packet);
+                IOEvent::Destroy(event);
+                break;
+            }
+        }
+    }
+
+    // Give back the slots we could not fill.
+    if (i < count)
+    {
+        InterlockedExchangeAdd(&listener->numPostAccept, i - count);
+
+        // Nothing may complete to trigger the next refill, so try again a little later.
+        if (IsAccepting())
+        {
+            SetRelativeTimer(listener->retryTimer, ACCEPT_RETRY_DELAY_MS, 0);
+        }
+    }
+
+    TRACE("[%d] Post AcceptEx : port[%d], %d", GetCurrentThreadId(), listener->port,
+          listener->numPostAccept);
+}
+
+void Server::OnAccept(Listener* listener, IOEvent* event, DWORD numberOfBytes)
+{
+    assert(listener);
+    assert(event);
+
+    TRACE("[%d] Enter OnAccept()", GetCurrentThreadId());
+    assert(event->GetType() == IOEvent::ACCEPT);
+
+    ForgetPendingAccept(listener, event);
+
+    // Check if we need to post more accept requests.
+    if (InterlockedDecrement(&listener->numPostAccept) < listener->minPostAccept)
+    {
+        RequestAcceptRefill(listener);
+    }
+
+    // Add client in a different thread.
+    // It is because we need to return this function ASAP so that this IO worker thread can process
+    // the other IO notifications.
+    // If adding client is fast enough, we can call it here but I assume it's slow.
+    Packet* packet = event->GetPacket();
+    if (IsAccepting())
+    {
+        Client* client = event->GetClient();
+
+        // The addresses are behind the first data, which the packet hands over.
+        sockaddr* remote = NULL;
+        int remoteLength = 0;
+        Network::GetAcceptExRemoteAddress(packet->GetData(), m_AcceptDataSize, &remote,
+                                          &remoteLength);
+
+        // A connection that isn't admitted is turned away right here, so that a flood doesn't
+        // queue up on the pools ahead of the clients that are. The event's and the packet's
+        // references keep the client until its connection has been reset.
+        if (!AdmitClient(remote, remoteLength))
+        {
+            RejectClient(client);
+            Packet::Destroy(packet);
+        }
+        else
+        {
+            // The event's reference goes away when we return, so take one for AddClient().
+            client->AddRef();
+            client->SetRemoteAddress(remote, remoteLength);
+
+            packet->SetSize(numberOfBytes);
+
+            if (!m_ThreadPools.Submit(listener->pool, Server::WorkerAddClient, packet, true))
+            {
+                ERROR_CODE(GetLastError(), "Could not start WorkerAddClient.");
+
+                AddClient(packet);
+            }
+        }
+    }
+    else
+    {
+        Packet::Destroy(packet);
+    }
+
+    TRACE("[%d] Leave OnAccept()", GetCurrentThreadId());
+}
+
+void Server::ResumeAccepts()
+{
+    if (InterlockedExchange(&m_AcceptsPaused, 0) == 0)
+    {
+        return;
+    }
+
+    // This runs on the pool that removed a client, which may be while the server stops.
+    CritSecLock lock(m_CSForListeners);
+    for (size_t i = 0; i < m_Listeners.size(); ++i)
+    {
+        RequestAcceptRefill(m_Listeners[i]);
+    }
+}
+
+void Server::OnAcceptFailed(Listener* listener, IOEvent* event)
+{
+    assert(listener);
+    assert(event);
+    assert(event->GetType() == IOEvent::ACCEPT);
+
+    ForgetPendingAccept(listener, event);
+
+    if (InterlockedDecrement(&listener->numPostAccept) < listener->minPostAccept)
+    {
+        RequestAcceptRefill(listener);
+    }
+
+    // The client is not reusable, so it is destroyed once the event and the packet release it.
+    Packet::Destroy(event->GetPacket());
+}
+
+void Server::ForgetPendingAccept(Listener* listener, IOEvent* event)
+{
+    if (m_AcceptDataSize == 0)
+    {
+        return;
+    }
+
+    CritSecLock lock(listener->csForPendingAccepts);
+
+    std::vector<IOEvent*>& pendingAccepts = listener->pendingAccepts;
+    std::vector<IOEvent*>::iterator it =
+        std::find(pendingAccepts.begin(), pendingAccepts.end(), event);
+    if (it != pendingAccepts.end())
+    {
+        *it = pendingAccepts.back();
+        pendingAccepts.pop_back();
+    }
+}
+
+void Server::SweepPendingAccepts()
+{
+    CritSecLock lock(m_CSForListeners);
+    for (size_t i = 0; i < m_Listeners.size(); ++i)
+    {
+        Listener* listener = m_Listeners[i];
+
+        CritSecLock pendingLock(listener->csForPendingAccepts);
+
+        for (size_t j = 0; j < listener->pendingAccepts.size(); ++j)
+        {
+            IOEvent* event = listener->pendingAccepts[j];
+
+            // How long the socket has been connected, or 0xFFFFFFFF while nobody has connected.
+            DWORD seconds = 0;
+            int length = sizeof(seconds);
+            if (getsockopt(event->GetClient()->GetSocket(), SOL_SOCKET, SO_CONNECT_TIME,
+                           reinterpret_cast<char*>(&seconds), &length) == SOCKET_ERROR ||
+                seconds == 0xFFFFFFFF || seconds < m_AcceptDataTimeout)
+            {
+                continue;
+            }
+
+            TRACE("[%d] Dropping a connection that has sent nothing for %u seconds. port[%d]",
+                  GetCurrentThreadId(), seconds, listener->port);
+
+            // The accept fails, which takes the event off the list and refills the backlog.
+            CancelIoEx(reinterpret_cast<HANDLE>(listener->socket), &event->GetOverlapped());
+        }
+    }
+}
+
+long Server::GetNumPostAccepts()
+{
+    long numPostAccepts = 0;
+
+    CritSecLock lock(m_CSForListeners);
+    for (size_t i = 0; i < m_Listeners.size(); ++i)
+    {
+        numPostAccepts += m_Listeners[i]->numPostAccept;
+    }
+    return numPostAccepts;
+}
+
+bool Server::SetAcceptFirstData(DWORD timeoutSeconds)
+{
+    if (!CanConfigure("The first data timeout"))
+    {
+        return false;
+    }
+
+    m_AcceptDataTimeout = timeoutSeconds;
+    return true;
+}
+
+DWORD Server::GetAcceptFirstDataTimeout() { return m_AcceptDataTimeout; }
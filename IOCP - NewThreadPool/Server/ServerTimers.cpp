@@ -0,0 +1,248 @@
+#include "Server.h"
+#include "Client.h"
+#include "Packet.h"
+
+#include "common/Log.h"
+#include "common/ThreadPoolTimer.h"
+
+#include <cassert>
+
+void CALLBACK Server::WorkerTickTimers(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+                                       PTP_TIMER /* Timer */)
+{
+    Server* server = static_cast<Server*>(Context);
+    assert(server);
+
+    NodeThreadPools::Scope scope(server->m_ThreadPools, ACCEPT_THREAD_POOL);
+
+    server->TickTimers();
+}
+
+void CALLBACK Server::WorkerRunTimers(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context)
+{
+    TimerBatch* batch = static_cast<TimerBatch*>(Context);
+    assert(batch);
+    assert(!batch->timers.empty());
+
+    batch->server->RunTimers(&batch->timers[0], batch->timers.size());
+    delete batch;
+}
+
+bool Server::StartTimers()
+{
+    if (m_IdleTimeout == 0 && m_HeartbeatInterval == 0)
+    {
+        return true;
+    }
+
+    m_Timers.Reset(GetTimerTick());
+
+    if (m_HeartbeatInterval > 0)
+    {
+        m_Heartbeat = Packet::Create(NULL, &m_HeartbeatPayload[0],
+                                     static_cast<DWORD>(m_HeartbeatPayload.size()));
+    }
+
+    m_TimerTPTIMER = CreateThreadpoolTimer(Server::WorkerTickTimers, this,
+                                           m_ThreadPools.GetEnvironment(ACCEPT_THREAD_POOL));
+    if (m_TimerTPTIMER == NULL)
+    {
+        ERROR_CODE(GetLastError(), "Could not create the timer for idle clients.");
+        return false;
+    }
+
+    SetRelativeTimer(m_TimerTPTIMER, TIMER_TICK_MS, TIMER_TICK_MS);
+    return true;
+}
+
+void Server::StopTimers()
+{
+    if (m_TimerTPTIMER != NULL)
+    {
+        SetThreadpoolTimer(m_TimerTPTIMER, NULL, 0, 0);
+        WaitForThreadpoolTimerCallbacks(m_TimerTPTIMER, true);
+        CloseThreadpoolTimer(m_TimerTPTIMER);
+        m_TimerTPTIMER = NULL;
+    }
+}
+
+/* static */ ULONGLONG Server::GetTimerTick() { return GetTickCount64() / TIMER_TICK_MS; }
+
+/* static */ ULONGLONG Server::GetTimerTicks(DWORD ms)
+{
+    return (static_cast<ULONGLONG>(ms) + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+void Server::ScheduleClientTimers(Client* client)
+{
+    assert(client);
+    assert(client->GetId() != INVALID_HANDLE_ID);
+
+    const DWORD now = GetTickCount();
+    client->SetLastRecvTime(now);
+    client->SetLastSendTime(now);
+
+    const ULONGLONG tick = GetTimerTick();
+    ClientTimer timer;
+    timer.clientId = client->GetId();
+
+    if (m_IdleTimeout > 0)
+    {
+        timer.kind = IDLE_TIMER;
+        m_Timers.Schedule(timer, tick + GetTimerTicks(m_IdleTimeout * 1000));
+    }
+
+    if (m_HeartbeatInterval > 0)
+    {
+        timer.kind = HEARTBEAT_TIMER;
+        m_Timers.Schedule(timer, tick + GetTimerTicks(m_HeartbeatInterval * 1000));
+    }
+}
+
+void Server::TickTimers()
+{
+    std::vector<ClientTimer> expired;
+    m_Timers.Advance(GetTimerTick(), expired);
+
+    // When many clients time out together, e.g. after an outage, the pools share the work so
+    // that the next tick isn't held up.
+    size_t begin = 0;
+    while (expired.size() - begin > MAX_TIMER_BATCH)
+    {
+        TimerBatch* batch = new TimerBatch();
+        batch->server = this;
+        batch->timers.assign(expired.begin() + begin, expired.begin() + begin + MAX_TIMER_BATCH);
+        begin += MAX_TIMER_BATCH;
+
+        m_NextTimerPool = (m_NextTimerPool + 1) % m_ThreadPools.GetNumPools();
+        if (!m_ThreadPools.Submit(m_NextTimerPool, Server::WorkerRunTimers, batch, true))
+        {
+            ERROR_CODE(GetLastError(), "Could not start WorkerRunTimers.");
+
+            RunTimers(&batch->timers[0], batch->timers.size());
+            delete batch;
+        }
+    }
+
+    if (begin < expired.size())
+    {
+        RunTimers(&expired[begin], expired.size() - begin);
+    }
+}
+
+void Server::RunTimers(const ClientTimer* timers, size_t numTimers)
+{
+    assert(timers);
+
+    const ULONGLONG tick = GetTimerTick();
+    std::vector<HandleId> idleClients;
+
+    for (size_t i = 0; i < numTimers; ++i)
+    {
+        const ClientTimer& timer = timers[i];
+
+        Client* client = NULL;
+        if (!m_Clients.Visit(timer.clientId, [&client](Client* found)
+            {
+                found->AddRef();
+                client = found;
+            }))
+        {
+            continue;
+        }
+
+        // Read the client's time before taking the current one, so that a receive or send in
+        // between can't make the difference wrap.
+        if (timer.kind == IDLE_TIMER)
+        {
+            const DWORD lastRecvTime = client->GetLastRecvTime();
+            const DWORD idleTime = GetTickCount() - lastRecvTime;
+            const DWORD timeout = m_IdleTimeout * 1000;
+            // Reads that have been paused for a slow consumer don't count as idle.
+            if (client->IsReadsPaused())
+            {
+                m_Timers.Schedule(timer, tick + GetTimerTicks(timeout));
+            }
+            else if (idleTime >= timeout)
+            {
+                idleClients.push_back(timer.clientId);
+            }
+            else
+            {
+                m_Timers.Schedule(timer, tick + GetTimerTicks(timeout - idleTime));
+            }
+        }
+        else
+        {
+            const DWORD lastSendTime = client->GetLastSendTime();
+            const DWORD quietTime = GetTickCount() - lastSendTime;
+            const DWORD interval = m_HeartbeatInterval * 1000;
+            if (quietTime >= interval)
+            {
+                if (client->GetState() == Client::ACCEPTED)
+                {
+                    PostSend(client, Packet::CreateShared(m_Heartbeat));
+                    InterlockedIncrement(&m_NumHeartbeats);
+                }
+                m_Timers.Schedule(timer, tick + GetTimerTicks(interval));
+            }
+            else
+            {
+                m_Timers.Schedule(timer, tick + GetTimerTicks(interval - quietTime));
+            }
+        }
+
+        client->Release();
+    }
+
+    for (size_t i = 0; i < idleClients.size(); ++i)
+    {
+        TRACE("[%d] Removing a client that has been idle for %u seconds.", GetCurrentThreadId(),
+              m_IdleTimeout);
+
+        InterlockedIncrement(&m_NumIdleDisconnects);
+        RemoveClient(idleClients[i]);
+    }
+}
+
+bool Server::SetIdleTimeout(DWORD timeoutSeconds)
+{
+    if (!CanConfigure("The idle timeout"))
+    {
+        return false;
+    }
+
+    m_IdleTimeout = timeoutSeconds;
+    return true;
+}
+
+DWORD Server::GetIdleTimeout() { return m_IdleTimeout; }
+
+bool Server::SetHeartbeat(DWORD intervalSeconds, const BYTE* payload, DWORD size)
+{
+    if (!CanConfigure("The heartbeat"))
+    {
+        return false;
+    }
+
+    if (intervalSeconds > 0 && (payload == NULL || size == 0))
+    {
+        ERROR_MSG("A heartbeat needs a payload.");
+        return false;
+    }
+
+    m_HeartbeatInterval = intervalSeconds;
+    m_HeartbeatPayload.assign(payload, payload + (intervalSeconds > 0 ? size : 0));
+    return true;
+}
+
+DWORD Server::GetHeartbeatInterval() { return m_HeartbeatInterval; }
+
+Server::TimerStats Server::GetTimerStats()
+{
+    TimerStats stats;
+    stats.numTimers = m_Timers.GetSize();
+    stats.numIdleDisconnects = m_NumIdleDisconnects;
+    stats.numHeartbeats = m_NumHeartbeats;
+    return stats;
+}
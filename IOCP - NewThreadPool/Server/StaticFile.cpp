@@ -0,0 +1,90 @@
+#include "StaticFile.h"
+
+#include "common/Log.h"
+
+#include <cassert>
+
+/* static */ StaticFile* StaticFile::Open(const char* path, bool map)
+{
+    assert(path);
+
+    StaticFile* file = new StaticFile();
+
+    // The kernel reads the file front to back as it sends it.
+    file->m_hFile = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file->m_hFile == INVALID_HANDLE_VALUE)
+    {
+        ERROR_CODE(GetLastError(), "Could not open %s.", path);
+        file->Release();
+        return NULL;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file->m_hFile, &size))
+    {
+        ERROR_CODE(GetLastError(), "Could not get the size of %s.", path);
+        file->Release();
+        return NULL;
+    }
+    file->m_Size = static_cast<ULONGLONG>(size.QuadPart);
+
+    // An empty file can't be mapped, but it has nothing to send anyway.
+    if (map && file->m_Size > 0)
+    {
+        file->m_hMapping = CreateFileMappingA(file->m_hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (file->m_hMapping == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not create a mapping of %s.", path);
+            file->Release();
+            return NULL;
+        }
+
+        file->m_View = static_cast<const BYTE*>(MapViewOfFile(file->m_hMapping, FILE_MAP_READ,
+                                                              0, 0, 0));
+        if (file->m_View == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not map a view of %s.", path);
+            file->Release();
+            return NULL;
+        }
+    }
+
+    return file;
+}
+
+StaticFile::StaticFile()
+    : m_hFile(INVALID_HANDLE_VALUE), m_hMapping(NULL), m_View(NULL), m_Size(0), m_RefCount(1)
+{
+}
+
+StaticFile::~StaticFile()
+{
+    assert(m_RefCount == 0);
+
+    if (m_View != NULL)
+    {
+        UnmapViewOfFile(m_View);
+    }
+
+    if (m_hMapping != NULL)
+    {
+        CloseHandle(m_hMapping);
+    }
+
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+    }
+}
+
+void StaticFile::Release()
+{
+    const long refCount = InterlockedDecrement(&m_RefCount);
+    assert(refCount >= 0);
+
+    if (refCount == 0)
+    {
+        delete this;
+    }
+}
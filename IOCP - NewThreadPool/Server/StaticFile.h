@@ -0,0 +1,37 @@
+#pragma once
+
+#include <Windows.h>
+
+// A file whose regions can be queued on sends without reading them into packets. The kernel
+// sends them straight from the file with TransmitPackets(), or from a view of the whole file if
+// it has been mapped. Either way, no pool memory is taken up while they are queued.
+class StaticFile
+{
+public:
+    // Opens path for reading, or returns NULL. Mapping suits small files that are sent over and
+    // over, whose regions can then go out with the packets around them in a single WSASend().
+    static StaticFile* Open(const char* path, bool map = false);
+
+    // Every packet of the file's regions holds a reference, as does whoever has opened it. The
+    // last Release() closes the file.
+    void AddRef() { InterlockedIncrement(&m_RefCount); }
+    void Release();
+
+    HANDLE GetHandle() { return m_hFile; }
+    ULONGLONG GetSize() { return m_Size; }
+    // NULL unless the file has been mapped.
+    const BYTE* GetView() { return m_View; }
+
+private:
+    StaticFile();
+    ~StaticFile();
+    StaticFile(const StaticFile&) = delete;
+    StaticFile& operator=(const StaticFile&) = delete;
+
+private:
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+    const BYTE* m_View;
+    ULONGLONG m_Size;
+    volatile long m_RefCount;
+};
@@ -0,0 +1,80 @@
+#include "ThreadPoolEngine.h"
+#include "Client.h"
+#include "IOEvent.h"
+
+#include "common/Log.h"
+
+#include <cassert>
+
+/* static */ void CALLBACK ThreadPoolEngine::IoCompletionCallback(
+    PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PVOID Overlapped, ULONG IoResult,
+    ULONG_PTR NumberOfBytesTransferred, PTP_IO /* Io */)
+{
+    PoolContext* context = static_cast<PoolContext*>(Context);
+    assert(context);
+
+    NodeThreadPools::Scope scope(*context->engine->m_ThreadPools, context->pool);
+
+    IOEvent* event = CONTAINING_RECORD(Overlapped, IOEvent, GetOverlapped());
+    assert(event);
+
+    Complete(event, IoResult, NumberOfBytesTransferred);
+}
+
+ThreadPoolEngine::ThreadPoolEngine() : m_ThreadPools(NULL) {}
+
+ThreadPoolEngine::~ThreadPoolEngine() { Destroy(); }
+
+bool ThreadPoolEngine::Create(NodeThreadPools& pools)
+{
+    m_ThreadPools = &pools;
+
+    // The contexts don't move once the TP_IOs have been given them.
+    m_Contexts.resize(pools.GetNumPools());
+    for (int i = 0; i < pools.GetNumPools(); ++i)
+    {
+        m_Contexts[i].engine = this;
+        m_Contexts[i].pool = i;
+    }
+
+    return true;
+}
+
+void ThreadPoolEngine::Destroy()
+{
+    // The clients close their TP_IOs as they are deleted, once none of their I/O is outstanding.
+}
+
+bool ThreadPoolEngine::AttachClient(Client* client)
+{
+    assert(client);
+
+    if (client->GetTPIO() != NULL)
+    {
+        return true;
+    }
+
+    const int pool = client->GetThreadPool();
+    TP_IO* pTPIO = CreateThreadpoolIo(reinterpret_cast<HANDLE>(client->GetSocket()),
+                                      ThreadPoolEngine::IoCompletionCallback, &m_Contexts[pool],
+                                      m_ThreadPools->GetEnvironment(pool));
+    if (pTPIO == NULL)
+    {
+        ERROR_CODE(GetLastError(), "CreateThreadpoolIo failed for a client.");
+        return false;
+    }
+
+    client->SetTPIO(pTPIO);
+    client->SetBound(true);
+    return true;
+}
+
+/* virtual */ void ThreadPoolEngine::StartIo(Client* client)
+{
+    StartThreadpoolIo(client->GetTPIO());
+}
+
+/* virtual */ void ThreadPoolEngine::AbandonIo(Client* client)
+{
+    CancelThreadpoolIo(client->GetTPIO());
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <winsock2.h>
+#include <vector>
+
+#include "IoEngine.h"
+
+// Gives each socket a TP_IO on its NUMA node's pool, which runs the socket's completions.
+class ThreadPoolEngine : public IoEngine
+{
+private:
+    // What a TP_IO is created with, one for each pool.
+    struct PoolContext
+    {
+        ThreadPoolEngine* engine;
+        int pool;
+    };
+
+    static void CALLBACK IoCompletionCallback(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context,
+                                              PVOID Overlapped, ULONG IoResult,
+                                              ULONG_PTR NumberOfBytesTransferred, PTP_IO /* Io */);
+
+public:
+    ThreadPoolEngine();
+    virtual ~ThreadPoolEngine();
+
+    virtual bool Create(NodeThreadPools& pools);
+    virtual void Destroy();
+
+    // A recycled socket keeps its TP_IO.
+    virtual bool AttachClient(Client* client);
+
+protected:
+    virtual void StartIo(Client* client);
+    virtual void AbandonIo(Client* client);
+
+private:
+    NodeThreadPools* m_ThreadPools;
+    std::vector<PoolContext> m_Contexts;
+};
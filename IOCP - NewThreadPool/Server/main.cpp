@@ -1,42 +1,363 @@
 
+#include <cstdlib>
 #include <string>
 #include <iostream>
 
 #include "common/Log.h"
+#include "common/Metrics.h"
 #include "common/Network.h"
+#include "common/ThreadPoolTimer.h"
+#include "EventTrace.h"
+#include "RecvPipeline.h"
 #include "Server.h"
 
 using std::string;
 using std::cin;
 
+namespace
+{
+	// The number of clients `send_stats lists.
+	const size_t MAX_LISTED_CLIENTS = 10;
+	// How often `stats_dump_on dumps the stats.
+	const DWORD STATS_DUMP_INTERVAL_MS = 10000;
+
+	// The echo that the `recv_* commands switch to, keeping the framing given on the command line.
+	typedef RecvPipeline<ConfiguredFraming, PlainCodec, EchoRecv, Server::DISPATCH_INLINE> InlineEcho;
+	typedef RecvPipeline<ConfiguredFraming, PlainCodec, EchoRecv, Server::DISPATCH_BATCHED> BatchedEcho;
+	typedef RecvPipeline<ConfiguredFraming, PlainCodec, EchoRecv, Server::DISPATCH_STRAND> StrandEcho;
+
+	void DumpStats(Server* server)
+	{
+		Metrics::Snapshot snapshot;
+		Metrics::GetSnapshot(snapshot);
+
+		for(int i = 0; i < Metrics::NUM_COUNTERS; ++i)
+		{
+			Log::Info(" %s : %I64d", Metrics::GetName(static_cast<Metrics::Counter>(i)), snapshot.counters[i]);
+		}
+		for(size_t i = 0; i < snapshot.failures.size(); ++i)
+		{
+			Log::Info("  error %u : %I64d", snapshot.failures[i].first, snapshot.failures[i].second);
+		}
+		for(int i = 0; i < Metrics::NUM_HISTOGRAMS; ++i)
+		{
+			const Metrics::LatencyStats& latency = snapshot.latencies[i];
+			Log::Info(" %s (us) : count : %I64d, p50 : %u, p90 : %u, p99 : %u, p99.9 : %u, max : %u",
+				Metrics::GetName(static_cast<Metrics::Histogram>(i)), latency.count,
+				latency.p50, latency.p90, latency.p99, latency.p999, latency.max);
+		}
+
+		std::vector<NodeThreadPools::Stats> threadStats;
+		server->GetThreadPoolStats(threadStats);
+		long numQueuedWork = 0;
+		for(size_t i = 0; i < threadStats.size(); ++i)
+		{
+			numQueuedWork += threadStats[i].numQueued;
+		}
+		Log::Info(" Queued : work items : %ld, batched receives : %Iu",
+			numQueuedWork, server->GetNumQueuedRecvs());
+
+		CachedAlloc::Stats events = server->GetEventPoolStats();
+		CachedAlloc::Stats recvs = server->GetRecvPoolStats();
+		Log::Info(" Pool refills : events : %Iu (%Iu slabs), recv buffers : %Iu (%Iu slabs)",
+			events.numRefills, events.numSlabAllocations, recvs.numRefills, recvs.numSlabAllocations);
+
+		Log::Info(" Clients : %Iu, accept posts : %ld",
+			server->GetNumClients(), server->GetNumPostAccepts());
+	}
+
+	// Adds a listener for each of the comma separated [address/]port[:profile] entries, e.g.
+	// "0.0.0.0/17001,::/17001,17002:bulk". The listeners are spread over the NUMA nodes' pools.
+	// Those without a socket profile of their own use the server's.
+	bool AddListeners(Server* server, const string& list, int maxPostAccept)
+	{
+		size_t begin = 0;
+		while(begin < list.size())
+		{
+			size_t end = list.find(',', begin);
+			if(end == string::npos)
+			{
+				end = list.size();
+			}
+
+			const string entry = list.substr(begin, end - begin);
+			const size_t slash = entry.rfind('/');
+			const string address = slash != string::npos ? entry.substr(0, slash) : "";
+			const u_short port = static_cast<u_short>( atoi(entry.c_str() + (slash != string::npos ? slash + 1 : 0)) );
+
+			// An IPv6 address has colons of its own, so the profile is looked for behind the port.
+			const size_t colon = entry.find(':', slash != string::npos ? slash : 0);
+			Network::SocketOptions options;
+			if(colon != string::npos && !Network::GetSocketProfile(entry.c_str() + colon + 1, options))
+			{
+				ERROR_MSG("Unknown socket profile : %s", entry.c_str() + colon + 1);
+				return false;
+			}
+
+			if(!server->AddListener(address.empty() ? NULL : address.c_str(), port, maxPostAccept, -1,
+				colon != string::npos ? &options : NULL))
+			{
+				return false;
+			}
+
+			begin = end + 1;
+		}
+
+		return true;
+	}
+
+	// Adds an echoing datagram listener for each of the comma separated [address/]port entries,
+	// each with numRecvs receives posted.
+	bool AddDatagramListeners(Server* server, const string& list, int numRecvs)
+	{
+		size_t begin = 0;
+		while(begin < list.size())
+		{
+			size_t end = list.find(',', begin);
+			if(end == string::npos)
+			{
+				end = list.size();
+			}
+
+			const string entry = list.substr(begin, end - begin);
+			const size_t slash = entry.rfind('/');
+			const string address = slash != string::npos ? entry.substr(0, slash) : "";
+			const u_short port = static_cast<u_short>( atoi(entry.c_str() + (slash != string::npos ? slash + 1 : 0)) );
+
+			if(!server->AddDatagramListener(address.empty() ? NULL : address.c_str(), port, numRecvs,
+				DatagramListener::EchoHandler))
+			{
+				return false;
+			}
+
+			begin = end + 1;
+		}
+
+		return true;
+	}
+
+	// The settings after the port and the accept posts, which are given as --name=value.
+	struct Options
+	{
+		Options()
+			: recvBufferSize(Server::DEFAULT_RECV_BUFFER_SIZE), expectedClients(0), engine("tp"),
+			  minThreads(0), maxThreads(0), framePrefixSize(0), acceptDataTimeout(0),
+			  completionBatchSize(Server::DEFAULT_COMPLETION_BATCH_SIZE), completionThreads(0),
+			  recvDepth(1), socketProfile("default"), idleTimeout(0), heartbeatInterval(0),
+			  compressionMinBatch(0), acceptRate(0), maxClients(0)
+		{
+		}
+
+		DWORD recvBufferSize;
+		DWORD expectedClients;
+		string engine;
+		DWORD minThreads;
+		DWORD maxThreads;
+		DWORD framePrefixSize;
+		DWORD acceptDataTimeout;
+		DWORD completionBatchSize;
+		DWORD completionThreads;
+		string listeners;
+		DWORD recvDepth;
+		string socketProfile;
+		DWORD idleTimeout;
+		DWORD heartbeatInterval;
+		string datagramListeners;
+		DWORD compressionMinBatch;
+		DWORD acceptRate;
+		DWORD maxClients;
+	};
+
+	// An option sets either a number or a string of Options.
+	struct OptionSpec
+	{
+		const char* name;
+		DWORD Options::* number;
+		string Options::* text;
+		const char* help;
+	};
+
+	const OptionSpec OPTION_SPECS[] =
+	{
+		{"recv-buffer", &Options::recvBufferSize, NULL, "pool bytes each posted receive takes"},
+		{"expected-clients", &Options::expectedClients, NULL, "clients to pre-warm the pools for"},
+		{"engine", NULL, &Options::engine, "tp, rio, iocp or legacy"},
+		{"min-threads", &Options::minThreads, NULL, "threads per NUMA node's pool at least"},
+		{"max-threads", &Options::maxThreads, NULL, "threads per NUMA node's pool at most, 0 for a thread per processor"},
+		{"frame-prefix", &Options::framePrefixSize, NULL, "bytes of the frames' length prefix, 0, 1, 2 or 4, 0 for no framing"},
+		{"accept-data-timeout", &Options::acceptDataTimeout, NULL, "seconds to wait for the first data with accepts, 0 doesn't wait"},
+		{"completion-batch", &Options::completionBatchSize, NULL, "completions iocp dequeues at a time"},
+		{"completion-threads", &Options::completionThreads, NULL, "iocp threads per NUMA node, 0 for a thread per processor"},
+		{"listeners", NULL, &Options::listeners, "more listeners, as comma separated [address/]port[:profile] entries"},
+		{"recv-depth", &Options::recvDepth, NULL, "receives outstanding per client"},
+		{"socket-profile", NULL, &Options::socketProfile, "default, latency or bulk"},
+		{"idle-timeout", &Options::idleTimeout, NULL, "seconds after which idle clients are removed, 0 keeps them"},
+		{"heartbeat", &Options::heartbeatInterval, NULL, "seconds between heartbeats, 0 sends none, needs framing"},
+		{"udp", NULL, &Options::datagramListeners, "comma separated [address/]port entries to echo datagrams on, with as many receives posted as accepts"},
+		{"compress-min-batch", &Options::compressionMinBatch, NULL, "smallest batch in bytes to compress for clients that ask for it, 0 doesn't compress, needs framing"},
+		{"accept-rate", &Options::acceptRate, NULL, "connections each source address can open a second, 0 doesn't limit them"},
+		{"max-clients", &Options::maxClients, NULL, "clients at a time at most, 0 doesn't limit them"},
+	};
+
+	void PrintUsage()
+	{
+		TRACE("Usage : <port> <max accept posts> [--name=value ...], with these options :");
+		for(size_t i = 0; i < sizeof(OPTION_SPECS) / sizeof(OPTION_SPECS[0]); ++i)
+		{
+			TRACE("  --%s : %s", OPTION_SPECS[i].name, OPTION_SPECS[i].help);
+		}
+		TRACE("(ex) 17000 100 --engine=iocp --frame-prefix=2 --listeners=0.0.0.0/17001,::/17001:bulk --heartbeat=15 --udp=17100");
+	}
+
+	// Fills options from arguments of the form --name=value. Returns false for an option that
+	// doesn't exist, or a number that doesn't parse.
+	bool ParseOptions(int argc, char* argv[], Options& options)
+	{
+		for(int i = 0; i < argc; ++i)
+		{
+			const string arg = argv[i];
+			const size_t equals = arg.find('=');
+			if(arg.compare(0, 2, "--") != 0 || equals == string::npos)
+			{
+				ERROR_MSG("Options are given as --name=value : %s", arg.c_str());
+				return false;
+			}
+
+			const string name = arg.substr(2, equals - 2);
+			const string value = arg.substr(equals + 1);
+
+			const OptionSpec* spec = NULL;
+			for(size_t j = 0; j < sizeof(OPTION_SPECS) / sizeof(OPTION_SPECS[0]); ++j)
+			{
+				if(name == OPTION_SPECS[j].name)
+				{
+					spec = &OPTION_SPECS[j];
+					break;
+				}
+			}
+			if(spec == NULL)
+			{
+				ERROR_MSG("Unknown option : %s", name.c_str());
+				return false;
+			}
+
+			if(spec->text != NULL)
+			{
+				options.*spec->text = value;
+				continue;
+			}
+
+			char* end = NULL;
+			const unsigned long number = strtoul(value.c_str(), &end, 10);
+			if(value.empty() || *end != '\0')
+			{
+				ERROR_MSG("--%s takes a number : %s", name.c_str(), value.c_str());
+				return false;
+			}
+			options.*spec->number = static_cast<DWORD>(number);
+		}
+
+		return true;
+	}
+
+	void CALLBACK DumpStatsTimer(PTP_CALLBACK_INSTANCE /* Instance */, PVOID Context, PTP_TIMER /* Timer */)
+	{
+		DumpStats(static_cast<Server*>(Context));
+	}
+}
+
 void main(int argc, char* argv[])
 {
 	Log::Setup();
 
-	if( argc != 3)
+	Options options;
+	if( argc < 3 || !ParseOptions(argc - 3, argv + 3, options) )
 	{
-		TRACE("Please add port and max number of accept posts.");
-		TRACE("(ex) 17000 100");
+		PrintUsage();
+		Log::Cleanup();
 		return;
 	}
 
 	u_short port = static_cast<u_short>( atoi(argv[1]) );
 	int maxPostAccept = atoi(argv[2]);
 
-	TRACE("Input : port : %d, max accept : %d", port, maxPostAccept);
+	TRACE("Input : port : %d, max accept : %d, recv buffer : %d, expected clients : %d, engine : %s",
+		port, maxPostAccept, options.recvBufferSize, options.expectedClients, options.engine.c_str());
 
 	if (!Network::Initialize())
 	{
 		ERROR_MSG("Network::Initialize() failed");
+		Log::Cleanup();
 		return;
 	}
 
-	Server::New();
+	Metrics::Setup();
+	// Sessions that are already running get the events from here on.
+	EventTrace::Register();
+
+	Server* server = new Server();
+	if (options.engine == "rio")
+	{
+		server->SetEngine(Server::REGISTERED_IO);
+	}
+	else if (options.engine == "iocp")
+	{
+		server->SetEngine(Server::COMPLETION_PORT);
+		server->SetCompletionPortThreads(options.completionThreads, options.completionBatchSize);
+	}
+	else if (options.engine == "legacy")
+	{
+		server->SetEngine(Server::LEGACY_THREAD_POOL);
+	}
+	else
+	{
+		server->SetEngine(Server::THREAD_POOL);
+	}
+	server->SetThreadPoolLimits(options.minThreads, options.maxThreads);
+	server->SetAcceptFirstData(options.acceptDataTimeout);
+
+	Network::SocketOptions socketOptions;
+	const bool knownProfile = Network::GetSocketProfile(options.socketProfile.c_str(), socketOptions);
+	if (!knownProfile)
+	{
+		ERROR_MSG("Unknown socket profile : %s", options.socketProfile.c_str());
+	}
+	server->SetSocketOptions(socketOptions);
+	server->SetCompression(options.compressionMinBatch);
+	server->SetAcceptRate(options.acceptRate);
+	server->SetMaxClients(options.maxClients);
+
+	// A heartbeat is a frame with nothing in it, which a client that reads frames skips.
+	server->SetIdleTimeout(options.idleTimeout);
+	const std::vector<BYTE> heartbeat(options.framePrefixSize, 0);
+	bool heartbeatSet = true;
+	if (options.heartbeatInterval > 0 && options.framePrefixSize == 0)
+	{
+		ERROR_MSG("Heartbeats need framing.");
+		heartbeatSet = false;
+	}
+	else if (options.heartbeatInterval > 0)
+	{
+		heartbeatSet = server->SetHeartbeat(options.heartbeatInterval, &heartbeat[0], options.framePrefixSize);
+	}
+
+	if (!knownProfile || !heartbeatSet || !server->SetFraming(options.framePrefixSize) || !server->SetRecvDepth(options.recvDepth) ||
+		!AddListeners(server, options.listeners, maxPostAccept) || !AddDatagramListeners(server, options.datagramListeners, maxPostAccept))
+	{
+		EventTrace::Unregister();
+		Metrics::Cleanup();
+		Network::Deinitialize();
+		Log::Cleanup();
+		return;
+	}
 	
-	if (!Server::Instance()->Create(port, maxPostAccept))
+	if (!server->Create(port, maxPostAccept, options.recvBufferSize, options.expectedClients))
 	{
 		ERROR_MSG("Server::Create() failed");
+		EventTrace::Unregister();
+		Metrics::Cleanup();
 		Network::Deinitialize();
+		Log::Cleanup();
 		return;
 	}
 
@@ -44,19 +365,174 @@ void main(int argc, char* argv[])
 	Log::EnableTrace(false);
 #endif
 
+	TP_TIMER* statsTimer = CreateThreadpoolTimer(DumpStatsTimer, server, NULL);
+
 	string input;
 	bool loop = true;
 	while(loop)
 	{
 		std::getline(cin, input);
 
-		if(input == "`client_size")
+		if(input == "`stats")
+		{
+			DumpStats(server);
+		}
+		else if(input == "`stats_dump_on" && statsTimer != NULL)
+		{
+			SetRelativeTimer(statsTimer, STATS_DUMP_INTERVAL_MS, STATS_DUMP_INTERVAL_MS, 1000);
+		}
+		else if(input == "`stats_dump_off" && statsTimer != NULL)
 		{
-			TRACE(" Number of Clients : %d", Server::Instance()->GetNumClients());
+			SetThreadpoolTimer(statsTimer, NULL, 0, 0);
 		}
-		if(input == "`accept_size")
+		else if(input == "`client_size")
 		{
-			TRACE(" Number of Accept posts : %d", Server::Instance()->GetNumPostAccepts());
+			Log::Info(" Number of Clients : %Iu", server->GetNumClients());
+		}
+		else if(input.compare(0, 7, "`drain ") == 0)
+		{
+			// Sends what is queued for up to the given seconds and shuts down.
+			server->Drain(static_cast<DWORD>(atoi(input.c_str() + 7)) * 1000);
+			loop = false;
+		}
+		else if(input == "`timer_stats")
+		{
+			Server::TimerStats stats = server->GetTimerStats();
+			Log::Info(" Timers : %Iu, idle clients removed : %d, heartbeats : %d",
+				stats.numTimers, stats.numIdleDisconnects, stats.numHeartbeats);
+		}
+		else if(input == "`datagram_stats")
+		{
+			std::vector<DatagramListener::Stats> stats;
+			server->GetDatagramStats(stats);
+			for(size_t i = 0; i < stats.size(); ++i)
+			{
+				Log::Info(" Datagram listener %Iu : ip[%s], port[%d], pool : %d, receives : %d / %d, sessions : %d, dropped : %d recvs, %d sends, %d untracked",
+					i, stats[i].ip.c_str(), stats[i].port, stats[i].pool, stats[i].numPostedRecvs,
+					stats[i].numRecvs, stats[i].numSessions, stats[i].numDroppedRecvs, stats[i].numDroppedSends,
+					stats[i].numUntrackedRecvs);
+			}
+		}
+		else if(input == "`accept_size")
+		{
+			Log::Info(" Number of Accept posts : %d", server->GetNumPostAccepts());
+		}
+		else if(input == "`listener_stats")
+		{
+			std::vector<Server::ListenerStats> stats;
+			server->GetListenerStats(stats);
+			for(size_t i = 0; i < stats.size(); ++i)
+			{
+				Log::Info(" Listener %Iu : ip[%s], port[%d], pool : %d, accept posts : %d / %d",
+					i, stats[i].ip.c_str(), stats[i].port, stats[i].pool,
+					stats[i].numPostAccepts, stats[i].maxPostAccept);
+			}
+		}
+		else if(input == "`admission_stats")
+		{
+			Server::AdmissionStats stats = server->GetAdmissionStats();
+			Log::Info(" Sources : %d, rate limited : %d, over capacity : %d, untracked : %d, accepts paused : %d, clients : %Iu / %Iu",
+				stats.numSources, stats.numRateLimited, stats.numOverCapacity, stats.numUntracked, stats.acceptsPaused,
+				server->GetNumClients(), server->GetMaxClients());
+		}
+		else if(input == "`reuse_stats")
+		{
+			Log::Info(" Reuse hits : %d, misses : %d, free clients : %Iu",
+				server->GetNumReuseHits(),
+				server->GetNumReuseMisses(),
+				server->GetNumFreeClients());
+		}
+		else if(input == "`pool_stats")
+		{
+			CachedAlloc::Stats events = server->GetEventPoolStats();
+			Log::Info(" Events : slabs : %Iu, live : %Iu, free : %Iu, peak : %Iu",
+				events.numSlabs, events.numLive, events.numFree, events.peakLive);
+
+			CachedAlloc::Stats recvs = server->GetRecvPoolStats();
+			Log::Info(" Recv buffers : slabs : %Iu, live : %Iu, free : %Iu, peak : %Iu",
+				recvs.numSlabs, recvs.numLive, recvs.numFree, recvs.peakLive);
+		}
+		else if(input == "`pool_trim")
+		{
+			server->TrimPools();
+		}
+		else if(input == "`thread_stats")
+		{
+			std::vector<NodeThreadPools::Stats> stats;
+			server->GetThreadPoolStats(stats);
+			for(size_t i = 0; i < stats.size(); ++i)
+			{
+				Log::Info(" Node %d : threads : %d (min %u, max %u), active : %d, queued : %d, callbacks : %d",
+					stats[i].node, stats[i].numThreads, stats[i].minThreads, stats[i].maxThreads,
+					stats[i].numActive, stats[i].numQueued, stats[i].numCallbacks);
+			}
+		}
+		else if(input == "`iocp_stats")
+		{
+			Server::CompletionPortStats stats = server->GetCompletionPortStats();
+			Log::Info(" Completion port threads : %u, dequeues : %I64d, completions : %I64d, per dequeue : %.2f",
+				stats.numThreads, stats.numDequeues, stats.numCompletions,
+				stats.numDequeues > 0 ? static_cast<double>(stats.numCompletions) / stats.numDequeues : 0.0);
+		}
+		else if(input == "`send_stats")
+		{
+			Server::SendStats stats = server->GetSendStats();
+			Log::Info(" Pending send bytes : total : %u, max : %u, over high water : %Iu, reads paused : %Iu",
+				stats.totalPendingBytes, stats.maxPendingBytes, stats.numOverHighWater, stats.numReadsPaused);
+			Log::Info(" Dropped packets : %d, slow clients disconnected : %d",
+				stats.numDroppedPackets, stats.numSlowDisconnects);
+
+			std::vector<std::pair<HandleId, DWORD> > pendingSends;
+			server->GetTopPendingSends(pendingSends, MAX_LISTED_CLIENTS);
+			for(size_t i = 0; i < pendingSends.size(); ++i)
+			{
+				Log::Info("  Client %Iu : %u bytes pending", pendingSends[i].first, pendingSends[i].second);
+			}
+		}
+		else if(input == "`recv_inline")
+		{
+			InlineEcho::Install(*server);
+		}
+		else if(input == "`recv_batched")
+		{
+			BatchedEcho::Install(*server);
+		}
+		else if(input == "`recv_strand")
+		{
+			StrandEcho::Install(*server);
+		}
+		else if(input == "`recv_single")
+		{
+			// Echo frame by frame, keeping the current dispatch policy.
+			server->SetRecvHandler(Server::EchoHandler, server->GetRecvDispatchPolicy());
+		}
+		else if(input == "`send_policy_pause")
+		{
+			server->SetSlowConsumerPolicy(Server::PAUSE_READS);
+		}
+		else if(input == "`send_policy_drop")
+		{
+			server->SetSlowConsumerPolicy(Server::DROP);
+		}
+		else if(input == "`send_policy_disconnect")
+		{
+			server->SetSlowConsumerPolicy(Server::DISCONNECT);
+		}
+		else if(input == "`enable_inline_completion")
+		{
+			server->EnableInlineCompletion(true);
+		}
+		else if(input == "`disable_inline_completion")
+		{
+			server->EnableInlineCompletion(false);
+		}
+		else if(input == "`enable_zero_byte_recv")
+		{
+			server->EnableZeroByteRecv(true);
+		}
+		else if(input == "`disable_zero_byte_recv")
+		{
+			server->EnableZeroByteRecv(false);
 		}
 		else if(input == "`enable_trace")
 		{
@@ -66,9 +542,23 @@ void main(int argc, char* argv[])
 		{
 			Log::EnableTrace(false);
 		}
+		else if(input == "`log_stats")
+		{
+			Log::Info(" Dropped log messages : %ld", Log::GetNumDropped());
+		}
 	}
 
-	Server::Delete();
+	if (statsTimer != NULL)
+	{
+		SetThreadpoolTimer(statsTimer, NULL, 0, 0);
+		WaitForThreadpoolTimerCallbacks(statsTimer, TRUE);
+		CloseThreadpoolTimer(statsTimer);
+	}
+
+	delete server;
+
+	EventTrace::Unregister();
+	Metrics::Cleanup();
 
 	Network::Deinitialize();
 
@@ -0,0 +1,902 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "common/HandleTable.h"
+#include "common/Log.h"
+#include "common/Lz4.h"
+#include "common/TimerWheel.h"
+#include "Server/FrameCompression.h"
+#include "Server/Framer.h"
+#include "Server/Packet.h"
+
+// Unit tests of the parsers and data structures that take what peers send. Every case runs once,
+// each failed check is printed, and the exit code is the number of cases that failed. Only the
+// cases whose names start with the prefix given on the command line run, if there is one.
+//
+//   Tests [name prefix]
+
+namespace
+{
+int g_NumFailedChecks = 0;
+
+void ReportFailure(const char* fileName, int line, const char* condition)
+{
+    printf("  %s(%d): CHECK(%s) failed\n", fileName, line, condition);
+    ++g_NumFailedChecks;
+}
+
+#define CHECK(condition)                                                                        \
+    do                                                                                          \
+    {                                                                                           \
+        if (!(condition))                                                                       \
+        {                                                                                       \
+            ReportFailure(__FILE__, __LINE__, #condition);                                      \
+        }                                                                                       \
+    } while (0)
+
+typedef std::vector<BYTE> Bytes;
+
+// The data of every segment of packet, back to back.
+Bytes Flatten(Packet* packet)
+{
+    Bytes bytes;
+    for (Packet* segment = packet; segment != NULL; segment = segment->GetNext())
+    {
+        bytes.insert(bytes.end(), segment->GetData(), segment->GetData() + segment->GetSize());
+    }
+    return bytes;
+}
+
+void DestroyAll(std::vector<Packet*>& packets)
+{
+    for (size_t i = 0; i < packets.size(); ++i)
+    {
+        Packet::Destroy(packets[i]);
+    }
+    packets.clear();
+}
+
+//---------------------------------------------------------------------------------------------
+// Framer
+
+const DWORD FRAMER_MAX_FRAME_SIZE = 1000;
+
+// A frame of framer's framing whose data is size bytes counting up from seed.
+Bytes MakeFrame(const Framer& framer, DWORD size, BYTE seed)
+{
+    Bytes frame(framer.GetPrefixSize() + size);
+    framer.EncodeLength(size, &frame[0]);
+    for (DWORD i = 0; i < size; ++i)
+    {
+        frame[framer.GetPrefixSize() + i] = static_cast<BYTE>(seed + i);
+    }
+    return frame;
+}
+
+// Receives stream like the server does, at most chunkSize bytes at a time: into the frame that is
+// being reassembled if there is one, and into a fresh packet otherwise.
+// Returns false as soon as the framer does.
+bool FeedStream(Framer& framer, const Bytes& stream, DWORD chunkSize,
+                std::vector<Packet*>& frames)
+{
+    FrameState state;
+    Framer::ResetState(state);
+
+    auto collect = [&frames](Packet* frame) { frames.push_back(frame); };
+
+    bool succeeded = true;
+    DWORD offset = 0;
+    while (offset < stream.size() && succeeded)
+    {
+        const DWORD chunk = min(chunkSize, static_cast<DWORD>(stream.size()) - offset);
+
+        DWORD length = 0;
+        Packet* target = Framer::GetRecvTarget(state, length);
+        if (target != NULL)
+        {
+            const DWORD count = min(chunk, length);
+            CopyMemory(target->GetData() + target->GetSize(), &stream[offset], count);
+            framer.FeedTarget(state, count, collect);
+            offset += count;
+        }
+        else
+        {
+            Packet* packet = Packet::Create(NULL, &stream[offset], chunk);
+            succeeded = framer.Feed(state, packet, collect);
+            offset += chunk;
+        }
+    }
+
+    // A frame that is still being reassembled is the caller's to drop, as it would be on close.
+    if (state.frame != NULL)
+    {
+        Packet::Destroy(state.frame);
+    }
+    return succeeded;
+}
+
+void TestFramerSplitPrefixes()
+{
+    const DWORD prefixSizes[] = {1, 2, 4};
+    for (int p = 0; p < 3; ++p)
+    {
+        for (int bigEndian = 0; bigEndian < 2; ++bigEndian)
+        {
+            Framer framer;
+            CHECK(framer.Configure(prefixSizes[p], bigEndian != 0, FRAMER_MAX_FRAME_SIZE));
+
+            // Sizes around a chunk, so that prefixes and frames end on every byte of one.
+            const DWORD maxSize = prefixSizes[p] == 1 ? 255 : 300;
+            std::vector<Bytes> expected;
+            Bytes stream;
+            for (DWORD size = 0; size <= maxSize; size += 37)
+            {
+                expected.push_back(MakeFrame(framer, size, static_cast<BYTE>(size)));
+                stream.insert(stream.end(), expected.back().begin(), expected.back().end());
+            }
+
+            for (DWORD chunkSize = 1; chunkSize <= 9; ++chunkSize)
+            {
+                std::vector<Packet*> frames;
+                CHECK(FeedStream(framer, stream, chunkSize, frames));
+                CHECK(frames.size() == expected.size());
+                for (size_t i = 0; i < frames.size() && i < expected.size(); ++i)
+                {
+                    CHECK(Flatten(frames[i]) == expected[i]);
+                }
+                DestroyAll(frames);
+            }
+        }
+    }
+}
+
+void TestFramerManyFramesPerReceive()
+{
+    Framer framer;
+    CHECK(framer.Configure(2, true, FRAMER_MAX_FRAME_SIZE));
+
+    std::vector<Bytes> expected;
+    Bytes stream;
+    for (BYTE i = 0; i < 10; ++i)
+    {
+        expected.push_back(MakeFrame(framer, 10 + i, i));
+        stream.insert(stream.end(), expected.back().begin(), expected.back().end());
+    }
+
+    // All of them in one receive, and then with the last one cut short.
+    std::vector<Packet*> frames;
+    CHECK(FeedStream(framer, stream, static_cast<DWORD>(stream.size()), frames));
+    CHECK(frames.size() == expected.size());
+    for (size_t i = 0; i < frames.size() && i < expected.size(); ++i)
+    {
+        CHECK(frames[i]->GetNext() == NULL);
+        CHECK(Flatten(frames[i]) == expected[i]);
+    }
+    DestroyAll(frames);
+
+    stream.pop_back();
+    CHECK(FeedStream(framer, stream, static_cast<DWORD>(stream.size()), frames));
+    CHECK(frames.size() == expected.size() - 1);
+    DestroyAll(frames);
+
+    // A receive that is exactly one frame is handed over as it is.
+    FrameState state;
+    Framer::ResetState(state);
+    Packet* packet = Packet::Create(NULL, &expected[0][0], static_cast<DWORD>(expected[0].size()));
+    CHECK(framer.Feed(state, packet, [&frames](Packet* frame) { frames.push_back(frame); }));
+    CHECK(frames.size() == 1 && frames[0] == packet);
+    DestroyAll(frames);
+}
+
+void TestFramerMaxFrameSize()
+{
+    const DWORD prefixSizes[] = {1, 2, 4};
+    for (int p = 0; p < 3; ++p)
+    {
+        const DWORD maxFrameSize = prefixSizes[p] == 1 ? 200 : FRAMER_MAX_FRAME_SIZE;
+
+        Framer framer;
+        CHECK(framer.Configure(prefixSizes[p], false, maxFrameSize));
+
+        // The maximum includes the prefix.
+        const Bytes largest = MakeFrame(framer, maxFrameSize - prefixSizes[p], 1);
+        const Bytes tooLarge = MakeFrame(framer, maxFrameSize - prefixSizes[p] + 1, 2);
+
+        for (DWORD chunkSize = 1; chunkSize <= largest.size(); chunkSize += 99)
+        {
+            std::vector<Packet*> frames;
+            CHECK(FeedStream(framer, largest, chunkSize, frames));
+            CHECK(frames.size() == 1 && Flatten(frames[0]) == largest);
+            DestroyAll(frames);
+
+            CHECK(!FeedStream(framer, tooLarge, chunkSize, frames));
+            CHECK(frames.empty());
+            DestroyAll(frames);
+        }
+    }
+}
+
+// Lengths close to 4 GB wrap around when the prefix is added to them. They have to be rejected
+// rather than taken for a frame of the prefix alone, or smaller still.
+void TestFramerLengthWrap()
+{
+    Framer framer;
+    CHECK(framer.Configure(4, true, FRAMER_MAX_FRAME_SIZE));
+
+    const DWORD lengths[] = {0xFFFFFFFF, 0xFFFFFFFE, 0xFFFFFFFD, 0xFFFFFFFC, 0xFFFFFFFB,
+                             0x80000000, FRAMER_MAX_FRAME_SIZE - 3};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i)
+    {
+        Bytes stream(4 + 16, 0xAB);
+        framer.EncodeLength(lengths[i], &stream[0]);
+
+        for (DWORD chunkSize = 1; chunkSize <= stream.size(); chunkSize += 3)
+        {
+            std::vector<Packet*> frames;
+            CHECK(!FeedStream(framer, stream, chunkSize, frames));
+            CHECK(frames.empty());
+            DestroyAll(frames);
+        }
+
+        std::vector<Packet*> frames;
+        Packet* segment = Packet::Create(NULL, &stream[0], static_cast<DWORD>(stream.size()));
+        CHECK(!framer.Split(segment, 0, [&frames](Packet* frame) { frames.push_back(frame); }));
+        CHECK(frames.empty());
+        DestroyAll(frames);
+    }
+}
+
+void TestFramerSplit()
+{
+    Framer framer;
+    CHECK(framer.Configure(2, false, FRAMER_MAX_FRAME_SIZE));
+
+    Bytes data(3, 0xEE);
+    std::vector<Bytes> expected;
+    for (BYTE i = 0; i < 5; ++i)
+    {
+        expected.push_back(MakeFrame(framer, i * 7, i));
+        data.insert(data.end(), expected.back().begin(), expected.back().end());
+    }
+
+    std::vector<Packet*> frames;
+    auto collect = [&frames](Packet* frame) { frames.push_back(frame); };
+
+    // Whole frames from the offset on.
+    Packet* segment = Packet::Create(NULL, &data[0], static_cast<DWORD>(data.size()));
+    CHECK(framer.Split(segment, 3, collect));
+    CHECK(frames.size() == expected.size());
+    for (size_t i = 0; i < frames.size() && i < expected.size(); ++i)
+    {
+        CHECK(Flatten(frames[i]) == expected[i]);
+    }
+    DestroyAll(frames);
+
+    // A frame cut short, and a prefix cut short, fail after the frames before them.
+    segment = Packet::Create(NULL, &data[0], static_cast<DWORD>(data.size()) - 1);
+    CHECK(!framer.Split(segment, 3, collect));
+    CHECK(frames.size() == expected.size() - 1);
+    DestroyAll(frames);
+
+    data.push_back(0x01);
+    segment = Packet::Create(NULL, &data[0], static_cast<DWORD>(data.size()));
+    CHECK(!framer.Split(segment, 3, collect));
+    CHECK(frames.size() == expected.size());
+    DestroyAll(frames);
+}
+
+//---------------------------------------------------------------------------------------------
+// Lz4
+
+// A linear congruential generator, so that every run sees the same data.
+BYTE NextRandom(unsigned& state)
+{
+    state = state * 1103515245 + 12345;
+    return static_cast<BYTE>(state >> 16);
+}
+
+Bytes MakeRandom(DWORD size, unsigned seed)
+{
+    Bytes data(size);
+    for (DWORD i = 0; i < size; ++i)
+    {
+        data[i] = NextRandom(seed);
+    }
+    return data;
+}
+
+// Mostly runs copied from up to 64 bytes back, with some noise in between, like the frames of a
+// protocol.
+Bytes MakeCompressible(DWORD size, unsigned seed)
+{
+    Bytes data(size);
+    DWORD i = 0;
+    while (i < size)
+    {
+        const BYTE random = NextRandom(seed);
+        if (i < 64 || random % 4 == 0)
+        {
+            data[i++] = random;
+            continue;
+        }
+
+        const DWORD offset = 1 + NextRandom(seed) % 64;
+        for (DWORD run = 4 + random % 16; run > 0 && i < size; --run, ++i)
+        {
+            data[i] = data[i - offset];
+        }
+    }
+    return data;
+}
+
+Bytes Compress(const Bytes& data)
+{
+    Bytes block(Lz4::GetMaxCompressedSize(static_cast<DWORD>(data.size())));
+    const DWORD blockSize = Lz4::Compress(data.empty() ? NULL : &data[0],
+                                          static_cast<DWORD>(data.size()), &block[0],
+                                          static_cast<DWORD>(block.size()));
+    CHECK(blockSize > 0);
+    block.resize(blockSize);
+    return block;
+}
+
+// Decompresses block into exactly size bytes, with a guard byte after them that has to stay put.
+bool Decompress(const Bytes& block, DWORD size, Bytes& data)
+{
+    const BYTE GUARD = 0x5A;
+    data.assign(size + 1, GUARD);
+    const bool succeeded = Lz4::Decompress(&block[0], static_cast<DWORD>(block.size()), &data[0],
+                                           size);
+    CHECK(data[size] == GUARD);
+    data.resize(size);
+    return succeeded;
+}
+
+void TestLz4RoundTrip()
+{
+    // Sizes around the end of block rules, the longest offset and lengths that take more bytes.
+    const DWORD sizes[] = {1, 4, 12, 13, 14, 16, 17, 100, 270, 4096, 65535, 65536 + 300, 200000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        const DWORD size = sizes[i];
+        const Bytes inputs[] = {Bytes(size, 0x00), MakeRandom(size, size),
+                                MakeCompressible(size, size)};
+        for (int j = 0; j < 3; ++j)
+        {
+            const Bytes block = Compress(inputs[j]);
+            CHECK(block.size() <= Lz4::GetMaxCompressedSize(size));
+
+            Bytes data;
+            CHECK(Decompress(block, size, data));
+            CHECK(data == inputs[j]);
+
+            // The size has to be exactly what the block decompresses to.
+            CHECK(!Decompress(block, size - 1, data));
+            CHECK(!Decompress(block, size + 1, data));
+        }
+    }
+
+    // Long runs compress to a fraction of their size.
+    CHECK(Compress(Bytes(10000, 0x11)).size() < 100);
+}
+
+void TestLz4Capacity()
+{
+    // With less room than the data, only data that gets smaller is compressed.
+    const Bytes random = MakeRandom(1000, 7);
+    Bytes block(random.size());
+    CHECK(Lz4::Compress(&random[0], 1000, &block[0], 999) == 0);
+
+    const Bytes compressible = MakeCompressible(1000, 7);
+    const DWORD blockSize = Lz4::Compress(&compressible[0], 1000, &block[0], 999);
+    CHECK(blockSize > 0 && blockSize < 999);
+
+    // A capacity a byte short of the block fails rather than writing past it.
+    Bytes exact(blockSize - 1);
+    CHECK(Lz4::Compress(&compressible[0], 1000, &exact[0], blockSize - 1) == 0);
+}
+
+void TestLz4Truncated()
+{
+    const Bytes data = MakeCompressible(1000, 3);
+    const Bytes block = Compress(data);
+
+    // Every cut fails, whether it falls in a token, a length, the literals or an offset.
+    for (size_t cut = 1; cut < block.size(); ++cut)
+    {
+        Bytes output;
+        CHECK(!Decompress(Bytes(block.begin(), block.begin() + cut), 1000, output));
+    }
+}
+
+void TestLz4Malformed()
+{
+    Bytes data;
+
+    // One literal and a match of four at offset 1 repeat the literal.
+    const BYTE repeat[] = {0x10, 'a', 0x01, 0x00};
+    CHECK(Decompress(Bytes(repeat, repeat + 4), 5, data));
+    CHECK(data == Bytes(5, 'a'));
+
+    // Offset 0, and offsets before the start of the output.
+    const BYTE offsetZero[] = {0x10, 'a', 0x00, 0x00};
+    CHECK(!Decompress(Bytes(offsetZero, offsetZero + 4), 5, data));
+    const BYTE offsetBeyond[] = {0x10, 'a', 0x02, 0x00};
+    CHECK(!Decompress(Bytes(offsetBeyond, offsetBeyond + 4), 5, data));
+    const BYTE offsetFar[] = {0x10, 'a', 0xFF, 0xFF};
+    CHECK(!Decompress(Bytes(offsetFar, offsetFar + 4), 5, data));
+
+    // Literals and matches that go past the end of the output.
+    const BYTE literalsOver[] = {0x50, 'a', 'b', 'c', 'd', 'e'};
+    CHECK(!Decompress(Bytes(literalsOver, literalsOver + 6), 4, data));
+    const BYTE matchOver[] = {0x1F, 'a', 0x01, 0x00, 0x00};
+    CHECK(!Decompress(Bytes(matchOver, matchOver + 5), 5 + 14, data));
+    CHECK(Decompress(Bytes(matchOver, matchOver + 5), 5 + 15, data));
+
+    // Literals that go past the end of the block, and lengths that do.
+    const BYTE literalsShort[] = {0x50, 'a', 'b'};
+    CHECK(!Decompress(Bytes(literalsShort, literalsShort + 3), 5, data));
+    const BYTE lengthShort[] = {0xF0, 0xFF, 0xFF};
+    CHECK(!Decompress(Bytes(lengthShort, lengthShort + 3), 1000, data));
+
+    // A match without its offset.
+    const BYTE offsetShort[] = {0x10, 'a', 0x01};
+    CHECK(!Decompress(Bytes(offsetShort, offsetShort + 3), 5, data));
+}
+
+//---------------------------------------------------------------------------------------------
+// FrameCompression
+
+const DWORD COMPRESSION_MIN_BATCH_SIZE = 64;
+
+// Wraps frames as a send of theirs would be, and returns the transport frame that goes out.
+Bytes WrapBatch(const FrameCompression& compression, const std::vector<Bytes>& frames,
+                bool& compressed)
+{
+    std::vector<Packet*> batch;
+    std::vector<WSABUF> buffers(frames.size() + 1);
+    std::vector<Packet*> segments(frames.size() + 1);
+    for (size_t i = 0; i < frames.size(); ++i)
+    {
+        batch.push_back(Packet::Create(NULL, &frames[i][0], static_cast<DWORD>(frames[i].size())));
+        buffers[i].buf = reinterpret_cast<char*>(batch[i]->GetData());
+        buffers[i].len = batch[i]->GetSize();
+        segments[i] = batch[i];
+    }
+
+    DWORD numBuffers = static_cast<DWORD>(frames.size());
+    Packet* kept = compression.Wrap(&buffers[0], &segments[0], numBuffers);
+    CHECK(kept != NULL && segments[0] == kept);
+
+    Bytes transportFrame;
+    for (DWORD i = 0; i < numBuffers; ++i)
+    {
+        transportFrame.insert(transportFrame.end(), buffers[i].buf,
+                              buffers[i].buf + buffers[i].len);
+    }
+    compressed = numBuffers == 1;
+
+    batch.push_back(kept);
+    DestroyAll(batch);
+    return transportFrame;
+}
+
+bool Unwrap(const FrameCompression& compression, const Bytes& transportFrame,
+            std::vector<Packet*>& frames)
+{
+    Packet* packet = Packet::Create(NULL, &transportFrame[0],
+                                    static_cast<DWORD>(transportFrame.size()));
+    return compression.Unwrap(packet, [&frames](Packet* frame) { frames.push_back(frame); });
+}
+
+void TestFrameCompressionRoundTrip()
+{
+    Framer framer;
+    CHECK(framer.Configure(2, true, FRAMER_MAX_FRAME_SIZE));
+    FrameCompression compression;
+    CHECK(compression.Configure(framer, COMPRESSION_MIN_BATCH_SIZE));
+    CHECK(compression.GetMaxBatchSize() == FRAMER_MAX_FRAME_SIZE - 3);
+
+    // Frames that compress, a batch under the smallest size to compress, frames that don't
+    // compress, and a batch of the largest size.
+    std::vector<std::vector<Bytes> > batches(4);
+    for (BYTE i = 0; i < 8; ++i)
+    {
+        batches[0].push_back(MakeFrame(framer, 100, 0));
+    }
+    batches[1].push_back(MakeFrame(framer, COMPRESSION_MIN_BATCH_SIZE - 3, 1));
+    Bytes random = MakeRandom(400, 2);
+    framer.EncodeLength(400 - framer.GetPrefixSize(), &random[0]);
+    batches[2].push_back(MakeFrame(framer, 0, 0));
+    batches[2].push_back(random);
+    batches[3].push_back(
+        MakeFrame(framer, compression.GetMaxBatchSize() - framer.GetPrefixSize(), 3));
+    const bool shouldCompress[] = {true, false, false, true};
+
+    for (size_t i = 0; i < batches.size(); ++i)
+    {
+        bool compressed = false;
+        const Bytes transportFrame = WrapBatch(compression, batches[i], compressed);
+        CHECK(compressed == shouldCompress[i]);
+        CHECK(transportFrame.size() <= FRAMER_MAX_FRAME_SIZE);
+
+        // The transport frame is a frame of the connection's framing.
+        std::vector<Packet*> frames;
+        CHECK(Unwrap(compression, transportFrame, frames));
+        CHECK(frames.size() == batches[i].size());
+        for (size_t j = 0; j < frames.size() && j < batches[i].size(); ++j)
+        {
+            CHECK(Flatten(frames[j]) == batches[i][j]);
+        }
+        DestroyAll(frames);
+    }
+}
+
+void TestFrameCompressionMalformed()
+{
+    Framer framer;
+    CHECK(framer.Configure(2, true, FRAMER_MAX_FRAME_SIZE));
+    FrameCompression compression;
+    CHECK(compression.Configure(framer, COMPRESSION_MIN_BATCH_SIZE));
+
+    std::vector<Bytes> batch(1, MakeFrame(framer, 500, 4));
+    bool compressed = false;
+    const Bytes transportFrame = WrapBatch(compression, batch, compressed);
+    CHECK(compressed);
+
+    // The prefix, the flag, the size before compression and the block.
+    const size_t flagOffset = framer.GetPrefixSize();
+    const size_t sizeOffset = flagOffset + 1;
+    const size_t blockOffset = sizeOffset + 4;
+
+    std::vector<Packet*> frames;
+    CHECK(Unwrap(compression, transportFrame, frames));
+    CHECK(frames.size() == 1);
+    DestroyAll(frames);
+
+    Bytes corrupt = transportFrame;
+    corrupt[flagOffset] = 2;
+    CHECK(!Unwrap(compression, corrupt, frames));
+
+    // Sizes of nothing, of more than a segment, and off by one.
+    const DWORD sizes[] = {0, Packet::GetMaxSegmentCapacity() + 1, 0xFFFFFFFF,
+                           static_cast<DWORD>(batch[0].size()) - 1,
+                           static_cast<DWORD>(batch[0].size()) + 1};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        corrupt = transportFrame;
+        for (size_t j = 0; j < 4; ++j)
+        {
+            corrupt[sizeOffset + j] = static_cast<BYTE>(sizes[i] >> (8 * j));
+        }
+        CHECK(!Unwrap(compression, corrupt, frames));
+    }
+
+    // Blocks cut short, down to no block at all, and frames cut into their header.
+    for (size_t size = blockOffset; size < transportFrame.size(); size += 7)
+    {
+        CHECK(!Unwrap(compression, Bytes(transportFrame.begin(), transportFrame.begin() + size),
+                      frames));
+    }
+    for (size_t size = 1; size < blockOffset; ++size)
+    {
+        CHECK(!Unwrap(compression, Bytes(transportFrame.begin(), transportFrame.begin() + size),
+                      frames));
+    }
+    CHECK(frames.empty());
+    DestroyAll(frames);
+}
+
+void TestFrameCompressionHello()
+{
+    Framer framer;
+    CHECK(framer.Configure(4, false, FRAMER_MAX_FRAME_SIZE));
+    FrameCompression compression;
+    CHECK(!compression.IsEnabled());
+    CHECK(compression.Configure(framer, COMPRESSION_MIN_BATCH_SIZE));
+    CHECK(compression.IsEnabled());
+
+    Bytes hello(framer.GetPrefixSize());
+    framer.EncodeLength(FrameCompression::HELLO_SIZE, &hello[0]);
+    hello.insert(hello.end(), FrameCompression::HELLO,
+                 FrameCompression::HELLO + FrameCompression::HELLO_SIZE);
+
+    Packet* packet = Packet::Create(NULL, &hello[0], static_cast<DWORD>(hello.size()));
+    CHECK(compression.IsHello(packet));
+    packet->GetData()[hello.size() - 1] = '!';
+    CHECK(!compression.IsHello(packet));
+    Packet::Destroy(packet);
+
+    packet = compression.CreateAck();
+    Bytes ack = hello;
+    ack.back() = '!';
+    CHECK(packet != NULL && Flatten(packet) == ack);
+    Packet::Destroy(packet);
+
+    // Compression needs framing, with frames large enough for a batch.
+    Framer unframed;
+    CHECK(!compression.Configure(unframed, COMPRESSION_MIN_BATCH_SIZE));
+    Framer small;
+    CHECK(small.Configure(1, true, 32));
+    CHECK(!compression.Configure(small, COMPRESSION_MIN_BATCH_SIZE));
+    CHECK(compression.Configure(small, 0));
+    CHECK(!compression.IsEnabled());
+}
+
+//---------------------------------------------------------------------------------------------
+// TimerWheel
+
+// The ticks each wheel's slots span.
+const ULONGLONG WHEEL_SPANS[] = {1, 1 << 6, 1 << 12, 1 << 18, 1 << 24};
+
+// Schedules a timer delays[i] ticks after start for every delay, and checks that each one expires
+// on its tick, neither earlier nor later.
+void CheckExpiries(ULONGLONG start, const std::vector<ULONGLONG>& delays)
+{
+    TimerWheel<size_t> wheel(start);
+    std::vector<ULONGLONG> expiries;
+    for (size_t i = 0; i < delays.size(); ++i)
+    {
+        wheel.Schedule(i, start + delays[i]);
+        expiries.push_back(start + delays[i]);
+    }
+    CHECK(wheel.GetSize() == delays.size());
+
+    std::sort(expiries.begin(), expiries.end());
+    expiries.erase(std::unique(expiries.begin(), expiries.end()), expiries.end());
+
+    for (size_t i = 0; i < expiries.size(); ++i)
+    {
+        std::vector<size_t> expired;
+        wheel.Advance(expiries[i] - 1, expired);
+        CHECK(expired.empty());
+
+        wheel.Advance(expiries[i], expired);
+        CHECK(!expired.empty());
+        for (size_t j = 0; j < expired.size(); ++j)
+        {
+            CHECK(start + delays[expired[j]] == expiries[i]);
+        }
+        CHECK(expired.size() == static_cast<size_t>(std::count(
+                                    delays.begin(), delays.end(), expiries[i] - start)));
+    }
+
+    CHECK(wheel.GetSize() == 0);
+    CHECK(wheel.GetCurrentTick() == expiries.back());
+}
+
+void TestTimerWheelBoundaries()
+{
+    // A tick either side of the spans of the wheels below the last, which is where a timer goes
+    // up a wheel, starting on and next to the ticks at which the wheels come round.
+    std::vector<ULONGLONG> delays;
+    delays.push_back(1);
+    delays.push_back(2);
+    for (int wheel = 1; wheel < 4; ++wheel)
+    {
+        delays.push_back(WHEEL_SPANS[wheel] - 1);
+        delays.push_back(WHEEL_SPANS[wheel]);
+        delays.push_back(WHEEL_SPANS[wheel] + 1);
+        delays.push_back(2 * WHEEL_SPANS[wheel] + 3);
+    }
+
+    std::vector<ULONGLONG> starts;
+    starts.push_back(0);
+    for (int wheel = 1; wheel < 5; ++wheel)
+    {
+        starts.push_back(WHEEL_SPANS[wheel] - 1);
+        starts.push_back(WHEEL_SPANS[wheel]);
+    }
+    starts.push_back(0x123456789ULL);
+
+    for (size_t i = 0; i < starts.size(); ++i)
+    {
+        CheckExpiries(starts[i], delays);
+    }
+
+    // The last wheel takes a tick at a time to get through, so it only gets a few of them.
+    delays.push_back(WHEEL_SPANS[4] - 1);
+    delays.push_back(WHEEL_SPANS[4]);
+    delays.push_back(WHEEL_SPANS[4] + 1);
+    CheckExpiries(0, delays);
+    CheckExpiries(WHEEL_SPANS[4] - 1, delays);
+}
+
+void TestTimerWheelCascade()
+{
+    // Timers for the same tick that have been scheduled from further and further away, so they
+    // start out on every wheel and meet on the first one.
+    const ULONGLONG expiry = WHEEL_SPANS[4] + WHEEL_SPANS[3] + WHEEL_SPANS[2] + 5;
+    TimerWheel<int> wheel;
+    std::vector<int> expired;
+    for (int i = 4; i >= 0; --i)
+    {
+        wheel.Advance(expiry - WHEEL_SPANS[i] - 1, expired);
+        wheel.Schedule(i, expiry);
+    }
+    CHECK(expired.empty());
+
+    wheel.Advance(expiry - 1, expired);
+    CHECK(expired.empty());
+    wheel.Advance(expiry, expired);
+    std::sort(expired.begin(), expired.end());
+    CHECK(expired.size() == 5);
+    for (size_t i = 0; i < expired.size(); ++i)
+    {
+        CHECK(expired[i] == static_cast<int>(i));
+    }
+
+    // A timer that is due already expires with the next tick, after the ones before it.
+    wheel.Schedule(10, expiry - 100);
+    wheel.Schedule(11, expiry);
+    wheel.Schedule(12, expiry + 1);
+    expired.clear();
+    wheel.Advance(expiry + 1, expired);
+    CHECK(expired.size() == 3);
+    CHECK(wheel.GetSize() == 0);
+
+    // Starting over drops the timers.
+    wheel.Schedule(13, expiry + 10);
+    wheel.Schedule(14, expiry + WHEEL_SPANS[3]);
+    wheel.Reset(0);
+    CHECK(wheel.GetSize() == 0 && wheel.GetCurrentTick() == 0);
+    expired.clear();
+    wheel.Advance(WHEEL_SPANS[3] + 1, expired);
+    CHECK(expired.empty());
+}
+
+//---------------------------------------------------------------------------------------------
+// HandleTable
+
+// Adds and removes as many objects as there are shards, so that every shard reuses a slot.
+// Returns whether id has been handed out again meanwhile.
+bool ReuseSlots(HandleTable<int>& table, int* object, HandleId id)
+{
+    std::vector<HandleId> ids;
+    for (int i = 0; i < 64; ++i)
+    {
+        ids.push_back(table.Add(object));
+    }
+
+    bool reused = false;
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        CHECK(table.Remove(ids[i]) == object);
+        reused = reused || ids[i] == id;
+    }
+    return reused;
+}
+
+void TestHandleTableReuse()
+{
+    HandleTable<int> table;
+    std::vector<int> objects(64 * 3);
+
+    std::vector<HandleId> ids;
+    for (size_t i = 0; i < objects.size(); ++i)
+    {
+        ids.push_back(table.Add(&objects[i]));
+        CHECK(ids.back() != INVALID_HANDLE_ID);
+    }
+    CHECK(table.GetSize() == objects.size());
+
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        int* found = NULL;
+        CHECK(table.Visit(ids[i], [&found](int* object) { found = object; }));
+        CHECK(found == &objects[i]);
+    }
+
+    // Removed handles stay invalid once their slots have been taken again.
+    std::vector<HandleId> stale(ids.begin(), ids.begin() + 64);
+    for (size_t i = 0; i < stale.size(); ++i)
+    {
+        CHECK(table.Remove(stale[i]) == &objects[i]);
+        CHECK(table.Remove(stale[i]) == NULL);
+    }
+    for (size_t i = 0; i < stale.size(); ++i)
+    {
+        ids[i] = table.Add(&objects[i]);
+        CHECK(ids[i] != stale[i]);
+    }
+    for (size_t i = 0; i < stale.size(); ++i)
+    {
+        CHECK(!table.Contains(stale[i]));
+        CHECK(table.Contains(ids[i]));
+    }
+
+    size_t numRemoved = 0;
+    table.RemoveAll([&numRemoved](int*) { ++numRemoved; });
+    CHECK(numRemoved == objects.size() && table.GetSize() == 0);
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        CHECK(!table.Contains(ids[i]));
+    }
+    CHECK(!table.Contains(INVALID_HANDLE_ID));
+}
+
+void TestHandleTableGenerationWrap()
+{
+    HandleTable<int> table;
+    int object = 0;
+
+    // One slot per shard, reused over and over.
+    const HandleId staleId = table.Add(&object);
+    CHECK(table.Remove(staleId) == &object);
+
+    // A stale handle isn't handed out again until its slot has gone through every generation,
+    // which takes too long to go through where the generation has 32 bits.
+    const ULONGLONG maxGeneration = HandleTable<int>::GetMaxGeneration();
+    const ULONGLONG numReuses = min(maxGeneration, static_cast<ULONGLONG>(100000));
+    for (ULONGLONG i = 1; i < numReuses; ++i)
+    {
+        CHECK(!ReuseSlots(table, &object, staleId));
+        CHECK(!table.Contains(staleId));
+    }
+
+    // After that the generations start over.
+    if (numReuses == maxGeneration)
+    {
+        CHECK(ReuseSlots(table, &object, staleId));
+    }
+}
+
+//---------------------------------------------------------------------------------------------
+
+struct Case
+{
+    const char* name;
+    void (*run)();
+};
+
+const Case CASES[] = {
+    {"framer_split_prefixes", TestFramerSplitPrefixes},
+    {"framer_many_frames_per_receive", TestFramerManyFramesPerReceive},
+    {"framer_max_frame_size", TestFramerMaxFrameSize},
+    {"framer_length_wrap", TestFramerLengthWrap},
+    {"framer_split", TestFramerSplit},
+    {"lz4_round_trip", TestLz4RoundTrip},
+    {"lz4_capacity", TestLz4Capacity},
+    {"lz4_truncated", TestLz4Truncated},
+    {"lz4_malformed", TestLz4Malformed},
+    {"frame_compression_round_trip", TestFrameCompressionRoundTrip},
+    {"frame_compression_malformed", TestFrameCompressionMalformed},
+    {"frame_compression_hello", TestFrameCompressionHello},
+    {"timer_wheel_boundaries", TestTimerWheelBoundaries},
+    {"timer_wheel_cascade", TestTimerWheelCascade},
+    {"handle_table_reuse", TestHandleTableReuse},
+    {"handle_table_generation_wrap", TestHandleTableGenerationWrap},
+};
+}
+
+int main(int argc, char* argv[])
+{
+    const char* prefix = argc > 1 ? argv[1] : "";
+
+    int numRun = 0;
+    int numFailed = 0;
+    for (size_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); ++i)
+    {
+        if (strncmp(CASES[i].name, prefix, strlen(prefix)) != 0)
+        {
+            continue;
+        }
+
+        printf("%s\n", CASES[i].name);
+
+        const int numFailedChecks = g_NumFailedChecks;
+        CASES[i].run();
+
+        ++numRun;
+        if (g_NumFailedChecks != numFailedChecks)
+        {
+            ++numFailed;
+        }
+    }
+
+    printf("%d of %d cases failed.\n", numFailed, numRun);
+
+    return numFailed;
+}
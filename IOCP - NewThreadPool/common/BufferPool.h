@@ -0,0 +1,128 @@
+#pragma once
+
+#include <windows.h>
+#include <cassert>
+
+#include "CachedAlloc.h"
+
+// Hands out blocks from power-of-two size classes, each backed by its own CachedAlloc, so that
+// small buffers don't pay for the largest one.
+class BufferPool
+{
+public:
+    enum
+    {
+        MIN_CLASS_SHIFT = 6,
+        MAX_CLASS_SHIFT = 16,
+        NUM_CLASSES = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1,
+        MIN_BLOCK_SIZE = 1 << MIN_CLASS_SHIFT,
+        MAX_BLOCK_SIZE = 1 << MAX_CLASS_SHIFT,
+    };
+
+public:
+    BufferPool()
+    {
+        for (int i = 0; i < NUM_CLASSES; ++i)
+        {
+            m_Classes[i] = new CachedAlloc(static_cast<size_t>(MIN_BLOCK_SIZE) << i);
+        }
+    }
+
+    ~BufferPool()
+    {
+        for (int i = 0; i < NUM_CLASSES; ++i)
+        {
+            delete m_Classes[i];
+        }
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Returns a block of getBlockSize(size) bytes, or NULL if size is over MAX_BLOCK_SIZE.
+    void* get(size_t size)
+    {
+        const int index = GetClassIndex(size);
+        if (index < 0)
+        {
+            return NULL;
+        }
+
+        return m_Classes[index]->get();
+    }
+
+    // size is the one the block was got with, or its block size.
+    void put(void* block, size_t size)
+    {
+        const int index = GetClassIndex(size);
+        assert(index >= 0);
+
+        m_Classes[index]->put(block);
+    }
+
+    // The CachedAlloc settings and stats of the class that serves size bytes.
+    void reserve(size_t size, size_t count) { GetClass(size)->reserve(count); }
+    void setHighWater(size_t size, size_t highWater) { GetClass(size)->setHighWater(highWater); }
+    CachedAlloc::Stats getStats(size_t size) { return GetClass(size)->getStats(); }
+
+    void setSlabObserver(SlabObserver* observer)
+    {
+        for (int i = 0; i < NUM_CLASSES; ++i)
+        {
+            m_Classes[i]->setSlabObserver(observer);
+        }
+    }
+
+    void trim()
+    {
+        for (int i = 0; i < NUM_CLASSES; ++i)
+        {
+            m_Classes[i]->trim();
+        }
+    }
+
+    // The size of the class that serves size bytes, or 0 if no class is large enough.
+    static size_t getBlockSize(size_t size)
+    {
+        const int index = GetClassIndex(size);
+        return index < 0 ? 0 : static_cast<size_t>(MIN_BLOCK_SIZE) << index;
+    }
+
+    // The largest class that is no larger than size, but never smaller than MIN_BLOCK_SIZE.
+    static size_t getFittingBlockSize(size_t size)
+    {
+        size_t blockSize = MIN_BLOCK_SIZE;
+        while (blockSize < MAX_BLOCK_SIZE && (blockSize << 1) <= size)
+        {
+            blockSize <<= 1;
+        }
+        return blockSize;
+    }
+
+private:
+    CachedAlloc* GetClass(size_t size)
+    {
+        const int index = GetClassIndex(size);
+        assert(index >= 0);
+
+        return m_Classes[index];
+    }
+
+    static int GetClassIndex(size_t size)
+    {
+        if (size > MAX_BLOCK_SIZE)
+        {
+            return -1;
+        }
+
+        int index = 0;
+        while ((static_cast<size_t>(MIN_BLOCK_SIZE) << index) < size)
+        {
+            ++index;
+        }
+        return index;
+    }
+
+private:
+    CachedAlloc* m_Classes[NUM_CLASSES];
+};
@@ -1,38 +1,176 @@
 #pragma once
 
 #include <windows.h>
-#include <malloc.h>
+#include <algorithm>
+#include <cassert>
+#include <vector>
 
+#include "CritSecLock.h"
+
+// Lets the user of a CachedAlloc register every slab it allocates, e.g. with Registered I/O.
+class SlabObserver
+{
+public:
+	virtual ~SlabObserver() {}
+
+	// Returns a tag that CachedAlloc::getSlab() hands back for the slab's objects.
+	virtual ULONG_PTR OnSlabAllocated(BYTE* base, size_t size) = 0;
+	virtual void OnSlabFreed(ULONG_PTR tag) = 0;
+};
+
+// A free list shared by all threads with a small magazine per thread in front of it.
+// Threads only touch the shared list to move whole batches, so most get() and put() calls stay
+// on the calling thread's own cache lines.
+// Objects are carved out of slabs that come straight from VirtualAlloc(). A slab whose objects
+// are all back in the shared list can be returned to the OS by trim().
+// Slabs are aligned to the allocation granularity and the objects all start in its first 64 KB,
+// so an object finds its slab by masking its address.
 class CachedAlloc
 {
+public:
+	struct Stats
+	{
+		size_t numSlabs;
+		size_t numTotal; // objects carved out of the slabs.
+		size_t numFree; // objects in the shared list.
+		size_t numLive; // the rest, which are in use or cached by a thread.
+		size_t peakLive;
+		// get()s that the thread's magazine couldn't serve, and how many of those needed a new slab.
+		size_t numRefills;
+		size_t numSlabAllocations;
+	};
+
+private:
+	enum
+	{
+		CACHE_LINE_SIZE = 64,
+		SLAB_SIZE = 64 * 1024,
+		// VirtualAlloc() aligns every allocation to this.
+		SLAB_ALIGNMENT = 64 * 1024,
+		// The slab header takes up the first cache line of a slab.
+		SLAB_HEADER_SIZE = CACHE_LINE_SIZE,
+		BATCH_SIZE = 32,
+		// Room for two batches so that alternating get() and put() at a batch boundary don't
+		// move the same batch back and forth.
+		MAGAZINE_SIZE = BATCH_SIZE * 2,
+	};
+
+	// Free objects are chained into batches through their own memory.
+	struct Node
+	{
+		SLIST_ENTRY entry; // only used by the first node of a batch.
+		Node* next;
+	};
+
+	struct Magazine
+	{
+		CachedAlloc* owner;
+		int count;
+		void* objects[MAGAZINE_SIZE];
+	};
+
+	struct SlabHeader
+	{
+		ULONG_PTR tag;
+	};
+
+	struct Slab
+	{
+		BYTE* base;
+		size_t numObjects;
+
+		bool operator<(const Slab& other) const { return base < other.base; }
+	};
+
 public:
 	CachedAlloc(size_t size)
-        : m_size(max(size, sizeof(SLIST_ENTRY)))
+        : m_size(RoundUpToCacheLine(max(size, sizeof(Node)))),
+		  m_objectsPerSlab(max(static_cast<size_t>(1), (SLAB_SIZE - SLAB_HEADER_SIZE) / m_size)),
+		  m_flsIndex(FlsAlloc(CachedAlloc::OnThreadExit)),
+		  m_highWater(0),
+		  m_observer(NULL),
+		  m_numTotal(0),
+		  m_numFree(0),
+		  m_peakLive(0),
+		  m_numRefills(0),
+		  m_numSlabAllocations(0)
 	{
 		m_pListHead = (PSLIST_HEADER)_aligned_malloc(sizeof(SLIST_HEADER),
 												MEMORY_ALLOCATION_ALIGNMENT);
 		InitializeSListHead(m_pListHead);
+		InitializeCriticalSection(&m_slabLock);
 	}
 	~CachedAlloc()
 	{
+		// This flushes the magazines of the threads that are still alive.
+		if (m_flsIndex != FLS_OUT_OF_INDEXES)
+		{
+			FlsFree(m_flsIndex);
+		}
+
+		for (size_t i = 0; i < m_slabs.size(); ++i)
+		{
+			FreeSlab(m_slabs[i]);
+		}
+
+		DeleteCriticalSection(&m_slabLock);
 		 _aligned_free(m_pListHead);
 	}
 
 	void put(void* pData)
 	{
-		InterlockedPushEntrySList(m_pListHead, (PSLIST_ENTRY) pData);
+		Magazine* magazine = GetMagazine();
+		if (magazine == NULL)
+		{
+			PushBatch(&pData, 1);
+			return;
+		}
+
+		if (magazine->count == MAGAZINE_SIZE)
+		{
+			magazine->count -= BATCH_SIZE;
+			PushBatch(&magazine->objects[magazine->count], BATCH_SIZE);
+
+			// Only trim when a batch goes back, so that it stays off the fast path.
+			if (m_highWater != 0 && static_cast<size_t>(m_numFree) > m_highWater)
+			{
+				trim(false);
+			}
+		}
+
+		magazine->objects[magazine->count++] = pData;
 	}
 
 	void* get()
 	{
-		void* result = InterlockedPopEntrySList(m_pListHead);
-		if (NULL == result)
+		Magazine* magazine = GetMagazine();
+		if (magazine == NULL)
 		{
-			result = _aligned_malloc(m_size,
-									MEMORY_ALLOCATION_ALIGNMENT);
+			void* objects[BATCH_SIZE];
+			const int count = PopOrAllocateBatch(objects);
+			if (count == 0)
+			{
+				return NULL;
+			}
+
+			// Give the rest of the batch back.
+			if (count > 1)
+			{
+				PushBatch(&objects[1], count - 1);
+			}
+			return objects[0];
 		}
 
-		return result;
+		if (magazine->count == 0)
+		{
+			magazine->count = PopOrAllocateBatch(magazine->objects);
+			if (magazine->count == 0)
+			{
+				return NULL;
+			}
+		}
+
+		return magazine->objects[--magazine->count];
 	}
 
 	size_t getSize() const
@@ -40,11 +178,330 @@ public:
 		return m_size;
 	}
 
+	// Carves out slabs until at least count objects exist, so that a burst of connections
+	// doesn't have to wait on VirtualAlloc().
+	void reserve(size_t count)
+	{
+		while (static_cast<size_t>(m_numTotal) < count && AllocateSlab())
+		{
+		}
+	}
+
+	// Once more than highWater objects are in the shared list, slabs that are entirely free are
+	// returned to the OS until it's back under highWater. 0 disables this.
+	void setHighWater(size_t highWater)
+	{
+		m_highWater = highWater;
+	}
+
+	// Returns the slabs whose objects are all in the shared list to the OS, keeping at least
+	// the high water mark of free objects. Objects cached by other threads keep their slabs alive.
+	void trim(bool wait = true)
+	{
+		if (wait)
+		{
+			EnterCriticalSection(&m_slabLock);
+		}
+		else if (!TryEnterCriticalSection(&m_slabLock))
+		{
+			// Someone else is already at it.
+			return;
+		}
+
+		std::vector<void*> objects;
+		for (Node* batch = reinterpret_cast<Node*>(InterlockedFlushSList(m_pListHead));
+			 batch != NULL; batch = reinterpret_cast<Node*>(batch->entry.Next))
+		{
+			for (Node* node = batch; node != NULL; node = node->next)
+			{
+				objects.push_back(node);
+			}
+		}
+		InterlockedExchangeAdd(&m_numFree, -static_cast<LONG>(objects.size()));
+
+		// Count the free objects of each slab.
+		std::vector<size_t> numFree(m_slabs.size(), 0);
+		for (size_t i = 0; i < objects.size(); ++i)
+		{
+			++numFree[FindSlab(objects[i])];
+		}
+
+		std::vector<bool> released(m_slabs.size(), false);
+		size_t remaining = objects.size();
+		for (size_t i = 0; i < m_slabs.size(); ++i)
+		{
+			if (numFree[i] == m_slabs[i].numObjects &&
+				remaining - m_slabs[i].numObjects >= m_highWater)
+			{
+				released[i] = true;
+				remaining -= m_slabs[i].numObjects;
+			}
+		}
+
+		// Put back the objects of the slabs we keep.
+		std::vector<void*> kept;
+		kept.reserve(remaining);
+		for (size_t i = 0; i < objects.size(); ++i)
+		{
+			if (!released[FindSlab(objects[i])])
+			{
+				kept.push_back(objects[i]);
+			}
+		}
+		for (size_t i = 0; i < kept.size(); i += BATCH_SIZE)
+		{
+			PushBatch(&kept[i], static_cast<int>(min(kept.size() - i, static_cast<size_t>(BATCH_SIZE))));
+		}
+
+		size_t numKept = 0;
+		for (size_t i = 0; i < m_slabs.size(); ++i)
+		{
+			if (released[i])
+			{
+				InterlockedExchangeAdd(&m_numTotal, -static_cast<LONG>(m_slabs[i].numObjects));
+				FreeSlab(m_slabs[i]);
+			}
+			else
+			{
+				m_slabs[numKept++] = m_slabs[i];
+			}
+		}
+		m_slabs.resize(numKept);
+
+		LeaveCriticalSection(&m_slabLock);
+	}
+
+	// Tells observer about the slabs that exist and every one allocated or freed from now on.
+	// Passing NULL tells the previous observer that all of them are gone.
+	void setSlabObserver(SlabObserver* observer)
+	{
+		CritSecLock lock(m_slabLock);
+
+		for (size_t i = 0; i < m_slabs.size(); ++i)
+		{
+			SlabHeader* header = reinterpret_cast<SlabHeader*>(m_slabs[i].base);
+			if (m_observer != NULL)
+			{
+				m_observer->OnSlabFreed(header->tag);
+			}
+			header->tag =
+				observer != NULL ? observer->OnSlabAllocated(m_slabs[i].base, GetSlabSize()) : 0;
+		}
+
+		m_observer = observer;
+	}
+
+	// Returns the slab an object got from get() lives in, along with the slab's observer tag.
+	static BYTE* getSlab(void* object, ULONG_PTR& tag)
+	{
+		BYTE* base = reinterpret_cast<BYTE*>(
+			reinterpret_cast<ULONG_PTR>(object) & ~static_cast<ULONG_PTR>(SLAB_ALIGNMENT - 1));
+		tag = reinterpret_cast<SlabHeader*>(base)->tag;
+		return base;
+	}
+
+	Stats getStats()
+	{
+		CritSecLock lock(m_slabLock);
+
+		Stats stats;
+		stats.numSlabs = m_slabs.size();
+		stats.numTotal = static_cast<size_t>(m_numTotal);
+		stats.numFree = static_cast<size_t>(m_numFree);
+		stats.numLive = stats.numTotal - min(stats.numTotal, stats.numFree);
+		stats.peakLive = static_cast<size_t>(m_peakLive);
+		stats.numRefills = static_cast<size_t>(m_numRefills);
+		stats.numSlabAllocations = m_numSlabAllocations;
+		return stats;
+	}
+
 private:
     CachedAlloc(const CachedAlloc&) = delete;
     CachedAlloc& operator = (const CachedAlloc&) = delete;
 
+	static size_t RoundUpToCacheLine(size_t size)
+	{
+		return (size + CACHE_LINE_SIZE - 1) & ~static_cast<size_t>(CACHE_LINE_SIZE - 1);
+	}
+
+	static void NTAPI OnThreadExit(PVOID data)
+	{
+		Magazine* magazine = static_cast<Magazine*>(data);
+		if (magazine == NULL)
+		{
+			return;
+		}
+
+		while (magazine->count > 0)
+		{
+			const int count = min(magazine->count, static_cast<int>(BATCH_SIZE));
+			magazine->count -= count;
+			magazine->owner->PushBatch(&magazine->objects[magazine->count], count);
+		}
+
+		_aligned_free(magazine);
+	}
+
+	Magazine* GetMagazine()
+	{
+		if (m_flsIndex == FLS_OUT_OF_INDEXES)
+		{
+			return NULL;
+		}
+
+		Magazine* magazine = static_cast<Magazine*>(FlsGetValue(m_flsIndex));
+		if (magazine == NULL)
+		{
+			magazine = static_cast<Magazine*>(_aligned_malloc(sizeof(Magazine), CACHE_LINE_SIZE));
+			if (magazine == NULL)
+			{
+				return NULL;
+			}
+
+			magazine->owner = this;
+			magazine->count = 0;
+
+			if (!FlsSetValue(m_flsIndex, magazine))
+			{
+				_aligned_free(magazine);
+				return NULL;
+			}
+		}
+
+		return magazine;
+	}
+
+	void PushBatch(void** objects, int count)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			static_cast<Node*>(objects[i])->next =
+				i + 1 < count ? static_cast<Node*>(objects[i + 1]) : NULL;
+		}
+
+		InterlockedPushEntrySList(m_pListHead, &static_cast<Node*>(objects[0])->entry);
+		InterlockedExchangeAdd(&m_numFree, count);
+	}
+
+	// Fills objects with up to BATCH_SIZE objects and returns how many.
+	int PopOrAllocateBatch(void** objects)
+	{
+		InterlockedIncrement(&m_numRefills);
+
+		for (;;)
+		{
+			Node* node = reinterpret_cast<Node*>(InterlockedPopEntrySList(m_pListHead));
+			if (node != NULL)
+			{
+				int count = 0;
+				for (; node != NULL; node = node->next)
+				{
+					objects[count++] = node;
+				}
+
+				const LONG numFree = InterlockedExchangeAdd(&m_numFree, -count) - count;
+				UpdatePeak(m_numTotal - numFree);
+
+				return count;
+			}
+
+			// Another thread may take the new slab's objects before we get to them, so loop.
+			if (!AllocateSlab())
+			{
+				return 0;
+			}
+		}
+	}
+
+	bool AllocateSlab()
+	{
+		CritSecLock lock(m_slabLock);
+
+		BYTE* base = static_cast<BYTE*>(
+			VirtualAlloc(NULL, GetSlabSize(), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+		if (base == NULL)
+		{
+			return false;
+		}
+		assert((reinterpret_cast<ULONG_PTR>(base) & (SLAB_ALIGNMENT - 1)) == 0);
+
+		reinterpret_cast<SlabHeader*>(base)->tag =
+			m_observer != NULL ? m_observer->OnSlabAllocated(base, GetSlabSize()) : 0;
+
+		Slab slab = { base, m_objectsPerSlab };
+		m_slabs.insert(std::upper_bound(m_slabs.begin(), m_slabs.end(), slab), slab);
+		++m_numSlabAllocations;
+		InterlockedExchangeAdd(&m_numTotal, static_cast<LONG>(m_objectsPerSlab));
+
+		void* objects[BATCH_SIZE];
+		int count = 0;
+		for (size_t i = 0; i < m_objectsPerSlab; ++i)
+		{
+			objects[count++] = base + SLAB_HEADER_SIZE + i * m_size;
+			if (count == BATCH_SIZE)
+			{
+				PushBatch(objects, count);
+				count = 0;
+			}
+		}
+		if (count > 0)
+		{
+			PushBatch(objects, count);
+		}
+
+		return true;
+	}
+
+	size_t GetSlabSize() const
+	{
+		return SLAB_HEADER_SIZE + m_objectsPerSlab * m_size;
+	}
+
+	// m_slabLock must be held.
+	void FreeSlab(const Slab& slab)
+	{
+		if (m_observer != NULL)
+		{
+			m_observer->OnSlabFreed(reinterpret_cast<SlabHeader*>(slab.base)->tag);
+		}
+		VirtualFree(slab.base, 0, MEM_RELEASE);
+	}
+
+	// m_slabLock must be held.
+	size_t FindSlab(void* object)
+	{
+		Slab key = { static_cast<BYTE*>(object), 0 };
+		return (std::upper_bound(m_slabs.begin(), m_slabs.end(), key) - m_slabs.begin()) - 1;
+	}
+
+	void UpdatePeak(LONG live)
+	{
+		LONG peak = m_peakLive;
+		while (live > peak)
+		{
+			const LONG previous = InterlockedCompareExchange(&m_peakLive, live, peak);
+			if (previous == peak)
+			{
+				break;
+			}
+			peak = previous;
+		}
+	}
+
 private:
-	size_t m_size;
+	const size_t m_size;
+	const size_t m_objectsPerSlab;
+	DWORD m_flsIndex;
 	PSLIST_HEADER m_pListHead;
+
+	CRITICAL_SECTION m_slabLock;
+	std::vector<Slab> m_slabs; // sorted by address.
+	size_t m_highWater;
+	SlabObserver* m_observer;
+
+	volatile LONG m_numTotal;
+	volatile LONG m_numFree;
+	volatile LONG m_peakLive;
+	volatile LONG m_numRefills;
+	size_t m_numSlabAllocations; // guarded by m_slabLock.
 };
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+#include <cassert>
+
+#include "CritSecLock.h"
+
+// A handle is pointer-sized so that it can be passed as the context of a thread pool callback.
+// It packs [generation][slot index][shard] and is never 0.
+typedef ULONG_PTR HandleId;
+
+const HandleId INVALID_HANDLE_ID = 0;
+
+// Maps generation-tagged handles to objects in O(1).
+// Slots are spread over shards that each have their own lock, so lookups for different objects
+// rarely contend. A slot's generation is bumped when its object is removed, so a stale handle
+// doesn't resolve to the object that reuses the slot. Freed slots are reused oldest first, which
+// makes a slot go round the other free slots of its shard before it is reused.
+// The generation wraps after GetMaxGeneration() reuses of a slot, and a stale handle that is
+// still held by then resolves again. That is 4095 reuses on 32-bit builds, where the handle only
+// has 32 bits, and 2^32 - 1 on 64-bit builds.
+template <typename T> class HandleTable
+{
+private:
+    enum
+    {
+        SHARD_BITS = 6,
+        NUM_SHARDS = 1 << SHARD_BITS,
+#ifdef _WIN64
+        INDEX_BITS = 26,
+        GENERATION_BITS = 32,
+#else
+        // 2^20 handles, more than a 32-bit process has room for clients.
+        INDEX_BITS = 14,
+        GENERATION_BITS = 12,
+#endif
+        NO_SLOT = 0xFFFFFFFF,
+    };
+
+    struct Slot
+    {
+        T* object;
+        DWORD generation;
+        DWORD nextFree;
+    };
+
+    struct Shard
+    {
+        CRITICAL_SECTION cs;
+        std::vector<Slot> slots;
+        DWORD freeHead;
+        DWORD freeTail;
+
+        // Keep each shard's lock on its own cache line.
+        char padding[64];
+    };
+
+public:
+    HandleTable() : m_Size(0), m_NextShard(0)
+    {
+        for (int i = 0; i < NUM_SHARDS; ++i)
+        {
+            InitializeCriticalSection(&m_Shards[i].cs);
+            m_Shards[i].freeHead = NO_SLOT;
+            m_Shards[i].freeTail = NO_SLOT;
+        }
+    }
+
+    ~HandleTable()
+    {
+        for (int i = 0; i < NUM_SHARDS; ++i)
+        {
+            DeleteCriticalSection(&m_Shards[i].cs);
+        }
+    }
+
+    HandleTable(const HandleTable&) = delete;
+    HandleTable& operator=(const HandleTable&) = delete;
+
+    HandleId Add(T* object)
+    {
+        assert(object);
+
+        const DWORD shardIndex = InterlockedIncrement(&m_NextShard) & (NUM_SHARDS - 1);
+        Shard& shard = m_Shards[shardIndex];
+
+        CritSecLock lock(shard.cs);
+
+        DWORD slotIndex = shard.freeHead;
+        if (slotIndex != NO_SLOT)
+        {
+            shard.freeHead = shard.slots[slotIndex].nextFree;
+            if (shard.freeHead == NO_SLOT)
+            {
+                shard.freeTail = NO_SLOT;
+            }
+        }
+        else
+        {
+            slotIndex = static_cast<DWORD>(shard.slots.size());
+            if (slotIndex >= (1UL << INDEX_BITS))
+            {
+                return INVALID_HANDLE_ID;
+            }
+
+            Slot slot = { NULL, 1, NO_SLOT };
+            shard.slots.push_back(slot);
+        }
+
+        Slot& slot = shard.slots[slotIndex];
+        slot.object = object;
+        slot.nextFree = NO_SLOT;
+
+        InterlockedIncrement(&m_Size);
+
+        return MakeId(slot.generation, slotIndex, shardIndex);
+    }
+
+    // Returns the object if the handle was still valid.
+    T* Remove(HandleId id)
+    {
+        if (id == INVALID_HANDLE_ID)
+        {
+            return NULL;
+        }
+
+        Shard& shard = m_Shards[GetShardIndex(id)];
+
+        CritSecLock lock(shard.cs);
+
+        Slot* slot = FindSlot(shard, id);
+        if (slot == NULL)
+        {
+            return NULL;
+        }
+
+        T* object = slot->object;
+
+        slot->object = NULL;
+        slot->generation = NextGeneration(slot->generation);
+        PushFree(shard, GetSlotIndex(id));
+
+        InterlockedDecrement(&m_Size);
+
+        return object;
+    }
+
+    bool Contains(HandleId id)
+    {
+        if (id == INVALID_HANDLE_ID)
+        {
+            return false;
+        }
+
+        Shard& shard = m_Shards[GetShardIndex(id)];
+
+        CritSecLock lock(shard.cs);
+
+        return FindSlot(shard, id) != NULL;
+    }
+
+    // Calls func(T*) while holding the shard lock, so the object can't be removed meanwhile.
+    // Returns false if the handle is no longer valid.
+    template <typename Func> bool Visit(HandleId id, Func func)
+    {
+        if (id == INVALID_HANDLE_ID)
+        {
+            return false;
+        }
+
+        Shard& shard = m_Shards[GetShardIndex(id)];
+
+        CritSecLock lock(shard.cs);
+
+        Slot* slot = FindSlot(shard, id);
+        if (slot == NULL)
+        {
+            return false;
+        }
+
+        func(slot->object);
+        return true;
+    }
+
+    // Calls func(T*) for every object, one shard lock at a time.
+    // func must not add objects to this table.
+    template <typename Func> void ForEach(Func func)
+    {
+        for (int i = 0; i < NUM_SHARDS; ++i)
+        {
+            Shard& shard = m_Shards[i];
+
+            CritSecLock lock(shard.cs);
+
+            for (size_t slotIndex = 0; slotIndex < shard.slots.size(); ++slotIndex)
+            {
+                if (shard.slots[slotIndex].object != NULL)
+                {
+                    func(shard.slots[slotIndex].object);
+                }
+            }
+        }
+    }
+
+    // Invalidates every handle and calls func(T*) for each object that was removed.
+    template <typename Func> void RemoveAll(Func func)
+    {
+        for (int i = 0; i < NUM_SHARDS; ++i)
+        {
+            Shard& shard = m_Shards[i];
+
+            CritSecLock lock(shard.cs);
+
+            for (size_t slotIndex = 0; slotIndex < shard.slots.size(); ++slotIndex)
+            {
+                Slot& slot = shard.slots[slotIndex];
+                if (slot.object != NULL)
+                {
+                    T* object = slot.object;
+
+                    slot.object = NULL;
+                    slot.generation = NextGeneration(slot.generation);
+                    PushFree(shard, static_cast<DWORD>(slotIndex));
+
+                    InterlockedDecrement(&m_Size);
+
+                    func(object);
+                }
+            }
+        }
+    }
+
+    size_t GetSize() const { return static_cast<size_t>(m_Size); }
+
+    // The reuses of a slot after which its generations start over.
+    static ULONGLONG GetMaxGeneration()
+    {
+        return (static_cast<ULONGLONG>(1) << GENERATION_BITS) - 1;
+    }
+
+private:
+    static HandleId MakeId(DWORD generation, DWORD slotIndex, DWORD shardIndex)
+    {
+        return (static_cast<HandleId>(generation) << (INDEX_BITS + SHARD_BITS)) |
+               (static_cast<HandleId>(slotIndex) << SHARD_BITS) | shardIndex;
+    }
+
+    static DWORD GetShardIndex(HandleId id) { return static_cast<DWORD>(id & (NUM_SHARDS - 1)); }
+
+    static DWORD GetSlotIndex(HandleId id)
+    {
+        return static_cast<DWORD>((id >> SHARD_BITS) & ((1UL << INDEX_BITS) - 1));
+    }
+
+    static DWORD GetGeneration(HandleId id)
+    {
+        return static_cast<DWORD>(id >> (INDEX_BITS + SHARD_BITS));
+    }
+
+    static DWORD NextGeneration(DWORD generation)
+    {
+        const DWORD mask = static_cast<DWORD>(GetMaxGeneration());
+
+        // Skip 0 so that no valid handle is ever INVALID_HANDLE_ID.
+        generation = (generation + 1) & mask;
+        return generation == 0 ? 1 : generation;
+    }
+
+    // Appends the slot to the shard's free slots.
+    static void PushFree(Shard& shard, DWORD slotIndex)
+    {
+        shard.slots[slotIndex].nextFree = NO_SLOT;
+        if (shard.freeTail != NO_SLOT)
+        {
+            shard.slots[shard.freeTail].nextFree = slotIndex;
+        }
+        else
+        {
+            shard.freeHead = slotIndex;
+        }
+        shard.freeTail = slotIndex;
+    }
+
+    static Slot* FindSlot(Shard& shard, HandleId id)
+    {
+        const DWORD slotIndex = GetSlotIndex(id);
+        if (slotIndex >= shard.slots.size())
+        {
+            return NULL;
+        }
+
+        Slot& slot = shard.slots[slotIndex];
+        if (slot.object == NULL || slot.generation != GetGeneration(id))
+        {
+            return NULL;
+        }
+
+        return &slot;
+    }
+
+private:
+    Shard m_Shards[NUM_SHARDS];
+    volatile long m_Size;
+    volatile long m_NextShard;
+};
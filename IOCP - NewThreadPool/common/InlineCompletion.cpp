@@ -0,0 +1,3 @@
+#include "InlineCompletion.h"
+
+__declspec(thread) int InlineCompletionScope::s_Depth = 0;
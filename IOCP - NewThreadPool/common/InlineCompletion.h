@@ -0,0 +1,27 @@
+#pragma once
+
+#include <windows.h>
+
+// Handling a completion inline from the function that posted the I/O recurses when the handler
+// posts the next I/O. This counts how deep that goes on the calling thread, so that past
+// MAX_DEPTH the caller can hand the completion to the thread pool instead.
+class InlineCompletionScope
+{
+public:
+    enum
+    {
+        MAX_DEPTH = 8,
+    };
+
+public:
+    InlineCompletionScope() { ++s_Depth; }
+    ~InlineCompletionScope() { --s_Depth; }
+
+    InlineCompletionScope(const InlineCompletionScope&) = delete;
+    InlineCompletionScope& operator=(const InlineCompletionScope&) = delete;
+
+    static bool CanEnter() { return s_Depth < MAX_DEPTH; }
+
+private:
+    static __declspec(thread) int s_Depth;
+};
@@ -2,110 +2,753 @@
 
 #include "Log.h"
 #include <windows.h>
-#include <iostream>
-#include <iomanip>
+#include <algorithm>
+#include <cassert>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <vector>
 
 #include "CritSecLock.h"
 
-using std::cout;
-using std::endl;
-using std::hex;
-using std::dec;
-
 namespace Log
+{
+	volatile bool g_TraceEnabled = true;
+
+namespace
 {
 	const int BUFFER_SIZE = 256;
+	// Entries per thread. Must be a power of two. An entry is a little over 300 bytes, so every
+	// thread that logs while the writer runs has a ring of about 77 KB, pool threads included.
+	const LONG RING_SIZE = 256;
+	// Wake the writer early once a ring is this full.
+	const LONG RING_WAKE_LEVEL = RING_SIZE / 2;
+	const DWORD WRITE_BUFFER_SIZE = 64 * 1024;
+	const DWORD FLUSH_INTERVAL_MS = 100;
+
+	enum EntryType
+	{
+		TRACE_ENTRY,
+		INFO_ENTRY,
+		ERROR_ENTRY,
+		ERROR_CODE_ENTRY,
+	};
+
+	// What a conversion of a message's format takes from the arguments.
+	enum ArgType
+	{
+		ARG_NONE, // %%
+		ARG_INT,
+		ARG_LONG,
+		ARG_INT64,
+		ARG_SIZE,
+		ARG_DOUBLE,
+		ARG_LONG_DOUBLE,
+		ARG_POINTER,
+		ARG_STRING,
+		// Anything else, e.g. a '*' width or a wide string, which is formatted right away.
+		ARG_UNSUPPORTED,
+	};
 
-	static bool s_Enable = true;
+	// The longest conversion that is formatted by the writer, e.g. "%-24s".
+	const int MAX_SPEC_SIZE = 16;
+
+	// The logging thread only copies the arguments that the format takes, and the writer formats
+	// them. Strings are copied in, since they may not outlive the call, and cut short when they
+	// don't fit.
+	struct Entry
+	{
+		EntryType type;
+		DWORD threadId;
+		FILETIME time;
+		const char* fileName;
+		const char* funcName;
+		int line;
+		int code;
+		// A literal, like the file and function. NULL when data already holds the formatted text.
+		const char* format;
+		char data[BUFFER_SIZE];
+	};
+
+	// Only its thread adds to a ring and only the writer takes from it.
+	struct Ring
+	{
+		Entry entries[RING_SIZE];
+		volatile LONG head;
+		volatile LONG tail;
+		// Set once the thread has exited. The writer deletes the ring once it has drained it.
+		volatile LONG retired;
+	};
 
 	HMODULE libModule;
-	CRITICAL_SECTION logCS;
 
-	void Error(const char * fileName, const char * funcName, int line, const char * msg, ...)
+	// Guards the list of rings, which only changes as threads log for the first time and exit.
+	CRITICAL_SECTION ringsCS;
+	std::vector<Ring*> rings;
+	DWORD flsIndex = FLS_OUT_OF_INDEXES;
+
+	HANDLE writerThread = NULL;
+	HANDLE wakeupEvent = NULL;
+	volatile LONG wakeupPending = 0;
+	volatile bool stopping = false;
+	// Set while the writer runs, which is when messages are queued.
+	volatile bool async = false;
+	// Threads that may be queuing on a ring. Cleanup() waits for them before deleting the rings.
+	volatile long numWriters = 0;
+
+	HANDLE fileSink = INVALID_HANDLE_VALUE;
+
+	volatile long numDropped = 0;
+
+	// Only touched by the writer.
+	char writeBuffer[WRITE_BUFFER_SIZE];
+	DWORD writeSize = 0;
+
+	void WriteSinks(const char* data, DWORD size)
 	{
-        CritSecLock lock(logCS);
+		DWORD written = 0;
+		HANDLE console = GetStdHandle(STD_OUTPUT_HANDLE);
+		if (console != INVALID_HANDLE_VALUE && console != NULL)
+		{
+			WriteFile(console, data, size, &written, NULL);
+		}
+		if (fileSink != INVALID_HANDLE_VALUE)
+		{
+			WriteFile(fileSink, data, size, &written, NULL);
+		}
+	}
+
+	// Appends to out, and returns how much has been appended.
+	int Append(char* out, int size, const char* format, ...)
+	{
+		if (size <= 0)
+		{
+			return 0;
+		}
 
-		static char buffer[BUFFER_SIZE] = {0,};
 		va_list args;
-		va_start(args, msg);
-		vsnprintf_s(buffer, BUFFER_SIZE, BUFFER_SIZE-1, msg, args);
+		va_start(args, format);
+		const int length = vsnprintf_s(out, size, _TRUNCATE, format, args);
 		va_end(args);
 
-		cout << "File: " << fileName << "\nFunction: " << funcName << "\nLine: " << line
-			 << "\nError: " << buffer << endl;
+		return length >= 0 ? length : static_cast<int>(strlen(out));
 	}
 
-	void Error(const char * fileName, const char * funcName, int line, int code, const char * msg, ...)
+	// Returns where the conversion that spec points at, just past its '%', ends.
+	const char* ParseSpec(const char* spec, ArgType& type)
 	{
-        CritSecLock lock(logCS);
+		const char* p = spec;
+		while (*p != '\0' && strchr("-+ #0", *p) != NULL)
+		{
+			++p;
+		}
+		while (*p >= '0' && *p <= '9')
+		{
+			++p;
+		}
+		if (*p == '.')
+		{
+			++p;
+			while (*p >= '0' && *p <= '9')
+			{
+				++p;
+			}
+		}
 
-		char* lpMessageBuffer;
+		ArgType integer = ARG_INT;
+		bool longDouble = false;
+		bool wide = false;
+		if (strncmp(p, "I64", 3) == 0 || strncmp(p, "ll", 2) == 0)
+		{
+			integer = ARG_INT64;
+			p += *p == 'I' ? 3 : 2;
+		}
+		else if (strncmp(p, "I32", 3) == 0 || strncmp(p, "hh", 2) == 0)
+		{
+			p += *p == 'I' ? 3 : 2;
+		}
+		else if (*p == 'I' || *p == 'z' || *p == 't')
+		{
+			integer = ARG_SIZE;
+			++p;
+		}
+		else if (*p == 'j')
+		{
+			integer = ARG_INT64;
+			++p;
+		}
+		else if (*p == 'l' || *p == 'w')
+		{
+			integer = ARG_LONG;
+			wide = true;
+			++p;
+		}
+		else if (*p == 'L')
+		{
+			longDouble = true;
+			++p;
+		}
+		else if (*p == 'h')
+		{
+			++p;
+		}
 
-		FormatMessageA(
-			FORMAT_MESSAGE_ALLOCATE_BUFFER | 
-			FORMAT_MESSAGE_FROM_SYSTEM | 
-			FORMAT_MESSAGE_FROM_HMODULE,
-			libModule, 
-			code,  
-			MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-			(LPSTR) &lpMessageBuffer,  
-			0,  
-			NULL );
+		switch (*p)
+		{
+		case '%':
+			type = p == spec ? ARG_NONE : ARG_UNSUPPORTED;
+			break;
+		case 'c':
+			type = wide ? ARG_UNSUPPORTED : ARG_INT;
+			break;
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+			type = integer;
+			break;
+		case 'a': case 'A': case 'e': case 'E': case 'f': case 'F': case 'g': case 'G':
+			type = longDouble ? ARG_LONG_DOUBLE : ARG_DOUBLE;
+			break;
+		case 'p':
+			type = ARG_POINTER;
+			break;
+		case 's':
+			type = wide ? ARG_UNSUPPORTED : ARG_STRING;
+			break;
+		default:
+			type = ARG_UNSUPPORTED;
+			return *p != '\0' ? p + 1 : p;
+		}
+
+		// With the '%' and the terminator.
+		if (p + 3 - spec > MAX_SPEC_SIZE)
+		{
+			type = ARG_UNSUPPORTED;
+		}
+		return p + 1;
+	}
 
-		static char buffer[BUFFER_SIZE] = {0,};
+	template <typename T>
+	bool CopyArg(char* data, int& size, T value)
+	{
+		if (size + static_cast<int>(sizeof(T)) > BUFFER_SIZE)
+		{
+			return false;
+		}
+		CopyMemory(data + size, &value, sizeof(T));
+		size += sizeof(T);
+		return true;
+	}
+
+	template <typename T>
+	T ReadArg(const char*& data)
+	{
+		T value;
+		CopyMemory(&value, data, sizeof(T));
+		data += sizeof(T);
+		return value;
+	}
+
+	// Copies the arguments that format takes into data. Returns false if it has a conversion
+	// that the writer can't format, or the arguments don't fit.
+	bool CopyArgs(const char* format, va_list args, char* data)
+	{
+		int size = 0;
+		for (const char* p = strchr(format, '%'); p != NULL; p = strchr(p, '%'))
+		{
+			ArgType type;
+			p = ParseSpec(p + 1, type);
+
+			bool copied = true;
+			switch (type)
+			{
+			case ARG_NONE:
+				break;
+			case ARG_INT:
+				copied = CopyArg(data, size, va_arg(args, int));
+				break;
+			case ARG_LONG:
+				copied = CopyArg(data, size, va_arg(args, long));
+				break;
+			case ARG_INT64:
+				copied = CopyArg(data, size, va_arg(args, __int64));
+				break;
+			case ARG_SIZE:
+				copied = CopyArg(data, size, va_arg(args, size_t));
+				break;
+			case ARG_DOUBLE:
+				copied = CopyArg(data, size, va_arg(args, double));
+				break;
+			case ARG_LONG_DOUBLE:
+				copied = CopyArg(data, size, va_arg(args, long double));
+				break;
+			case ARG_POINTER:
+				copied = CopyArg(data, size, va_arg(args, void*));
+				break;
+			case ARG_STRING:
+			{
+				const char* text = va_arg(args, const char*);
+				if (text == NULL)
+				{
+					text = "(null)";
+				}
+				const int length = min(static_cast<int>(strlen(text)), BUFFER_SIZE - size - 1);
+				copied = length >= 0;
+				if (copied)
+				{
+					CopyMemory(data + size, text, length);
+					data[size + length] = '\0';
+					size += length + 1;
+				}
+				break;
+			}
+			default:
+				copied = false;
+				break;
+			}
+
+			if (!copied)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Formats the entry's message on the writer, the way vsnprintf_s() would have on the thread.
+	void FormatText(const Entry& entry, char* out, int size)
+	{
+		if (entry.format == NULL)
+		{
+			strncpy_s(out, size, entry.data, _TRUNCATE);
+			return;
+		}
+
+		const char* data = entry.data;
+		int length = 0;
+		const char* p = entry.format;
+		while (*p != '\0' && length < size - 1)
+		{
+			const char* percent = strchr(p, '%');
+			const char* end = percent != NULL ? percent : p + strlen(p);
+
+			const int literal = min(static_cast<int>(end - p), size - 1 - length);
+			CopyMemory(out + length, p, literal);
+			length += literal;
+			out[length] = '\0';
+			if (percent == NULL)
+			{
+				break;
+			}
+
+			ArgType type;
+			p = ParseSpec(percent + 1, type);
+
+			char spec[MAX_SPEC_SIZE];
+			strncpy_s(spec, percent, p - percent);
+
+			char* next = out + length;
+			const int room = size - length;
+			switch (type)
+			{
+			case ARG_NONE:
+				length += Append(next, room, "%%");
+				break;
+			case ARG_INT:
+				length += Append(next, room, spec, ReadArg<int>(data));
+				break;
+			case ARG_LONG:
+				length += Append(next, room, spec, ReadArg<long>(data));
+				break;
+			case ARG_INT64:
+				length += Append(next, room, spec, ReadArg<__int64>(data));
+				break;
+			case ARG_SIZE:
+				length += Append(next, room, spec, ReadArg<size_t>(data));
+				break;
+			case ARG_DOUBLE:
+				length += Append(next, room, spec, ReadArg<double>(data));
+				break;
+			case ARG_LONG_DOUBLE:
+				length += Append(next, room, spec, ReadArg<long double>(data));
+				break;
+			case ARG_POINTER:
+				length += Append(next, room, spec, ReadArg<void*>(data));
+				break;
+			case ARG_STRING:
+				length += Append(next, room, spec, data);
+				data += strlen(data) + 1;
+				break;
+			default:
+				// CopyArgs() doesn't let these through.
+				assert(false);
+				return;
+			}
+		}
+	}
+
+	int FormatEntry(const Entry& entry, char* out, int size)
+	{
+		char text[BUFFER_SIZE];
+		FormatText(entry, text, sizeof(text));
+
+		FILETIME localTime;
+		SYSTEMTIME time;
+		FileTimeToLocalFileTime(&entry.time, &localTime);
+		FileTimeToSystemTime(&localTime, &time);
+
+		int length = Append(out, size, "%02d:%02d:%02d.%03d [%u] ", time.wHour, time.wMinute,
+			time.wSecond, time.wMilliseconds, entry.threadId);
+
+		if (entry.type == TRACE_ENTRY || entry.type == INFO_ENTRY)
+		{
+			length += Append(out + length, size - length, "%s\n", text);
+			return length;
+		}
+
+		length += Append(out + length, size - length, "\nFile: %s\nFunction: %s\nLine: %d\nError: %s\n",
+			entry.fileName, entry.funcName, entry.line, text);
+
+		if (entry.type == ERROR_CODE_ENTRY)
+		{
+			char* lpMessageBuffer = NULL;
+
+			FormatMessageA(
+				FORMAT_MESSAGE_ALLOCATE_BUFFER |
+				FORMAT_MESSAGE_FROM_SYSTEM |
+				FORMAT_MESSAGE_FROM_HMODULE,
+				libModule,
+				entry.code,
+				MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+				(LPSTR) &lpMessageBuffer,
+				0,
+				NULL );
+
+			length += Append(out + length, size - length, "Msg: %sCode: %d 0x%x\n",
+				lpMessageBuffer != NULL ? lpMessageBuffer : "\n", entry.code, entry.code);
+
+			// Free the buffer allocated by the system.
+			LocalFree( lpMessageBuffer );
+		}
+
+		return length;
+	}
+
+	void WriteEntry(const Entry& entry)
+	{
+		// The longest an entry gets, with the file, function and system message.
+		const int MAX_ENTRY_SIZE = 4 * BUFFER_SIZE + MAX_PATH;
+
+		if (writeSize + MAX_ENTRY_SIZE > WRITE_BUFFER_SIZE)
+		{
+			WriteSinks(writeBuffer, writeSize);
+			writeSize = 0;
+		}
+
+		writeSize += FormatEntry(entry, writeBuffer + writeSize, WRITE_BUFFER_SIZE - writeSize);
+	}
+
+	void Wake()
+	{
+		// Only the first message since the writer last woke up has to signal it.
+		if (InterlockedExchange(&wakeupPending, 1) == 0)
+		{
+			SetEvent(wakeupEvent);
+		}
+	}
+
+	void DrainRings()
+	{
+		std::vector<Ring*> snapshot;
+		{
+			CritSecLock lock(ringsCS);
+			snapshot = rings;
+		}
+
+		std::vector<Ring*> drained;
+		for (size_t i = 0; i < snapshot.size(); ++i)
+		{
+			Ring* ring = snapshot[i];
+
+			// Read this before the head, so that nothing is queued after a retired ring is drained.
+			const bool retired = ring->retired != 0;
+			const LONG head = ring->head;
+
+			for (LONG tail = ring->tail; tail != head; ++tail)
+			{
+				WriteEntry(ring->entries[tail & (RING_SIZE - 1)]);
+			}
+			InterlockedExchange(&ring->tail, head);
+
+			if (retired)
+			{
+				drained.push_back(ring);
+			}
+		}
+
+		if (writeSize > 0)
+		{
+			WriteSinks(writeBuffer, writeSize);
+			writeSize = 0;
+		}
+
+		if (!drained.empty())
+		{
+			CritSecLock lock(ringsCS);
+			for (size_t i = 0; i < drained.size(); ++i)
+			{
+				rings.erase(std::find(rings.begin(), rings.end(), drained[i]));
+				delete drained[i];
+			}
+		}
+	}
+
+	DWORD WINAPI WriterThread(LPVOID /* param */)
+	{
+		for (;;)
+		{
+			WaitForSingleObject(wakeupEvent, FLUSH_INTERVAL_MS);
+			InterlockedExchange(&wakeupPending, 0);
+
+			const bool stop = stopping;
+			DrainRings();
+
+			if (stop)
+			{
+				return 0;
+			}
+		}
+	}
+
+	void NTAPI OnThreadExit(PVOID data)
+	{
+		Ring* ring = static_cast<Ring*>(data);
+		if (ring != NULL)
+		{
+			InterlockedExchange(&ring->retired, 1);
+		}
+	}
+
+	Ring* GetRing()
+	{
+		Ring* ring = static_cast<Ring*>(FlsGetValue(flsIndex));
+		if (ring == NULL)
+		{
+			ring = new Ring();
+			ring->head = 0;
+			ring->tail = 0;
+			ring->retired = 0;
+
+			{
+				CritSecLock lock(ringsCS);
+				rings.push_back(ring);
+			}
+			FlsSetValue(flsIndex, ring);
+		}
+		return ring;
+	}
+
+	void Write(EntryType type, const char* fileName, const char* funcName, int line, int code,
+		const char* msg, va_list args)
+	{
+		// Counted before async is read, so that Cleanup() either sees the thread or the thread sees
+		// that the rings are going away.
+		InterlockedIncrement(&numWriters);
+		Ring* ring = async ? GetRing() : NULL;
+		if (ring == NULL)
+		{
+			InterlockedDecrement(&numWriters);
+		}
+
+		Entry syncEntry;
+		Entry* entry = &syncEntry;
+		if (ring != NULL)
+		{
+			const LONG head = ring->head;
+			if (head - ring->tail >= RING_SIZE)
+			{
+				// Never make the thread wait for the writer.
+				InterlockedIncrement(&numDropped);
+				Wake();
+				InterlockedDecrement(&numWriters);
+				return;
+			}
+			entry = &ring->entries[head & (RING_SIZE - 1)];
+		}
+
+		entry->type = type;
+		entry->threadId = GetCurrentThreadId();
+		GetSystemTimeAsFileTime(&entry->time);
+		entry->fileName = fileName;
+		entry->funcName = funcName;
+		entry->line = line;
+		entry->code = code;
+
+		// Messages that are written right away are formatted right away.
+		va_list copy;
+		va_copy(copy, args);
+		entry->format = ring != NULL && CopyArgs(msg, copy, entry->data) ? msg : NULL;
+		va_end(copy);
+		if (entry->format == NULL)
+		{
+			vsnprintf_s(entry->data, BUFFER_SIZE, _TRUNCATE, msg, args);
+		}
+
+		if (ring == NULL)
+		{
+			char buffer[4 * BUFFER_SIZE + MAX_PATH];
+			WriteSinks(buffer, FormatEntry(*entry, buffer, sizeof(buffer)));
+			return;
+		}
+
+		// This publishes the entry to the writer.
+		const LONG queued = InterlockedIncrement(&ring->head) - ring->tail;
+
+		// Traces wait for the next flush unless the ring fills up. Reports and errors go out right
+		// away.
+		if (type != TRACE_ENTRY || queued >= RING_WAKE_LEVEL)
+		{
+			Wake();
+		}
+		InterlockedDecrement(&numWriters);
+	}
+}
+
+	void Error(const char * fileName, const char * funcName, int line, const char * msg, ...)
+	{
 		va_list args;
 		va_start(args, msg);
-		vsnprintf_s(buffer, BUFFER_SIZE, BUFFER_SIZE-1, msg, args);
-		va_end(args);		
-
-		cout << "File: " << fileName << "\nFunction: " << funcName << "\nLine: " << line
-			<< "\nError: " << buffer << "\nMsg: " << lpMessageBuffer << "Code: " << code << " 0x" << hex << code << endl;
+		Write(ERROR_ENTRY, fileName, funcName, line, 0, msg, args);
+		va_end(args);
+	}
 
-		cout << dec;
+	void Error(const char * fileName, const char * funcName, int line, int code, const char * msg, ...)
+	{
+		va_list args;
+		va_start(args, msg);
+		Write(ERROR_CODE_ENTRY, fileName, funcName, line, code, msg, args);
+		va_end(args);
+	}
 
-		// Free the buffer allocated by the system.
-		LocalFree( lpMessageBuffer ); 
+	void Info(const char * msg, ...)
+	{
+		va_list args;
+		va_start(args, msg);
+		Write(INFO_ENTRY, NULL, NULL, 0, 0, msg, args);
+		va_end(args);
 	}
 
 	void Trace(const char * msg, ...)
 	{
-		if( s_Enable )
+		if( g_TraceEnabled )
 		{
-            CritSecLock lock(logCS);
-
-			static char buffer[BUFFER_SIZE] = {0,};
 			va_list args;
 			va_start(args, msg);
-			vsnprintf_s(buffer, BUFFER_SIZE, BUFFER_SIZE-1, msg, args);
+			Write(TRACE_ENTRY, NULL, NULL, 0, 0, msg, args);
 			va_end(args);
-			
-			cout << buffer << endl;
 		}
 	}
 
-	void Setup()
+	void Setup(const char* fileName)
 	{
-		InitializeCriticalSection(&logCS);
+		InitializeCriticalSection(&ringsCS);
 
 		libModule = LoadLibraryA("NTDLL.DLL");
+
+		if (fileName != NULL)
+		{
+			fileSink = CreateFileA(fileName, FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+				FILE_ATTRIBUTE_NORMAL, NULL);
+			if (fileSink == INVALID_HANDLE_VALUE)
+			{
+				ERROR_CODE(GetLastError(), "Log::Setup() - Could not open %s.", fileName);
+			}
+		}
+
+		// Without a writer, everything is written right away.
+		flsIndex = FlsAlloc(OnThreadExit);
+		if (flsIndex == FLS_OUT_OF_INDEXES)
+		{
+			ERROR_CODE(GetLastError(), "Log::Setup() - FlsAlloc() failed.");
+			return;
+		}
+
+		wakeupEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (wakeupEvent == NULL)
+		{
+			ERROR_CODE(GetLastError(), "Log::Setup() - CreateEvent() failed.");
+			return;
+		}
+
+		stopping = false;
+		writerThread = CreateThread(NULL, 0, WriterThread, NULL, 0, NULL);
+		if (writerThread == NULL)
+		{
+			ERROR_CODE(GetLastError(), "Log::Setup() - Could not start the writer.");
+			return;
+		}
+
+		async = true;
 	}
 
 	void Cleanup()
 	{
-		EnterCriticalSection(&logCS);
+		// Write whatever comes from here on right away. The threads that are queuing a message
+		// already finish it first, so that the writer drains it and no ring is deleted under them.
+		async = false;
+		MemoryBarrier();
+		while (numWriters != 0)
+		{
+			Sleep(0);
+		}
+
+		if (writerThread != NULL)
+		{
+			stopping = true;
+			SetEvent(wakeupEvent);
+			WaitForSingleObject(writerThread, INFINITE);
+
+			CloseHandle(writerThread);
+			writerThread = NULL;
+		}
+
+		if (wakeupEvent != NULL)
+		{
+			CloseHandle(wakeupEvent);
+			wakeupEvent = NULL;
+		}
+
+		if (flsIndex != FLS_OUT_OF_INDEXES)
+		{
+			FlsFree(flsIndex);
+			flsIndex = FLS_OUT_OF_INDEXES;
+		}
+
+		for (size_t i = 0; i < rings.size(); ++i)
+		{
+			delete rings[i];
+		}
+		rings.clear();
 
 		if(!FreeLibrary(libModule))
 		{
 			ERROR_CODE(GetLastError(), "Log::CleanUp() - FreeLibrary() failed.");
 		}
 
-        LeaveCriticalSection(&logCS);
+		if (fileSink != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(fileSink);
+			fileSink = INVALID_HANDLE_VALUE;
+		}
 
-        DeleteCriticalSection(&logCS);
+		DeleteCriticalSection(&ringsCS);
 	}
 
 	void EnableTrace(bool enable)
 	{
-		s_Enable = enable;
+		g_TraceEnabled = enable;
+	}
+
+	long GetNumDropped()
+	{
+		return numDropped;
 	}
 }
@@ -1,18 +1,42 @@
 #pragma once
 
+#include <cstddef>
+
+// Messages are queued on a ring per thread without taking a lock, and a writer thread formats
+// and decorates them and writes them out in batches. The logging thread only copies the
+// arguments, so the format has to be a literal. Until Setup() and after Cleanup() they are
+// written right away.
+// Each thread that logs while the writer runs has a ring of about 77 KB.
 namespace Log
 {
 	void Trace(const char * msg, ...);
+	// Written like a trace, but whether tracing is enabled or not. For reports that are asked
+	// for, like the server's stats.
+	void Info(const char * msg, ...);
 
 	void Error(const char* fileName, const char* funcName, int line, const char* msg, ...);
 	void Error(const char* fileName, const char* funcName, int line, int code, const char* msg, ...);
 
-	void Setup();
+	// Writes to the console, and appends to fileName if it is given.
+	void Setup(const char* fileName = NULL);
+	// Writes out what has been queued and stops the writer.
 	void Cleanup();
 
+	extern volatile bool g_TraceEnabled;
+
 	void EnableTrace(bool enable);
+	inline bool IsTraceEnabled() { return g_TraceEnabled; }
+
+	// Messages that were dropped because their thread's ring was full.
+	long GetNumDropped();
 }
 
-#define TRACE(msg, ...) Log::Trace(msg, __VA_ARGS__);
+// The arguments of a trace are only evaluated while tracing is enabled. Defining LOG_NO_TRACE
+// compiles traces out altogether.
+#ifdef LOG_NO_TRACE
+#define TRACE(msg, ...) ((void)0)
+#else
+#define TRACE(msg, ...) do { if (Log::IsTraceEnabled()) { Log::Trace(msg, __VA_ARGS__); } } while (0)
+#endif
 #define ERROR_MSG(msg, ...) Log::Error(__FILE__, __FUNCTION__, __LINE__, msg, __VA_ARGS__);
 #define ERROR_CODE(code, msg, ...) Log::Error(__FILE__, __FUNCTION__, __LINE__, code, msg, __VA_ARGS__);
@@ -0,0 +1,238 @@
+#include "Lz4.h"
+
+#include <cassert>
+#include <cstring>
+
+namespace
+{
+const DWORD MIN_MATCH = 4;
+const DWORD MAX_OFFSET = 65535;
+// The format ends every block with literals: the last match ends LAST_LITERALS bytes before the
+// end, and starts at least MATCH_FREE_LIMIT bytes before it.
+const DWORD LAST_LITERALS = 5;
+const DWORD MATCH_FREE_LIMIT = 12;
+// A token holds lengths up to 15, and longer ones go on in bytes of up to 255.
+const DWORD RUN_MASK = 15;
+
+// The positions of the last four bytes seen with each hash. 16 KB, which is cheap to clear per
+// block and stays in the cache.
+const DWORD HASH_LOG = 12;
+const DWORD HASH_SIZE = 1 << HASH_LOG;
+
+UINT32 Read32(const BYTE* p)
+{
+    UINT32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+UINT32 Hash(UINT32 value) { return (value * 2654435761U) >> (32 - HASH_LOG); }
+
+// The bytes a length of the token's field takes after the token.
+DWORD GetLengthBytes(DWORD length)
+{
+    return length >= RUN_MASK ? (length - RUN_MASK) / 255 + 1 : 0;
+}
+
+BYTE* WriteLength(BYTE* op, DWORD length)
+{
+    for (length -= RUN_MASK; length >= 255; length -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = static_cast<BYTE>(length);
+    return op;
+}
+
+// Reads the rest of a length whose field in the token is full. Returns false if it runs past end.
+bool ReadLength(const BYTE*& ip, const BYTE* end, DWORD& length)
+{
+    BYTE byte;
+    do
+    {
+        if (ip >= end)
+        {
+            return false;
+        }
+        byte = *ip++;
+        if (length > 0xFFFFFFFF - byte)
+        {
+            return false;
+        }
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// Writes the literals from anchor up to match, and then the match unless matchLength is 0.
+// Returns NULL if that doesn't fit before end.
+BYTE* WriteSequence(BYTE* op, BYTE* end, const BYTE* anchor, DWORD numLiterals, DWORD offset,
+                    DWORD matchLength)
+{
+    const DWORD matchCode = matchLength > 0 ? matchLength - MIN_MATCH : 0;
+    const DWORD needed = 1 + GetLengthBytes(numLiterals) + numLiterals +
+                         (matchLength > 0 ? 2 + GetLengthBytes(matchCode) : 0);
+    if (needed > static_cast<DWORD>(end - op))
+    {
+        return NULL;
+    }
+
+    BYTE* token = op++;
+    *token = static_cast<BYTE>(min(numLiterals, RUN_MASK) << 4);
+    if (numLiterals >= RUN_MASK)
+    {
+        op = WriteLength(op, numLiterals);
+    }
+    memcpy(op, anchor, numLiterals);
+    op += numLiterals;
+
+    if (matchLength > 0)
+    {
+        *op++ = static_cast<BYTE>(offset);
+        *op++ = static_cast<BYTE>(offset >> 8);
+
+        *token |= static_cast<BYTE>(min(matchCode, RUN_MASK));
+        if (matchCode >= RUN_MASK)
+        {
+            op = WriteLength(op, matchCode);
+        }
+    }
+    return op;
+}
+}
+
+namespace Lz4
+{
+DWORD GetMaxCompressedSize(DWORD size) { return size + size / 255 + 16; }
+
+DWORD Compress(const BYTE* source, DWORD size, BYTE* dest, DWORD capacity)
+{
+    assert(source || size == 0);
+    assert(dest);
+
+    const BYTE* ip = source;
+    const BYTE* anchor = source;
+    const BYTE* const end = source + size;
+    BYTE* op = dest;
+    BYTE* const destEnd = dest + capacity;
+
+    if (size > MATCH_FREE_LIMIT)
+    {
+        const BYTE* const matchLimit = end - LAST_LITERALS;
+        const BYTE* const searchLimit = end - MATCH_FREE_LIMIT;
+
+        DWORD table[HASH_SIZE];
+        ZeroMemory(table, sizeof(table));
+
+        while (ip < searchLimit)
+        {
+            const UINT32 hash = Hash(Read32(ip));
+            const BYTE* match = source + table[hash];
+            table[hash] = static_cast<DWORD>(ip - source);
+
+            if (match >= ip || static_cast<DWORD>(ip - match) > MAX_OFFSET ||
+                Read32(match) != Read32(ip))
+            {
+                // Step further the longer nothing has matched, which gets through data that
+                // doesn't compress quickly.
+                ip += 1 + (static_cast<DWORD>(ip - anchor) >> 6);
+                continue;
+            }
+
+            // The match may have started before the literals that were skipped.
+            while (ip > anchor && match > source && ip[-1] == match[-1])
+            {
+                --ip;
+                --match;
+            }
+
+            DWORD matchLength = MIN_MATCH;
+            while (ip + matchLength < matchLimit && match[matchLength] == ip[matchLength])
+            {
+                ++matchLength;
+            }
+
+            op = WriteSequence(op, destEnd, anchor, static_cast<DWORD>(ip - anchor),
+                               static_cast<DWORD>(ip - match), matchLength);
+            if (op == NULL)
+            {
+                return 0;
+            }
+
+            ip += matchLength;
+            anchor = ip;
+        }
+    }
+
+    op = WriteSequence(op, destEnd, anchor, static_cast<DWORD>(end - anchor), 0, 0);
+    return op != NULL ? static_cast<DWORD>(op - dest) : 0;
+}
+
+bool Decompress(const BYTE* source, DWORD blockSize, BYTE* dest, DWORD size)
+{
+    assert(source || blockSize == 0);
+    assert(dest || size == 0);
+
+    const BYTE* ip = source;
+    const BYTE* const end = source + blockSize;
+    BYTE* op = dest;
+    BYTE* const destEnd = dest + size;
+
+    while (ip < end)
+    {
+        const BYTE token = *ip++;
+
+        DWORD numLiterals = token >> 4;
+        if (numLiterals == RUN_MASK && !ReadLength(ip, end, numLiterals))
+        {
+            return false;
+        }
+        if (numLiterals > static_cast<DWORD>(end - ip) ||
+            numLiterals > static_cast<DWORD>(destEnd - op))
+        {
+            return false;
+        }
+        memcpy(op, ip, numLiterals);
+        ip += numLiterals;
+        op += numLiterals;
+
+        // The last sequence has no match.
+        if (ip == end)
+        {
+            break;
+        }
+
+        if (end - ip < 2)
+        {
+            return false;
+        }
+        const DWORD offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > static_cast<DWORD>(op - dest))
+        {
+            return false;
+        }
+
+        DWORD matchLength = token & RUN_MASK;
+        if (matchLength == RUN_MASK && !ReadLength(ip, end, matchLength))
+        {
+            return false;
+        }
+        matchLength += MIN_MATCH;
+        if (matchLength > static_cast<DWORD>(destEnd - op))
+        {
+            return false;
+        }
+
+        // A match can overlap what it writes, which repeats the last offset bytes.
+        const BYTE* match = op - offset;
+        for (DWORD i = 0; i < matchLength; ++i)
+        {
+            op[i] = match[i];
+        }
+        op += matchLength;
+    }
+
+    return op == destEnd;
+}
+}
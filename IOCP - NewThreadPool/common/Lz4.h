@@ -0,0 +1,20 @@
+#pragma once
+
+#include <windows.h>
+
+// Compresses into and out of the LZ4 block format, which trades ratio for speed: a block is runs
+// of literals, each followed by a copy of earlier output. Nothing is kept between blocks, so each
+// one decompresses on its own.
+namespace Lz4
+{
+// The most that size bytes can compress to.
+DWORD GetMaxCompressedSize(DWORD size);
+
+// Returns the size of the block, or 0 if it doesn't fit in capacity bytes. Passing a capacity
+// smaller than size only compresses what actually gets smaller.
+DWORD Compress(const BYTE* source, DWORD size, BYTE* dest, DWORD capacity);
+
+// Returns false unless the block is well formed and decompresses to exactly size bytes.
+// Nothing is read or written out of bounds, whatever the block holds.
+bool Decompress(const BYTE* source, DWORD blockSize, BYTE* dest, DWORD size);
+}
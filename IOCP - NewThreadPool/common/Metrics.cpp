@@ -0,0 +1,335 @@
+#include "Metrics.h"
+#include "CritSecLock.h"
+
+#include <intrin.h>
+#include <algorithm>
+#include <map>
+
+namespace Metrics
+{
+namespace {
+
+// Each power of two is split into this many buckets, which bounds the error to an eighth.
+const DWORD SUB_BUCKET_BITS = 3;
+const DWORD SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+// Enough for any DWORD latency.
+const DWORD NUM_BUCKETS = (32 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+// Error codes a thread tells apart. Others are only counted in IO_FAILURES.
+const DWORD MAX_FAILURE_CODES = 16;
+
+struct Failure
+{
+    DWORD code;
+    LONGLONG count;
+};
+
+// Only its thread writes to it, so nothing needs to be interlocked. A reader may see a 64 bit
+// count torn on 32 bit builds, which is no worse than the count being a moment old.
+struct ThreadMetrics
+{
+    volatile LONGLONG counters[NUM_COUNTERS];
+    Failure failures[MAX_FAILURE_CODES];
+    volatile DWORD numFailureCodes;
+    volatile LONGLONG buckets[NUM_HISTOGRAMS][NUM_BUCKETS];
+    volatile DWORD max[NUM_HISTOGRAMS];
+};
+
+const char* counterNames[NUM_COUNTERS] = {
+    "accepts", "recvs", "recv bytes", "recv wakeups", "sends", "send bytes", "I/O failures",
+    "datagram recvs", "datagram recv bytes", "datagram sends", "datagram send bytes",
+    "compressed sends", "compressed send bytes", "compressed wire bytes", "rejected accepts",
+};
+
+const char* histogramNames[NUM_HISTOGRAMS] = {
+    "dispatch delay", "send time", "round trip",
+};
+
+CRITICAL_SECTION threadsCS;
+std::vector<ThreadMetrics*> threads;
+// What the threads that have exited recorded.
+ThreadMetrics retired;
+DWORD flsIndex = FLS_OUT_OF_INDEXES;
+LONGLONG ticksPerSecond = 0;
+
+DWORD GetBucket(DWORD value)
+{
+    if (value < SUB_BUCKETS)
+    {
+        return value;
+    }
+
+    unsigned long magnitude = 0;
+    _BitScanReverse(&magnitude, value);
+
+    const DWORD shift = magnitude - SUB_BUCKET_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+DWORD GetBucketUpperBound(DWORD bucket)
+{
+    if (bucket < SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    const DWORD shift = bucket / SUB_BUCKETS - 1;
+    const ULONGLONG lower = static_cast<ULONGLONG>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return static_cast<DWORD>(min(lower + (1ULL << shift) - 1, static_cast<ULONGLONG>(MAXDWORD)));
+}
+
+// threadsCS must be held.
+void Accumulate(ThreadMetrics& total, const ThreadMetrics& metrics)
+{
+    for (DWORD i = 0; i < NUM_COUNTERS; ++i)
+    {
+        total.counters[i] += metrics.counters[i];
+    }
+
+    for (DWORD i = 0; i < min(metrics.numFailureCodes, MAX_FAILURE_CODES); ++i)
+    {
+        DWORD slot = 0;
+        while (slot < total.numFailureCodes && total.failures[slot].code != metrics.failures[i].code)
+        {
+            ++slot;
+        }
+
+        if (slot == total.numFailureCodes)
+        {
+            if (slot == MAX_FAILURE_CODES)
+            {
+                continue;
+            }
+            total.failures[slot].code = metrics.failures[i].code;
+            total.failures[slot].count = 0;
+            ++total.numFailureCodes;
+        }
+        total.failures[slot].count += metrics.failures[i].count;
+    }
+
+    for (DWORD h = 0; h < NUM_HISTOGRAMS; ++h)
+    {
+        for (DWORD b = 0; b < NUM_BUCKETS; ++b)
+        {
+            total.buckets[h][b] += metrics.buckets[h][b];
+        }
+        total.max[h] = max(total.max[h], metrics.max[h]);
+    }
+}
+
+void NTAPI OnThreadExit(PVOID data)
+{
+    ThreadMetrics* metrics = static_cast<ThreadMetrics*>(data);
+    if (metrics == NULL)
+    {
+        return;
+    }
+
+    CritSecLock lock(threadsCS);
+
+    Accumulate(retired, *metrics);
+    threads.erase(std::find(threads.begin(), threads.end(), metrics));
+    delete metrics;
+}
+
+ThreadMetrics* GetThreadMetrics()
+{
+    if (flsIndex == FLS_OUT_OF_INDEXES)
+    {
+        return NULL;
+    }
+
+    ThreadMetrics* metrics = static_cast<ThreadMetrics*>(FlsGetValue(flsIndex));
+    if (metrics == NULL)
+    {
+        metrics = new ThreadMetrics();
+        ZeroMemory(metrics, sizeof(ThreadMetrics));
+
+        {
+            CritSecLock lock(threadsCS);
+            threads.push_back(metrics);
+        }
+
+        if (!FlsSetValue(flsIndex, metrics))
+        {
+            OnThreadExit(metrics);
+            return NULL;
+        }
+    }
+    return metrics;
+}
+
+void GetLatencyStats(const volatile LONGLONG* buckets, DWORD maxValue, LatencyStats& stats)
+{
+    ZeroMemory(&stats, sizeof(stats));
+
+    for (DWORD b = 0; b < NUM_BUCKETS; ++b)
+    {
+        stats.count += buckets[b];
+    }
+    if (stats.count == 0)
+    {
+        return;
+    }
+
+    const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    DWORD* values[] = { &stats.p50, &stats.p90, &stats.p99, &stats.p999 };
+
+    LONGLONG seen = 0;
+    DWORD next = 0;
+    for (DWORD b = 0; b < NUM_BUCKETS && next < _countof(percentiles); ++b)
+    {
+        seen += buckets[b];
+        while (next < _countof(percentiles) && seen >= percentiles[next] * stats.count)
+        {
+            *values[next++] = min(GetBucketUpperBound(b), maxValue);
+        }
+    }
+    stats.max = maxValue;
+}
+
+}
+
+bool Setup()
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    ticksPerSecond = frequency.QuadPart;
+
+    InitializeCriticalSection(&threadsCS);
+    ZeroMemory(&retired, sizeof(retired));
+
+    // Threads that exit fold what they have recorded into the totals.
+    flsIndex = FlsAlloc(OnThreadExit);
+    return flsIndex != FLS_OUT_OF_INDEXES;
+}
+
+void Cleanup()
+{
+    if (flsIndex != FLS_OUT_OF_INDEXES)
+    {
+        // This retires the metrics of the threads that are still alive.
+        FlsFree(flsIndex);
+        flsIndex = FLS_OUT_OF_INDEXES;
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+        delete threads[i];
+    }
+    threads.clear();
+
+    DeleteCriticalSection(&threadsCS);
+}
+
+void Add(Counter counter, LONGLONG value)
+{
+    ThreadMetrics* metrics = GetThreadMetrics();
+    if (metrics != NULL)
+    {
+        metrics->counters[counter] += value;
+    }
+}
+
+void RecordFailure(DWORD code)
+{
+    ThreadMetrics* metrics = GetThreadMetrics();
+    if (metrics == NULL)
+    {
+        return;
+    }
+
+    metrics->counters[IO_FAILURES] += 1;
+
+    for (DWORD i = 0; i < metrics->numFailureCodes; ++i)
+    {
+        if (metrics->failures[i].code == code)
+        {
+            ++metrics->failures[i].count;
+            return;
+        }
+    }
+
+    if (metrics->numFailureCodes < MAX_FAILURE_CODES)
+    {
+        Failure& failure = metrics->failures[metrics->numFailureCodes];
+        failure.code = code;
+        failure.count = 1;
+        // Publish the slot once it is filled in.
+        MemoryBarrier();
+        ++metrics->numFailureCodes;
+    }
+}
+
+LONGLONG Now()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void RecordLatency(Histogram histogram, LONGLONG start)
+{
+    ThreadMetrics* metrics = GetThreadMetrics();
+    if (metrics == NULL || start == 0)
+    {
+        return;
+    }
+
+    const LONGLONG elapsed = max(Now() - start, 0LL);
+    const DWORD micros = static_cast<DWORD>(
+        min(elapsed * 1000000 / ticksPerSecond, static_cast<LONGLONG>(MAXDWORD)));
+
+    ++metrics->buckets[histogram][GetBucket(micros)];
+    if (micros > metrics->max[histogram])
+    {
+        metrics->max[histogram] = micros;
+    }
+}
+
+void GetSnapshot(Snapshot& snapshot)
+{
+    ThreadMetrics* total = new ThreadMetrics();
+    ZeroMemory(total, sizeof(ThreadMetrics));
+
+    // Accumulate() only keeps MAX_FAILURE_CODES codes, so merge the codes separately.
+    std::map<DWORD, LONGLONG> failures;
+    {
+        CritSecLock lock(threadsCS);
+
+        Accumulate(*total, retired);
+        for (DWORD i = 0; i < retired.numFailureCodes; ++i)
+        {
+            failures[retired.failures[i].code] += retired.failures[i].count;
+        }
+
+        for (size_t t = 0; t < threads.size(); ++t)
+        {
+            Accumulate(*total, *threads[t]);
+
+            const DWORD numCodes = threads[t]->numFailureCodes;
+            for (DWORD i = 0; i < numCodes; ++i)
+            {
+                failures[threads[t]->failures[i].code] += threads[t]->failures[i].count;
+            }
+        }
+    }
+
+    for (DWORD i = 0; i < NUM_COUNTERS; ++i)
+    {
+        snapshot.counters[i] = total->counters[i];
+    }
+
+    snapshot.failures.assign(failures.begin(), failures.end());
+
+    for (DWORD h = 0; h < NUM_HISTOGRAMS; ++h)
+    {
+        GetLatencyStats(total->buckets[h], total->max[h], snapshot.latencies[h]);
+    }
+
+    delete total;
+}
+
+const char* GetName(Counter counter) { return counterNames[counter]; }
+
+const char* GetName(Histogram histogram) { return histogramNames[histogram]; }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <windows.h>
+#include <utility>
+#include <vector>
+
+// Counters and latency histograms that each thread keeps on its own, so recording one is a plain
+// add to memory no other thread writes. Reading them sums up every thread's.
+// Nothing is recorded until Setup().
+namespace Metrics
+{
+enum Counter
+{
+    ACCEPTS,
+    RECVS,
+    RECV_BYTES,
+    // Zero-byte receives that have completed.
+    RECV_WAKEUPS,
+    SENDS,
+    SEND_BYTES,
+    IO_FAILURES,
+    DATAGRAM_RECVS,
+    DATAGRAM_RECV_BYTES,
+    DATAGRAM_SENDS,
+    DATAGRAM_SEND_BYTES,
+    // Batches that went out compressed, with their size before and after.
+    COMPRESSED_SENDS,
+    COMPRESSED_SEND_BYTES,
+    COMPRESSED_WIRE_BYTES,
+    // Accepts that were reset with an abortive close as soon as they completed, as they weren't
+    // admitted.
+    REJECTED_ACCEPTS,
+    NUM_COUNTERS,
+};
+
+enum Histogram
+{
+    // From a receive's completion to its packets reaching the handler.
+    DISPATCH_DELAY,
+    // From posting a send to its completion.
+    SEND_TIME,
+    // From the load-test client stamping a benchmark message to its echo arriving.
+    ROUND_TRIP,
+    NUM_HISTOGRAMS,
+};
+
+// Latencies in microseconds. The percentiles are upper bounds, which are within an eighth of
+// the actual value.
+struct LatencyStats
+{
+    LONGLONG count;
+    DWORD p50;
+    DWORD p90;
+    DWORD p99;
+    DWORD p999;
+    DWORD max;
+};
+
+struct Snapshot
+{
+    LONGLONG counters[NUM_COUNTERS];
+    // How many times each error code was recorded, by code.
+    std::vector<std::pair<DWORD, LONGLONG> > failures;
+    LatencyStats latencies[NUM_HISTOGRAMS];
+};
+
+bool Setup();
+void Cleanup();
+
+void Add(Counter counter, LONGLONG value = 1);
+// Counts an IO_FAILURES along with its error code.
+void RecordFailure(DWORD code);
+
+// A timestamp to measure a latency from.
+LONGLONG Now();
+void RecordLatency(Histogram histogram, LONGLONG start);
+
+void GetSnapshot(Snapshot& snapshot);
+const char* GetName(Counter counter);
+const char* GetName(Histogram histogram);
+}
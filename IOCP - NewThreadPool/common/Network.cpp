@@ -1,16 +1,23 @@
 #include "Network.h"
 #include "Log.h"
+#include <mstcpip.h>
 #include <cassert>
+#include <cstring>
 #include <sstream>
 #include <string>
 #include <iostream>
+#include <vector>
 
 using std::stringstream;
 
 namespace
 {
 LPFN_ACCEPTEX s_AcceptEx = NULL;
+LPFN_GETACCEPTEXSOCKADDRS s_GetAcceptExSockaddrs = NULL;
 LPFN_CONNECTEX s_ConnectEx = NULL;
+LPFN_DISCONNECTEX s_DisconnectEx = NULL;
+LPFN_TRANSMITPACKETS s_TransmitPackets = NULL;
+LPFN_WSARECVMSG s_WSARecvMsg = NULL;
 
 bool BindSocket(SOCKET socket, addrinfo* info)
 {
@@ -43,14 +50,17 @@ bool Network::Initialize()
 
 void Network::Deinitialize() { WSACleanup(); }
 
-SOCKET Network::CreateSocket(bool bind, u_short port)
+SOCKET Network::CreateSocket(bool bind, u_short port, DWORD flags, const char* address,
+                             int family, int type)
 {
+    assert(type == SOCK_STREAM || type == SOCK_DGRAM);
+
     // Get Address Info
     addrinfo hints;
     ZeroMemory(&hints, sizeof(addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_family = family;
+    hints.ai_socktype = type;
+    hints.ai_protocol = type == SOCK_DGRAM ? IPPROTO_UDP : IPPROTO_TCP;
     hints.ai_flags = bind ? AI_PASSIVE : 0;
 
     stringstream portBuff;
@@ -58,9 +68,10 @@ SOCKET Network::CreateSocket(bool bind, u_short port)
 
     struct addrinfo* infoList = NULL;
     // Passing NULL for pNodeName should return INADDR_ANY
-    if (getaddrinfo(NULL, portBuff.str().c_str(), &hints, &infoList) != 0)
+    if (getaddrinfo(address, portBuff.str().c_str(), &hints, &infoList) != 0)
     {
-        ERROR_CODE(WSAGetLastError(), "getaddrinfo() failed. port : %d", port);
+        ERROR_CODE(WSAGetLastError(), "getaddrinfo() failed. address : %s, port : %d",
+                   address != NULL ? address : "any", port);
         return INVALID_SOCKET;
     }
 
@@ -70,7 +81,7 @@ SOCKET Network::CreateSocket(bool bind, u_short port)
     for (; info != NULL; info = info->ai_next)
     {
         socket = WSASocket(info->ai_family, info->ai_socktype, info->ai_protocol, NULL, 0,
-                           WSA_FLAG_OVERLAPPED);
+                           WSA_FLAG_OVERLAPPED | flags);
         if (socket != INVALID_SOCKET)
         {
             if (!bind)
@@ -93,6 +104,135 @@ SOCKET Network::CreateSocket(bool bind, u_short port)
     return socket;
 }
 
+SOCKET Network::CreateConnectSocket(int family, DWORD flags)
+{
+    assert(family == AF_INET || family == AF_INET6);
+
+    SOCKET socket =
+        WSASocket(family, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED | flags);
+    if (socket == INVALID_SOCKET)
+    {
+        ERROR_CODE(WSAGetLastError(), "WSASocket() failed.");
+        return INVALID_SOCKET;
+    }
+
+    // An all zero address is the wildcard address, and its port 0 lets the stack pick one.
+    sockaddr_storage address;
+    ZeroMemory(&address, sizeof(address));
+    address.ss_family = static_cast<ADDRESS_FAMILY>(family);
+    const int length = family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+
+    if (bind(socket, reinterpret_cast<sockaddr*>(&address), length) == SOCKET_ERROR)
+    {
+        ERROR_CODE(WSAGetLastError(), "bind() failed.");
+        CloseSocket(socket);
+        return INVALID_SOCKET;
+    }
+
+    return socket;
+}
+
+bool Network::GetSocketProfile(const char* name, SocketOptions& options)
+{
+    assert(name);
+
+    options = SocketOptions();
+
+    if (strcmp(name, "default") == 0)
+    {
+        return true;
+    }
+
+    // Both profiles notice a peer that went away without closing within about a minute.
+    options.loopbackFastPath = true;
+    options.keepAliveTime = 30 * 1000;
+    options.keepAliveInterval = 1000;
+
+    if (strcmp(name, "latency") == 0)
+    {
+        options.noDelay = true;
+        return true;
+    }
+
+    if (strcmp(name, "bulk") == 0)
+    {
+        // Large enough for a window that fills a fast link with a long round trip.
+        options.recvBufferSize = 1024 * 1024;
+        options.sendBufferSize = 1024 * 1024;
+        return true;
+    }
+
+    options = SocketOptions();
+    return false;
+}
+
+bool Network::ApplySocketOptions(SOCKET socket, const SocketOptions& options, bool accepted)
+{
+    if (options.noDelay)
+    {
+        BOOL noDelay = TRUE;
+        if (setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay),
+                       sizeof(noDelay)) == SOCKET_ERROR)
+        {
+            ERROR_CODE(WSAGetLastError(), "setsockopt() failed with TCP_NODELAY.");
+            return false;
+        }
+    }
+
+    if (options.recvBufferSize != DEFAULT_BUFFER_SIZE &&
+        setsockopt(socket, SOL_SOCKET, SO_RCVBUF,
+                   reinterpret_cast<const char*>(&options.recvBufferSize),
+                   sizeof(options.recvBufferSize)) == SOCKET_ERROR)
+    {
+        ERROR_CODE(WSAGetLastError(), "setsockopt() failed with SO_RCVBUF.");
+        return false;
+    }
+
+    if (options.sendBufferSize != DEFAULT_BUFFER_SIZE &&
+        setsockopt(socket, SOL_SOCKET, SO_SNDBUF,
+                   reinterpret_cast<const char*>(&options.sendBufferSize),
+                   sizeof(options.sendBufferSize)) == SOCKET_ERROR)
+    {
+        ERROR_CODE(WSAGetLastError(), "setsockopt() failed with SO_SNDBUF.");
+        return false;
+    }
+
+    if (options.loopbackFastPath && !accepted)
+    {
+        int enable = 1;
+        DWORD bytesReturned = 0;
+        if (WSAIoctl(socket, SIO_LOOPBACK_FAST_PATH, &enable, sizeof(enable), NULL, 0,
+                     &bytesReturned, NULL, NULL) == SOCKET_ERROR)
+        {
+            // Older systems don't have it, and connections work the same without it.
+            const int error = WSAGetLastError();
+            if (error != WSAEOPNOTSUPP)
+            {
+                ERROR_CODE(error, "WSAIoctl() failed with SIO_LOOPBACK_FAST_PATH.");
+                return false;
+            }
+        }
+    }
+
+    if (options.keepAliveTime > 0)
+    {
+        tcp_keepalive keepAlive;
+        keepAlive.onoff = 1;
+        keepAlive.keepalivetime = options.keepAliveTime;
+        keepAlive.keepaliveinterval = options.keepAliveInterval;
+
+        DWORD bytesReturned = 0;
+        if (WSAIoctl(socket, SIO_KEEPALIVE_VALS, &keepAlive, sizeof(keepAlive), NULL, 0,
+                     &bytesReturned, NULL, NULL) == SOCKET_ERROR)
+        {
+            ERROR_CODE(WSAGetLastError(), "WSAIoctl() failed with SIO_KEEPALIVE_VALS.");
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void Network::CloseSocket(SOCKET socket)
 {
     if (closesocket(socket) == SOCKET_ERROR)
@@ -101,8 +241,23 @@ void Network::CloseSocket(SOCKET socket)
     }
 }
 
-BOOL Network::AcceptEx(SOCKET listenSocket, SOCKET newSocket, LPOVERLAPPED overlapped)
+bool Network::SetAbortiveClose(SOCKET socket)
+{
+    linger option = {1, 0};
+    if (setsockopt(socket, SOL_SOCKET, SO_LINGER, reinterpret_cast<const char*>(&option),
+                   sizeof(option)) == SOCKET_ERROR)
+    {
+        ERROR_CODE(WSAGetLastError(), "setsockopt() for SO_LINGER failed.");
+        return false;
+    }
+    return true;
+}
+
+BOOL Network::AcceptEx(SOCKET listenSocket, SOCKET newSocket, BYTE* buffer,
+                       DWORD receiveDataLength, LPOVERLAPPED overlapped)
 {
+    assert(buffer);
+
     if (s_AcceptEx == NULL)
     {
         DWORD dwBytes = 0;
@@ -116,16 +271,35 @@ BOOL Network::AcceptEx(SOCKET listenSocket, SOCKET newSocket, LPOVERLAPPED overl
         }
     }
 
-    // This value is for retriving first data, local and remote addresses from AcceptEx by calling
-    // GetAcceptExSockaddrs() later.
-    // Each address buffer must be at least 16 bytes more than the maximum address length for the
-    // transport protocol in use.
-    // It seems we don't need to use GetAcceptExSockaddrs() as we can get the address from
-    // getsockname(), getpeername() once we set SO_UPDATE_ACCEPT_CONTEXT.
-    static BYTE buffer[(sizeof(sockaddr_in6) + 16) * 2];
+    // Load this now, since no accept can complete before it.
+    if (s_GetAcceptExSockaddrs == NULL)
+    {
+        DWORD dwBytes = 0;
+        GUID guidGetAcceptExSockaddrs = WSAID_GETACCEPTEXSOCKADDRS;
+        if (WSAIoctl(listenSocket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guidGetAcceptExSockaddrs,
+                     sizeof(guidGetAcceptExSockaddrs), &s_GetAcceptExSockaddrs,
+                     sizeof(s_GetAcceptExSockaddrs), &dwBytes, 0, 0) == SOCKET_ERROR)
+        {
+            ERROR_CODE(WSAGetLastError(), "WSAIoctl() to get GetAcceptExSockaddrs() failed.");
+            return FALSE;
+        }
+    }
+
+    // Each call has a buffer of its own, since the addresses are written into it in the
+    // background.
+    return s_AcceptEx(listenSocket, newSocket, buffer, receiveDataLength, ACCEPT_ADDRESS_SIZE,
+                      ACCEPT_ADDRESS_SIZE, NULL, overlapped);
+}
+
+void Network::GetAcceptExRemoteAddress(BYTE* buffer, DWORD receiveDataLength, sockaddr** remote,
+                                       int* remoteLength)
+{
+    assert(s_GetAcceptExSockaddrs);
 
-    return s_AcceptEx(listenSocket, newSocket, &buffer, 0, sizeof(sockaddr_in6) + 16,
-                      sizeof(sockaddr_in6) + 16, NULL, overlapped);
+    sockaddr* local = NULL;
+    int localLength = 0;
+    s_GetAcceptExSockaddrs(buffer, receiveDataLength, ACCEPT_ADDRESS_SIZE, ACCEPT_ADDRESS_SIZE,
+                           &local, &localLength, remote, remoteLength);
 }
 
 BOOL Network::ConnectEx(SOCKET socket, sockaddr* addr, int addrlen, LPOVERLAPPED overlapped)
@@ -146,38 +320,190 @@ BOOL Network::ConnectEx(SOCKET socket, sockaddr* addr, int addrlen, LPOVERLAPPED
     return s_ConnectEx(socket, addr, addrlen, NULL, 0, NULL, overlapped);
 }
 
-bool Network::GetLocalAddress(SOCKET socket, std::string& ip, u_short& port)
+BOOL Network::DisconnectEx(SOCKET socket, LPOVERLAPPED overlapped, DWORD flags)
 {
-    sockaddr_in6 addr6;
-    ZeroMemory(&addr6, sizeof(addr6));
-    int size = sizeof(addr6);
+    if (s_DisconnectEx == NULL)
+    {
+        DWORD dwBytes = 0;
+        GUID guidDisconnectEx = WSAID_DISCONNECTEX;
+        if (WSAIoctl(socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guidDisconnectEx,
+                     sizeof(guidDisconnectEx), &s_DisconnectEx, sizeof(s_DisconnectEx), &dwBytes, 0,
+                     0) == SOCKET_ERROR)
+        {
+            ERROR_CODE(WSAGetLastError(), "WSAIoctl() to get DisconnectEx() failed");
+            return FALSE;
+        }
+    }
 
-    char buff[INET6_ADDRSTRLEN] = { 0 };
+    // With TF_REUSE_SOCKET the socket handle can be passed to AcceptEx() again once this completes.
+    return s_DisconnectEx(socket, overlapped, flags, 0);
+}
 
-    if (0 == getsockname(socket, reinterpret_cast<sockaddr*>(&addr6), &size))
+BOOL Network::TransmitPackets(SOCKET socket, TRANSMIT_PACKETS_ELEMENT* elements, DWORD numElements,
+                              LPOVERLAPPED overlapped, DWORD flags)
+{
+    if (s_TransmitPackets == NULL)
     {
-        if (size == sizeof(sockaddr_in6))
+        DWORD dwBytes = 0;
+        GUID guidTransmitPackets = WSAID_TRANSMITPACKETS;
+        if (WSAIoctl(socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guidTransmitPackets,
+                     sizeof(guidTransmitPackets), &s_TransmitPackets, sizeof(s_TransmitPackets),
+                     &dwBytes, 0, 0) == SOCKET_ERROR)
         {
-            port = ntohs(addr6.sin6_port);
-            inet_ntop(AF_INET6, &addr6.sin6_addr, buff, INET6_ADDRSTRLEN);
-
-            ip = buff;
+            ERROR_CODE(WSAGetLastError(), "WSAIoctl() to get TransmitPackets() failed");
+            return FALSE;
         }
-        else if (size == sizeof(sockaddr_in))
-        {
-            sockaddr_in* pAddr4 = reinterpret_cast<sockaddr_in*>(&addr6);
+    }
 
-            port = ntohs(pAddr4->sin_port);
-            inet_ntop(AF_INET, &pAddr4->sin_addr, buff, INET_ADDRSTRLEN);
+    // Sending 0 bytes per send leaves the size of the sends to the provider.
+    return s_TransmitPackets(socket, elements, numElements, 0, overlapped, flags);
+}
 
-            ip = buff;
+int Network::RecvMsg(SOCKET socket, WSAMSG* msg, LPOVERLAPPED overlapped)
+{
+    if (s_WSARecvMsg == NULL)
+    {
+        DWORD dwBytes = 0;
+        GUID guidWSARecvMsg = WSAID_WSARECVMSG;
+        if (WSAIoctl(socket, SIO_GET_EXTENSION_FUNCTION_POINTER, &guidWSARecvMsg,
+                     sizeof(guidWSARecvMsg), &s_WSARecvMsg, sizeof(s_WSARecvMsg), &dwBytes, 0,
+                     0) == SOCKET_ERROR)
+        {
+            ERROR_CODE(WSAGetLastError(), "WSAIoctl() to get WSARecvMsg() failed");
+            return SOCKET_ERROR;
         }
-        else
+    }
+
+    return s_WSARecvMsg(socket, msg, NULL, overlapped, NULL);
+}
+
+int Network::SendMsg(SOCKET socket, WSAMSG* msg, LPOVERLAPPED overlapped)
+{
+    return WSASendMsg(socket, msg, 0, NULL, overlapped, NULL);
+}
+
+bool Network::DisableUdpConnReset(SOCKET socket)
+{
+    BOOL connReset = FALSE;
+    DWORD dwBytes = 0;
+    if (WSAIoctl(socket, SIO_UDP_CONNRESET, &connReset, sizeof(connReset), NULL, 0, &dwBytes,
+                 NULL, NULL) == SOCKET_ERROR)
+    {
+        ERROR_CODE(WSAGetLastError(), "WSAIoctl() failed with SIO_UDP_CONNRESET.");
+        return false;
+    }
+    return true;
+}
+
+bool Network::CanSkipCompletionPortOnSuccess()
+{
+    int protocols[] = { IPPROTO_TCP, 0 };
+
+    DWORD size = 0;
+    if (WSAEnumProtocols(protocols, NULL, &size) != SOCKET_ERROR || WSAGetLastError() != WSAENOBUFS)
+    {
+        ERROR_CODE(WSAGetLastError(), "WSAEnumProtocols() failed to get the size.");
+        return false;
+    }
+
+    std::vector<BYTE> buffer(size);
+    LPWSAPROTOCOL_INFO infos = reinterpret_cast<LPWSAPROTOCOL_INFO>(&buffer[0]);
+
+    const int numInfos = WSAEnumProtocols(protocols, infos, &size);
+    if (numInfos == SOCKET_ERROR)
+    {
+        ERROR_CODE(WSAGetLastError(), "WSAEnumProtocols() failed.");
+        return false;
+    }
+
+    for (int i = 0; i < numInfos; ++i)
+    {
+        if ((infos[i].dwServiceFlags1 & XP1_IFS_HANDLES) == 0)
         {
             return false;
         }
+    }
 
-        return true;
+    return true;
+}
+
+bool Network::SkipCompletionPortOnSuccess(SOCKET socket)
+{
+    if (!SetFileCompletionNotificationModes(reinterpret_cast<HANDLE>(socket),
+                                            FILE_SKIP_COMPLETION_PORT_ON_SUCCESS))
+    {
+        ERROR_CODE(GetLastError(), "SetFileCompletionNotificationModes() failed.");
+        return false;
+    }
+
+    return true;
+}
+
+bool Network::LoadRio(RIO_EXTENSION_FUNCTION_TABLE& table)
+{
+    // The function table can only be queried through a socket that supports RIO.
+    SOCKET socket = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_REGISTERED_IO);
+    if (socket == INVALID_SOCKET)
+    {
+        ERROR_CODE(WSAGetLastError(), "WSASocket() for RIO failed.");
+        return false;
+    }
+
+    ZeroMemory(&table, sizeof(table));
+    table.cbSize = sizeof(table);
+
+    DWORD dwBytes = 0;
+    GUID guidRio = WSAID_MULTIPLE_RIO;
+    const bool loaded =
+        WSAIoctl(socket, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, &guidRio, sizeof(guidRio),
+                 &table, sizeof(table), &dwBytes, 0, 0) != SOCKET_ERROR;
+    if (!loaded)
+    {
+        ERROR_CODE(WSAGetLastError(), "WSAIoctl() to get RIO functions failed");
+    }
+
+    CloseSocket(socket);
+    return loaded;
+}
+
+bool Network::GetRssNumaNode(SOCKET socket, USHORT& node)
+{
+    SOCKET_PROCESSOR_AFFINITY affinity;
+    DWORD dwBytes = 0;
+    if (WSAIoctl(socket, SIO_QUERY_RSS_PROCESSOR_INFO, NULL, 0, &affinity, sizeof(affinity),
+                 &dwBytes, NULL, NULL) == SOCKET_ERROR)
+    {
+        // Not every adapter does RSS, so this isn't worth logging.
+        return false;
+    }
+
+    node = affinity.NumaNodeId;
+    return true;
+}
+
+int Network::GetSocketFamily(SOCKET socket)
+{
+    SOCKADDR_STORAGE addr;
+    ZeroMemory(&addr, sizeof(addr));
+    int size = sizeof(addr);
+
+    if (0 == getsockname(socket, reinterpret_cast<sockaddr*>(&addr), &size))
+    {
+        return addr.ss_family;
+    }
+
+    return AF_UNSPEC;
+}
+
+bool Network::GetLocalAddress(SOCKET socket, std::string& ip, u_short& port)
+{
+    sockaddr_in6 addr6;
+    ZeroMemory(&addr6, sizeof(addr6));
+    int size = sizeof(addr6);
+
+    if (0 == getsockname(socket, reinterpret_cast<sockaddr*>(&addr6), &size))
+    {
+        return GetAddress(reinterpret_cast<sockaddr*>(&addr6), size, ip, port);
     }
 
     return false;
@@ -185,36 +511,42 @@ bool Network::GetLocalAddress(SOCKET socket, std::string& ip, u_short& port)
 
 bool Network::GetRemoteAddress(SOCKET socket, std::string& ip, u_short& port)
 {
-    char buff[INET6_ADDRSTRLEN] = { 0 };
-
     sockaddr_in6 addr6;
     ZeroMemory(&addr6, sizeof(addr6));
     int size = sizeof(addr6);
 
     if (0 == getpeername(socket, reinterpret_cast<sockaddr*>(&addr6), &size))
     {
-        if (size == sizeof(sockaddr_in6))
-        {
-            port = ntohs(addr6.sin6_port);
-            inet_ntop(AF_INET6, &addr6.sin6_addr, buff, INET6_ADDRSTRLEN);
+        return GetAddress(reinterpret_cast<sockaddr*>(&addr6), size, ip, port);
+    }
 
-            ip = buff;
-        }
-        else if (size == sizeof(sockaddr_in))
-        {
-            sockaddr_in* pAddr4 = reinterpret_cast<sockaddr_in*>(&addr6);
-            port = ntohs(pAddr4->sin_port);
-            inet_ntop(AF_INET, &pAddr4->sin_addr, buff, INET_ADDRSTRLEN);
+    return false;
+}
 
-            ip = buff;
-        }
-        else
-        {
-            return false;
-        }
+bool Network::GetAddress(const sockaddr* addr, int length, std::string& ip, u_short& port)
+{
+    char buff[INET6_ADDRSTRLEN] = { 0 };
 
-        return true;
+    if (length == sizeof(sockaddr_in6))
+    {
+        const sockaddr_in6* pAddr6 = reinterpret_cast<const sockaddr_in6*>(addr);
+        port = ntohs(pAddr6->sin6_port);
+        inet_ntop(AF_INET6, &pAddr6->sin6_addr, buff, INET6_ADDRSTRLEN);
+
+        ip = buff;
     }
+    else if (length == sizeof(sockaddr_in))
+    {
+        const sockaddr_in* pAddr4 = reinterpret_cast<const sockaddr_in*>(addr);
+        port = ntohs(pAddr4->sin_port);
+        inet_ntop(AF_INET, &pAddr4->sin_addr, buff, INET_ADDRSTRLEN);
 
-    return false;
+        ip = buff;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
 }
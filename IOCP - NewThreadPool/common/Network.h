@@ -9,15 +9,95 @@ struct addrinfo;
 
 namespace Network
 {
+	// Room AcceptEx() needs for each of the local and the remote address.
+	const DWORD ACCEPT_ADDRESS_SIZE = sizeof(sockaddr_in6) + 16;
+	// Leaves SO_RCVBUF or SO_SNDBUF at the system's default.
+	const int DEFAULT_BUFFER_SIZE = -1;
+
+	// The options ApplySocketOptions() sets on a socket. The defaults change nothing.
+	struct SocketOptions
+	{
+		SocketOptions()
+			: noDelay(false), recvBufferSize(DEFAULT_BUFFER_SIZE),
+			  sendBufferSize(DEFAULT_BUFFER_SIZE), loopbackFastPath(false), keepAliveTime(0),
+			  keepAliveInterval(0)
+		{
+		}
+
+		// Turns Nagle off, so that small messages aren't held back for the ACK of the last.
+		bool noDelay;
+		// SO_RCVBUF and SO_SNDBUF in bytes. 0 sends straight from the posted buffers.
+		int recvBufferSize;
+		int sendBufferSize;
+		// SIO_LOOPBACK_FAST_PATH, which only takes effect if both ends of a loopback connection
+		// set it before it is made. It is ignored where it isn't supported.
+		bool loopbackFastPath;
+		// Milliseconds the connection has to be idle for before keepalives are sent, and between
+		// them. A keepAliveTime of 0 leaves keepalives off.
+		ULONG keepAliveTime;
+		ULONG keepAliveInterval;
+	};
+
+	// Fills options with the named profile: "default", "latency" for small messages that
+	// shouldn't wait, or "bulk" for large transfers. Returns false for any other name.
+	bool GetSocketProfile(const char* name, SocketOptions& options);
+	// Sets the options on a listen socket or one that is about to connect. An accepted socket
+	// inherits the loopback fast path from its listener, so that is skipped when accepted is
+	// true. Logs and returns false if one of them can't be set.
+	bool ApplySocketOptions(SOCKET socket, const SocketOptions& options, bool accepted = false);
+
 	bool Initialize();
 	void Deinitialize();
 
-	SOCKET CreateSocket(bool bind, u_short port);
+	// flags are added to WSA_FLAG_OVERLAPPED, e.g. WSA_FLAG_REGISTERED_IO.
+	// A socket that is bound to a NULL address is bound to every local address of the first
+	// family that resolves. Otherwise the socket is of the address's family, or of family unless
+	// that is AF_UNSPEC. type is SOCK_STREAM for TCP or SOCK_DGRAM for UDP.
+	SOCKET CreateSocket(bool bind, u_short port, DWORD flags = 0, const char* address = NULL,
+		int family = AF_UNSPEC, int type = SOCK_STREAM);
+	// A socket of family bound to the wildcard address and an ephemeral port, as ConnectEx()
+	// needs. Nothing is resolved, so it's cheap enough to create many sockets with.
+	SOCKET CreateConnectSocket(int family, DWORD flags = 0);
 	void CloseSocket(SOCKET socket);
+	// Makes closing the socket reset the connection at once, rather than send what is left and
+	// wait for the peer. The socket doesn't linger in TIME_WAIT either.
+	bool SetAbortiveClose(SOCKET socket);
 
-	BOOL AcceptEx(SOCKET listenSocket, SOCKET newSocket, LPOVERLAPPED overlapped);
+	// buffer receives the first receiveDataLength bytes of data, followed by the addresses, so it
+	// has to hold receiveDataLength + 2 * ACCEPT_ADDRESS_SIZE bytes. With receiveDataLength of 0
+	// the accept completes as soon as the connection is made, and otherwise once data arrives.
+	BOOL AcceptEx(SOCKET listenSocket, SOCKET newSocket, BYTE* buffer, DWORD receiveDataLength,
+		LPOVERLAPPED overlapped);
+	// Finds the remote address in the buffer of a completed AcceptEx().
+	void GetAcceptExRemoteAddress(BYTE* buffer, DWORD receiveDataLength, sockaddr** remote,
+		int* remoteLength);
 	BOOL ConnectEx(SOCKET socket, sockaddr* addr, int addrlen, LPOVERLAPPED overlapped);
+	BOOL DisconnectEx(SOCKET socket, LPOVERLAPPED overlapped, DWORD flags);
+	// Sends the elements in order, the file elements straight from their files.
+	BOOL TransmitPackets(SOCKET socket, TRANSMIT_PACKETS_ELEMENT* elements, DWORD numElements,
+		LPOVERLAPPED overlapped, DWORD flags);
+	// Overlapped WSARecvMsg() and WSASendMsg() of one datagram, whose address is in msg's name.
+	// They return 0 or SOCKET_ERROR as those do.
+	int RecvMsg(SOCKET socket, WSAMSG* msg, LPOVERLAPPED overlapped);
+	int SendMsg(SOCKET socket, WSAMSG* msg, LPOVERLAPPED overlapped);
+	// Stops the ICMP port unreachable of a datagram that has been sent from failing the next
+	// receive on a UDP socket, which serves many peers.
+	bool DisableUdpConnReset(SOCKET socket);
+
+	// Skipping the completion port on success is only safe if every installed provider hands out
+	// real file handles. Layered providers that don't may never report some completions.
+	bool CanSkipCompletionPortOnSuccess();
+	bool SkipCompletionPortOnSuccess(SOCKET socket);
+
+	// Fills table with the Registered I/O functions. Returns false if RIO isn't available.
+	bool LoadRio(RIO_EXTENSION_FUNCTION_TABLE& table);
+
+	// The NUMA node of the processor that RSS delivers the connection's packets to.
+	bool GetRssNumaNode(SOCKET socket, USHORT& node);
 
+	// AF_UNSPEC if the socket has no local address yet.
+	int GetSocketFamily(SOCKET socket);
 	bool GetLocalAddress(SOCKET socket, std::string& ip, u_short& port);
 	bool GetRemoteAddress(SOCKET socket, std::string& ip, u_short& port);
+	bool GetAddress(const sockaddr* addr, int length, std::string& ip, u_short& port);
 };
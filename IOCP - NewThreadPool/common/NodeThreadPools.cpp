@@ -0,0 +1,308 @@
+#include "NodeThreadPools.h"
+#include "Log.h"
+#include "Network.h"
+
+#include <cassert>
+
+struct NodeThreadPools::Pool
+{
+    USHORT node;
+    GROUP_AFFINITY affinity;
+    DWORD numProcessors;
+    DWORD minThreads;
+    DWORD maxThreads;
+
+    TP_POOL* pool;
+    TP_CALLBACK_ENVIRON environment;
+    // A separate environment for work that is waited for, since objects created in an environment
+    // with a cleanup group would be closed along with it.
+    TP_CALLBACK_ENVIRON cleanupEnvironment;
+    TP_CLEANUP_GROUP* cleanupGroup;
+
+    volatile long numThreads;
+    volatile long numActive;
+    volatile long numQueued;
+    volatile long numCallbacks;
+};
+
+NodeThreadPools::Scope::Scope(NodeThreadPools& pools, int pool, bool queued)
+    : m_Pool(pools.GetPool(pool))
+{
+    if (queued)
+    {
+        InterlockedDecrement(&m_Pool->numQueued);
+    }
+    InterlockedIncrement(&m_Pool->numActive);
+    InterlockedIncrement(&m_Pool->numCallbacks);
+
+    pools.PinCurrentThread(m_Pool);
+}
+
+NodeThreadPools::Scope::~Scope() { InterlockedDecrement(&m_Pool->numActive); }
+
+NodeThreadPools::NodeThreadPools() : m_FlsIndex(FLS_OUT_OF_INDEXES), m_WorkItems(sizeof(WorkItem))
+{
+}
+
+NodeThreadPools::~NodeThreadPools() { Destroy(); }
+
+bool NodeThreadPools::Create(DWORD minThreads, DWORD maxThreads)
+{
+    assert(m_Pools.empty());
+
+    // Pinned threads remember their pool so that they are only pinned once, and so that the pool
+    // can count them until they exit.
+    m_FlsIndex = FlsAlloc(NodeThreadPools::OnThreadExit);
+    if (m_FlsIndex == FLS_OUT_OF_INDEXES)
+    {
+        ERROR_CODE(GetLastError(), "FlsAlloc() failed.");
+        return false;
+    }
+
+    ULONG highestNode = 0;
+    if (!GetNumaHighestNodeNumber(&highestNode))
+    {
+        ERROR_CODE(GetLastError(), "GetNumaHighestNodeNumber() failed.");
+        highestNode = 0;
+    }
+
+    for (ULONG node = 0; node <= highestNode; ++node)
+    {
+        GROUP_AFFINITY affinity;
+        ZeroMemory(&affinity, sizeof(affinity));
+        if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(node), &affinity) ||
+            affinity.Mask == 0)
+        {
+            // Node numbers can have gaps, and a node may have no processors.
+            continue;
+        }
+
+        DWORD numProcessors = 0;
+        for (KAFFINITY mask = affinity.Mask; mask != 0; mask &= mask - 1)
+        {
+            ++numProcessors;
+        }
+
+        Pool* pool = new Pool();
+        pool->node = static_cast<USHORT>(node);
+        pool->affinity = affinity;
+        pool->numProcessors = numProcessors;
+        pool->maxThreads = maxThreads > 0 ? maxThreads : numProcessors;
+        pool->minThreads = min(max(minThreads, static_cast<DWORD>(1)), pool->maxThreads);
+        pool->cleanupGroup = NULL;
+        pool->numThreads = 0;
+        pool->numActive = 0;
+        pool->numQueued = 0;
+        pool->numCallbacks = 0;
+
+        pool->pool = CreateThreadpool(NULL);
+        if (pool->pool == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not create the thread pool for node %d.", node);
+            delete pool;
+            Destroy();
+            return false;
+        }
+
+        pool->cleanupGroup = CreateThreadpoolCleanupGroup();
+        if (pool->cleanupGroup == NULL)
+        {
+            ERROR_CODE(GetLastError(), "Could not create the cleanup group for node %d.", node);
+            CloseThreadpool(pool->pool);
+            delete pool;
+            Destroy();
+            return false;
+        }
+
+        SetThreadpoolThreadMaximum(pool->pool, pool->maxThreads);
+        if (!SetThreadpoolThreadMinimum(pool->pool, pool->minThreads))
+        {
+            ERROR_CODE(GetLastError(), "SetThreadpoolThreadMinimum() failed for node %d.", node);
+        }
+
+        InitializeThreadpoolEnvironment(&pool->environment);
+        SetThreadpoolCallbackPool(&pool->environment, pool->pool);
+
+        InitializeThreadpoolEnvironment(&pool->cleanupEnvironment);
+        SetThreadpoolCallbackPool(&pool->cleanupEnvironment, pool->pool);
+        SetThreadpoolCallbackCleanupGroup(&pool->cleanupEnvironment, pool->cleanupGroup, NULL);
+
+        m_Pools.push_back(pool);
+
+        TRACE("Thread pool for node %d : processors : %d, min threads : %d, max threads : %d",
+              node, numProcessors, pool->minThreads, pool->maxThreads);
+    }
+
+    if (m_Pools.empty())
+    {
+        ERROR_MSG("No NUMA node has any processors.");
+        Destroy();
+        return false;
+    }
+
+    return true;
+}
+
+void NodeThreadPools::Destroy()
+{
+    WaitForCleanupWork();
+
+    // This tells every pool that its threads are gone, so stop counting them first.
+    if (m_FlsIndex != FLS_OUT_OF_INDEXES)
+    {
+        FlsFree(m_FlsIndex);
+        m_FlsIndex = FLS_OUT_OF_INDEXES;
+    }
+
+    for (size_t i = 0; i < m_Pools.size(); ++i)
+    {
+        Pool* pool = m_Pools[i];
+
+        CloseThreadpoolCleanupGroup(pool->cleanupGroup);
+        DestroyThreadpoolEnvironment(&pool->cleanupEnvironment);
+        DestroyThreadpoolEnvironment(&pool->environment);
+        CloseThreadpool(pool->pool);
+
+        delete pool;
+    }
+    m_Pools.clear();
+}
+
+void NodeThreadPools::WaitForCleanupWork()
+{
+    for (size_t i = 0; i < m_Pools.size(); ++i)
+    {
+        CloseThreadpoolCleanupGroupMembers(m_Pools[i]->cleanupGroup, false, NULL);
+    }
+}
+
+int NodeThreadPools::SelectPool(SOCKET socket, ULONG_PTR hash)
+{
+    assert(!m_Pools.empty());
+
+    USHORT node = 0;
+    if (Network::GetRssNumaNode(socket, node))
+    {
+        for (size_t i = 0; i < m_Pools.size(); ++i)
+        {
+            if (m_Pools[i]->node == node)
+            {
+                return static_cast<int>(i);
+            }
+        }
+    }
+
+    return static_cast<int>(hash % m_Pools.size());
+}
+
+PTP_CALLBACK_ENVIRON NodeThreadPools::GetEnvironment(int pool)
+{
+    return &GetPool(pool)->environment;
+}
+
+DWORD NodeThreadPools::GetNumProcessors(int pool) { return GetPool(pool)->numProcessors; }
+
+bool NodeThreadPools::Submit(int pool, PTP_SIMPLE_CALLBACK callback, PVOID context, bool cleanup)
+{
+    assert(callback);
+
+    WorkItem* item = static_cast<WorkItem*>(m_WorkItems.get());
+    item->owner = this;
+    item->pool = pool;
+    item->callback = callback;
+    item->context = context;
+
+    Pool* target = GetPool(pool);
+    InterlockedIncrement(&target->numQueued);
+
+    if (!TrySubmitThreadpoolCallback(NodeThreadPools::WorkerRunWorkItem, item,
+                                     cleanup ? &target->cleanupEnvironment : &target->environment))
+    {
+        const DWORD error = GetLastError();
+
+        InterlockedDecrement(&target->numQueued);
+        m_WorkItems.put(item);
+
+        SetLastError(error);
+        return false;
+    }
+
+    return true;
+}
+
+void NodeThreadPools::GetStats(std::vector<Stats>& stats)
+{
+    stats.clear();
+
+    for (size_t i = 0; i < m_Pools.size(); ++i)
+    {
+        const Pool* pool = m_Pools[i];
+
+        Stats poolStats;
+        poolStats.node = pool->node;
+        poolStats.minThreads = pool->minThreads;
+        poolStats.maxThreads = pool->maxThreads;
+        poolStats.numThreads = pool->numThreads;
+        poolStats.numActive = pool->numActive;
+        poolStats.numQueued = pool->numQueued;
+        poolStats.numCallbacks = pool->numCallbacks;
+        stats.push_back(poolStats);
+    }
+}
+
+/* static */ void CALLBACK NodeThreadPools::WorkerRunWorkItem(PTP_CALLBACK_INSTANCE Instance,
+                                                            PVOID Context)
+{
+    WorkItem* item = static_cast<WorkItem*>(Context);
+    assert(item);
+
+    // Hand the item back before running the callback, which may well submit the next one.
+    const WorkItem work = *item;
+    work.owner->m_WorkItems.put(item);
+
+    Scope scope(*work.owner, work.pool, true);
+    work.callback(Instance, work.context);
+}
+
+/* static */ void NTAPI NodeThreadPools::OnThreadExit(PVOID data)
+{
+    Pool* pool = static_cast<Pool*>(data);
+    if (pool != NULL)
+    {
+        InterlockedDecrement(&pool->numThreads);
+    }
+}
+
+NodeThreadPools::Pool* NodeThreadPools::GetPool(int pool)
+{
+    assert(pool >= 0 && pool < static_cast<int>(m_Pools.size()));
+    return m_Pools[pool];
+}
+
+void NodeThreadPools::PinCurrentThread(Pool* pool)
+{
+    if (m_FlsIndex == FLS_OUT_OF_INDEXES)
+    {
+        return;
+    }
+
+    Pool* pinned = static_cast<Pool*>(FlsGetValue(m_FlsIndex));
+    if (pinned == pool)
+    {
+        return;
+    }
+
+    if (!SetThreadGroupAffinity(GetCurrentThread(), &pool->affinity, NULL))
+    {
+        ERROR_CODE(GetLastError(), "SetThreadGroupAffinity() failed for node %d.", pool->node);
+        return;
+    }
+
+    if (pinned != NULL)
+    {
+        InterlockedDecrement(&pinned->numThreads);
+    }
+    InterlockedIncrement(&pool->numThreads);
+
+    FlsSetValue(m_FlsIndex, pool);
+}
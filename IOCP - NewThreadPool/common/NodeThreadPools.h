@@ -0,0 +1,99 @@
+#pragma once
+
+#include <winsock2.h>
+#include <vector>
+
+#include "CachedAlloc.h"
+
+// A private thread pool per NUMA node. A pool's threads are pinned to the processors of its
+// node the first time they run one of its callbacks, so work bound to a pool stays on the node.
+// Every callback that runs on a pool has to open a Scope for the pool first.
+class NodeThreadPools
+{
+private:
+    struct Pool;
+
+public:
+    struct Stats
+    {
+        USHORT node;
+        DWORD minThreads;
+        DWORD maxThreads;
+        // Threads that have run a callback and haven't exited since.
+        long numThreads;
+        // Callbacks that are running.
+        long numActive;
+        // Work submitted through Submit() that hasn't started yet.
+        long numQueued;
+        long numCallbacks;
+    };
+
+    // Tracks the callback and pins the calling thread to the pool's node.
+    // queued tells whether the callback was submitted through Submit().
+    class Scope
+    {
+    public:
+        Scope(NodeThreadPools& pools, int pool, bool queued = false);
+        ~Scope();
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        Pool* m_Pool;
+    };
+
+public:
+    NodeThreadPools();
+    ~NodeThreadPools();
+
+    NodeThreadPools(const NodeThreadPools&) = delete;
+    NodeThreadPools& operator=(const NodeThreadPools&) = delete;
+
+    // maxThreads of 0 allows a thread per processor of the node.
+    bool Create(DWORD minThreads, DWORD maxThreads);
+    // Waits for the work that has been submitted with cleanup, then closes the pools.
+    // Every object created in one of the environments has to be closed before.
+    void Destroy();
+    // Waits for the work that has been submitted with cleanup.
+    void WaitForCleanupWork();
+
+    int GetNumPools() { return static_cast<int>(m_Pools.size()); }
+
+    // The pool of the NUMA node RSS delivers the socket's packets on, or one picked by hash if
+    // that isn't known.
+    int SelectPool(SOCKET socket, ULONG_PTR hash);
+
+    // Objects created in this environment run their callbacks on the pool.
+    PTP_CALLBACK_ENVIRON GetEnvironment(int pool);
+    // The processors of the pool's node, as its group affinity has them. The node may be in
+    // another processor group than the calling thread.
+    DWORD GetNumProcessors(int pool);
+
+    // Runs callback on the pool inside a Scope. Work submitted with cleanup is waited for by
+    // WaitForCleanupWork(). Returns false if the work could not be submitted, in which case
+    // GetLastError() tells why.
+    bool Submit(int pool, PTP_SIMPLE_CALLBACK callback, PVOID context, bool cleanup);
+
+    void GetStats(std::vector<Stats>& stats);
+
+private:
+    struct WorkItem
+    {
+        NodeThreadPools* owner;
+        int pool;
+        PTP_SIMPLE_CALLBACK callback;
+        PVOID context;
+    };
+
+    static void CALLBACK WorkerRunWorkItem(PTP_CALLBACK_INSTANCE Instance, PVOID Context);
+    static void NTAPI OnThreadExit(PVOID data);
+
+    Pool* GetPool(int pool);
+    void PinCurrentThread(Pool* pool);
+
+private:
+    std::vector<Pool*> m_Pools;
+    DWORD m_FlsIndex;
+    CachedAlloc m_WorkItems;
+};
@@ -0,0 +1,63 @@
+#include "Strand.h"
+#include "CritSecLock.h"
+
+#include <cassert>
+
+Strand::Strand() : m_Scheduled(false) { InitializeCriticalSection(&m_Lock); }
+
+Strand::~Strand()
+{
+    assert(m_Items.empty());
+    assert(!m_Scheduled);
+
+    DeleteCriticalSection(&m_Lock);
+}
+
+bool Strand::Post(Callback callback, PVOID context)
+{
+    assert(callback);
+
+    Item item = { callback, context };
+
+    CritSecLock lock(m_Lock);
+
+    m_Items.push_back(item);
+
+    const bool schedule = !m_Scheduled;
+    m_Scheduled = true;
+    return schedule;
+}
+
+bool Strand::Run(size_t maxCallbacks)
+{
+    for (size_t i = 0; i < maxCallbacks; ++i)
+    {
+        Item item;
+        {
+            CritSecLock lock(m_Lock);
+
+            assert(m_Scheduled);
+            if (m_Items.empty())
+            {
+                m_Scheduled = false;
+                return false;
+            }
+
+            item = m_Items.front();
+            m_Items.pop_front();
+        }
+
+        // Nothing else runs this strand meanwhile, since it stays scheduled until Run() finds it
+        // empty.
+        item.callback(item.context);
+    }
+
+    CritSecLock lock(m_Lock);
+
+    if (m_Items.empty())
+    {
+        m_Scheduled = false;
+        return false;
+    }
+    return true;
+}
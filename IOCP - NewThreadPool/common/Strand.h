@@ -0,0 +1,42 @@
+#pragma once
+
+#include <windows.h>
+#include <deque>
+
+// Runs callbacks one at a time in the order they were posted, on whichever thread runs the
+// strand. Different strands can run in parallel, so ordering work per connection doesn't take a
+// lock shared by all of them.
+// The strand doesn't schedule itself. Post() tells when it has to be scheduled, and the owner
+// then calls Run() from a thread pool callback until it returns false.
+class Strand
+{
+public:
+    typedef void (*Callback)(PVOID context);
+
+public:
+    Strand();
+    ~Strand();
+
+    Strand(const Strand&) = delete;
+    Strand& operator=(const Strand&) = delete;
+
+    // Returns true if the strand was idle, in which case the caller has to schedule Run().
+    bool Post(Callback callback, PVOID context);
+
+    // Runs up to maxCallbacks of the posted callbacks. Returns true if more are left, in which
+    // case Run() has to be scheduled again. Otherwise the strand is idle and the next Post()
+    // schedules it.
+    bool Run(size_t maxCallbacks);
+
+private:
+    struct Item
+    {
+        Callback callback;
+        PVOID context;
+    };
+
+private:
+    CRITICAL_SECTION m_Lock;
+    std::deque<Item> m_Items;
+    bool m_Scheduled;
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <Windows.h>
+
+// Starts timer dueMs from now, and then every periodMs unless that is 0. The system may delay
+// each expiry by up to windowMs to batch it with others.
+inline void SetRelativeTimer(PTP_TIMER timer, DWORD dueMs, DWORD periodMs, DWORD windowMs = 0)
+{
+    // A negative due time is relative, in units of 100 nanoseconds.
+    ULARGE_INTEGER dueTime;
+    dueTime.QuadPart = static_cast<ULONGLONG>(-(dueMs * 10000LL));
+
+    FILETIME fileDueTime;
+    fileDueTime.dwHighDateTime = dueTime.HighPart;
+    fileDueTime.dwLowDateTime = dueTime.LowPart;
+
+    SetThreadpoolTimer(timer, &fileDueTime, periodMs, windowMs);
+}
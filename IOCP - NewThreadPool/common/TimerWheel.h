@@ -0,0 +1,178 @@
+#pragma once
+
+#include <windows.h>
+#include <vector>
+#include <cassert>
+
+#include "CritSecLock.h"
+
+// Timers of T that expire on whole ticks, in hierarchical wheels of slots.
+// The first wheel has a slot per tick, and every wheel after it has slots that each span a whole
+// turn of the one before. Scheduling puts a timer into the slot of the coarsest wheel it has to
+// wait for, in O(1). When a wheel comes round, its next slot of the wheel above is spread over it,
+// so a timer only moves once per wheel on its way down.
+// There is no cancelling. Whoever handles an expired timer checks whether it still applies, and
+// schedules it again for the time that is left if it doesn't yet.
+template <typename T> class TimerWheel
+{
+private:
+    enum
+    {
+        SLOT_BITS = 6,
+        NUM_SLOTS = 1 << SLOT_BITS,
+        NUM_WHEELS = 5,
+    };
+
+    struct Timer
+    {
+        ULONGLONG expiry;
+        T value;
+    };
+
+    typedef std::vector<Timer> Slot;
+
+public:
+    // Timers can't be further ahead than this. Later ones expire at the latest tick there is.
+    static ULONGLONG GetMaxDelay()
+    {
+        return (static_cast<ULONGLONG>(1) << (SLOT_BITS * NUM_WHEELS)) - 1;
+    }
+
+    explicit TimerWheel(ULONGLONG currentTick = 0) : m_CurrentTick(currentTick), m_Size(0)
+    {
+        InitializeCriticalSection(&m_cs);
+    }
+
+    ~TimerWheel() { DeleteCriticalSection(&m_cs); }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // Starts over at currentTick without any timers.
+    void Reset(ULONGLONG currentTick)
+    {
+        CritSecLock lock(m_cs);
+
+        for (int wheel = 0; wheel < NUM_WHEELS; ++wheel)
+        {
+            for (int slot = 0; slot < NUM_SLOTS; ++slot)
+            {
+                m_Wheels[wheel][slot].clear();
+            }
+        }
+
+        m_CurrentTick = currentTick;
+        m_Size = 0;
+    }
+
+    // A timer that is due already expires with the next tick.
+    void Schedule(const T& value, ULONGLONG expiry)
+    {
+        Timer timer;
+        timer.value = value;
+
+        CritSecLock lock(m_cs);
+
+        if (expiry <= m_CurrentTick)
+        {
+            timer.expiry = m_CurrentTick + 1;
+        }
+        else if (expiry - m_CurrentTick > GetMaxDelay())
+        {
+            timer.expiry = m_CurrentTick + GetMaxDelay();
+        }
+        else
+        {
+            timer.expiry = expiry;
+        }
+
+        Insert(timer);
+        ++m_Size;
+    }
+
+    // Moves on to tick and appends the timers that have expired by then to expired.
+    void Advance(ULONGLONG tick, std::vector<T>& expired)
+    {
+        CritSecLock lock(m_cs);
+
+        while (m_CurrentTick < tick)
+        {
+            ++m_CurrentTick;
+
+            // Every wheel that has come round takes the next slot of the wheel above.
+            for (int wheel = 1; wheel < NUM_WHEELS; ++wheel)
+            {
+                if (GetSlotIndex(m_CurrentTick, wheel - 1) != 0)
+                {
+                    break;
+                }
+                Cascade(wheel);
+            }
+
+            Slot& slot = m_Wheels[0][GetSlotIndex(m_CurrentTick, 0)];
+            for (size_t i = 0; i < slot.size(); ++i)
+            {
+                expired.push_back(slot[i].value);
+            }
+            m_Size -= slot.size();
+            slot.clear();
+        }
+    }
+
+    ULONGLONG GetCurrentTick()
+    {
+        CritSecLock lock(m_cs);
+        return m_CurrentTick;
+    }
+
+    size_t GetSize()
+    {
+        CritSecLock lock(m_cs);
+        return m_Size;
+    }
+
+private:
+    static DWORD GetSlotIndex(ULONGLONG tick, int wheel)
+    {
+        return static_cast<DWORD>((tick >> (SLOT_BITS * wheel)) & (NUM_SLOTS - 1));
+    }
+
+    // A cascaded timer may expire with the current tick, as its slot of the first wheel hasn't
+    // been taken yet.
+    void Insert(const Timer& timer)
+    {
+        assert(timer.expiry >= m_CurrentTick);
+
+        // The first wheel whose slots, counted from the current tick, reach the expiry.
+        const ULONGLONG delay = timer.expiry - m_CurrentTick;
+        int wheel = 0;
+        while (wheel < NUM_WHEELS - 1 &&
+               delay >= (static_cast<ULONGLONG>(1) << (SLOT_BITS * (wheel + 1))))
+        {
+            ++wheel;
+        }
+
+        m_Wheels[wheel][GetSlotIndex(timer.expiry, wheel)].push_back(timer);
+    }
+
+    void Cascade(int wheel)
+    {
+        assert(wheel > 0);
+
+        // Swap the slot out first, as the timers may land in it again.
+        Slot timers;
+        timers.swap(m_Wheels[wheel][GetSlotIndex(m_CurrentTick, wheel)]);
+
+        for (size_t i = 0; i < timers.size(); ++i)
+        {
+            Insert(timers[i]);
+        }
+    }
+
+private:
+    CRITICAL_SECTION m_cs;
+    Slot m_Wheels[NUM_WHEELS][NUM_SLOTS];
+    // The last tick that has expired.
+    ULONGLONG m_CurrentTick;
+    size_t m_Size;
+};